@@ -939,7 +939,12 @@ gtkntf_display_condense(GtkNtfEventInfo *info) {
 	 * has been removed, so we have space.
 	 */
 	if(ret == FALSE) {
-		gint throttle = oul_prefs_get_int(BEASY_PREFS_NTF_BEHAVIOR_THROTTLE);
+		static OulPrefId throttle_id = 0;
+		gint throttle;
+
+		if(throttle_id == 0)
+			throttle_id = oul_prefs_get_id(BEASY_PREFS_NTF_BEHAVIOR_THROTTLE);
+		throttle = oul_prefs_get_int_by_id(throttle_id);
 
 		if(throttle > 0 && g_list_length(displays) + 1 > throttle) {
 			display = GTKNTF_DISPLAY(g_list_nth_data(displays, 0));
@@ -990,6 +995,7 @@ gtkntf_display_screen_saver_is_running() {
 
 void
 gtkntf_display_show_event(GtkNtfEventInfo *info, GtkNtfNotification *notification) {
+	static OulPrefId display_time_id = 0;
 	GtkNtfDisplay *display = NULL;
 	gint display_time;
 	guint timeout_id = 0;
@@ -1069,7 +1075,9 @@ gtkntf_display_show_event(GtkNtfEventInfo *info, GtkNtfNotification *notificatio
 	gtk_container_add(GTK_CONTAINER(display->event), display->image);
 
 	/* grab the display time */
-	display_time = 1000 * oul_prefs_get_int(BEASY_PREFS_NTF_BEHAVIOR_DISPLAY_TIME);
+	if(display_time_id == 0)
+		display_time_id = oul_prefs_get_id(BEASY_PREFS_NTF_BEHAVIOR_DISPLAY_TIME);
+	display_time = 1000 * oul_prefs_get_int_by_id(display_time_id);
 
 	/* animation is set, this is a new notification, so we animate it */
 	if(animate) {
@@ -3,6 +3,10 @@
 #include "core.h"
 
 #include "signals.h"
+#include "http.h"
+#include "dnsquery.h"
+#include "dnssrv.h"
+#include "prefs.h"
 
 
 /* define here for future instance reference */
@@ -34,6 +38,7 @@ oul_init(void)
     
     /* prefs sub system init */
     oul_prefs_init();
+    oul_signals_profile_init();
 
     /* plugins sub system init */
     oul_plugins_init();
@@ -51,6 +56,9 @@ oul_init(void)
 
 	/* network sub-system init */
 	oul_proxy_init();
+	oul_http_init();
+	oul_dnsquery_init();
+	oul_srv_init();
 	oul_network_init();
 	
 }
@@ -130,7 +138,13 @@ oul_core_quit(void)
 	/* The self destruct sequence has been initiated */
 	oul_signal_emit(core, "quitting");
 
+	if (oul_prefs_get_bool("/oul/signals/profile"))
+		oul_signals_profile_dump("signals-profile.txt");
+
 	/* Save .xml files, remove signals, etc. */
+	oul_http_uninit();
+	oul_srv_uninit();
+	oul_dnsquery_uninit();
 	oul_notify_uninit();
 	oul_prefs_uninit();
 
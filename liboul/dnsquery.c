@@ -15,22 +15,88 @@
 
 
 
+/* lookups running at once, the others wait for a worker */
+#define DNS_WORKERS_MAX		4
+
+/* hosts in the cache, the expired entries go first, then the oldest */
+#define DNS_CACHE_MAX		64
+
 /**************************************************************************
  * DNS query API
  **************************************************************************/
 
 static OulDnsQueryUiOps *dns_query_ui_ops = NULL;
 
-typedef struct _OulDnsQueryResolverProcess OulDnsQueryResolverProcess;
-
 struct _OulDnsQueryData {
 	char *hostname;
 	int port;
 	OulDnsQueryConnectFunction callback;
 	gpointer data;
 	guint timeout;
+	gboolean waiting;		/* for the lookup of its host, in dns_pending */
 };
 
+/* a getaddrinfo() run by a worker, shared by the queries for the host */
+typedef struct
+{
+	char *hostname;
+	GSList *hosts;			/* addrlen and addr pairs, without the port */
+	int error;
+
+} OulDnsLookup;
+
+typedef struct
+{
+	GSList *hosts;
+	char *error_message;	/* the host does not resolve */
+	time_t expires;
+
+} OulDnsCacheEntry;
+
+static GHashTable *dns_cache = NULL;	/* lower cased hostname to OulDnsCacheEntry */
+static GHashTable *dns_pending = NULL;	/* lower cased hostname to the waiting queries */
+static GThreadPool *dns_workers = NULL;
+static GAsyncQueue *dns_results = NULL;	/* lookups done by the workers */
+static int dns_pipe[2] = { -1, -1 };	/* wakes the main loop up for them */
+static guint dns_pipe_inpa = 0;
+
+static void
+dns_hosts_free(GSList *hosts)
+{
+	while (hosts != NULL)
+	{
+		hosts = g_slist_delete_link(hosts, hosts);
+		g_free(hosts->data);
+		hosts = g_slist_delete_link(hosts, hosts);
+	}
+}
+
+/* a copy of hosts for the caller, which has the port in every address */
+static GSList *
+dns_hosts_copy(GSList *hosts, int port)
+{
+	GSList *ret = NULL;
+	struct sockaddr *addr;
+	size_t addrlen;
+
+	for (; hosts != NULL && hosts->next != NULL; hosts = hosts->next->next)
+	{
+		addrlen = GPOINTER_TO_INT(hosts->data);
+		addr = g_memdup(hosts->next->data, addrlen);
+
+		if (addr->sa_family == AF_INET6)
+			((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+		else
+			((struct sockaddr_in *)addr)->sin_port = htons(port);
+
+		ret = g_slist_prepend(ret, GINT_TO_POINTER(addrlen));
+		ret = g_slist_prepend(ret, addr);
+	}
+
+	/* the pairs were prepended address last */
+	return g_slist_reverse(ret);
+}
+
 static void
 oul_dnsquery_resolved(OulDnsQueryData *query_data, GSList *hosts)
 {
@@ -44,12 +110,7 @@ oul_dnsquery_resolved(OulDnsQueryData *query_data, GSList *hosts)
 		 * NULL if we cancel a thread-based DNS lookup.  So we need
 		 * to free hosts.
 		 */
-		while (hosts != NULL)
-		{
-			hosts = g_slist_remove(hosts, hosts->data);
-			g_free(hosts->data);
-			hosts = g_slist_remove(hosts, hosts->data);
-		}
+		dns_hosts_free(hosts);
 	}
 
 	oul_dnsquery_destroy(query_data);
@@ -78,17 +139,263 @@ oul_dnsquery_ui_resolve(OulDnsQueryData *query_data)
 	return FALSE;
 }
 
+/**************************************************************************
+ * Cache
+ **************************************************************************/
+static void
+dns_cache_entry_free(OulDnsCacheEntry *entry)
+{
+	dns_hosts_free(entry->hosts);
+	g_free(entry->error_message);
+	g_free(entry);
+}
+
+static gboolean
+dns_cache_entry_expired(gpointer key, gpointer value, gpointer data)
+{
+	return ((OulDnsCacheEntry *)value)->expires <= *(time_t *)data;
+}
+
+static void
+dns_cache_entry_soonest(gpointer key, gpointer value, gpointer data)
+{
+	gpointer *soonest = data;	/* the key and the entry expiring first */
+
+	if (soonest[1] == NULL ||
+		((OulDnsCacheEntry *)value)->expires < ((OulDnsCacheEntry *)soonest[1])->expires)
+	{
+		soonest[0] = key;
+		soonest[1] = value;
+	}
+}
+
+/* make room for one more host */
+static void
+dns_cache_evict(time_t now)
+{
+	gpointer soonest[2] = { NULL, NULL };
+
+	g_hash_table_foreach_remove(dns_cache, dns_cache_entry_expired, &now);
+	if (g_hash_table_size(dns_cache) < DNS_CACHE_MAX)
+		return;
+
+	g_hash_table_foreach(dns_cache, dns_cache_entry_soonest, soonest);
+	if (soonest[0] != NULL)
+		g_hash_table_remove(dns_cache, soonest[0]);
+}
+
+/* the entry for the host if it did not expire yet */
+static OulDnsCacheEntry *
+dns_cache_lookup(const char *key)
+{
+	OulDnsCacheEntry *entry;
+
+	if ((entry = g_hash_table_lookup(dns_cache, key)) == NULL)
+		return NULL;
+
+	if (entry->expires <= time(NULL))
+	{
+		g_hash_table_remove(dns_cache, key);
+		return NULL;
+	}
+
+	return entry;
+}
+
 /*
- * We weren't able to do anything fancier above, so use the
- * fail-safe name resolution code, which is blocking.
+ * getaddrinfo() does not tell the TTL of the records, the entries are kept
+ * for the time set in the prefs. The failures are kept for a shorter time.
  */
+static void
+dns_cache_insert(OulDnsLookup *lookup, const char *error_message)
+{
+	OulDnsCacheEntry *entry;
+	time_t now = time(NULL);
+	int ttl;
+
+	ttl = oul_prefs_get_int(error_message ?
+			"/oul/network/dns/negative_ttl" : "/oul/network/dns/cache_ttl");
+	if (ttl <= 0)
+		return;
+
+	if (g_hash_table_size(dns_cache) >= DNS_CACHE_MAX &&
+		g_hash_table_lookup(dns_cache, lookup->hostname) == NULL)
+		dns_cache_evict(now);
+
+	entry = g_new0(OulDnsCacheEntry, 1);
+	entry->hosts = dns_hosts_copy(lookup->hosts, 0);
+	entry->error_message = g_strdup(error_message);
+	entry->expires = now + ttl;
+
+	g_hash_table_replace(dns_cache, g_strdup(lookup->hostname), entry);
+}
+
+/* answer the query from the cache, FALSE if the host is not in it */
+static gboolean
+dns_cache_resolve(OulDnsQueryData *query_data, const char *key)
+{
+	OulDnsCacheEntry *entry;
+
+	if ((entry = dns_cache_lookup(key)) == NULL)
+		return FALSE;
+
+	oul_debug_misc("dnsquery", "%s found in the cache\n", query_data->hostname);
+
+	if (entry->error_message != NULL)
+		oul_dnsquery_failed(query_data, entry->error_message);
+	else
+		oul_dnsquery_resolved(query_data, dns_hosts_copy(entry->hosts, query_data->port));
+
+	return TRUE;
+}
+
+/**************************************************************************
+ * Workers
+ **************************************************************************/
+/* run by a worker, or on the main loop if there are no threads */
+static void
+dns_lookup_run(OulDnsLookup *lookup)
+{
+	struct addrinfo hints, *res, *tmp;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+#ifdef AI_ADDRCONFIG
+	hints.ai_flags = AI_ADDRCONFIG;
+#endif
+
+	lookup->error = getaddrinfo(lookup->hostname, NULL, &hints, &res);
+	if (lookup->error != 0)
+		return;
+
+	/* in the order of preference getaddrinfo() sorted them in */
+	for (tmp = res; tmp != NULL; tmp = tmp->ai_next)
+	{
+		if (tmp->ai_family != AF_INET && tmp->ai_family != AF_INET6)
+			continue;
+
+		lookup->hosts = g_slist_prepend(lookup->hosts, GINT_TO_POINTER(tmp->ai_addrlen));
+		lookup->hosts = g_slist_prepend(lookup->hosts, g_memdup(tmp->ai_addr, tmp->ai_addrlen));
+	}
+
+	lookup->hosts = g_slist_reverse(lookup->hosts);
+	freeaddrinfo(res);
+}
+
+static void
+dns_worker(gpointer data, gpointer user_data)
+{
+	dns_lookup_run(data);
+
+	g_async_queue_push(dns_results, data);
+	if (write(dns_pipe[1], "", 1) < 0 && errno != EAGAIN)
+		oul_debug_error("dnsquery", "Unable to wake up the main loop: %s\n", g_strerror(errno));
+}
+
+/* hand the result to every query waiting for the host, and cache it */
+static void
+dns_lookup_done(OulDnsLookup *lookup)
+{
+	OulDnsQueryData *query_data;
+	GSList *waiters;
+	char *error_message = NULL;
+
+	if (lookup->error != 0 || lookup->hosts == NULL)
+		error_message = g_strdup_printf(_("Error resolving %s:\n%s"), lookup->hostname,
+				lookup->error != 0 ? gai_strerror(lookup->error) : _("No address found"));
+
+	dns_cache_insert(lookup, error_message);
+
+	/* the callbacks may cancel the other queries waiting here */
+	while ((waiters = g_hash_table_lookup(dns_pending, lookup->hostname)) != NULL)
+	{
+		query_data = waiters->data;
+		waiters = g_slist_delete_link(waiters, waiters);
+
+		if (waiters != NULL)
+			g_hash_table_insert(dns_pending, g_strdup(lookup->hostname), waiters);
+		else
+			g_hash_table_remove(dns_pending, lookup->hostname);
+
+		query_data->waiting = FALSE;
+
+		if (error_message != NULL)
+			oul_dnsquery_failed(query_data, error_message);
+		else
+			oul_dnsquery_resolved(query_data, dns_hosts_copy(lookup->hosts, query_data->port));
+	}
+
+	g_free(error_message);
+	dns_hosts_free(lookup->hosts);
+	g_free(lookup->hostname);
+	g_free(lookup);
+}
+
+static void
+dns_results_cb(gpointer data, gint source, OulInputCondition cond)
+{
+	OulDnsLookup *lookup;
+	char buf[64];
+
+	while (read(source, buf, sizeof(buf)) > 0)
+		;
+
+	while ((lookup = g_async_queue_try_pop(dns_results)) != NULL)
+		dns_lookup_done(lookup);
+}
+
+/* started with the first lookup, once the UI set its event loop up */
+static gboolean
+dns_workers_start(void)
+{
+	GError *error = NULL;
+
+	if (dns_workers != NULL)
+		return TRUE;
+
+	if (!g_thread_supported())
+		return FALSE;
+
+	if (pipe(dns_pipe) < 0)
+	{
+		oul_debug_error("dnsquery", "Unable to create a pipe: %s\n", g_strerror(errno));
+		return FALSE;
+	}
+
+	fcntl(dns_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(dns_pipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(dns_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(dns_pipe[1], F_SETFD, FD_CLOEXEC);
+
+	dns_workers = g_thread_pool_new(dns_worker, NULL, DNS_WORKERS_MAX, FALSE, &error);
+	if (dns_workers == NULL)
+	{
+		oul_debug_error("dnsquery", "Unable to start the resolver threads: %s\n",
+				error ? error->message : "");
+		if (error != NULL)
+			g_error_free(error);
+		close(dns_pipe[0]);
+		close(dns_pipe[1]);
+		dns_pipe[0] = dns_pipe[1] = -1;
+		return FALSE;
+	}
+
+	dns_results = g_async_queue_new();
+	dns_pipe_inpa = oul_input_add(dns_pipe[0], OUL_INPUT_READ, dns_results_cb, NULL);
+
+	return TRUE;
+}
 
 static gboolean
 resolve_host(gpointer data)
 {
 	OulDnsQueryData *query_data;
+	OulDnsLookup *lookup;
 	struct sockaddr_in sin;
-	GSList *hosts = NULL;
+	struct sockaddr_in6 sin6;
+	GSList *hosts = NULL, *waiters;
+	char *key;
 
 	query_data = data;
 	query_data->timeout = 0;
@@ -99,26 +406,65 @@ resolve_host(gpointer data)
 		return FALSE;
 	}
 
-	if (!inet_aton(query_data->hostname, &sin.sin_addr)) {
-		struct hostent *hp;
-		if(!(hp = gethostbyname(query_data->hostname))) {
-			char message[1024];
-			g_snprintf(message, sizeof(message), _("Error resolving %s: %d"),
-					query_data->hostname, h_errno);
-			oul_dnsquery_failed(query_data, message);
-			return FALSE;
-		}
-		memset(&sin, 0, sizeof(struct sockaddr_in));
-		memcpy(&sin.sin_addr.s_addr, hp->h_addr, hp->h_length);
-		sin.sin_family = hp->h_addrtype;
-	} else
+	memset(&sin, 0, sizeof(sin));
+	memset(&sin6, 0, sizeof(sin6));
+
+	/* an address needs no lookup */
+	if (inet_pton(AF_INET, query_data->hostname, &sin.sin_addr) > 0)
+	{
 		sin.sin_family = AF_INET;
-	sin.sin_port = htons(query_data->port);
+		sin.sin_port = htons(query_data->port);
+		hosts = g_slist_append(hosts, GINT_TO_POINTER(sizeof(sin)));
+		hosts = g_slist_append(hosts, g_memdup(&sin, sizeof(sin)));
+		oul_dnsquery_resolved(query_data, hosts);
+		return FALSE;
+	}
+
+	if (inet_pton(AF_INET6, query_data->hostname, &sin6.sin6_addr) > 0)
+	{
+		sin6.sin6_family = AF_INET6;
+		sin6.sin6_port = htons(query_data->port);
+		hosts = g_slist_append(hosts, GINT_TO_POINTER(sizeof(sin6)));
+		hosts = g_slist_append(hosts, g_memdup(&sin6, sizeof(sin6)));
+		oul_dnsquery_resolved(query_data, hosts);
+		return FALSE;
+	}
+
+	key = g_ascii_strdown(query_data->hostname, -1);
+
+	if (dns_cache_resolve(query_data, key))
+	{
+		g_free(key);
+		return FALSE;
+	}
+
+	/* share the lookup in progress for the host */
+	waiters = g_hash_table_lookup(dns_pending, key);
+	g_hash_table_insert(dns_pending, g_strdup(key), g_slist_append(waiters, query_data));
+	query_data->waiting = TRUE;
 
-	hosts = g_slist_append(hosts, GINT_TO_POINTER(sizeof(sin)));
-	hosts = g_slist_append(hosts, g_memdup(&sin, sizeof(sin)));
+	if (waiters != NULL)
+	{
+		g_free(key);
+		return FALSE;
+	}
 
-	oul_dnsquery_resolved(query_data, hosts);
+	lookup = g_new0(OulDnsLookup, 1);
+	lookup->hostname = key;
+
+	if (dns_workers_start())
+	{
+		g_thread_pool_push(dns_workers, lookup, NULL);
+	}
+	else
+	{
+		/*
+		 * Without threads, use the fail-safe name resolution code,
+		 * which is blocking.
+		 */
+		dns_lookup_run(lookup);
+		dns_lookup_done(lookup);
+	}
 
 	return FALSE;
 }
@@ -133,7 +479,7 @@ oul_dnsquery_a(const char *hostname, int port,
 	g_return_val_if_fail(port	  != 0, NULL);
 	g_return_val_if_fail(callback != NULL, NULL);
 
-	query_data = g_new(OulDnsQueryData, 1);
+	query_data = g_new0(OulDnsQueryData, 1);
 	query_data->hostname = g_strdup(hostname);
 	g_strstrip(query_data->hostname);
 	query_data->port = port;
@@ -156,6 +502,8 @@ void
 oul_dnsquery_destroy(OulDnsQueryData *query_data)
 {
 	OulDnsQueryUiOps *ops = oul_dnsquery_get_ui_ops();
+	GSList *waiters;
+	char *key;
 
 	if (ops && ops->destroy)
 		ops->destroy(query_data);
@@ -163,6 +511,21 @@ oul_dnsquery_destroy(OulDnsQueryData *query_data)
 	if (query_data->timeout > 0)
 		oul_timeout_remove(query_data->timeout);
 
+	/* the lookup goes on, its result is cached for the next query */
+	if (query_data->waiting && dns_pending != NULL)
+	{
+		key = g_ascii_strdown(query_data->hostname, -1);
+		waiters = g_slist_remove(g_hash_table_lookup(dns_pending, key), query_data);
+
+		if (waiters != NULL)
+			g_hash_table_insert(dns_pending, key, waiters);
+		else
+		{
+			g_hash_table_remove(dns_pending, key);
+			g_free(key);
+		}
+	}
+
 	g_free(query_data->hostname);
 	g_free(query_data);
 }
@@ -201,16 +564,54 @@ oul_dnsquery_get_ui_ops(void)
 void
 oul_dnsquery_init(void)
 {
+	oul_prefs_add_none("/oul/network");
+	oul_prefs_add_none("/oul/network/dns");
+	oul_prefs_add_int("/oul/network/dns/cache_ttl", 300);
+	oul_prefs_add_int("/oul/network/dns/negative_ttl", 30);
+
+	dns_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, (GDestroyNotify)dns_cache_entry_free);
+	dns_pending = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, NULL);
 }
 
 void
 oul_dnsquery_uninit(void)
 {
-#if defined(OUL_DNSQUERY_USE_FORK)
-	while (free_dns_children != NULL)
+	OulDnsLookup *lookup;
+
+	/* the lookups not started are dropped, the running ones are waited for */
+	if (dns_workers != NULL)
+	{
+		g_thread_pool_free(dns_workers, TRUE, TRUE);
+		dns_workers = NULL;
+
+		while ((lookup = g_async_queue_try_pop(dns_results)) != NULL)
+		{
+			dns_hosts_free(lookup->hosts);
+			g_free(lookup->hostname);
+			g_free(lookup);
+		}
+
+		g_async_queue_unref(dns_results);
+		dns_results = NULL;
+
+		oul_input_remove(dns_pipe_inpa);
+		dns_pipe_inpa = 0;
+		close(dns_pipe[0]);
+		close(dns_pipe[1]);
+		dns_pipe[0] = dns_pipe[1] = -1;
+	}
+
+	if (dns_cache != NULL)
 	{
-		oul_dnsquery_resolver_destroy(free_dns_children->data);
-		free_dns_children = g_slist_remove(free_dns_children, free_dns_children->data);
+		g_hash_table_destroy(dns_cache);
+		dns_cache = NULL;
+	}
+
+	if (dns_pending != NULL)
+	{
+		g_hash_table_destroy(dns_pending);
+		dns_pending = NULL;
 	}
-#endif
 }
@@ -20,6 +20,13 @@
 #include "dnssrv.h"
 #include "eventloop.h"
 #include "debug.h"
+#include "prefs.h"
+
+/* lookups running at once, the others wait for a worker */
+#define SRV_WORKERS_MAX		2
+
+/* queries in the cache, the expired entries go first, then the oldest */
+#define SRV_CACHE_MAX		32
 
 typedef union {
 	HEADER hdr;
@@ -27,18 +34,43 @@ typedef union {
 } queryans;
 
 struct _OulSrvQueryData {
+	char *query;			/* lower cased _protocol._transport.domain */
 	OulSrvCallback cb;
 	gpointer extradata;
 	guint handle;
-	int fd_in, fd_out;
-	pid_t pid;
+	gboolean waiting;		/* for the lookup of its query, in srv_pending */
 };
 
-static gint
-responsecompare(gconstpointer ar, gconstpointer br)
+/* a res_query() run by a worker, shared by the queries for the same record */
+typedef struct
+{
+	char *query;
+	OulSrvResponse *responses;
+	int results;
+	guint32 ttl;			/* the lowest TTL of the answers */
+
+} OulSrvLookup;
+
+typedef struct
 {
-	OulSrvResponse *a = (OulSrvResponse*)ar;
-	OulSrvResponse *b = (OulSrvResponse*)br;
+	OulSrvResponse *responses;
+	int results;
+	time_t expires;
+
+} OulSrvCacheEntry;
+
+static GHashTable *srv_cache = NULL;	/* query to OulSrvCacheEntry */
+static GHashTable *srv_pending = NULL;	/* query to the waiting OulSrvQueryData */
+static GThreadPool *srv_workers = NULL;
+static GAsyncQueue *srv_results = NULL;	/* lookups done by the workers */
+static int srv_pipe[2] = { -1, -1 };	/* wakes the main loop up for them */
+static guint srv_pipe_inpa = 0;
+
+static int
+responsecompare(const void *ar, const void *br)
+{
+	const OulSrvResponse *a = ar;
+	const OulSrvResponse *b = br;
 
 	if(a->pref == b->pref) {
 		if(a->weight == b->weight)
@@ -52,11 +84,164 @@ responsecompare(gconstpointer ar, gconstpointer br)
 	return 1;
 }
 
-G_GNUC_NORETURN static void
-resolve(int in, int out)
+/*
+ * A copy of the responses in the order they should be tried in. As in
+ * RFC 2782, the targets of the same priority are picked at random, in
+ * proportion to their weight, so every caller spreads the load over them.
+ */
+static OulSrvResponse *
+srv_responses_order(const OulSrvResponse *responses, int results)
 {
-	GList *ret = NULL;
-	OulSrvResponse *srvres;
+	OulSrvResponse *ret, tmp;
+	int first, last, i, j, sum, pick;
+
+	if (results <= 0)
+		return NULL;
+
+	ret = g_memdup(responses, results * sizeof(OulSrvResponse));
+
+	/* the targets of weight 0 come first in each priority */
+	qsort(ret, results, sizeof(OulSrvResponse), responsecompare);
+
+	for (first = 0; first < results; first = last) {
+		for (last = first + 1; last < results && ret[last].pref == ret[first].pref; last++)
+			;
+
+		for (i = first; i < last - 1; i++) {
+			for (sum = 0, j = i; j < last; j++)
+				sum += ret[j].weight;
+
+			pick = g_random_int_range(0, sum + 1);
+
+			for (sum = 0, j = i; j < last - 1; j++) {
+				sum += ret[j].weight;
+				if (sum >= pick)
+					break;
+			}
+
+			tmp = ret[i];
+			ret[i] = ret[j];
+			ret[j] = tmp;
+		}
+	}
+
+	return ret;
+}
+
+static void
+srv_query_resolved(OulSrvQueryData *query_data, const OulSrvResponse *responses, int results)
+{
+	oul_debug_info("dnssrv", "found %d SRV entries for %s\n", results, query_data->query);
+
+	query_data->cb(srv_responses_order(responses, results), results, query_data->extradata);
+
+	oul_srv_cancel(query_data);
+}
+
+/**************************************************************************
+ * Cache
+ **************************************************************************/
+static void
+srv_cache_entry_free(OulSrvCacheEntry *entry)
+{
+	g_free(entry->responses);
+	g_free(entry);
+}
+
+static gboolean
+srv_cache_entry_expired(gpointer key, gpointer value, gpointer data)
+{
+	return ((OulSrvCacheEntry *)value)->expires <= *(time_t *)data;
+}
+
+static void
+srv_cache_entry_soonest(gpointer key, gpointer value, gpointer data)
+{
+	gpointer *soonest = data;	/* the key and the entry expiring first */
+
+	if (soonest[1] == NULL ||
+		((OulSrvCacheEntry *)value)->expires < ((OulSrvCacheEntry *)soonest[1])->expires) {
+		soonest[0] = key;
+		soonest[1] = value;
+	}
+}
+
+/* make room for one more query */
+static void
+srv_cache_evict(time_t now)
+{
+	gpointer soonest[2] = { NULL, NULL };
+
+	g_hash_table_foreach_remove(srv_cache, srv_cache_entry_expired, &now);
+	if (g_hash_table_size(srv_cache) < SRV_CACHE_MAX)
+		return;
+
+	g_hash_table_foreach(srv_cache, srv_cache_entry_soonest, soonest);
+	if (soonest[0] != NULL)
+		g_hash_table_remove(srv_cache, soonest[0]);
+}
+
+/* the records are kept for their TTL, a missing record like a missing host */
+static void
+srv_cache_insert(OulSrvLookup *lookup)
+{
+	OulSrvCacheEntry *entry;
+	time_t now = time(NULL);
+	guint32 ttl;
+
+	if (lookup->results > 0)
+		ttl = lookup->ttl;
+	else
+		ttl = MAX(oul_prefs_get_int("/oul/network/dns/negative_ttl"), 0);
+
+	if (ttl == 0)
+		return;
+
+	if (g_hash_table_size(srv_cache) >= SRV_CACHE_MAX &&
+		g_hash_table_lookup(srv_cache, lookup->query) == NULL)
+		srv_cache_evict(now);
+
+	entry = g_new0(OulSrvCacheEntry, 1);
+	entry->responses = g_memdup(lookup->responses, lookup->results * sizeof(OulSrvResponse));
+	entry->results = lookup->results;
+	entry->expires = now + ttl;
+
+	g_hash_table_replace(srv_cache, g_strdup(lookup->query), entry);
+}
+
+/* answer the query from the cache, FALSE if the record is not in it */
+static gboolean
+srv_cache_resolve(OulSrvQueryData *query_data)
+{
+	OulSrvCacheEntry *entry;
+
+	if ((entry = g_hash_table_lookup(srv_cache, query_data->query)) == NULL)
+		return FALSE;
+
+	if (entry->expires <= time(NULL)) {
+		g_hash_table_remove(srv_cache, query_data->query);
+		return FALSE;
+	}
+
+	oul_debug_misc("dnssrv", "%s found in the cache\n", query_data->query);
+
+	srv_query_resolved(query_data, entry->responses, entry->results);
+
+	return TRUE;
+}
+
+/**************************************************************************
+ * Workers
+ **************************************************************************/
+/*
+ * Run by a worker, or on the main loop if there are no threads. The
+ * resolver state is per thread with the usual libcs.
+ */
+static void
+srv_lookup_run(OulSrvLookup *lookup)
+{
+	GArray *ret;
+	OulSrvResponse srvres;
 	queryans answer;
 	int size;
 	int qdcount;
@@ -65,19 +250,16 @@ resolve(int in, int out)
 	guchar *cp;
 	gchar name[256];
 	guint16 type, dlen, pref, weight, port;
-	gchar query[256];
+	guint32 ttl;
 
-#ifdef HAVE_SIGNAL_H
-	oul_restore_default_signal_handlers();
-#endif
+	ret = g_array_new(FALSE, TRUE, sizeof(OulSrvResponse));
 
-	if (read(in, query, 256) <= 0) {
-		close(out);
-		close(in);
-		_exit(0);
-	}
+	size = res_query(lookup->query, C_IN, T_SRV, (u_char*)&answer, sizeof(answer));
+	if (size < (int)sizeof(HEADER))
+		goto end;
 
-	size = res_query( query, C_IN, T_SRV, (u_char*)&answer, sizeof( answer));
+	/* a truncated answer is parsed as far as it goes */
+	size = MIN(size, (int)sizeof(answer));
 
 	qdcount = ntohs(answer.hdr.qdcount);
 	ancount = ntohs(answer.hdr.ancount);
@@ -99,14 +281,22 @@ resolve(int in, int out)
 
 		cp += size;
 
+		if (cp + 10 > end)
+			goto end;
+
 		GETSHORT(type,cp);
 
-		/* skip ttl and class since we already know it */
-		cp += 6;
+		/* skip class since we already know it */
+		cp += 2;
+
+		GETLONG(ttl,cp);
 
 		GETSHORT(dlen,cp);
 
-		if (type == T_SRV) {
+		if (cp + dlen > end)
+			goto end;
+
+		if (type == T_SRV && dlen > 6) {
 			GETSHORT(pref,cp);
 
 			GETSHORT(weight,cp);
@@ -119,140 +309,257 @@ resolve(int in, int out)
 
 			cp += size;
 
-			srvres = g_new0(OulSrvResponse, 1);
-			strcpy(srvres->hostname, name);
-			srvres->pref = pref;
-			srvres->port = port;
-			srvres->weight = weight;
+			memset(&srvres, 0, sizeof(srvres));
+			g_strlcpy(srvres.hostname, name, sizeof(srvres.hostname));
+			srvres.pref = pref;
+			srvres.port = port;
+			srvres.weight = weight;
+
+			g_array_append_val(ret, srvres);
 
-			ret = g_list_insert_sorted(ret, srvres, responsecompare);
+			if (ret->len == 1 || ttl < lookup->ttl)
+				lookup->ttl = ttl;
 		} else {
 			cp += dlen;
 		}
 	}
 
 end:
-	size = g_list_length(ret);
-	write(out, &size, sizeof(int));
-	while (ret != NULL)
+	lookup->results = ret->len;
+	lookup->responses = (OulSrvResponse *)g_array_free(ret, lookup->results == 0);
+}
+
+static void
+srv_worker(gpointer data, gpointer user_data)
+{
+	srv_lookup_run(data);
+
+	g_async_queue_push(srv_results, data);
+	if (write(srv_pipe[1], "", 1) < 0 && errno != EAGAIN)
+		oul_debug_error("dnssrv", "Unable to wake up the main loop: %s\n", g_strerror(errno));
+}
+
+static void
+srv_lookup_free(OulSrvLookup *lookup)
+{
+	g_free(lookup->responses);
+	g_free(lookup->query);
+	g_free(lookup);
+}
+
+/* hand the result to every query waiting for the record, and cache it */
+static void
+srv_lookup_done(OulSrvLookup *lookup)
+{
+	OulSrvQueryData *query_data;
+	GSList *waiters;
+
+	srv_cache_insert(lookup);
+
+	/* the callbacks may cancel the other queries waiting here */
+	while ((waiters = g_hash_table_lookup(srv_pending, lookup->query)) != NULL)
 	{
-		write(out, ret->data, sizeof(OulSrvResponse));
-		g_free(ret->data);
-		ret = g_list_remove(ret, ret->data);
-	}
+		query_data = waiters->data;
+		waiters = g_slist_delete_link(waiters, waiters);
 
-	close(out);
-	close(in);
+		if (waiters != NULL)
+			g_hash_table_insert(srv_pending, g_strdup(lookup->query), waiters);
+		else
+			g_hash_table_remove(srv_pending, lookup->query);
+
+		query_data->waiting = FALSE;
+
+		srv_query_resolved(query_data, lookup->responses, lookup->results);
+	}
 
-	_exit(0);
+	srv_lookup_free(lookup);
 }
 
 static void
-resolved(gpointer data, gint source, OulInputCondition cond)
+srv_results_cb(gpointer data, gint source, OulInputCondition cond)
 {
-	int size;
-	OulSrvQueryData *query_data = (OulSrvQueryData*)data;
-	OulSrvResponse *res;
-	OulSrvResponse *tmp;
-	int i;
-	OulSrvCallback cb = query_data->cb;
-	int status;
-
-	if (read(source, &size, sizeof(int)) == sizeof(int))
+	OulSrvLookup *lookup;
+	char buf[64];
+
+	while (read(source, buf, sizeof(buf)) > 0)
+		;
+
+	while ((lookup = g_async_queue_try_pop(srv_results)) != NULL)
+		srv_lookup_done(lookup);
+}
+
+/* started with the first lookup, once the UI set its event loop up */
+static gboolean
+srv_workers_start(void)
+{
+	GError *error = NULL;
+
+	if (srv_workers != NULL)
+		return TRUE;
+
+	if (!g_thread_supported())
+		return FALSE;
+
+	if (pipe(srv_pipe) < 0)
 	{
-		ssize_t red;
-		oul_debug_info("dnssrv","found %d SRV entries\n", size);
-		tmp = res = g_new0(OulSrvResponse, size);
-		for (i = 0; i < size; i++) {
-			red = read(source, tmp++, sizeof(OulSrvResponse));
-			if (red != sizeof(OulSrvResponse)) {
-				oul_debug_error("dnssrv","unable to read srv "
-						"response: %s\n", g_strerror(errno));
-				size = 0;
-				g_free(res);
-				res = NULL;
-			}
-		}
+		oul_debug_error("dnssrv", "Unable to create a pipe: %s\n", g_strerror(errno));
+		return FALSE;
 	}
-	else
+
+	fcntl(srv_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(srv_pipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(srv_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(srv_pipe[1], F_SETFD, FD_CLOEXEC);
+
+	srv_workers = g_thread_pool_new(srv_worker, NULL, SRV_WORKERS_MAX, FALSE, &error);
+	if (srv_workers == NULL)
 	{
-		oul_debug_info("dnssrv","found 0 SRV entries; errno is %i\n", errno);
-		size = 0;
-		res = NULL;
+		oul_debug_error("dnssrv", "Unable to start the resolver threads: %s\n",
+				error ? error->message : "");
+		if (error != NULL)
+			g_error_free(error);
+		close(srv_pipe[0]);
+		close(srv_pipe[1]);
+		srv_pipe[0] = srv_pipe[1] = -1;
+		return FALSE;
 	}
 
-	cb(res, size, query_data->extradata);
-	waitpid(query_data->pid, &status, 0);
+	srv_results = g_async_queue_new();
+	srv_pipe_inpa = oul_input_add(srv_pipe[0], OUL_INPUT_READ, srv_results_cb, NULL);
 
-	oul_srv_cancel(query_data);
+	return TRUE;
 }
 
-
-OulSrvQueryData *
-oul_srv_resolve(const char *protocol, const char *transport, const char *domain, OulSrvCallback cb, gpointer extradata)
+static gboolean
+srv_resolve(gpointer data)
 {
-	char *query;
-	OulSrvQueryData *query_data;
-	int in[2], out[2];
-	int pid;
+	OulSrvQueryData *query_data = data;
+	OulSrvLookup *lookup;
+	GSList *waiters;
 
-	query = g_strdup_printf("_%s._%s.%s", protocol, transport, domain);
-	oul_debug_info("dnssrv","querying SRV record for %s\n", query);
+	query_data->handle = 0;
 
-	if(pipe(in) || pipe(out)) {
-		oul_debug_error("dnssrv", "Could not create pipe\n");
-		g_free(query);
-		cb(NULL, 0, extradata);
-		return NULL;
-	}
+	if (srv_cache_resolve(query_data))
+		return FALSE;
 
-	pid = fork();
-	if (pid == -1) {
-		oul_debug_error("dnssrv", "Could not create process!\n");
-		cb(NULL, 0, extradata);
-		g_free(query);
-		return NULL;
-	}
+	/* share the lookup in progress for the record */
+	waiters = g_hash_table_lookup(srv_pending, query_data->query);
+	g_hash_table_insert(srv_pending, g_strdup(query_data->query),
+			g_slist_append(waiters, query_data));
+	query_data->waiting = TRUE;
 
-	/* Child */
-	if (pid == 0)
-	{
-		g_free(query);
+	if (waiters != NULL)
+		return FALSE;
+
+	lookup = g_new0(OulSrvLookup, 1);
+	lookup->query = g_strdup(query_data->query);
 
-		close(out[0]);
-		close(in[1]);
-		resolve(in[0], out[1]);
-		/* resolve() does not return */
+	if (srv_workers_start())
+	{
+		g_thread_pool_push(srv_workers, lookup, NULL);
+	}
+	else
+	{
+		/* Without threads, the lookup blocks */
+		srv_lookup_run(lookup);
+		srv_lookup_done(lookup);
 	}
 
-	close(out[1]);
-	close(in[0]);
+	return FALSE;
+}
 
-	if (write(in[1], query, strlen(query)+1) < 0)
-		oul_debug_error("dnssrv", "Could not write to SRV resolver\n");
+OulSrvQueryData *
+oul_srv_resolve(const char *protocol, const char *transport, const char *domain, OulSrvCallback cb, gpointer extradata)
+{
+	char *query;
+	OulSrvQueryData *query_data;
+
+	g_return_val_if_fail(protocol  != NULL, NULL);
+	g_return_val_if_fail(transport != NULL, NULL);
+	g_return_val_if_fail(domain    != NULL, NULL);
+	g_return_val_if_fail(cb        != NULL, NULL);
+
+	query = g_strdup_printf("_%s._%s.%s", protocol, transport, domain);
+	oul_debug_info("dnssrv","querying SRV record for %s\n", query);
 
 	query_data = g_new0(OulSrvQueryData, 1);
+	query_data->query = g_ascii_strdown(query, -1);
 	query_data->cb = cb;
 	query_data->extradata = extradata;
-	query_data->pid = pid;
-	query_data->fd_out = out[0];
-	query_data->fd_in = in[1];
-	query_data->handle = oul_input_add(out[0], OUL_INPUT_READ, resolved, query_data);
+
+	/* Don't call the callback before returning */
+	query_data->handle = oul_timeout_add(0, srv_resolve, query_data);
 
 	g_free(query);
 
 	return query_data;
-
 }
 
 void
 oul_srv_cancel(OulSrvQueryData *query_data)
 {
+	GSList *waiters;
+
 	if (query_data->handle > 0)
-		oul_input_remove(query_data->handle);
+		oul_timeout_remove(query_data->handle);
+
+	/* the lookup goes on, its result is cached for the next query */
+	if (query_data->waiting && srv_pending != NULL)
+	{
+		waiters = g_slist_remove(g_hash_table_lookup(srv_pending, query_data->query), query_data);
 
-	close(query_data->fd_out);
-	close(query_data->fd_in);
+		if (waiters != NULL)
+			g_hash_table_insert(srv_pending, g_strdup(query_data->query), waiters);
+		else
+			g_hash_table_remove(srv_pending, query_data->query);
+	}
 
+	g_free(query_data->query);
 	g_free(query_data);
 }
+
+void
+oul_srv_init(void)
+{
+	srv_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, (GDestroyNotify)srv_cache_entry_free);
+	srv_pending = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, NULL);
+}
+
+void
+oul_srv_uninit(void)
+{
+	OulSrvLookup *lookup;
+
+	/* the lookups not started are dropped, the running ones are waited for */
+	if (srv_workers != NULL)
+	{
+		g_thread_pool_free(srv_workers, TRUE, TRUE);
+		srv_workers = NULL;
+
+		while ((lookup = g_async_queue_try_pop(srv_results)) != NULL)
+			srv_lookup_free(lookup);
+
+		g_async_queue_unref(srv_results);
+		srv_results = NULL;
+
+		oul_input_remove(srv_pipe_inpa);
+		srv_pipe_inpa = 0;
+		close(srv_pipe[0]);
+		close(srv_pipe[1]);
+		srv_pipe[0] = srv_pipe[1] = -1;
+	}
+
+	if (srv_cache != NULL)
+	{
+		g_hash_table_destroy(srv_cache);
+		srv_cache = NULL;
+	}
+
+	if (srv_pending != NULL)
+	{
+		g_hash_table_destroy(srv_pending);
+		srv_pending = NULL;
+	}
+}
@@ -24,6 +24,10 @@ typedef void (*OulSrvCallback)(OulSrvResponse *resp, int results, gpointer data)
 /**
  * Queries an SRV record.
  *
+ * The records are cached for their TTL.  The responses are sorted by
+ * priority, and the targets of the same priority in a random order
+ * weighted by their weight.  The callback frees them with g_free().
+ *
  * @param protocol Name of the protocol (e.g. "sip")
  * @param transport Name of the transport ("tcp" or "udp")
  * @param domain Domain name to query (e.g. "blubb.com")
@@ -39,6 +43,16 @@ OulSrvQueryData *oul_srv_resolve(const char *protocol, const char *transport, co
  */
 void oul_srv_cancel(OulSrvQueryData *query_data);
 
+/**
+ * Initializes the SRV query subsystem.
+ */
+void oul_srv_init(void);
+
+/**
+ * Uninitializes the SRV query subsystem.
+ */
+void oul_srv_uninit(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,13 +1,57 @@
 #include "internal.h"
 
+#include <sys/uio.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "debug.h"
+#include "eventloop.h"
+#include "prefs.h"
 #include "util.h"
 #include "proxy.h"
 #include "http.h"
 
+/* how often the idle connections are checked for expiry, in seconds */
+#define HTTP_POOL_SWEEP_INTERVAL	10
+
+/* what one read takes besides the room left in webdata */
+#define HTTP_READ_BUFFER			16384
+
+#ifdef HAVE_ZLIB
+/* the decoded body is handed over in slices of this size */
+#define HTTP_INFLATE_BUFFER			16384
+#define HTTP_ACCEPT_ENCODING		"Accept-Encoding: gzip, deflate\r\n"
+#else
+#define HTTP_ACCEPT_ENCODING		""
+#endif
+
+/* where the decoder is in a chunked body [RFC 2616, section 3.6.1] */
+typedef enum
+{
+	HTTP_CHUNK_SIZE,		/* the size line, extensions included */
+	HTTP_CHUNK_DATA,
+	HTTP_CHUNK_DATA_END,	/* the CRLF after the data */
+	HTTP_CHUNK_TRAILER,		/* the trailer headers, up to an empty line */
+	HTTP_CHUNK_DONE
+
+} OulHttpChunkState;
+
+/* a response header, as offsets into webdata since it moves as it grows */
+typedef struct
+{
+	gsize name;
+	gsize name_len;
+	gsize value;
+	gsize value_len;
+
+} OulHttpHeader;
 
 struct _OulHttpFetchUrlData
 {
 	OulHttpFetchUrlCallback callback;
+	OulHttpFetchUrlBodyCallback body_cb;	/* the body is streamed to it, not buffered */
 	void *user_data;
 
 	struct
@@ -32,6 +76,18 @@ struct _OulHttpFetchUrlData
 	OulProxyConnectData *connect_data;
 	int fd;
 	guint inpa;
+	gboolean reading;		/* the request was sent */
+
+	char *conn_key;			/* server and proxy of the connection, in the pool */
+	gboolean reused;		/* the connection was taken from the pool */
+	gboolean keep_alive;	/* the server keeps the connection after the response */
+
+	GArray *headers;		/* OulHttpHeader, valid until the body is read */
+	gsize header_scan;		/* where the header parser goes on in webdata */
+	gsize header_line;		/* start of the line it is in */
+	int http_major;
+	int http_minor;
+	int status;
 
 	gboolean got_headers;
 	gboolean has_explicit_data_len;
@@ -39,9 +95,536 @@ struct _OulHttpFetchUrlData
 	unsigned long len;
 	unsigned long data_len;
 	gssize max_len;
+
+	gsize content_len;
+	gsize body_received;	/* body bytes read, as framed by the server */
+	gsize body_len;			/* body bytes delivered */
+	gboolean body_done;
+
+	gboolean chunked;
+	OulHttpChunkState chunk_state;
+	gsize chunk_left;
+	gboolean chunk_digits;
+	gboolean chunk_ext;		/* an extension is skipped up to the end of the line */
+	gsize trailer_line;
+
+#ifdef HAVE_ZLIB
+	z_stream *inflate;		/* decodes the Content-Encoding */
+	gboolean inflate_guess;	/* deflate, which some servers send without the zlib header */
+	gboolean inflate_done;
+	gboolean inflate_pending;	/* inflate has output left for after the pause */
+	char *inflate_held;		/* framed input it did not take yet */
+	gsize inflate_held_len;
+#endif
+
+	gboolean paused;		/* the caller is not ready for more of the body */
+	guint resume_timer;
+	char *held;				/* input read before the transfer was paused */
+	gsize held_len;
+
+	gboolean in_callback;
+	gboolean cancelled;		/* by the body callback, freed once it returns */
+
+	OulHttpPriority priority;
+	gboolean queued;		/* waits for a connection slot */
+	GTimeVal queued_at;
+	char *sched_host;		/* the server its slot counts against, while it runs */
+	OulHttpPriority sched_priority;
 };
 
+/* an idle connection kept open for the next request to the same server */
+typedef struct _OulHttpConn
+{
+	char *key;
+	int fd;
+	guint inpa;			/* the server may close the idle connection */
+	time_t idle_since;
+}OulHttpConn;
+
+/* idle connections by key, the most recently used first */
+static GHashTable *http_pool = NULL;
+static guint http_pool_timer = 0;
+
+/* the fetches to a server waiting for a slot, in the order they came */
+typedef struct
+{
+	char *host;
+	GQueue *fetches;
+}OulHttpHostQueue;
+
+/* non-interactive fetches leave this many slots for the user */
+#define HTTP_SCHED_INTERACTIVE_RESERVE	2
+
+/* servers with waiting fetches by priority, they take turns */
+static GQueue *sched_hosts[OUL_HTTP_PRIORITY_COUNT];
+static GHashTable *sched_running = NULL;	/* running fetches by server */
+static guint sched_running_total = 0;
+static guint sched_timer = 0;
+static OulHttpQueueStats sched_stats[OUL_HTTP_PRIORITY_COUNT];
+
 static void url_fetch_connect_cb(gpointer url_data, gint source, const gchar *error_message);
+static gboolean url_fetch_connect(OulHttpFetchUrlData *gfud);
+static void oul_http_fetch_url_error(OulHttpFetchUrlData *gfud, const char *format, ...);
+
+/**************************************************************************
+ * Keep-alive connection pool
+ **************************************************************************/
+static gboolean
+http_keepalive_enabled(void)
+{
+	return oul_prefs_get_int("/oul/network/http/keepalive_timeout") > 0
+		&& oul_prefs_get_int("/oul/network/http/keepalive_per_host") > 0;
+}
+
+/* connections are only shared by requests to the same server through the same proxy */
+static char *
+http_conn_key(const char *host, int port)
+{
+	OulProxyInfo *gpi = oul_proxy_get_setup();
+	const char *proxy_host = oul_proxy_info_get_host(gpi);
+	const char *proxy_user = oul_proxy_info_get_username(gpi);
+	char *host_down, *key;
+
+	host_down = g_ascii_strdown(host ? host : "", -1);
+
+	key = g_strdup_printf("%s:%d|%d:%s:%d:%s", host_down, port,
+			oul_proxy_info_get_type(gpi),
+			proxy_host ? proxy_host : "", oul_proxy_info_get_port(gpi),
+			proxy_user ? proxy_user : "");
+
+	g_free(host_down);
+
+	return key;
+}
+
+static void
+http_conn_close(OulHttpConn *conn)
+{
+	if (conn->inpa > 0)
+		oul_input_remove(conn->inpa);
+
+	close(conn->fd);
+
+	g_free(conn->key);
+	g_free(conn);
+}
+
+static void
+http_pool_remove(OulHttpConn *conn)
+{
+	GQueue *conns;
+	GList *link;
+
+	conns = g_hash_table_lookup(http_pool, conn->key);
+	if (conns == NULL)
+		return;
+
+	if ((link = g_queue_find(conns, conn)) != NULL)
+		g_queue_delete_link(conns, link);
+
+	if (g_queue_is_empty(conns))
+		g_hash_table_remove(http_pool, conn->key);
+}
+
+/* an idle connection became readable, the server closed it */
+static void
+http_conn_idle_cb(gpointer data, gint source, OulInputCondition cond)
+{
+	OulHttpConn *conn = data;
+
+	oul_debug_misc("http", "Idle connection to %s was closed\n", conn->key);
+
+	http_pool_remove(conn);
+	http_conn_close(conn);
+}
+
+static gboolean
+http_pool_sweep_queue(gpointer key, gpointer value, gpointer data)
+{
+	GQueue *conns = value;
+	time_t expiry = *(time_t *)data;
+	OulHttpConn *conn;
+
+	while ((conn = g_queue_peek_tail(conns)) != NULL && conn->idle_since <= expiry)
+	{
+		g_queue_pop_tail(conns);
+		http_conn_close(conn);
+	}
+
+	return g_queue_is_empty(conns);
+}
+
+static gboolean
+http_pool_sweep_cb(gpointer data)
+{
+	time_t expiry = time(NULL) - oul_prefs_get_int("/oul/network/http/keepalive_timeout");
+
+	g_hash_table_foreach_remove(http_pool, http_pool_sweep_queue, &expiry);
+
+	if (g_hash_table_size(http_pool) == 0)
+	{
+		http_pool_timer = 0;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* keep the connection for the next request, or close it if the pool is full */
+static void
+http_pool_release(const char *key, int fd)
+{
+	int per_host = oul_prefs_get_int("/oul/network/http/keepalive_per_host");
+	OulHttpConn *conn;
+	GQueue *conns;
+
+	if (http_pool == NULL || !http_keepalive_enabled())
+	{
+		close(fd);
+		return;
+	}
+
+	conns = g_hash_table_lookup(http_pool, key);
+	if (conns == NULL)
+	{
+		conns = g_queue_new();
+		g_hash_table_insert(http_pool, g_strdup(key), conns);
+	}
+
+	while (g_queue_get_length(conns) >= per_host)
+		http_conn_close(g_queue_pop_tail(conns));
+
+	conn = g_new0(OulHttpConn, 1);
+	conn->key = g_strdup(key);
+	conn->fd = fd;
+	conn->idle_since = time(NULL);
+	conn->inpa = oul_input_add(fd, OUL_INPUT_READ, http_conn_idle_cb, conn);
+
+	g_queue_push_head(conns, conn);
+
+	if (http_pool_timer == 0)
+		http_pool_timer = oul_timeout_add_seconds(HTTP_POOL_SWEEP_INTERVAL,
+				http_pool_sweep_cb, NULL);
+}
+
+/* returns an idle connection to the server, or -1 if there is none */
+static int
+http_pool_take(const char *key)
+{
+	time_t expiry = time(NULL) - oul_prefs_get_int("/oul/network/http/keepalive_timeout");
+	OulHttpConn *conn;
+	GQueue *conns;
+	int fd = -1;
+
+	if (http_pool == NULL || !http_keepalive_enabled())
+		return -1;
+
+	conns = g_hash_table_lookup(http_pool, key);
+	if (conns == NULL)
+		return -1;
+
+	while (fd < 0 && (conn = g_queue_pop_head(conns)) != NULL)
+	{
+		if (conn->idle_since <= expiry)
+		{
+			http_conn_close(conn);
+			continue;
+		}
+
+		oul_input_remove(conn->inpa);
+		fd = conn->fd;
+
+		g_free(conn->key);
+		g_free(conn);
+	}
+
+	if (g_queue_is_empty(conns))
+		g_hash_table_remove(http_pool, key);
+
+	return fd;
+}
+
+static void
+http_pool_close_queue(gpointer key, gpointer value, gpointer data)
+{
+	GQueue *conns = value;
+	OulHttpConn *conn;
+
+	while ((conn = g_queue_pop_head(conns)) != NULL)
+		http_conn_close(conn);
+}
+
+/**************************************************************************
+ * Fetch scheduler
+ **************************************************************************/
+static char *
+http_sched_host(OulHttpFetchUrlData *gfud)
+{
+	char *host_down, *key;
+
+	host_down = g_ascii_strdown(gfud->website.address ? gfud->website.address : "", -1);
+	key = g_strdup_printf("%s:%d", host_down, gfud->website.port);
+	g_free(host_down);
+
+	return key;
+}
+
+/* whether a fetch of the class may start to the server now */
+static gboolean
+http_sched_can_run(OulHttpPriority priority, const char *host)
+{
+	int max_total = oul_prefs_get_int("/oul/network/http/max_connections");
+	int max_host = oul_prefs_get_int("/oul/network/http/max_per_host");
+
+	if (max_total > 0) {
+		if (priority != OUL_HTTP_PRIORITY_INTERACTIVE)
+			max_total = MAX(max_total - HTTP_SCHED_INTERACTIVE_RESERVE, 1);
+
+		if (sched_running_total >= max_total)
+			return FALSE;
+	}
+
+	if (max_host > 0 && sched_running != NULL &&
+			GPOINTER_TO_INT(g_hash_table_lookup(sched_running, host)) >= max_host)
+		return FALSE;
+
+	return TRUE;
+}
+
+static OulHttpHostQueue *
+http_sched_find(OulHttpPriority priority, const char *host)
+{
+	GList *l;
+
+	if (sched_hosts[priority] == NULL)
+		return NULL;
+
+	for (l = sched_hosts[priority]->head; l != NULL; l = l->next) {
+		OulHttpHostQueue *hq = l->data;
+
+		if (!strcmp(hq->host, host))
+			return hq;
+	}
+
+	return NULL;
+}
+
+static void
+http_sched_host_free(OulHttpHostQueue *hq)
+{
+	g_queue_free(hq->fetches);
+	g_free(hq->host);
+	g_free(hq);
+}
+
+/* whether fetches of the class, or of a higher one, are waiting */
+static gboolean
+http_sched_pending(OulHttpPriority priority)
+{
+	int i;
+
+	for (i = 0; i <= priority; i++)
+		if (sched_hosts[i] != NULL && !g_queue_is_empty(sched_hosts[i]))
+			return TRUE;
+
+	return FALSE;
+}
+
+static void
+http_sched_enqueue(OulHttpFetchUrlData *gfud)
+{
+	OulHttpHostQueue *hq;
+	char *host = http_sched_host(gfud);
+
+	if ((hq = http_sched_find(gfud->priority, host)) == NULL) {
+		hq = g_new0(OulHttpHostQueue, 1);
+		hq->host = host;
+		hq->fetches = g_queue_new();
+		g_queue_push_tail(sched_hosts[gfud->priority], hq);
+	} else
+		g_free(host);
+
+	g_queue_push_tail(hq->fetches, gfud);
+	gfud->queued = TRUE;
+	sched_stats[gfud->priority].queued++;
+}
+
+static void
+http_sched_dequeue(OulHttpFetchUrlData *gfud)
+{
+	OulHttpHostQueue *hq;
+	char *host;
+
+	if (!gfud->queued)
+		return;
+
+	gfud->queued = FALSE;
+	sched_stats[gfud->priority].queued--;
+
+	host = http_sched_host(gfud);
+	hq = http_sched_find(gfud->priority, host);
+	g_free(host);
+
+	if (hq == NULL)
+		return;
+
+	g_queue_remove(hq->fetches, gfud);
+
+	if (g_queue_is_empty(hq->fetches)) {
+		g_queue_remove(sched_hosts[gfud->priority], hq);
+		http_sched_host_free(hq);
+	}
+}
+
+/* takes a slot for the fetch and connects it */
+static gboolean
+http_sched_start(OulHttpFetchUrlData *gfud)
+{
+	OulHttpQueueStats *stats = &sched_stats[gfud->priority];
+	int running;
+
+	gfud->sched_host = http_sched_host(gfud);
+	gfud->sched_priority = gfud->priority;
+
+	if (sched_running != NULL) {
+		running = GPOINTER_TO_INT(g_hash_table_lookup(sched_running, gfud->sched_host));
+		g_hash_table_replace(sched_running, g_strdup(gfud->sched_host),
+				GINT_TO_POINTER(running + 1));
+	}
+	sched_running_total++;
+
+	stats->running++;
+	stats->started++;
+
+	if (gfud->queued_at.tv_sec != 0) {
+		GTimeVal now;
+		gulong waited;
+
+		g_get_current_time(&now);
+		waited = (now.tv_sec - gfud->queued_at.tv_sec) * 1000 +
+				(now.tv_usec - gfud->queued_at.tv_usec) / 1000;
+
+		stats->wait_total += waited;
+		stats->wait_max = MAX(stats->wait_max, waited);
+
+		oul_debug_misc("http", "Fetch of %s waited %lu ms for a slot\n",
+				gfud->sched_host, waited);
+	}
+
+	return url_fetch_connect(gfud);
+}
+
+static gboolean http_sched_dispatch_cb(gpointer data);
+
+static void
+http_sched_release(OulHttpFetchUrlData *gfud)
+{
+	int running;
+
+	if (gfud->sched_host == NULL)
+		return;
+
+	if (sched_running != NULL) {
+		running = GPOINTER_TO_INT(g_hash_table_lookup(sched_running, gfud->sched_host));
+		if (running > 1)
+			g_hash_table_replace(sched_running, g_strdup(gfud->sched_host),
+					GINT_TO_POINTER(running - 1));
+		else
+			g_hash_table_remove(sched_running, gfud->sched_host);
+	}
+	sched_running_total--;
+	sched_stats[gfud->sched_priority].running--;
+
+	g_free(gfud->sched_host);
+	gfud->sched_host = NULL;
+
+	/* the next fetch starts from the main loop, not inside a callback */
+	if (sched_timer == 0 && http_sched_pending(OUL_HTTP_PRIORITY_COUNT - 1))
+		sched_timer = oul_timeout_add(0, http_sched_dispatch_cb, NULL);
+}
+
+/*
+ * Starts the waiting fetches the slots allow, the higher classes first.
+ * Within a class the servers take turns, so a burst to one of them does
+ * not hold the others up.
+ */
+static gboolean
+http_sched_dispatch_cb(gpointer data)
+{
+	OulHttpFetchUrlData *gfud;
+	OulHttpHostQueue *hq;
+	gboolean started;
+	guint i, turns;
+	int priority;
+
+	sched_timer = 0;
+
+	for (priority = 0; priority < OUL_HTTP_PRIORITY_COUNT; priority++) {
+		do {
+			started = FALSE;
+			turns = g_queue_get_length(sched_hosts[priority]);
+
+			for (i = 0; i < turns; i++) {
+				if ((hq = g_queue_pop_head(sched_hosts[priority])) == NULL)
+					break;
+
+				if (!http_sched_can_run(priority, hq->host)) {
+					g_queue_push_tail(sched_hosts[priority], hq);
+					continue;
+				}
+
+				gfud = g_queue_pop_head(hq->fetches);
+
+				/* back in line before the fetch runs, its callbacks may queue more */
+				if (g_queue_is_empty(hq->fetches))
+					http_sched_host_free(hq);
+				else
+					g_queue_push_tail(sched_hosts[priority], hq);
+
+				gfud->queued = FALSE;
+				sched_stats[priority].queued--;
+
+				if (!http_sched_start(gfud))
+					oul_http_fetch_url_error(gfud, _("Unable to connect to %s"),
+							gfud->website.address);
+
+				started = TRUE;
+			}
+		} while (started);
+	}
+
+	return FALSE;
+}
+
+/* starts the fetch if a slot is free and nobody goes first, queues it otherwise */
+static gboolean
+http_sched_submit(OulHttpFetchUrlData *gfud)
+{
+	char *host;
+	gboolean run;
+
+	host = http_sched_host(gfud);
+	run = !http_sched_pending(gfud->priority) && http_sched_can_run(gfud->priority, host);
+	g_free(host);
+
+	if (run || sched_hosts[0] == NULL)
+		return http_sched_start(gfud);
+
+	g_get_current_time(&gfud->queued_at);
+	http_sched_enqueue(gfud);
+
+	oul_debug_info("http", "Fetch of %s waits for a slot, %u of its class queued\n",
+			gfud->url, sched_stats[gfud->priority].queued);
+
+	if (sched_timer == 0)
+		sched_timer = oul_timeout_add(0, http_sched_dispatch_cb, NULL);
+
+	return TRUE;
+}
+
+/**************************************************************************
+ * URL fetching
+ **************************************************************************/
 
 /**
  * The arguments to this function are similar to printf.
@@ -61,42 +644,182 @@ oul_http_fetch_url_error(OulHttpFetchUrlData *gfud, const char *format, ...)
 	oul_http_fetch_url_cancel(gfud);
 }
 
+/*
+ * Parses the header lines added to webdata since the last call, so each
+ * line is looked at once. Returns the length of the headers once the
+ * empty line ending them was read, 0 while more input is needed.
+ */
+static gsize
+parse_headers(OulHttpFetchUrlData *gfud)
+{
+	const char *data = gfud->webdata, *eol, *colon;
+	OulHttpHeader header, *last;
+	gsize start, end;
+
+	while (gfud->header_scan < gfud->len &&
+			(eol = memchr(data + gfud->header_scan, '\n', gfud->len - gfud->header_scan)) != NULL) {
+		start = gfud->header_line;
+		end = eol - data;
+
+		gfud->header_scan = gfud->header_line = end + 1;
+
+		if (end > start && data[end - 1] == '\r')
+			end--;
+
+		if (start == 0) {
+			/* webdata is nul-terminated, sscanf stops there at worst */
+			sscanf(data, "HTTP/%d.%d %d", &gfud->http_major, &gfud->http_minor, &gfud->status);
+			continue;
+		}
+
+		if (end == start)
+			return gfud->header_scan;
+
+		while (end > start && g_ascii_isspace(data[end - 1]))
+			end--;
+
+		/* a folded line goes on with the value of the last header */
+		if (data[start] == ' ' || data[start] == '\t') {
+			if (gfud->headers->len > 0) {
+				last = &g_array_index(gfud->headers, OulHttpHeader, gfud->headers->len - 1);
+				if (end > last->value)
+					last->value_len = end - last->value;
+			}
+			continue;
+		}
+
+		if ((colon = memchr(data + start, ':', end - start)) == NULL)
+			continue;
+
+		header.name = start;
+		header.name_len = colon - data - start;
+		while (header.name_len > 0 && g_ascii_isspace(data[start + header.name_len - 1]))
+			header.name_len--;
+
+		header.value = colon - data + 1;
+		while (header.value < end && (data[header.value] == ' ' || data[header.value] == '\t'))
+			header.value++;
+		header.value_len = end - header.value;
+
+		g_array_append_val(gfud->headers, header);
+	}
+
+	gfud->header_scan = gfud->len;
+
+	return 0;
+}
+
+/* forget the headers of a response, another one is read on gfud */
+static void
+parse_headers_reset(OulHttpFetchUrlData *gfud)
+{
+	g_array_set_size(gfud->headers, 0);
+	gfud->header_scan = 0;
+	gfud->header_line = 0;
+	gfud->http_major = 0;
+	gfud->http_minor = 0;
+	gfud->status = 0;
+}
+
+/* the first header named name, which is case-insensitive [RFC 2616, section 4.2] */
+static OulHttpHeader *
+parse_header_find(OulHttpFetchUrlData *gfud, const char *name, guint *index)
+{
+	OulHttpHeader *header;
+	gsize name_len = strlen(name);
+	guint i;
+
+	for (i = index ? *index : 0; i < gfud->headers->len; i++) {
+		header = &g_array_index(gfud->headers, OulHttpHeader, i);
+
+		if (header->name_len == name_len &&
+				g_ascii_strncasecmp(gfud->webdata + header->name, name, name_len) == 0) {
+			if (index)
+				*index = i + 1;
+			return header;
+		}
+	}
+
+	return NULL;
+}
+
+/* the value of the first header named name, NULL if there is none */
+static gchar *
+parse_header(OulHttpFetchUrlData *gfud, const char *name)
+{
+	OulHttpHeader *header = parse_header_find(gfud, name, NULL);
+
+	if (header == NULL)
+		return NULL;
+
+	return g_strndup(gfud->webdata + header->value, header->value_len);
+}
+
+/* whether one of the comma separated lists in the headers named name has token */
 static gboolean
-parse_redirect(const char *data, size_t data_len, OulHttpFetchUrlData *gfud)
+parse_header_has(OulHttpFetchUrlData *gfud, const char *name, const char *token)
 {
-	gchar *s;
-	gchar *new_url, *temp_url, *end;
-	gboolean full;
-	int len;
+	OulHttpHeader *header;
+	const char *p, *end, *item;
+	gsize token_len = strlen(token), len;
+	guint index = 0;
 
-	if ((s = g_strstr_len(data, data_len, "\nLocation: ")) == NULL)
-		/* We're not being redirected */
-		return FALSE;
+	while ((header = parse_header_find(gfud, name, &index)) != NULL) {
+		p = gfud->webdata + header->value;
+		end = p + header->value_len;
 
-	s += strlen("Location: ");
-	end = strchr(s, '\r');
+		while (p < end) {
+			while (p < end && (*p == ',' || g_ascii_isspace(*p)))
+				p++;
+
+			item = p;
+			while (p < end && *p != ',')
+				p++;
 
-	/* Just in case :) */
-	if (end == NULL)
-		end = strchr(s, '\n');
+			len = p - item;
+			while (len > 0 && g_ascii_isspace(item[len - 1]))
+				len--;
 
-	if (end == NULL)
-		return FALSE;
+			if (len == token_len && g_ascii_strncasecmp(item, token, len) == 0)
+				return TRUE;
+		}
+	}
 
-	len = end - s;
+	return FALSE;
+}
 
-	new_url = g_malloc(len + 1);
-	strncpy(new_url, s, len);
-	new_url[len] = '\0';
+static gboolean
+parse_redirect(OulHttpFetchUrlData *gfud)
+{
+	gchar *new_url, *temp_url, *dir;
+	gboolean full;
+
+	/* We're not being redirected */
+	if (gfud->status < 300 || gfud->status >= 400)
+		return FALSE;
+
+	if ((new_url = parse_header(gfud, "Location")) == NULL || *new_url == '\0') {
+		g_free(new_url);
+		return FALSE;
+	}
 
 	full = gfud->full;
 
-	if (*new_url == '/' || g_strstr_len(new_url, len, "://") == NULL)
+	if (strstr(new_url, "://") == NULL)
 	{
 		temp_url = new_url;
 
-		new_url = g_strdup_printf("%s:%d%s", gfud->website.address,
-								  gfud->website.port, temp_url);
+		/* a relative path goes on from the directory of the page */
+		if (*temp_url == '/') {
+			new_url = g_strdup_printf("%s:%d%s", gfud->website.address,
+									  gfud->website.port, temp_url);
+		} else {
+			dir = g_path_get_dirname(gfud->website.page ? gfud->website.page : "");
+			new_url = g_strdup_printf("%s:%d/%s%s%s", gfud->website.address,
+									  gfud->website.port, strcmp(dir, ".") ? dir : "",
+									  strcmp(dir, ".") ? "/" : "", temp_url);
+			g_free(dir);
+		}
 
 		g_free(temp_url);
 
@@ -108,6 +831,7 @@ parse_redirect(const char *data, size_t data_len, OulHttpFetchUrlData *gfud)
 	gfud->num_times_redirected++;
 	if (gfud->num_times_redirected >= 5)
 	{
+		g_free(new_url);
 		oul_http_fetch_url_error(gfud,
 				_("Could not open %s: Redirected too many times"),
 				gfud->url);
@@ -125,205 +849,714 @@ parse_redirect(const char *data, size_t data_len, OulHttpFetchUrlData *gfud)
 	g_free(gfud->request);
 	gfud->request = NULL;
 
-	oul_input_remove(gfud->inpa);
-	gfud->inpa = 0;
-	close(gfud->fd);
-	gfud->fd = -1;
-	gfud->request_written = 0;
-	gfud->len = 0;
-	gfud->data_len = 0;
+	oul_input_remove(gfud->inpa);
+	gfud->inpa = 0;
+	close(gfud->fd);
+	gfud->fd = -1;
+	gfud->reading = FALSE;
+	gfud->request_written = 0;
+	gfud->len = 0;
+	gfud->data_len = 0;
+	parse_headers_reset(gfud);
+
+	g_free(gfud->website.user);
+	g_free(gfud->website.passwd);
+	g_free(gfud->website.address);
+	g_free(gfud->website.page);
+	oul_url_parse(new_url, &gfud->website.address, &gfud->website.port,
+				   &gfud->website.page, &gfud->website.user, &gfud->website.passwd);
+
+	if (!url_fetch_connect(gfud))
+	{
+		oul_http_fetch_url_error(gfud, _("Unable to connect to %s"),
+				gfud->website.address);
+	}
+
+	return TRUE;
+}
+
+static gboolean
+parse_content_len(OulHttpFetchUrlData *gfud, size_t *content_len)
+{
+	OulHttpHeader *header = parse_header_find(gfud, "Content-Length", NULL);
+	const char *p;
+	size_t len = 0;
+	gsize i;
+
+	if (header == NULL || header->value_len == 0)
+		return FALSE;
+
+	p = gfud->webdata + header->value;
+
+	for (i = 0; i < header->value_len; i++) {
+		if (!g_ascii_isdigit(p[i]) || len > (G_MAXSIZE - 9) / 10)
+			return FALSE;
+
+		len = len * 10 + (p[i] - '0');
+	}
+
+	oul_debug_misc("util", "parsed %" G_GSIZE_FORMAT "\n", len);
+	*content_len = len;
+
+	return TRUE;
+}
+
+/* whether the server keeps the connection open after this response */
+static gboolean
+parse_keep_alive(OulHttpFetchUrlData *gfud)
+{
+	if (gfud->http_major == 0)
+		return FALSE;
+
+	if (parse_header_has(gfud, "Connection", "close"))
+		return FALSE;
+
+	if (parse_header_has(gfud, "Connection", "keep-alive"))
+		return TRUE;
+
+	/* persistent by default since HTTP/1.1 [RFC 2616, section 8.1.2] */
+	return gfud->http_major > 1 || (gfud->http_major == 1 && gfud->http_minor >= 1);
+}
+
+/* responses to HEAD, 204 and 304 never have a body [RFC 2616, section 4.4] */
+static gboolean
+parse_no_body(OulHttpFetchUrlData *gfud)
+{
+	if (gfud->request && g_ascii_strncasecmp(gfud->request, "HEAD ", 5) == 0)
+		return TRUE;
+
+	return gfud->status == 204 || gfud->status == 304;
+}
+
+/*
+ * A pooled connection may have been closed by the server before it got
+ * the request, send it again on a new connection.
+ */
+static gboolean
+url_fetch_retry(OulHttpFetchUrlData *gfud)
+{
+	if (!gfud->reused || gfud->got_headers || gfud->len > 0)
+		return FALSE;
+
+	oul_debug_info("http", "Connection to %s went stale, reconnecting\n",
+			gfud->website.address);
+
+	if (gfud->inpa > 0) {
+		oul_input_remove(gfud->inpa);
+		gfud->inpa = 0;
+	}
+
+	close(gfud->fd);
+	gfud->fd = -1;
+	gfud->reading = FALSE;
+	gfud->request_written = 0;
+	gfud->reused = FALSE;
+
+	gfud->connect_data = oul_proxy_connect(NULL, gfud->website.address,
+			gfud->website.port, url_fetch_connect_cb, gfud);
+
+	if (gfud->connect_data == NULL)
+		oul_http_fetch_url_error(gfud, _("Unable to connect to %s"),
+				gfud->website.address);
+
+	return TRUE;
+}
+
+
+/* the response is complete, or the server closed the connection */
+static void
+url_fetch_finish(OulHttpFetchUrlData *gfud)
+{
+	/* the whole response was read, the connection can serve the next request */
+	if (gfud->body_done && gfud->keep_alive) {
+		if (gfud->inpa > 0) {
+			oul_input_remove(gfud->inpa);
+			gfud->inpa = 0;
+		}
+
+		http_pool_release(gfud->conn_key, gfud->fd);
+		gfud->fd = -1;
+	}
+
+	gfud->webdata = g_realloc(gfud->webdata, gfud->len + 1);
+	gfud->webdata[gfud->len] = '\0';
+
+	gfud->callback(gfud, gfud->user_data, gfud->webdata, gfud->len, NULL);
+	oul_http_fetch_url_cancel(gfud);
+}
+
+/* the body is kept as it comes, so it can be read straight into webdata */
+static gboolean
+url_fetch_in_place(OulHttpFetchUrlData *gfud)
+{
+	if (gfud->body_cb || gfud->chunked)
+		return FALSE;
+
+#ifdef HAVE_ZLIB
+	if (gfud->inflate)
+		return FALSE;
+#endif
+
+	return TRUE;
+}
+
+/* make room for len more bytes and the nul in webdata, doubling it so appends stay linear */
+static void
+url_fetch_reserve(OulHttpFetchUrlData *gfud, gsize len)
+{
+	gsize size;
+
+	if (gfud->len + len < gfud->data_len)
+		return;
+
+	size = MAX(gfud->data_len, HTTP_READ_BUFFER);
+	while (size <= gfud->len + len)
+		size *= 2;
+
+	gfud->webdata = g_realloc(gfud->webdata, size);
+	gfud->data_len = size;
+}
+
+/* hands a slice of the body to the caller, FALSE if gfud is gone */
+static gboolean
+url_fetch_deliver(OulHttpFetchUrlData *gfud, const char *data, gsize len)
+{
+	gboolean more;
+
+	if (len == 0)
+		return TRUE;
+
+	if (gfud->max_len != -1 && (gfud->body_len + len) > gfud->max_len) {
+		oul_http_fetch_url_error(gfud, _("Error reading from %s: response too long (%d bytes limit)"),
+				gfud->website.address, gfud->max_len);
+		return FALSE;
+	}
+
+	gfud->body_len += len;
+
+	if (gfud->body_cb) {
+		gfud->in_callback = TRUE;
+		more = gfud->body_cb(gfud, gfud->user_data, data, len);
+		gfud->in_callback = FALSE;
+
+		if (gfud->cancelled) {
+			oul_http_fetch_url_cancel(gfud);
+			return FALSE;
+		}
+
+		if (!more)
+			oul_http_fetch_url_pause(gfud);
+
+		return TRUE;
+	}
+
+	url_fetch_reserve(gfud, len);
+	memcpy(gfud->webdata + gfud->len, data, len);
+	gfud->len += len;
+
+	return TRUE;
+}
+
+#ifdef HAVE_ZLIB
+/* start decoding the body if it was compressed with an encoding we know */
+static void
+url_fetch_inflate_init(OulHttpFetchUrlData *gfud, const char *encoding)
+{
+	z_stream *z;
+
+	if (g_ascii_strcasecmp(encoding, "gzip") && g_ascii_strcasecmp(encoding, "x-gzip")
+			&& g_ascii_strcasecmp(encoding, "deflate"))
+		return;
+
+	z = g_new0(z_stream, 1);
+
+	/* a gzip or a zlib header is detected */
+	if (inflateInit2(z, MAX_WBITS + 32) != Z_OK) {
+		oul_debug_error("util", "Failed to start decoding the %s body: %s\n",
+				encoding, z->msg ? z->msg : "");
+		g_free(z);
+		return;
+	}
+
+	gfud->inflate = z;
+	gfud->inflate_guess = !g_ascii_strcasecmp(encoding, "deflate");
+}
+
+static void
+url_fetch_inflate_end(OulHttpFetchUrlData *gfud)
+{
+	if (gfud->inflate == NULL)
+		return;
+
+	inflateEnd(gfud->inflate);
+	g_free(gfud->inflate);
+	gfud->inflate = NULL;
+
+	g_free(gfud->inflate_held);
+	gfud->inflate_held = NULL;
+	gfud->inflate_held_len = 0;
+	gfud->inflate_pending = FALSE;
+}
+
+/*
+ * Decodes a slice of the framed body and delivers the output. When the
+ * caller pauses the transfer, the input inflate did not take is kept
+ * until it is resumed. Returns FALSE if gfud is gone.
+ */
+static gboolean
+url_fetch_inflate(OulHttpFetchUrlData *gfud, const char *data, gsize len)
+{
+	z_stream *z = gfud->inflate;
+	char out[HTTP_INFLATE_BUFFER];
+	gboolean first = (z->total_in == 0);
+	int ret;
+
+	gfud->inflate_pending = FALSE;
+
+	z->next_in = (Bytef *)data;
+	z->avail_in = len;
+
+	while (!gfud->inflate_done) {
+		if (gfud->paused) {
+			gfud->inflate_held = g_memdup(z->next_in, z->avail_in);
+			gfud->inflate_held_len = z->avail_in;
+			gfud->inflate_pending = TRUE;
+			return TRUE;
+		}
+
+		z->next_out = (Bytef *)out;
+		z->avail_out = sizeof(out);
+
+		ret = inflate(z, Z_NO_FLUSH);
+
+		if (ret == Z_DATA_ERROR && first && gfud->inflate_guess) {
+			/* no zlib header, try the raw deflate data */
+			gfud->inflate_guess = FALSE;
+
+			inflateEnd(z);
+			memset(z, 0, sizeof(z_stream));
+			if (inflateInit2(z, -MAX_WBITS) == Z_OK) {
+				z->next_in = (Bytef *)data;
+				z->avail_in = len;
+				continue;
+			}
+		}
+
+		if (ret == Z_STREAM_END) {
+			gfud->inflate_done = TRUE;
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			oul_debug_error("util", "Failed to decode the body: %s\n",
+					z->msg ? z->msg : "");
+			oul_http_fetch_url_error(gfud, _("Error reading from %s: invalid compressed data"),
+					gfud->website.address);
+			return FALSE;
+		}
+
+		if (!url_fetch_deliver(gfud, out, sizeof(out) - z->avail_out))
+			return FALSE;
+
+		/* the input was taken and inflate has no more output for now */
+		if (z->avail_in == 0 && z->avail_out > 0)
+			break;
+	}
+
+	return TRUE;
+}
+#endif
+
+/* hands a slice of the framed body to the decoder if it is compressed. FALSE if gfud is gone */
+static gboolean
+url_fetch_decode(OulHttpFetchUrlData *gfud, const char *data, gsize len)
+{
+#ifdef HAVE_ZLIB
+	if (gfud->inflate && len > 0)
+		return url_fetch_inflate(gfud, data, len);
+#endif
+
+	return url_fetch_deliver(gfud, data, len);
+}
+
+/* the decoder still has output for the caller, once the transfer is resumed */
+static gboolean
+url_fetch_decode_pending(OulHttpFetchUrlData *gfud)
+{
+#ifdef HAVE_ZLIB
+	return gfud->inflate_pending;
+#else
+	return FALSE;
+#endif
+}
+
+/* decode what was left when the transfer was paused. FALSE if gfud is gone */
+static gboolean
+url_fetch_decode_resume(OulHttpFetchUrlData *gfud)
+{
+#ifdef HAVE_ZLIB
+	char *held = gfud->inflate_held;
+	gsize held_len = gfud->inflate_held_len;
+	gboolean alive;
+
+	if (!gfud->inflate_pending)
+		return TRUE;
+
+	gfud->inflate_held = NULL;
+	gfud->inflate_held_len = 0;
+
+	alive = url_fetch_inflate(gfud, held ? held : "", held_len);
+	g_free(held);
+
+	return alive;
+#else
+	return TRUE;
+#endif
+}
+
+/* steps the chunked decoder over a byte outside the chunk data, FALSE if it is invalid */
+static gboolean
+url_fetch_chunk_byte(OulHttpFetchUrlData *gfud, char c)
+{
+	switch (gfud->chunk_state) {
+		case HTTP_CHUNK_SIZE:
+			if (c == '\n') {
+				if (!gfud->chunk_digits)
+					return FALSE;
+
+				gfud->chunk_state = (gfud->chunk_left > 0) ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+				gfud->chunk_digits = FALSE;
+				gfud->chunk_ext = FALSE;
+				gfud->trailer_line = 0;
+			} else if (c == '\r' || gfud->chunk_ext) {
+				/* the extensions are ignored */
+			} else if (g_ascii_isxdigit(c)) {
+				if (gfud->chunk_left > (G_MAXSIZE >> 4))
+					return FALSE;
+
+				gfud->chunk_left = (gfud->chunk_left << 4) | g_ascii_xdigit_value(c);
+				gfud->chunk_digits = TRUE;
+			} else if (c == ';' || c == ' ' || c == '\t') {
+				gfud->chunk_ext = TRUE;
+			} else {
+				return FALSE;
+			}
+			break;
+
+		case HTTP_CHUNK_DATA_END:
+			if (c == '\n')
+				gfud->chunk_state = HTTP_CHUNK_SIZE;
+			else if (c != '\r')
+				return FALSE;
+			break;
 
-	g_free(gfud->website.user);
-	g_free(gfud->website.passwd);
-	g_free(gfud->website.address);
-	g_free(gfud->website.page);
-	oul_url_parse(new_url, &gfud->website.address, &gfud->website.port,
-				   &gfud->website.page, &gfud->website.user, &gfud->website.passwd);
+		case HTTP_CHUNK_TRAILER:
+			if (c == '\n') {
+				if (gfud->trailer_line == 0) {
+					gfud->chunk_state = HTTP_CHUNK_DONE;
+					gfud->body_done = TRUE;
+				}
 
-	gfud->connect_data = oul_proxy_connect(NULL, 
-			gfud->website.address, gfud->website.port,
-			url_fetch_connect_cb, gfud);
+				gfud->trailer_line = 0;
+			} else if (c != '\r') {
+				gfud->trailer_line++;
+			}
+			break;
 
-	if (gfud->connect_data == NULL)
-	{
-		oul_http_fetch_url_error(gfud, _("Unable to connect to %s"),
-				gfud->website.address);
+		default:
+			break;
 	}
 
 	return TRUE;
 }
 
-static size_t
-parse_content_len(const char *data, size_t data_len)
+static void
+url_fetch_hold(OulHttpFetchUrlData *gfud, const char *data, gsize len)
 {
-	size_t content_len = 0;
-	const char *p = NULL;
+	gfud->held = g_realloc(gfud->held, gfud->held_len + len);
+	memcpy(gfud->held + gfud->held_len, data, len);
+	gfud->held_len += len;
+}
 
-	/* This is still technically wrong, since headers are case-insensitive
-	 * [RFC 2616, section 4.2], though this ought to catch the normal case.
-	 * Note: data is _not_ nul-terminated.
-	 */
-	if(data_len > 16) {
-		p = (strncmp(data, "Content-Length: ", 16) == 0) ? data : NULL;
-		if(!p)
-			p = (strncmp(data, "CONTENT-LENGTH: ", 16) == 0)
-				? data : NULL;
-		if(!p) {
-			p = g_strstr_len(data, data_len, "\nContent-Length: ");
-			if (p)
-				p++;
+/*
+ * Frames the body by its length, its chunks or the end of the connection,
+ * and decodes it for the caller. The input left when the caller pauses the transfer is
+ * held until it is resumed. Returns FALSE if gfud is gone.
+ */
+static gboolean
+url_fetch_body(OulHttpFetchUrlData *gfud, const char *data, gsize len)
+{
+	gsize n;
+
+	while (len > 0 && !gfud->body_done) {
+		if (gfud->paused) {
+			url_fetch_hold(gfud, data, len);
+			return TRUE;
 		}
-		if(!p) {
-			p = g_strstr_len(data, data_len, "\nCONTENT-LENGTH: ");
-			if (p)
-				p++;
+
+		if (!gfud->chunked) {
+			n = len;
+
+			if (gfud->has_explicit_data_len) {
+				n = MIN(len, gfud->content_len - gfud->body_received);
+				gfud->body_received += n;
+				gfud->body_done = (gfud->body_received == gfud->content_len);
+			}
+
+			if (!url_fetch_decode(gfud, data, n))
+				return FALSE;
+		} else if (gfud->chunk_state == HTTP_CHUNK_DATA) {
+			n = MIN(len, gfud->chunk_left);
+
+			gfud->chunk_left -= n;
+			if (gfud->chunk_left == 0)
+				gfud->chunk_state = HTTP_CHUNK_DATA_END;
+
+			if (!url_fetch_decode(gfud, data, n))
+				return FALSE;
+		} else {
+			n = 1;
+
+			if (!url_fetch_chunk_byte(gfud, *data)) {
+				oul_http_fetch_url_error(gfud, _("Error reading from %s: invalid chunked encoding"),
+						gfud->website.address);
+				return FALSE;
+			}
 		}
 
-		if(p)
-			p += 16;
+		data += n;
+		len -= n;
 	}
 
-	/* If we can find a Content-Length header at all, try to sscanf it.
-	 * Response headers should end with at least \r\n, so sscanf is safe,
-	 * if we make sure that there is indeed a \n in our header.
-	 */
-	if (p && g_strstr_len(p, data_len - (p - data), "\n")) {
-		sscanf(p, "%" G_GSIZE_FORMAT, &content_len);
-		oul_debug_misc("util", "parsed %" G_GSIZE_FORMAT "\n", content_len);
-	}
+	/* bytes past the end of the response would confuse the next one */
+	if (len > 0)
+		gfud->keep_alive = FALSE;
 
-	return content_len;
+	return TRUE;
 }
 
-
-static void
-url_fetch_recv_cb(gpointer url_data, gint source, OulInputCondition cond)
+/* the headers are complete, find out how the body is framed. FALSE if gfud is gone */
+static gboolean
+url_fetch_headers(OulHttpFetchUrlData *gfud, guint header_len)
 {
-	OulHttpFetchUrlData *gfud = url_data;
-	int len;
-	char buf[4096];
-	char *data_cursor;
-	gboolean got_eof = FALSE;
+	gsize body_len = gfud->len - header_len;
+	size_t content_len = 0;
+	char *body, *new_data;
+#ifdef HAVE_ZLIB
+	char *encoding;
+#endif
+	gboolean ret;
 
-	while((len = read(source, buf, sizeof(buf))) > 0) {
+	oul_debug_misc("util", "Response headers: '%.*s'\n",
+		header_len, gfud->webdata);
 
-		if(gfud->max_len != -1 && (gfud->len + len) > gfud->max_len) {
-			oul_http_fetch_url_error(gfud, _("Error reading from %s: response too long (%d bytes limit)"),
-						    gfud->website.address, gfud->max_len);
-			return;
-		}
+	/* See if we can find a redirect. */
+	if (parse_redirect(gfud))
+		return FALSE;
+
+	gfud->got_headers = TRUE;
+
+	/* No redirect. See how the body is framed. */
+	gfud->keep_alive = parse_keep_alive(gfud);
 
-		/* If we've filled up our buffer, make it bigger */
-		if((gfud->len + len) >= gfud->data_len) {
-			while((gfud->len + len) >= gfud->data_len)
-				gfud->data_len += sizeof(buf);
+	if (parse_no_body(gfud)) {
+		gfud->has_explicit_data_len = TRUE;
+	} else if (parse_header_has(gfud, "Transfer-Encoding", "chunked")) {
+		/* chunked is always the last of the transfer codings */
+		gfud->chunked = TRUE;
+		gfud->chunk_state = HTTP_CHUNK_SIZE;
+	} else if (parse_content_len(gfud, &content_len)) {
+		gfud->has_explicit_data_len = TRUE;
+	} else {
+		/* the end is where the server closes the connection */
+		gfud->keep_alive = FALSE;
+	}
+
+#ifdef HAVE_ZLIB
+	encoding = parse_header(gfud, "Content-Encoding");
+	if (encoding && !parse_no_body(gfud))
+		url_fetch_inflate_init(gfud, encoding);
+	g_free(encoding);
+#endif
+
+	gfud->content_len = content_len;
+	gfud->body_done = (gfud->has_explicit_data_len && content_len == 0);
+
+	/* no need to allocate for a body which would be refused anyway */
+	if (gfud->has_explicit_data_len && gfud->max_len != -1 && content_len > gfud->max_len &&
+			url_fetch_in_place(gfud)) {
+		oul_http_fetch_url_error(gfud, _("Error reading from %s: response too long (%d bytes limit)"),
+				gfud->website.address, gfud->max_len);
+		return FALSE;
+	}
 
-			gfud->webdata = g_realloc(gfud->webdata, gfud->data_len);
+	/* We may have read part of the body when reading the headers, don't lose it */
+	body = g_memdup(gfud->webdata + header_len, body_len);
+
+	/* The headers are kept if they are returned too, or for the end of a stream */
+	gfud->len = (gfud->include_headers || gfud->body_cb) ? header_len : 0;
+
+	if (!gfud->body_cb && gfud->has_explicit_data_len) {
+		new_data = g_try_realloc(gfud->webdata, gfud->len + content_len + 1);
+		if (new_data == NULL) {
+			oul_debug_error("util",
+					"Failed to allocate %" G_GSIZE_FORMAT " bytes: %s\n",
+					content_len, g_strerror(errno));
+			oul_http_fetch_url_error(gfud,
+					_("Unable to allocate enough memory to hold "
+					  "the contents from %s.  The web server may "
+					  "be trying something malicious."),
+					gfud->website.address);
+			g_free(body);
+
+			return FALSE;
 		}
 
-		data_cursor = gfud->webdata + gfud->len;
+		gfud->webdata = new_data;
+		gfud->data_len = gfud->len + content_len + 1;
+	}
 
-		gfud->len += len;
+	ret = url_fetch_body(gfud, body, body_len);
+	g_free(body);
 
-		memcpy(data_cursor, buf, len);
+	return ret;
+}
 
-		gfud->webdata[gfud->len] = '\0';
+static void
+url_fetch_recv_cb(gpointer url_data, gint source, OulInputCondition cond)
+{
+	OulHttpFetchUrlData *gfud = url_data;
+	gssize len = 0;
+	char buf[HTTP_READ_BUFFER];
+	struct iovec iov[2];
+	int iovcnt;
+	gsize header_len, direct;
 
-		if(!gfud->got_headers) {
-			char *tmp;
+	while (!gfud->paused && !gfud->body_done) {
 
-			/* See if we've reached the end of the headers yet */
-			if((tmp = strstr(gfud->webdata, "\r\n\r\n"))) {
-				char * new_data;
-				guint header_len = (tmp + 4 - gfud->webdata);
-				size_t content_len;
+		if (gfud->got_headers && !url_fetch_in_place(gfud)) {
+			/* the body is framed or decoded on its way to the caller */
+			if ((len = read(source, buf, sizeof(buf))) <= 0)
+				break;
 
-				oul_debug_misc("util", "Response headers: '%.*s'\n",
-					header_len, gfud->webdata);
+			if (!url_fetch_body(gfud, buf, len))
+				return;
 
-				/* See if we can find a redirect. */
-				if(parse_redirect(gfud->webdata, header_len, gfud))
-					return;
+			continue;
+		}
 
-				gfud->got_headers = TRUE;
+		/*
+		 * The headers, and a body kept as it comes, are read into webdata.
+		 * A body of known length has its exact room, else what does not
+		 * fit in webdata goes to buf and is appended after it grew.
+		 */
+		if (gfud->got_headers && gfud->has_explicit_data_len) {
+			iov[0].iov_base = gfud->webdata + gfud->len;
+			iov[0].iov_len = gfud->content_len - gfud->body_received;
+			iovcnt = 1;
+		} else {
+			url_fetch_reserve(gfud, 1);
+			iov[0].iov_base = gfud->webdata + gfud->len;
+			iov[0].iov_len = gfud->data_len - gfud->len - 1;
+			iov[1].iov_base = buf;
+			iov[1].iov_len = sizeof(buf);
+			iovcnt = 2;
+		}
 
-				/* No redirect. See if we can find a content length. */
-				content_len = parse_content_len(gfud->webdata, header_len);
+		if ((len = readv(source, iov, iovcnt)) <= 0)
+			break;
 
-				if(content_len == 0) {
-					/* We'll stick with an initial 8192 */
-					content_len = 8192;
-				} else {
-					gfud->has_explicit_data_len = TRUE;
-				}
+		if (gfud->max_len != -1 &&
+				((gfud->got_headers ? gfud->body_len : gfud->len) + len) > gfud->max_len) {
+			oul_http_fetch_url_error(gfud, _("Error reading from %s: response too long (%d bytes limit)"),
+						    gfud->website.address, gfud->max_len);
+			return;
+		}
 
+		direct = MIN((gsize)len, iov[0].iov_len);
+		gfud->len += direct;
 
-				/* If we're returning the headers too, we don't need to clean them out */
-				if(gfud->include_headers) {
-					gfud->data_len = content_len + header_len;
-					gfud->webdata = g_realloc(gfud->webdata, gfud->data_len);
-				} else {
-					size_t body_len = 0;
-
-					if(gfud->len > (header_len + 1))
-						body_len = (gfud->len - header_len);
-
-					content_len = MAX(content_len, body_len);
-
-					new_data = g_try_malloc(content_len);
-					if(new_data == NULL) {
-						oul_debug_error("util",
-								"Failed to allocate %" G_GSIZE_FORMAT " bytes: %s\n",
-								content_len, g_strerror(errno));
-						oul_http_fetch_url_error(gfud,
-								_("Unable to allocate enough memory to hold "
-								  "the contents from %s.  The web server may "
-								  "be trying something malicious."),
-								gfud->website.address);
-
-						return;
-					}
-
-					/* We may have read part of the body when reading the headers, don't lose it */
-					if(body_len > 0) {
-						tmp += 4;
-						memcpy(new_data, tmp, body_len);
-					}
-
-					/* Out with the old... */
-					g_free(gfud->webdata);
-
-					/* In with the new. */
-					gfud->len = body_len;
-					gfud->data_len = content_len;
-					gfud->webdata = new_data;
-				}
-			}
+		if ((gsize)len > direct) {
+			url_fetch_reserve(gfud, len - direct);
+			memcpy(gfud->webdata + gfud->len, buf, len - direct);
+			gfud->len += len - direct;
 		}
 
-		if(gfud->has_explicit_data_len && gfud->len >= gfud->data_len) {
-			got_eof = TRUE;
-			break;
+		gfud->webdata[gfud->len] = '\0';
+
+		if (gfud->got_headers) {
+			gfud->body_received += len;
+			gfud->body_len += len;
+			gfud->body_done = (gfud->has_explicit_data_len &&
+					gfud->body_received == gfud->content_len);
+			continue;
 		}
+
+		/* See if we've reached the end of the headers yet */
+		if((header_len = parse_headers(gfud)) > 0 &&
+				!url_fetch_headers(gfud, header_len))
+			return;
 	}
 
+	if (gfud->body_done && !url_fetch_decode_pending(gfud)) {
+		url_fetch_finish(gfud);
+		return;
+	}
+
+	/* reading goes on once the caller resumes the transfer */
+	if (gfud->paused)
+		return;
+
 	if(len < 0) {
 		if(errno == EAGAIN) {
 			return;
 		} else {
+			if(url_fetch_retry(gfud))
+				return;
+
 			oul_http_fetch_url_error(gfud, _("Error reading from %s: %s"),
 					gfud->website.address, g_strerror(errno));
 			return;
 		}
 	}
 
-	if((len == 0) || got_eof) {
-		gfud->webdata = g_realloc(gfud->webdata, gfud->len + 1);
-		gfud->webdata[gfud->len] = '\0';
+	if(url_fetch_retry(gfud))
+		return;
 
-		gfud->callback(gfud, gfud->user_data, gfud->webdata, gfud->len, NULL);
-		oul_http_fetch_url_cancel(gfud);
+	/* the server closed the connection, which ends a response without a length */
+	url_fetch_finish(gfud);
+}
+
+static gboolean
+url_fetch_resume_cb(gpointer data)
+{
+	OulHttpFetchUrlData *gfud = data;
+	char *held;
+	gsize held_len;
+	gboolean alive = TRUE;
+
+	gfud->resume_timer = 0;
+
+	/* the decoder goes first, the held input comes after what it has */
+	if (!url_fetch_decode_resume(gfud) || gfud->paused)
+		return FALSE;
+
+	held = gfud->held;
+	held_len = gfud->held_len;
+	gfud->held = NULL;
+	gfud->held_len = 0;
+
+	if (held) {
+		alive = url_fetch_body(gfud, held, held_len);
+		g_free(held);
 	}
+
+	if (!alive || gfud->paused)
+		return FALSE;
+
+	if (gfud->body_done)
+		url_fetch_finish(gfud);
+	else if (gfud->reading && gfud->inpa == 0)
+		gfud->inpa = oul_input_add(gfud->fd, OUL_INPUT_READ, url_fetch_recv_cb, gfud);
+
+	return FALSE;
 }
 
 static void
@@ -342,6 +1575,9 @@ url_fetch_send_cb(gpointer data, gint source, OulInputCondition cond)
 	if (len < 0 && errno == EAGAIN)
 		return;
 	else if (len < 0) {
+		if (url_fetch_retry(gfud))
+			return;
+
 		oul_http_fetch_url_error(gfud, _("Error writing to %s: %s"),
 				gfud->website.address, g_strerror(errno));
 		return;
@@ -353,65 +1589,113 @@ url_fetch_send_cb(gpointer data, gint source, OulInputCondition cond)
 
 	/* We're done writing our request, now start reading the response */
 	oul_input_remove(gfud->inpa);
-	gfud->inpa = oul_input_add(gfud->fd, OUL_INPUT_READ, url_fetch_recv_cb,
-		gfud);
+	gfud->inpa = 0;
+	gfud->reading = TRUE;
+
+	if (!gfud->paused)
+		gfud->inpa = oul_input_add(gfud->fd, OUL_INPUT_READ, url_fetch_recv_cb,
+			gfud);
 }
 
+/* build the request if the caller gave none, and send it on fd */
 static void
-url_fetch_connect_cb(gpointer url_data, gint source, const gchar *error_message)
+url_fetch_start(OulHttpFetchUrlData *gfud, int fd)
 {
-	OulHttpFetchUrlData *gfud;
-
-	gfud = url_data;
-	gfud->connect_data = NULL;
+	const char *connection;
 
-	if (source == -1)
-	{
-		oul_http_fetch_url_error(gfud, _("Unable to connect to %s: %s"),
-				(gfud->website.address ? gfud->website.address : ""), error_message);
-		return;
-	}
+	gfud->fd = fd;
 
-	gfud->fd = source;
+	/* HTTP/1.0 servers would neither chunk nor frame the response for a persistent connection */
+	connection = (gfud->http11 && http_keepalive_enabled()) ?
+			"Connection: keep-alive\r\n" : "Connection: close\r\n";
 
 	if (!gfud->request) {
 		if (gfud->user_agent) {
-			/* Host header is not forbidden in HTTP/1.0 requests, and HTTP/1.1
-			 * clients must know how to handle the "chunked" transfer encoding.
-			 * Oul doesn't know how to handle "chunked", so should always send
-			 * the Host header regardless, to get around some observed problems
+			/* Host header is not forbidden in HTTP/1.0 requests, so always
+			 * send it regardless, to get around some observed problems
 			 */
 			gfud->request = g_strdup_printf(
 				"GET %s%s HTTP/%s\r\n"
-				"Connection: close\r\n"
+				"%s"
 				"User-Agent: %s\r\n"
 				"Accept: */*\r\n"
+				HTTP_ACCEPT_ENCODING
 				"Host: %s\r\n\r\n",
 				(gfud->full ? "" : "/"),
 				(gfud->full ? (gfud->url ? gfud->url : "") : (gfud->website.page ? gfud->website.page : "")),
 				(gfud->http11 ? "1.1" : "1.0"),
+				connection,
 				(gfud->user_agent ? gfud->user_agent : ""),
 				(gfud->website.address ? gfud->website.address : ""));
 		} else {
 			gfud->request = g_strdup_printf(
 				"GET %s%s HTTP/%s\r\n"
-				"Connection: close\r\n"
+				"%s"
 				"Accept: */*\r\n"
+				HTTP_ACCEPT_ENCODING
 				"Host: %s\r\n\r\n",
 				(gfud->full ? "" : "/"),
 				(gfud->full ? (gfud->url ? gfud->url : "") : (gfud->website.page ? gfud->website.page : "")),
 				(gfud->http11 ? "1.1" : "1.0"),
+				connection,
 				(gfud->website.address ? gfud->website.address : ""));
 		}
 	}
 
 	oul_debug_misc("util", "Request:\n%s\n", gfud->request);
 
-	gfud->inpa = oul_input_add(source, OUL_INPUT_WRITE,
+	gfud->inpa = oul_input_add(fd, OUL_INPUT_WRITE,
 								url_fetch_send_cb, gfud);
+}
+
+static void
+url_fetch_connect_cb(gpointer url_data, gint source, const gchar *error_message)
+{
+	OulHttpFetchUrlData *gfud;
+
+	gfud = url_data;
+	gfud->connect_data = NULL;
+
+	if (source == -1)
+	{
+		oul_http_fetch_url_error(gfud, _("Unable to connect to %s: %s"),
+				(gfud->website.address ? gfud->website.address : ""), error_message);
+		return;
+	}
+
+	url_fetch_start(gfud, source);
 	url_fetch_send_cb(gfud, source, OUL_INPUT_WRITE);
 }
 
+/*
+ * Reuse an idle connection to the server if there is one, the request is
+ * sent once the main loop sees it writable. Open a new one otherwise.
+ */
+static gboolean
+url_fetch_connect(OulHttpFetchUrlData *gfud)
+{
+	int fd;
+
+	g_free(gfud->conn_key);
+	gfud->conn_key = http_conn_key(gfud->website.address, gfud->website.port);
+
+	if ((fd = http_pool_take(gfud->conn_key)) >= 0)
+	{
+		oul_debug_misc("http", "Reusing connection to %s\n", gfud->conn_key);
+
+		gfud->reused = TRUE;
+		url_fetch_start(gfud, fd);
+
+		return TRUE;
+	}
+
+	gfud->reused = FALSE;
+	gfud->connect_data = oul_proxy_connect(NULL, gfud->website.address, gfud->website.port,
+			url_fetch_connect_cb, gfud);
+
+	return gfud->connect_data != NULL;
+}
+
 OulHttpFetchUrlData *
 oul_http_fetch_url_request(const char *url, gboolean full,
 		const char *user_agent, gboolean http11,
@@ -423,17 +1707,15 @@ oul_http_fetch_url_request(const char *url, gboolean full,
 						callback, user_data);
 }
 
-OulHttpFetchUrlData *
-oul_http_fetch_url_request_len(const char *url, gboolean full,
+static OulHttpFetchUrlData *
+url_fetch_new(const char *url, gboolean full,
 		const char *user_agent, gboolean http11,
 		const char *request, gboolean include_headers, gssize max_len,
+		OulHttpPriority priority, OulHttpFetchUrlBodyCallback body_cb,
 		OulHttpFetchUrlCallback callback, void *user_data)
 {
 	OulHttpFetchUrlData *gfud;
 
-	g_return_val_if_fail(url      != NULL, NULL);
-	g_return_val_if_fail(callback != NULL, NULL);
-
 	oul_debug_info("util",
 			 "requested to fetch (%s), full=%d, user_agent=(%s), http11=%d\n",
 			 url, full, user_agent?user_agent:"(null)", http11);
@@ -441,6 +1723,7 @@ oul_http_fetch_url_request_len(const char *url, gboolean full,
 	gfud = g_new0(OulHttpFetchUrlData, 1);
 
 	gfud->callback = callback;
+	gfud->body_cb = body_cb;
 	gfud->user_data  = user_data;
 	gfud->url = g_strdup(url);
 	gfud->user_agent = g_strdup(user_agent);
@@ -450,14 +1733,13 @@ oul_http_fetch_url_request_len(const char *url, gboolean full,
 	gfud->include_headers = include_headers;
 	gfud->fd = -1;
 	gfud->max_len = max_len;
+	gfud->priority = priority;
+	gfud->headers = g_array_new(FALSE, FALSE, sizeof(OulHttpHeader));
 
 	oul_url_parse(url, &gfud->website.address, &gfud->website.port,
 				   &gfud->website.page, &gfud->website.user, &gfud->website.passwd);
 
-	gfud->connect_data = oul_proxy_connect(NULL, gfud->website.address, gfud->website.port,
-			url_fetch_connect_cb, gfud);
-
-	if (gfud->connect_data == NULL)
+	if (!http_sched_submit(gfud))
 	{
 		oul_http_fetch_url_error(gfud, _("Unable to connect to %s"),
 				gfud->website.address);
@@ -467,15 +1749,104 @@ oul_http_fetch_url_request_len(const char *url, gboolean full,
 	return gfud;
 }
 
+OulHttpFetchUrlData *
+oul_http_fetch_url_request_len(const char *url, gboolean full,
+		const char *user_agent, gboolean http11,
+		const char *request, gboolean include_headers, gssize max_len,
+		OulHttpFetchUrlCallback callback, void *user_data)
+{
+	g_return_val_if_fail(url      != NULL, NULL);
+	g_return_val_if_fail(callback != NULL, NULL);
+
+	return url_fetch_new(url, full, user_agent, http11, request,
+			include_headers, max_len, OUL_HTTP_PRIORITY_INTERACTIVE,
+			NULL, callback, user_data);
+}
+
+OulHttpFetchUrlData *
+oul_http_fetch_url_request_priority(const char *url, gboolean full,
+		const char *user_agent, gboolean http11,
+		const char *request, gboolean include_headers, gssize max_len,
+		OulHttpPriority priority, OulHttpFetchUrlCallback callback, void *user_data)
+{
+	g_return_val_if_fail(url      != NULL, NULL);
+	g_return_val_if_fail(callback != NULL, NULL);
+	g_return_val_if_fail(priority >= 0 && priority < OUL_HTTP_PRIORITY_COUNT, NULL);
+
+	return url_fetch_new(url, full, user_agent, http11, request,
+			include_headers, max_len, priority, NULL, callback, user_data);
+}
+
+OulHttpFetchUrlData *
+oul_http_fetch_url_stream(const char *url, gboolean full,
+		const char *user_agent, gboolean http11,
+		const char *request, gssize max_len,
+		OulHttpFetchUrlBodyCallback body_cb, OulHttpFetchUrlCallback callback,
+		void *user_data)
+{
+	g_return_val_if_fail(url      != NULL, NULL);
+	g_return_val_if_fail(body_cb  != NULL, NULL);
+	g_return_val_if_fail(callback != NULL, NULL);
+
+	return url_fetch_new(url, full, user_agent, http11, request,
+			TRUE, max_len, OUL_HTTP_PRIORITY_INTERACTIVE,
+			body_cb, callback, user_data);
+}
+
+void
+oul_http_fetch_url_pause(OulHttpFetchUrlData *gfud)
+{
+	g_return_if_fail(gfud != NULL);
+
+	gfud->paused = TRUE;
+
+	if (gfud->resume_timer > 0) {
+		oul_timeout_remove(gfud->resume_timer);
+		gfud->resume_timer = 0;
+	}
+
+	/* the socket buffers fill up and the server slows down */
+	if (gfud->reading && gfud->inpa > 0) {
+		oul_input_remove(gfud->inpa);
+		gfud->inpa = 0;
+	}
+}
+
+void
+oul_http_fetch_url_resume(OulHttpFetchUrlData *gfud)
+{
+	g_return_if_fail(gfud != NULL);
+
+	if (!gfud->paused)
+		return;
+
+	gfud->paused = FALSE;
+
+	/* the held input is delivered from the main loop, never from inside the caller */
+	if (gfud->resume_timer == 0)
+		gfud->resume_timer = oul_timeout_add(0, url_fetch_resume_cb, gfud);
+}
+
 void
 oul_http_fetch_url_cancel(OulHttpFetchUrlData *gfud)
 {
+	if (gfud->in_callback) {
+		gfud->cancelled = TRUE;
+		return;
+	}
+
+	http_sched_dequeue(gfud);
+	http_sched_release(gfud);
+
 	if (gfud->connect_data != NULL)
 		oul_proxy_connect_cancel(gfud->connect_data);
 
 	if (gfud->inpa > 0)
 		oul_input_remove(gfud->inpa);
 
+	if (gfud->resume_timer > 0)
+		oul_timeout_remove(gfud->resume_timer);
+
 	if (gfud->fd >= 0)
 		close(gfud->fd);
 
@@ -487,10 +1858,114 @@ oul_http_fetch_url_cancel(OulHttpFetchUrlData *gfud)
 	g_free(gfud->user_agent);
 	g_free(gfud->request);
 	g_free(gfud->webdata);
+	g_free(gfud->conn_key);
+	g_free(gfud->held);
+	g_array_free(gfud->headers, TRUE);
+
+#ifdef HAVE_ZLIB
+	url_fetch_inflate_end(gfud);
+#endif
 
 	g_free(gfud);
 }
 
+void
+oul_http_fetch_url_set_priority(OulHttpFetchUrlData *gfud, OulHttpPriority priority)
+{
+	g_return_if_fail(gfud != NULL);
+	g_return_if_fail(priority >= 0 && priority < OUL_HTTP_PRIORITY_COUNT);
+
+	if (gfud->priority == priority)
+		return;
+
+	if (gfud->queued) {
+		http_sched_dequeue(gfud);
+		gfud->priority = priority;
+		http_sched_enqueue(gfud);
+
+		/* it may go first now */
+		if (sched_timer == 0)
+			sched_timer = oul_timeout_add(0, http_sched_dispatch_cb, NULL);
+	} else
+		gfud->priority = priority;
+}
+
+void
+oul_http_fetch_get_queue_stats(OulHttpPriority priority, OulHttpQueueStats *stats)
+{
+	g_return_if_fail(priority >= 0 && priority < OUL_HTTP_PRIORITY_COUNT);
+	g_return_if_fail(stats != NULL);
+
+	*stats = sched_stats[priority];
+}
+
+void
+oul_http_init(void)
+{
+	int i;
+
+	oul_prefs_add_none("/oul/network");
+	oul_prefs_add_none("/oul/network/http");
+	oul_prefs_add_int("/oul/network/http/keepalive_timeout", 60);
+	oul_prefs_add_int("/oul/network/http/keepalive_per_host", 2);
+	oul_prefs_add_int("/oul/network/http/max_connections", 16);
+	oul_prefs_add_int("/oul/network/http/max_per_host", 4);
+
+	http_pool = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, (GDestroyNotify)g_queue_free);
+
+	sched_running = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	for (i = 0; i < OUL_HTTP_PRIORITY_COUNT; i++)
+		sched_hosts[i] = g_queue_new();
+	memset(sched_stats, 0, sizeof(sched_stats));
+}
+
+void
+oul_http_uninit(void)
+{
+	int i;
+
+	if (http_pool_timer > 0) {
+		oul_timeout_remove(http_pool_timer);
+		http_pool_timer = 0;
+	}
+
+	if (http_pool != NULL) {
+		g_hash_table_foreach(http_pool, http_pool_close_queue, NULL);
+		g_hash_table_destroy(http_pool);
+		http_pool = NULL;
+	}
+
+	if (sched_timer > 0) {
+		oul_timeout_remove(sched_timer);
+		sched_timer = 0;
+	}
+
+	/* the fetches still waiting belong to their callers */
+	for (i = 0; i < OUL_HTTP_PRIORITY_COUNT; i++) {
+		OulHttpHostQueue *hq;
+
+		if (sched_hosts[i] == NULL)
+			continue;
+
+		while ((hq = g_queue_pop_head(sched_hosts[i])) != NULL) {
+			GList *l;
+
+			for (l = hq->fetches->head; l != NULL; l = l->next)
+				((OulHttpFetchUrlData *)l->data)->queued = FALSE;
+			http_sched_host_free(hq);
+		}
+
+		g_queue_free(sched_hosts[i]);
+		sched_hosts[i] = NULL;
+	}
+
+	if (sched_running != NULL) {
+		g_hash_table_destroy(sched_running);
+		sched_running = NULL;
+	}
+}
+
 
 
 
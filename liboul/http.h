@@ -3,6 +3,32 @@
 
 typedef struct _OulHttpFetchUrlData OulHttpFetchUrlData;
 
+/**
+ * The class of a fetch. When the connection slots are all taken, the
+ * waiting fetches are started in this order, and the servers take
+ * turns within a class.
+ */
+typedef enum
+{
+	OUL_HTTP_PRIORITY_INTERACTIVE = 0,	/**< The user waits for it, the default. */
+	OUL_HTTP_PRIORITY_POLL,				/**< Periodic checks.                    */
+	OUL_HTTP_PRIORITY_BACKGROUND,		/**< Discovery and other housekeeping.   */
+	OUL_HTTP_PRIORITY_COUNT
+
+} OulHttpPriority;
+
+/**
+ * How the fetches of a class were scheduled.
+ */
+typedef struct
+{
+	guint queued;		/**< Fetches waiting for a slot.                  */
+	guint running;		/**< Fetches holding a slot.                      */
+	guint started;		/**< Fetches which got a slot so far.             */
+	gulong wait_total;	/**< Milliseconds they waited, all together.      */
+	gulong wait_max;	/**< The longest wait, in milliseconds.           */
+
+} OulHttpQueueStats;
 
 /**
  * This is the signature used for functions that act as the callback
@@ -22,6 +48,21 @@ typedef struct _OulHttpFetchUrlData OulHttpFetchUrlData;
 typedef void (*OulHttpFetchUrlCallback)(OulHttpFetchUrlData *url_data, gpointer user_data, 
 		const gchar *url_text, gsize len, const gchar *error_message);
 
+/**
+ * This is the signature used for functions that receive the body
+ * streamed by oul_http_fetch_url_stream(), slice after slice as it
+ * arrives. Chunked bodies are already decoded.
+ *
+ * @param url_data      The value returned by oul_http_fetch_url_stream().
+ * @param user_data     The user data passed to oul_http_fetch_url_stream().
+ * @param data          The next slice of the body, not nul-terminated.
+ * @param len           The length of data.
+ *
+ * @return FALSE to pause the transfer until oul_http_fetch_url_resume().
+ */
+typedef gboolean (*OulHttpFetchUrlBodyCallback)(OulHttpFetchUrlData *url_data, gpointer user_data,
+		const gchar *data, gsize len);
+
 
 OulHttpFetchUrlData *	oul_http_fetch_url_request(const char *url, gboolean full,
 												const char *user_agent, gboolean http11,
@@ -32,11 +73,67 @@ OulHttpFetchUrlData * oul_http_fetch_url_request_len(const char *url, gboolean f
 														const char *request, gboolean include_headers, gssize max_len, 
 														OulHttpFetchUrlCallback callback, void *user_data);
 
-void			oul_http_fetch_url_cancel(OulHttpFetchUrlData *gfud);
+/**
+ * Same as oul_http_fetch_url_request_len(), in the given class: the
+ * scheduler sees the fetch with its class from the start.
+ */
+OulHttpFetchUrlData *	oul_http_fetch_url_request_priority(const char *url, gboolean full,
+													const char *user_agent, gboolean http11,
+													const char *request, gboolean include_headers,
+													gssize max_len, OulHttpPriority priority,
+													OulHttpFetchUrlCallback callback, void *user_data);
+
+/**
+ * Fetches a URL without buffering its body, which is handed to body_cb
+ * while it arrives. The callback is invoked once the body is complete,
+ * with url_text holding the response headers, or on error. max_len
+ * limits the body, -1 for no limit.
+ */
+OulHttpFetchUrlData *	oul_http_fetch_url_stream(const char *url, gboolean full,
+												const char *user_agent, gboolean http11,
+												const char *request, gssize max_len,
+												OulHttpFetchUrlBodyCallback body_cb,
+												OulHttpFetchUrlCallback callback, void *user_data);
+
+/**
+ * Stops reading from the server, so it slows down once the socket
+ * buffers are full. The rest of the input already read is delivered
+ * after oul_http_fetch_url_resume().
+ */
+void			oul_http_fetch_url_pause(OulHttpFetchUrlData *gfud);
+void			oul_http_fetch_url_resume(OulHttpFetchUrlData *gfud);
+
+void			oul_http_fetch_url_cancel(OulHttpFetchUrlData *gfud);
+
+/**
+ * Changes the class of a fetch, OUL_HTTP_PRIORITY_INTERACTIVE unless
+ * started with oul_http_fetch_url_request_priority(). It only matters
+ * while the fetch waits for a slot.
+ */
+void			oul_http_fetch_url_set_priority(OulHttpFetchUrlData *gfud, OulHttpPriority priority);
+
+/* fills stats with the scheduling of the fetches of a class */
+void			oul_http_fetch_get_queue_stats(OulHttpPriority priority, OulHttpQueueStats *stats);
+
 const char *	oul_url_decode(const char *str);
 const char *	oul_url_encode(const char *str);
 gboolean		oul_url_parse(const char *url, char **ret_host, int *ret_port, char **ret_path, char **ret_user, char **ret_passwd);
 
+/**
+ * Registers the http prefs. Connections to HTTP/1.1 servers are kept
+ * open for /oul/network/http/keepalive_timeout seconds after the
+ * response, at most /oul/network/http/keepalive_per_host of them for
+ * each server and proxy. Either pref set to 0 disables the reuse.
+ *
+ * At most /oul/network/http/max_connections fetches run at once, and
+ * /oul/network/http/max_per_host of them to the same server; the others
+ * wait for a slot. 0 lifts the limit.
+ */
+void			oul_http_init(void);
+
+/* closes the idle connections */
+void			oul_http_uninit(void);
+
 
 
 
@@ -0,0 +1,81 @@
+/*
+ * ipccheck - calls plugin IPC commands through their marshallers.
+ *
+ *   ipccheck
+ *
+ * The commands are registered on a plugin that is never loaded, with
+ * marshallers of sigdef.h, and every call checks the arguments the
+ * command got and the value it returned.  Exits with 1 on a mismatch.
+ */
+#include "internal.h"
+#include "plugin.h"
+#include "signals.h"
+#include "value.h"
+
+#define	CHECK_INT			0x12345
+
+static gint check_failures = 0;
+
+static void
+check(gboolean cond, const gchar *what)
+{
+	if(!cond){
+		g_printerr("ipccheck: %s failed.\n", what);
+		check_failures++;
+	}
+}
+
+/*******************************************************
+ ******commands*************************************
+ ********************************************************/
+static void
+check_set_pointer(gpointer ptr, void *data)
+{
+	*(gint *)ptr = CHECK_INT;
+}
+
+static gint
+check_negate(gint n, void *data)
+{
+	return -n;
+}
+
+/*******************************************************
+ ******main*************************************
+ ********************************************************/
+int
+main(int argc, char *argv[])
+{
+	OulPlugin *plugin;
+	gboolean ok = FALSE;
+	gint value = 0;
+	void *ret;
+
+	plugin = oul_plugin_new(TRUE, NULL);
+
+	oul_plugin_ipc_register(plugin, "set-pointer",
+			OUL_CALLBACK(check_set_pointer), oul_marshal_VOID__POINTER,
+			NULL, 1, oul_value_new(OUL_TYPE_POINTER));
+	oul_plugin_ipc_register(plugin, "negate",
+			OUL_CALLBACK(check_negate), oul_marshal_INT__INT,
+			oul_value_new(OUL_TYPE_INT), 1, oul_value_new(OUL_TYPE_INT));
+
+	ret = oul_plugin_ipc_call(plugin, "set-pointer", &ok, &value);
+	check(ok, "set-pointer call");
+	check(value == CHECK_INT, "set-pointer argument");
+
+	ok  = FALSE;
+	ret = oul_plugin_ipc_call(plugin, "negate", &ok, CHECK_INT);
+	check(ok, "negate call");
+	check(GPOINTER_TO_INT(ret) == -CHECK_INT, "negate return value");
+
+	oul_plugin_ipc_unregister_all(plugin);
+	oul_plugin_destroy(plugin);
+
+	if(check_failures > 0)
+		return 1;
+
+	g_print("ipccheck: ok\n");
+
+	return 0;
+}
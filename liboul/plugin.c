@@ -9,7 +9,6 @@
 #include "prefs.h"
 #include "util.h"
 #include "signals.h"
-#include "sigdef.h"
 
 typedef struct
 {
@@ -1031,8 +1030,9 @@ oul_plugin_ipc_call(OulPlugin *plugin, const char *command,
 {
 	OulPluginIpcInfo *ipc_info;
 	OulPluginIpcCommand *ipc_command;
+	OulValue *values;
 	va_list args;
-	void *ret_value;
+	void *ret_value = NULL;
 
 	if (ok != NULL)
 		*ok = FALSE;
@@ -1053,10 +1053,15 @@ oul_plugin_ipc_call(OulPlugin *plugin, const char *command,
 		return NULL;
 	}
 
+	/* the marshallers take the arguments packed, as for a signal */
 	va_start(args, ok);
-	ipc_command->marshal(ipc_command->func, args, NULL, &ret_value);
+	values = oul_signal_marshaller_pack(ipc_command->marshal,
+			ipc_command->num_params, ipc_command->params, NULL, args);
 	va_end(args);
 
+	ipc_command->marshal(ipc_command->func, values, NULL, &ret_value);
+	g_free(values);
+
 	if (ok != NULL)
 		*ok = TRUE;
 
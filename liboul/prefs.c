@@ -18,6 +18,10 @@ typedef struct _OulPref{
     struct _OulPref   *parent; 
     struct _OulPref   *sibling; 
     struct _OulPref   *first_child; 
+    struct _OulPref   *last_child;
+    GHashTable          *children;  /* by name, once there are some */
+    OulPrefId           id;
+    char                *path;      /* the full name */
 }OulPref;
 
 typedef struct _OulPrefCb{
@@ -28,7 +32,21 @@ typedef struct _OulPrefCb{
 }OulPrefCb;
 
 
+/*
+ * The string API is mostly called with the same literals over and
+ * over, so the pref found for a name is remembered by the address of
+ * the name, and only confirmed with a strcmp().
+ */
+#define PREFS_CACHE_SIZE    256
+
+typedef struct _OulPrefCacheEntry{
+    const char          *name;
+    OulPref             *pref;
+}OulPrefCacheEntry;
+
 static GHashTable   *prefs_hash = NULL;
+static GPtrArray    *prefs_table = NULL;    /* by OulPrefId, 0 is none */
+static OulPrefCacheEntry prefs_cache[PREFS_CACHE_SIZE];
 static gboolean     prefs_loaded = FALSE;
 static guint        save_timer = 0;
 static GList        *prefs_stack = NULL;
@@ -39,7 +57,11 @@ static OulPref    	prefs = {
     NULL,
     NULL,
     NULL,
-    NULL
+    NULL,
+    NULL,
+    NULL,
+    0,
+    "/"
 };
 
 static OulPref*     find_pref(const char *name);
@@ -51,7 +73,6 @@ static void         sync_prefs(void);
 static xmlnode*     prefs_to_xmlnode(void); 
 static void         pref_to_xmlnode(xmlnode *parent, OulPref *pref);
 static void         free_pref_value(OulPref *pref);  
-static char*        pref_full_name(OulPref *pref);
 static char*        get_path_basename(const char *name);
 static void         prefs_start_element_handler(GMarkupParseContext *context,
                             const gchar *element_name,
@@ -98,7 +119,7 @@ disco_callback_helper_handle(OulPref *pref, void *handle)
 }
 
 static void
-do_callbacks(const char *name, OulPref *pref)
+do_callbacks(OulPref *pref)
 {
     GSList *cbs;
     OulPref *cb_pref;
@@ -106,7 +127,7 @@ do_callbacks(const char *name, OulPref *pref)
     for(cb_pref = pref; cb_pref; cb_pref = cb_pref->parent){
         for(cbs = cb_pref->callbacks; cbs; cbs = cbs->next){
             OulPrefCb *cb = cbs->data;
-            cb->func(name, pref->type, pref->value.generic, cb->data);
+            cb->func(pref->path, pref->type, pref->value.generic, cb->data);
         }
     }
 }
@@ -282,7 +303,6 @@ add_pref(OulPrefType type, const char *name)
 {
     OulPref *parent;
     OulPref *me;
-    OulPref *sibling;
     char *myname;
 
     parent = find_pref_parent(name);
@@ -290,33 +310,39 @@ add_pref(OulPrefType type, const char *name)
       return NULL; 
 
     myname = get_path_basename(name);
-    for(sibling = parent->first_child; sibling; sibling = sibling->sibling){
-        if(!strcmp(sibling->name, myname)){
-            g_free(myname);
-            return NULL;
-        }
+    if(parent->children && g_hash_table_lookup(parent->children, myname)){
+        g_free(myname);
+        return NULL;
     }
 
-
     me = g_new0(OulPref, 1);
     me->type = type;
     me->name = myname;
+    me->path = g_strdup(name);
 
     me->parent = parent;
-    if(parent->first_child) {
-        for(sibling = parent->first_child; sibling->sibling; sibling = sibling->sibling);
-        sibling->sibling = me;
+    if(parent->last_child) {
+        parent->last_child->sibling = me;
     }else{
         parent->first_child = me;
+        parent->children = g_hash_table_new(g_str_hash, g_str_equal);
     }
+    parent->last_child = me;
 
-    g_hash_table_insert(prefs_hash, g_strdup(name), (gpointer)me);
+    g_hash_table_insert(parent->children, me->name, me);
+    g_hash_table_insert(prefs_hash, me->path, me);
+
+    me->id = prefs_table->len;
+    g_ptr_array_add(prefs_table, me);
     
     return me;
 }
 
 static OulPref * 
 find_pref(const char *name){
+    OulPrefCacheEntry *entry;
+    OulPref *pref;
+
     g_return_val_if_fail(name != NULL && name[0] == '/', NULL);
     
     if(name[1] == '\0') return &prefs;
@@ -324,10 +350,29 @@ find_pref(const char *name){
    /* when we are initializing, the debug system is initialized
      * before the prefs system, but debug calls will end up
      * calling prefs functions, so we need to deal cleanly here.*/
-    if(prefs_hash)
-        return g_hash_table_lookup(prefs_hash, name);
-    else
+    if(!prefs_hash)
+        return NULL;
+
+    entry = &prefs_cache[((gsize)name >> 3) % PREFS_CACHE_SIZE];
+    if(entry->name == name && entry->pref && !strcmp(entry->pref->path, name))
+        return entry->pref;
+
+    pref = g_hash_table_lookup(prefs_hash, name);
+    if(pref){
+        entry->name = name;
+        entry->pref = pref;
+    }
+
+    return pref;
+}
+
+static OulPref *
+find_pref_by_id(OulPrefId id)
+{
+    if(!prefs_table || id == 0 || id >= prefs_table->len)
         return NULL;
+
+    return g_ptr_array_index(prefs_table, id);
 }
 
 static void
@@ -461,8 +506,8 @@ pref_to_xmlnode(xmlnode *parent, OulPref *pref)
 static void
 remove_pref(OulPref *pref)
 {
-    char *name;
     GSList *list;
+    int i;
 
     if(!pref || pref == &prefs)
         return;
@@ -472,6 +517,8 @@ remove_pref(OulPref *pref)
 
     if(pref->parent->first_child == pref){
         pref->parent->first_child = pref->sibling;
+        if(pref->parent->last_child == pref)
+            pref->parent->last_child = NULL;
     }else{
         OulPref *sib = pref->parent->first_child;
         while(sib && sib->sibling != pref)
@@ -479,14 +526,20 @@ remove_pref(OulPref *pref)
 
         if(sib)
             sib->sibling = pref->sibling;
+        if(pref->parent->last_child == pref)
+            pref->parent->last_child = sib;
     }    
-    
-    name = pref_full_name(pref);
+    g_hash_table_remove(pref->parent->children, pref->name);
 
-    oul_debug_info("prefs", "removing pref %s\n", name);
+    oul_debug_info("prefs", "removing pref %s\n", pref->path);
     
-    g_hash_table_remove(prefs_hash, name);
-    g_free(name);
+    g_hash_table_remove(prefs_hash, pref->path);
+    g_ptr_array_index(prefs_table, pref->id) = NULL;
+
+    for(i = 0; i < PREFS_CACHE_SIZE; i++){
+        if(prefs_cache[i].pref == pref)
+            prefs_cache[i].pref = NULL;
+    }
 
     free_pref_value(pref);
 
@@ -495,6 +548,9 @@ remove_pref(OulPref *pref)
         g_free(list->data);
         g_slist_free_1(list);
     }
+    if(pref->children)
+        g_hash_table_destroy(pref->children);
+    g_free(pref->path);
     g_free(pref->name);
     g_free(pref);
 }
@@ -526,29 +582,6 @@ free_pref_value(OulPref *pref)
     }
 }
 
-static char *
-pref_full_name(OulPref *pref)
-{
-    GString *name;
-    OulPref *parent;
-
-    if(!pref) return NULL;
-    
-    if(pref = &prefs)
-        return g_strdup("/");
-
-    name = g_string_new(pref->name);
-    parent = pref->parent;
-
-    for(parent = pref->parent; parent && parent->name; parent = parent->parent){
-        name = g_string_prepend_c(name, '/');
-        name = g_string_prepend(name, parent->name);
-    }
-    name = g_string_prepend_c(name, '/');
-    
-    return g_string_free(name, FALSE);
-}
-
 /************************************************************
  ***********public functions*********************************
  ***********************************************************/
@@ -565,7 +598,11 @@ oul_prefs_init(void){
 
     void *handle = oul_prefs_get_handle();
 
-    prefs_hash = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    /* the keys are the paths of the prefs */
+    prefs_hash = g_hash_table_new(g_str_hash, g_str_equal);
+
+    prefs_table = g_ptr_array_new();
+    g_ptr_array_add(prefs_table, NULL);
     
     oul_prefs_connect_callback(handle, "/", prefs_save_cb, NULL); 
 
@@ -825,7 +862,61 @@ oul_prefs_set_generic(const char *name, gpointer value)
     }
 
     pref->value.generic = value;
-    do_callbacks(name, pref);
+    do_callbacks(pref);
+}
+
+static void
+pref_set_bool(OulPref *pref, gboolean value)
+{
+    if(pref->type != OUL_PREF_BOOLEAN) {
+        oul_debug_error("prefs",
+                "oul_prefs_set_bool: %s not a boolean pref\n", pref->path);
+        return;
+    }
+
+    if(pref->value.boolean != value) {
+        pref->value.boolean = value;
+        do_callbacks(pref);
+    }
+}
+
+static void
+pref_set_int(OulPref *pref, int value)
+{
+    if(pref->type != OUL_PREF_INT) {
+        oul_debug_error("prefs",
+                "oul_prefs_set_int: %s not an integer pref\n", pref->path);
+        return;
+    }
+
+    if(pref->value.integer != value) {
+        pref->value.integer = value;
+        do_callbacks(pref);
+    }
+}
+
+static void
+pref_set_string(OulPref *pref, const char *value)
+{
+    if(value != NULL && !g_utf8_validate(value, -1, NULL)) {
+        oul_debug_error("prefs", "oul_prefs_set_string: Cannot store invalid UTF8 for string pref %s\n", pref->path);
+        return;
+    }
+
+    if(pref->type != OUL_PREF_STRING && pref->type != OUL_PREF_PATH) {
+        oul_debug_error("prefs",
+                "oul_prefs_set_string: %s not a string pref\n", pref->path);
+        return;
+    }
+
+    if((value && !pref->value.string) ||
+            (!value && pref->value.string) ||
+            (value && pref->value.string &&
+             strcmp(pref->value.string, value))) {
+        g_free(pref->value.string);
+        pref->value.string = g_strdup(value);
+        do_callbacks(pref);
+    }
 }
 
 void
@@ -833,20 +924,10 @@ oul_prefs_set_bool(const char *name, gboolean value)
 {
     OulPref *pref = find_pref(name);
 
-    if(pref) {
-        if(pref->type != OUL_PREF_BOOLEAN) {
-            oul_debug_error("prefs",
-                    "oul_prefs_set_bool: %s not a boolean pref\n", name);
-            return;
-        }
-
-        if(pref->value.boolean != value) {
-            pref->value.boolean = value;
-            do_callbacks(name, pref);
-        }
-    } else {
+    if(pref)
+        pref_set_bool(pref, value);
+    else
         oul_prefs_add_bool(name, value);
-    }
 }
 
 void
@@ -854,20 +935,10 @@ oul_prefs_set_int(const char *name, int value)
 {
     OulPref *pref = find_pref(name);
 
-    if(pref) {
-        if(pref->type != OUL_PREF_INT) {
-            oul_debug_error("prefs",
-                    "oul_prefs_set_int: %s not an integer pref\n", name);
-            return;
-        }
-
-        if(pref->value.integer != value) {
-            pref->value.integer = value;
-            do_callbacks(name, pref);
-        }
-    } else {
+    if(pref)
+        pref_set_int(pref, value);
+    else
         oul_prefs_add_int(name, value);
-    }
 }
 
 void
@@ -875,29 +946,10 @@ oul_prefs_set_string(const char *name, const char *value)
 {
     OulPref *pref = find_pref(name);
 
-    if(value != NULL && !g_utf8_validate(value, -1, NULL)) {
-        oul_debug_error("prefs", "oul_prefs_set_string: Cannot store invalid UTF8 for string pref %s\n", name);
-        return;
-    }
-
-    if(pref) {
-        if(pref->type != OUL_PREF_STRING && pref->type != OUL_PREF_PATH) {
-            oul_debug_error("prefs",
-                    "oul_prefs_set_string: %s not a string pref\n", name);
-            return;
-        }
-
-        if((value && !pref->value.string) ||
-                (!value && pref->value.string) ||
-                (value && pref->value.string &&
-                 strcmp(pref->value.string, value))) {
-            g_free(pref->value.string);
-            pref->value.string = g_strdup(value);
-            do_callbacks(name, pref);
-        }
-    } else {
+    if(pref)
+        pref_set_string(pref, value);
+    else
         oul_prefs_add_string(name, value);
-    }
 }
 
 void
@@ -928,7 +980,7 @@ oul_prefs_set_string_list(const char *name, GList *value)
         }
         pref->value.stringlist = g_list_reverse(pref->value.stringlist);
 
-        do_callbacks(name, pref);
+        do_callbacks(pref);
 
     } else {
         oul_prefs_add_string_list(name, value);
@@ -953,7 +1005,7 @@ oul_prefs_set_path(const char *name, const char *value)
                  strcmp(pref->value.string, value))) {
             g_free(pref->value.string);
             pref->value.string = g_strdup(value);
-            do_callbacks(name, pref);
+            do_callbacks(pref);
         }
     } else {
         oul_prefs_add_path(name, value);
@@ -983,7 +1035,7 @@ oul_prefs_set_path_list(const char *name, GList *value)
                     g_strdup(tmp->data));
         pref->value.stringlist = g_list_reverse(pref->value.stringlist);
 
-        do_callbacks(name, pref);
+        do_callbacks(pref);
 
     } else {
         oul_prefs_add_path_list(name, value);
@@ -1000,7 +1052,7 @@ oul_prefs_trigger_callback(const char *name)
         return;
     }
 
-    do_callbacks(name, pref);
+    do_callbacks(pref);
 }
 
 OulPrefType
@@ -1143,3 +1195,89 @@ oul_prefs_disconnect_by_handle(void *handle)
     
     disco_callback_helper_handle(&prefs, handle);
 }
+
+OulPrefId
+oul_prefs_get_id(const char *name)
+{
+    OulPref *pref = find_pref(name);
+
+    if(!pref) {
+        oul_debug_error("prefs",
+                "oul_prefs_get_id: Unknown pref %s\n", name);
+        return 0;
+    }
+
+    return pref->id;
+}
+
+gboolean
+oul_prefs_get_bool_by_id(OulPrefId id)
+{
+    OulPref *pref = find_pref_by_id(id);
+
+    if(!pref || pref->type != OUL_PREF_BOOLEAN) {
+        oul_debug_error("prefs",
+                "oul_prefs_get_bool_by_id: %u not a boolean pref\n", id);
+        return FALSE;
+    }
+
+    return pref->value.boolean;
+}
+
+int
+oul_prefs_get_int_by_id(OulPrefId id)
+{
+    OulPref *pref = find_pref_by_id(id);
+
+    if(!pref || pref->type != OUL_PREF_INT) {
+        oul_debug_error("prefs",
+                "oul_prefs_get_int_by_id: %u not an integer pref\n", id);
+        return 0;
+    }
+
+    return pref->value.integer;
+}
+
+const char *
+oul_prefs_get_string_by_id(OulPrefId id)
+{
+    OulPref *pref = find_pref_by_id(id);
+
+    if(!pref || pref->type != OUL_PREF_STRING) {
+        oul_debug_error("prefs",
+                "oul_prefs_get_string_by_id: %u not a string pref\n", id);
+        return NULL;
+    }
+
+    return pref->value.string;
+}
+
+void
+oul_prefs_set_bool_by_id(OulPrefId id, gboolean value)
+{
+    OulPref *pref = find_pref_by_id(id);
+
+    g_return_if_fail(pref != NULL);
+
+    pref_set_bool(pref, value);
+}
+
+void
+oul_prefs_set_int_by_id(OulPrefId id, int value)
+{
+    OulPref *pref = find_pref_by_id(id);
+
+    g_return_if_fail(pref != NULL);
+
+    pref_set_int(pref, value);
+}
+
+void
+oul_prefs_set_string_by_id(OulPrefId id, const char *value)
+{
+    OulPref *pref = find_pref_by_id(id);
+
+    g_return_if_fail(pref != NULL);
+
+    pref_set_string(pref, value);
+}
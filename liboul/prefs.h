@@ -18,6 +18,13 @@ typedef enum _OulPrefType
 
 }OulPrefType;
 
+/**
+ * A handle to a pref, for the _by_id functions: their lookup is an array
+ * index, where the functions taking a name have to find the pref first.
+ * It stays valid as long as the pref exists, 0 is no pref.
+ */
+typedef guint OulPrefId;
+
 
 
 typedef void (* OulPrefCallback)(const char *name, OulPrefType type, 
@@ -62,6 +69,17 @@ GList*          oul_prefs_get_string_list(const char *name);
 const char*     oul_prefs_get_path(const char *name);
 GList*          oul_prefs_get_path_list(const char *name);
 
+/* the id of an existing pref, to look up once and keep */
+OulPrefId       oul_prefs_get_id(const char *name);
+
+gboolean        oul_prefs_get_bool_by_id(OulPrefId id);
+int             oul_prefs_get_int_by_id(OulPrefId id);
+const char*     oul_prefs_get_string_by_id(OulPrefId id);
+
+void            oul_prefs_set_bool_by_id(OulPrefId id, gboolean value);
+void            oul_prefs_set_int_by_id(OulPrefId id, int value);
+void            oul_prefs_set_string_by_id(OulPrefId id, const char *value);
+
 void            oul_prefs_remove(const char *name);
 void            oul_prefs_rename(const char *oldname, const char *newname);
 void            oul_prefs_destroy(void);
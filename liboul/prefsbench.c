@@ -0,0 +1,188 @@
+/*
+ * prefsbench - measures the get/set throughput of the prefs store.
+ *
+ *   prefsbench [-n iterations] [-p prefs]
+ *
+ * The prefs are added under /bench in a scratch user dir, and every
+ * operation is timed by the path, through the string API, and by the
+ * OulPrefId of the pref.  Nothing is saved: the save timer never runs.
+ */
+#include <sys/resource.h>
+
+#include "internal.h"
+#include "eventloop.h"
+#include "prefs.h"
+#include "util.h"
+
+#define	BENCH_ITERATIONS		1000000
+#define	BENCH_PREFS				1000
+
+typedef struct _BenchStage
+{
+	const gchar	*name;
+	GTimer		*timer;
+}BenchStage;
+
+/* the changes schedule a save, which is never run */
+static OulEventLoopUiOps bench_eventloop_ops =
+{
+	g_timeout_add,
+	g_source_remove,
+	NULL,
+	NULL,
+	NULL,
+#if GLIB_CHECK_VERSION(2,14,0)
+	g_timeout_add_seconds,
+#else
+	NULL,
+#endif
+	NULL,
+	NULL,
+	NULL
+};
+
+static volatile gint bench_sink = 0;
+
+/*******************************************************
+ ******stages*************************************
+ ********************************************************/
+static void
+bench_stage_begin(BenchStage *stage, const gchar *name)
+{
+	stage->name = name;
+	g_timer_start(stage->timer);
+}
+
+static void
+bench_stage_end(BenchStage *stage, gint iterations)
+{
+	g_timer_stop(stage->timer);
+
+	g_print("%-24s %10d %10.1f\n", stage->name, iterations,
+			g_timer_elapsed(stage->timer, NULL) * 1e9 / iterations);
+}
+
+/*******************************************************
+ ******main*************************************
+ ********************************************************/
+static void
+bench_run(gint iterations, gint count)
+{
+	BenchStage stage;
+	gchar **names = NULL;
+	OulPrefId *ids = NULL;
+	OulPrefId id;
+	gint i;
+
+	stage.timer = g_timer_new();
+	names 		= g_new0(gchar *, count + 1);
+	ids 		= g_new0(OulPrefId, count);
+
+	for(i = 0; i < count; i++)
+		names[i] = g_strdup_printf("/bench/group%d/pref%d", i % 16, i);
+
+	oul_prefs_add_none("/bench");
+	for(i = 0; i < 16; i++){
+		gchar *group = g_strdup_printf("/bench/group%d", i);
+		oul_prefs_add_none(group);
+		g_free(group);
+	}
+
+	bench_stage_begin(&stage, "add");
+	for(i = 0; i < count; i++)
+		oul_prefs_add_int(names[i], i);
+	bench_stage_end(&stage, count);
+
+	for(i = 0; i < count; i++)
+		ids[i] = oul_prefs_get_id(names[i]);
+
+	/* the same path over and over, as the hot paths do */
+	bench_stage_begin(&stage, "get_int, one path");
+	for(i = 0; i < iterations; i++)
+		bench_sink += oul_prefs_get_int(names[count - 1]);
+	bench_stage_end(&stage, iterations);
+
+	/* new pointers each time, so every lookup hashes */
+	bench_stage_begin(&stage, "get_int, all paths");
+	for(i = 0; i < iterations; i++){
+		gchar buf[64];
+
+		g_strlcpy(buf, names[i % count], sizeof(buf));
+		bench_sink += oul_prefs_get_int(buf);
+	}
+	bench_stage_end(&stage, iterations);
+
+	bench_stage_begin(&stage, "get_int_by_id");
+	for(i = 0; i < iterations; i++)
+		bench_sink += oul_prefs_get_int_by_id(ids[i % count]);
+	bench_stage_end(&stage, iterations);
+
+	bench_stage_begin(&stage, "set_int");
+	for(i = 0; i < iterations; i++)
+		oul_prefs_set_int(names[i % count], i);
+	bench_stage_end(&stage, iterations);
+
+	bench_stage_begin(&stage, "set_int_by_id");
+	for(i = 0; i < iterations; i++)
+		oul_prefs_set_int_by_id(ids[i % count], -i);
+	bench_stage_end(&stage, iterations);
+
+	id = oul_prefs_get_id(names[count - 1]);
+	if(oul_prefs_get_int_by_id(id) != oul_prefs_get_int(names[count - 1]))
+		g_printerr("prefsbench: the id and the path disagree.\n");
+
+	g_strfreev(names);
+	g_free(ids);
+	g_timer_destroy(stage.timer);
+}
+
+static void
+bench_usage(void)
+{
+	g_printerr("usage: prefsbench [-n iterations] [-p prefs]\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct rusage usage;
+	gint iterations = BENCH_ITERATIONS, count = BENCH_PREFS, i;
+	gchar *dir = NULL;
+
+	for(i = 1; i < argc; i++){
+		if(!strcmp(argv[i], "-n") && i + 1 < argc){
+			iterations = atoi(argv[++i]);
+			iterations = MAX(iterations, 1);
+		}else if(!strcmp(argv[i], "-p") && i + 1 < argc){
+			count = atoi(argv[++i]);
+			count = MAX(count, 1);
+		}else{
+			bench_usage();
+			return 1;
+		}
+	}
+
+	dir = g_build_filename(g_get_tmp_dir(), "prefsbench-XXXXXX", NULL);
+	if(mkdtemp(dir) == NULL){
+		g_printerr("prefsbench: can not create %s.\n", dir);
+		g_free(dir);
+		return 1;
+	}
+
+	oul_util_set_user_dir(dir);
+	oul_eventloop_set_ui_ops(&bench_eventloop_ops);
+	oul_prefs_init();
+
+	g_print("%-24s %10s %10s\n", "operation", "ops", "ns/op");
+
+	bench_run(iterations, count);
+
+	/* no oul_prefs_uninit(), it would write prefs.xml */
+	g_rmdir(dir);
+	g_free(dir);
+
+	getrusage(RUSAGE_SELF, &usage);
+	g_print("peak rss: %ld KB\n", usage.ru_maxrss);
+
+	return 0;
+}
@@ -22,6 +22,16 @@
 #include "ntlm.h"
 #include "util.h"
 
+/* how a proxy was satisfied the last time, see OulProxyAuth */
+typedef enum
+{
+	PROXY_AUTH_UNKNOWN = 0,
+	PROXY_AUTH_BASIC,
+	PROXY_AUTH_DIGEST,
+	PROXY_AUTH_NTLM
+
+} OulProxyAuthMethod;
+
 struct _OulProxyConnectData {
 	void *handle;
 	OulProxyConnectFunction connect_cb;
@@ -39,6 +49,16 @@ struct _OulProxyConnectData {
 	 */
 	GSList *hosts;
 
+	/*
+	 * The connection attempts racing over the hosts.  The first one
+	 * which connects becomes fd, and the protocol goes on from
+	 * connected_cb.
+	 */
+	GSList *attempts;
+	guint attempt_timer;
+	int attempt_error;
+	OulInputFunction connected_cb;
+
 	/*
 	 * All of the following variables are used when establishing a
 	 * connection through a proxy.
@@ -50,8 +70,42 @@ struct _OulProxyConnectData {
 	guchar *read_buffer;
 	gsize read_buf_len;
 	gsize read_len;
+
+	/*
+	 * The authentication sent to an HTTP proxy, remembered once the
+	 * tunnel is up, and the method a SOCKS5 proxy picked.  s5_pipelined
+	 * is set when the requests after the greeting were sent along with
+	 * it, for the method the proxy picked the last time.
+	 */
+	OulProxyAuthMethod auth_sent;
+	int auth_rounds;
+	int s5_method;
+	gboolean s5_pipelined;
 };
 
+/*
+ * What a proxy accepted the last time, by proxy and user.  The next
+ * connection answers it up front instead of waiting to be challenged,
+ * and a SOCKS5 proxy gets its requests in a single write.
+ */
+typedef struct
+{
+	OulProxyAuthMethod http_method;
+	int socks5_method;		/* -1 until a SOCKS5 connection succeeded */
+
+	/* the Digest challenge [RFC 2617], answered again with the next count */
+	char *realm;
+	char *nonce;
+	char *opaque;
+	char *algorithm;
+	gboolean qop_auth;
+	guint nonce_count;
+
+} OulProxyAuth;
+
+/* an NTLM handshake takes two rounds, a stale Digest nonce one more */
+#define PROXY_AUTH_MAX_ROUNDS 3
+
 static const char * const socks5errors[] = {
 	"succeeded\n",
 	"general SOCKS server failure\n",
@@ -68,7 +122,11 @@ static OulProxyInfo *global_proxy_info = NULL;
 
 static GSList *handles = NULL;
 
+static GHashTable *proxy_auth_cache = NULL;
+
 static void try_connect(OulProxyConnectData *connect_data);
+static void connect_attempts_clear(OulProxyConnectData *connect_data);
+static void connection_host_resolved(GSList *hosts, gpointer data, const char *error_message);
 
 /*
  * TODO: Eventually (GObjectification) this bad boy will be removed, because it is
@@ -326,10 +384,92 @@ oul_gnome_proxy_get_info(void)
 
 }
 
+/**************************************************************************
+ * Proxy authentication cache
+ **************************************************************************/
+static void
+proxy_auth_free(OulProxyAuth *auth)
+{
+	g_free(auth->realm);
+	g_free(auth->nonce);
+	g_free(auth->opaque);
+	g_free(auth->algorithm);
+	g_free(auth);
+}
+
+static char *
+proxy_auth_key(OulProxyInfo *gpi)
+{
+	const char *host = oul_proxy_info_get_host(gpi);
+	const char *user = oul_proxy_info_get_username(gpi);
+	char *host_down, *key;
+
+	host_down = g_ascii_strdown(host ? host : "", -1);
+
+	key = g_strdup_printf("%d:%s:%d:%s", oul_proxy_info_get_type(gpi),
+			host_down, oul_proxy_info_get_port(gpi), user ? user : "");
+
+	g_free(host_down);
+
+	return key;
+}
+
+static OulProxyAuth *
+proxy_auth_lookup(OulProxyInfo *gpi, gboolean create)
+{
+	OulProxyAuth *auth;
+	char *key;
+
+	if (proxy_auth_cache == NULL)
+		return NULL;
+
+	key = proxy_auth_key(gpi);
+	auth = g_hash_table_lookup(proxy_auth_cache, key);
+
+	if (auth == NULL && create)
+	{
+		auth = g_new0(OulProxyAuth, 1);
+		auth->socks5_method = -1;
+		g_hash_table_insert(proxy_auth_cache, key, auth);
+		return auth;
+	}
+
+	g_free(key);
+
+	return auth;
+}
+
+/* the proxy turned the cached state down, the next connection starts over */
+static void
+proxy_auth_forget(OulProxyInfo *gpi)
+{
+	char *key;
+
+	if (proxy_auth_cache == NULL)
+		return;
+
+	key = proxy_auth_key(gpi);
+	g_hash_table_remove(proxy_auth_cache, key);
+	g_free(key);
+}
+
 /**************************************************************************
  * Proxy API
  **************************************************************************/
 
+static void
+connect_hosts_free(OulProxyConnectData *connect_data)
+{
+	while (connect_data->hosts != NULL)
+	{
+		/* Discard the length... */
+		connect_data->hosts = g_slist_remove(connect_data->hosts, connect_data->hosts->data);
+		/* Free the address... */
+		g_free(connect_data->hosts->data);
+		connect_data->hosts = g_slist_remove(connect_data->hosts, connect_data->hosts->data);
+	}
+}
+
 /**
  * Whoever calls this needs to have called
  * oul_proxy_connect_data_disconnect() beforehand.
@@ -342,14 +482,7 @@ oul_proxy_connect_data_destroy(OulProxyConnectData *connect_data)
 	if (connect_data->query_data != NULL)
 		oul_dnsquery_destroy(connect_data->query_data);
 
-	while (connect_data->hosts != NULL)
-	{
-		/* Discard the length... */
-		connect_data->hosts = g_slist_remove(connect_data->hosts, connect_data->hosts->data);
-		/* Free the address... */
-		g_free(connect_data->hosts->data);
-		connect_data->hosts = g_slist_remove(connect_data->hosts, connect_data->hosts->data);
-	}
+	connect_hosts_free(connect_data);
 
 	g_free(connect_data->host);
 	g_free(connect_data);
@@ -375,6 +508,8 @@ oul_proxy_connect_data_destroy(OulProxyConnectData *connect_data)
 static void
 oul_proxy_connect_data_disconnect(OulProxyConnectData *connect_data, const gchar *error_message)
 {
+	connect_attempts_clear(connect_data);
+
 	if (connect_data->inpa > 0)
 	{
 		oul_input_remove(connect_data->inpa);
@@ -491,80 +626,6 @@ socket_ready_cb(gpointer data, gint source, OulInputCondition cond)
 	oul_proxy_connect_data_connected(connect_data);
 }
 
-static gboolean
-clean_connect(gpointer data)
-{
-	oul_proxy_connect_data_connected(data);
-
-	return FALSE;
-}
-
-static void
-proxy_connect_none(OulProxyConnectData *connect_data, struct sockaddr *addr, socklen_t addrlen)
-{
-	int flags;
-
-	oul_debug_info("proxy", "Connecting to %s:%d with no proxy\n",
-			connect_data->host, connect_data->port);
-
-	connect_data->fd = socket(addr->sa_family, SOCK_STREAM, 0);
-	if (connect_data->fd < 0)
-	{
-		oul_proxy_connect_data_disconnect_formatted(connect_data,
-				_("Unable to create socket:\n%s"), g_strerror(errno));
-		return;
-	}
-
-	flags = fcntl(connect_data->fd, F_GETFL);
-	fcntl(connect_data->fd, F_SETFL, flags | O_NONBLOCK);
-	fcntl(connect_data->fd, F_SETFD, FD_CLOEXEC);
-
-	if (connect(connect_data->fd, addr, addrlen) != 0)
-	{
-		if ((errno == EINPROGRESS) || (errno == EINTR))
-		{
-			oul_debug_info("proxy", "Connection in progress\n");
-			connect_data->inpa = oul_input_add(connect_data->fd,
-					OUL_INPUT_WRITE, socket_ready_cb, connect_data);
-		}
-		else
-		{
-			oul_proxy_connect_data_disconnect(connect_data, g_strerror(errno));
-		}
-	}
-	else
-	{
-		/*
-		 * The connection happened IMMEDIATELY... strange, but whatever.
-		 */
-		int error = ETIMEDOUT;
-		int ret;
-
-		oul_debug_info("proxy", "Connected immediately.\n");
-
-		ret = oul_input_get_error(connect_data->fd, &error);
-		if ((ret != 0) || (error != 0))
-		{
-			if (ret != 0)
-				error = errno;
-			oul_proxy_connect_data_disconnect(connect_data, g_strerror(error));
-			return;
-		}
-
-		/*
-		 * We want to call the "connected" callback eventually, but we
-		 * don't want to call it before we return, just in case.
-		 */
-		oul_timeout_add(10, clean_connect, connect_data);
-	}
-}
-
-/**
- * This is a utility function used by the HTTP, SOCKS4 and SOCKS5
- * connect functions.  It writes data from a buffer to a socket.
- * When all the data is written it sets up a watcher to read a
- * response and call a specified function.
- */
 static void
 proxy_do_write(gpointer data, gint source, OulInputCondition cond)
 {
@@ -604,6 +665,205 @@ proxy_do_write(gpointer data, gint source, OulInputCondition cond)
 #define HTTP_GOODSTRING "HTTP/1.0 200"
 #define HTTP_GOODSTRING2 "HTTP/1.1 200"
 
+static void
+http_auth_hostname(char *hostname, gsize len)
+{
+	int ret;
+
+	ret = gethostname(hostname, len);
+	hostname[len - 1] = '\0';
+	if (ret < 0 || hostname[0] == '\0') {
+		oul_debug_warning("proxy", "gethostname() failed -- is your hostname set?");
+		g_strlcpy(hostname, "localhost", len);
+	}
+}
+
+static char *
+http_auth_basic(OulProxyInfo *gpi)
+{
+	char *t1, *t2;
+
+	t1 = g_strdup_printf("%s:%s",
+		oul_proxy_info_get_username(gpi),
+		oul_proxy_info_get_password(gpi) ?
+			oul_proxy_info_get_password(gpi) : "");
+	t2 = oul_base64_encode((const guchar *)t1, strlen(t1));
+	g_free(t1);
+
+	return t2;
+}
+
+/**
+ * Returns the value of a parameter of a challenge, such as the realm in
+ * 'Digest realm="proxy", nonce="..."', or NULL if it has none.  The
+ * parameters end with the line.
+ */
+static char *
+http_auth_param(const char *params, const char *name)
+{
+	const char *p = params;
+	const char *start, *end, *value, *value_end;
+	gsize name_len = strlen(name);
+
+	while (*p != '\0' && *p != '\r' && *p != '\n')
+	{
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+
+		start = p;
+		while (*p != '=' && *p != ',' && *p != '\0' && *p != '\r' && *p != '\n')
+			p++;
+		end = p;
+		while (end > start && (end[-1] == ' ' || end[-1] == '\t'))
+			end--;
+
+		if (*p != '=')
+			continue;
+
+		p++;
+		while (*p == ' ' || *p == '\t')
+			p++;
+
+		if (*p == '"') {
+			value = ++p;
+			while (*p != '"' && *p != '\0' && *p != '\r' && *p != '\n') {
+				if (*p == '\\' && p[1] != '\0')
+					p++;
+				p++;
+			}
+			value_end = p;
+			if (*p == '"')
+				p++;
+		} else {
+			value = p;
+			while (*p != ',' && *p != ' ' && *p != '\t' &&
+					*p != '\0' && *p != '\r' && *p != '\n')
+				p++;
+			value_end = p;
+		}
+
+		if (end - start == name_len && !g_ascii_strncasecmp(start, name, name_len))
+			return g_strndup(value, value_end - value);
+	}
+
+	return NULL;
+}
+
+/* keeps a Digest challenge for this and the next connections */
+static OulProxyAuth *
+http_auth_digest_challenge(OulProxyInfo *gpi, const char *params)
+{
+	OulProxyAuth *auth;
+	char *realm, *nonce, *algorithm, *qop;
+	gboolean qop_auth = FALSE;
+
+	realm = http_auth_param(params, "realm");
+	nonce = http_auth_param(params, "nonce");
+	algorithm = http_auth_param(params, "algorithm");
+
+	if (realm == NULL || nonce == NULL || (algorithm != NULL &&
+			g_ascii_strcasecmp(algorithm, "MD5") &&
+			g_ascii_strcasecmp(algorithm, "MD5-sess")) ||
+			(auth = proxy_auth_lookup(gpi, TRUE)) == NULL)
+	{
+		g_free(realm);
+		g_free(nonce);
+		g_free(algorithm);
+		return NULL;
+	}
+
+	if ((qop = http_auth_param(params, "qop")) != NULL) {
+		gchar **qops = g_strsplit(qop, ",", -1);
+		int i;
+
+		for (i = 0; qops[i] != NULL; i++)
+			if (!strcmp(g_strstrip(qops[i]), "auth"))
+				qop_auth = TRUE;
+
+		g_strfreev(qops);
+		g_free(qop);
+	}
+
+	g_free(auth->realm);
+	g_free(auth->nonce);
+	g_free(auth->opaque);
+	g_free(auth->algorithm);
+
+	auth->realm = realm;
+	auth->nonce = nonce;
+	auth->opaque = http_auth_param(params, "opaque");
+	auth->algorithm = algorithm;
+	auth->qop_auth = qop_auth;
+	auth->nonce_count = 0;
+
+	return auth;
+}
+
+/* answers the Digest challenge for the CONNECT request */
+static char *
+http_auth_digest(OulProxyConnectData *connect_data, OulProxyAuth *auth)
+{
+	const char *username = oul_proxy_info_get_username(connect_data->gpi);
+	const char *password = oul_proxy_info_get_password(connect_data->gpi);
+	char *uri, *cnonce, *nc, *session_key, *response;
+	GString *ret;
+
+	if (auth->realm == NULL || auth->nonce == NULL)
+		return NULL;
+
+	uri = g_strdup_printf("%s:%d", connect_data->host, connect_data->port);
+	cnonce = g_strdup_printf("%08x%08x", g_random_int(), g_random_int());
+	nc = g_strdup_printf("%08x", ++auth->nonce_count);
+
+	session_key = oul_cipher_http_digest_calculate_session_key(auth->algorithm,
+			username, auth->realm, password ? password : "", auth->nonce, cnonce);
+	response = session_key == NULL ? NULL :
+			oul_cipher_http_digest_calculate_response(auth->algorithm, "CONNECT",
+				uri, auth->qop_auth ? "auth" : NULL, NULL, auth->nonce, nc, cnonce,
+				session_key);
+
+	if (response == NULL) {
+		g_free(uri);
+		g_free(cnonce);
+		g_free(nc);
+		g_free(session_key);
+		return NULL;
+	}
+
+	ret = g_string_new(NULL);
+	g_string_append_printf(ret,
+			"username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", response=\"%s\"",
+			username, auth->realm, auth->nonce, uri, response);
+	if (auth->algorithm != NULL)
+		g_string_append_printf(ret, ", algorithm=%s", auth->algorithm);
+	if (auth->opaque != NULL)
+		g_string_append_printf(ret, ", opaque=\"%s\"", auth->opaque);
+	if (auth->qop_auth)
+		g_string_append_printf(ret, ", qop=auth, nc=%s, cnonce=\"%s\"", nc, cnonce);
+
+	g_free(uri);
+	g_free(cnonce);
+	g_free(nc);
+	g_free(session_key);
+	g_free(response);
+
+	return g_string_free(ret, FALSE);
+}
+
+/* the tunnel is up, the next connection sends what worked right away */
+static void
+http_auth_remember(OulProxyConnectData *connect_data)
+{
+	OulProxyAuth *auth;
+
+	if (connect_data->auth_sent == PROXY_AUTH_UNKNOWN ||
+			oul_proxy_info_get_username(connect_data->gpi) == NULL)
+		return;
+
+	if ((auth = proxy_auth_lookup(connect_data->gpi, TRUE)) != NULL)
+		auth->http_method = connect_data->auth_sent;
+}
+
 /**
  * We're using an HTTP proxy for a non-port 80 tunnel.  Read the
  * response to the CONNECT request.
@@ -715,7 +975,22 @@ http_canread(gpointer data, gint source, OulInputCondition cond)
 
 		if (status == 407 /* Proxy Auth */) {
 			const char *header;
-			gchar *request;
+			GString *request;
+			OulProxyAuth *auth;
+			gchar *response;
+
+			if (++connect_data->auth_rounds > PROXY_AUTH_MAX_ROUNDS) {
+				proxy_auth_forget(connect_data->gpi);
+				oul_proxy_connect_data_disconnect(connect_data,
+						_("Authentication failed"));
+				return;
+			}
+
+			request = g_string_sized_new(4096);
+			g_string_append_printf(request,
+					"CONNECT %s:%d HTTP/1.1\r\nHost: %s:%d\r\n",
+					connect_data->host, connect_data->port,
+					connect_data->host, connect_data->port);
 
 			header = g_strrstr((const gchar *)connect_data->read_buffer,
 					"Proxy-Authenticate: NTLM");
@@ -723,19 +998,13 @@ http_canread(gpointer data, gint source, OulInputCondition cond)
 				const char *header_end = header + strlen("Proxy-Authenticate: NTLM");
 				const char *domain = oul_proxy_info_get_username(connect_data->gpi);
 				char *username = NULL, hostname[256];
-				gchar *response;
-				int ret;
-
-				ret = gethostname(hostname, sizeof(hostname));
-				hostname[sizeof(hostname) - 1] = '\0';
-				if (ret < 0 || hostname[0] == '\0') {
-					oul_debug_warning("proxy", "gethostname() failed -- is your hostname set?");
-					strcpy(hostname, "localhost");
-				}
+
+				http_auth_hostname(hostname, sizeof(hostname));
 
 				if (domain != NULL)
 					username = (char*) strchr(domain, '\\');
 				if (username == NULL) {
+					g_string_free(request, TRUE);
 					oul_proxy_connect_data_disconnect_formatted(connect_data,
 							_("HTTP proxy connection error %d"), status);
 					return;
@@ -763,49 +1032,49 @@ http_canread(gpointer data, gint source, OulInputCondition cond)
 
 				*username = '\\';
 
-				request = g_strdup_printf(
-					"CONNECT %s:%d HTTP/1.1\r\n"
-					"Host: %s:%d\r\n"
-					"Proxy-Authorization: NTLM %s\r\n"
-					"Proxy-Connection: Keep-Alive\r\n\r\n",
-					connect_data->host, connect_data->port,
-					connect_data->host, connect_data->port,
-					response);
+				g_string_append_printf(request,
+					"Proxy-Authorization: NTLM %s\r\n", response);
+				connect_data->auth_sent = PROXY_AUTH_NTLM;
+
+				g_free(response);
+
+			} else if((header = g_strrstr((const char *)connect_data->read_buffer, "Proxy-Authenticate: Digest ")) &&
+					oul_proxy_info_get_username(connect_data->gpi) != NULL &&
+					(auth = http_auth_digest_challenge(connect_data->gpi,
+						header + strlen("Proxy-Authenticate: Digest "))) != NULL &&
+					(response = http_auth_digest(connect_data, auth)) != NULL) {
+
+				g_string_append_printf(request,
+					"Proxy-Authorization: Digest %s\r\n", response);
+				connect_data->auth_sent = PROXY_AUTH_DIGEST;
 
 				g_free(response);
 
 			} else if((header = g_strrstr((const char *)connect_data->read_buffer, "Proxy-Authenticate: Basic"))) {
-				gchar *t1, *t2;
-
-				t1 = g_strdup_printf("%s:%s",
-					oul_proxy_info_get_username(connect_data->gpi),
-					oul_proxy_info_get_password(connect_data->gpi) ?
-					oul_proxy_info_get_password(connect_data->gpi) : "");
-				t2 = oul_base64_encode((const guchar *)t1, strlen(t1));
-				g_free(t1);
-
-				request = g_strdup_printf(
-					"CONNECT %s:%d HTTP/1.1\r\n"
-					"Host: %s:%d\r\n"
-					"Proxy-Authorization: Basic %s\r\n",
-					connect_data->host, connect_data->port,
-					connect_data->host, connect_data->port,
-					t2);
+				response = http_auth_basic(connect_data->gpi);
 
-				g_free(t2);
+				g_string_append_printf(request,
+					"Proxy-Authorization: Basic %s\r\n", response);
+				connect_data->auth_sent = PROXY_AUTH_BASIC;
+
+				g_free(response);
 
 			} else {
+				g_string_free(request, TRUE);
+				proxy_auth_forget(connect_data->gpi);
 				oul_proxy_connect_data_disconnect_formatted(connect_data,
 						_("HTTP proxy connection error %d"), status);
 				return;
 			}
 
+			g_string_append(request, "Proxy-Connection: Keep-Alive\r\n\r\n");
+
 			oul_input_remove(connect_data->inpa);
 			g_free(connect_data->read_buffer);
 			connect_data->read_buffer = NULL;
 
-			connect_data->write_buffer = (guchar *)request;
-			connect_data->write_buf_len = strlen(request);
+			connect_data->write_buf_len = request->len;
+			connect_data->write_buffer = (guchar *)g_string_free(request, FALSE);
 			connect_data->written_len = 0;
 
 			connect_data->read_cb = http_canread;
@@ -833,6 +1102,7 @@ http_canread(gpointer data, gint source, OulInputCondition cond)
 		g_free(connect_data->read_buffer);
 		connect_data->read_buffer = NULL;
 		oul_debug_info("proxy", "HTTP proxy connection established\n");
+		http_auth_remember(connect_data);
 		oul_proxy_connect_data_connected(connect_data);
 		return;
 	}
@@ -841,7 +1111,7 @@ http_canread(gpointer data, gint source, OulInputCondition cond)
 static void
 http_start_connect_tunneling(OulProxyConnectData *connect_data) {
 	GString *request;
-	int ret;
+	OulProxyAuth *auth;
 
 	oul_debug_info("proxy", "Using CONNECT tunneling for %s:%d\n",
 		connect_data->host, connect_data->port);
@@ -852,32 +1122,46 @@ http_start_connect_tunneling(OulProxyConnectData *connect_data) {
 			connect_data->host, connect_data->port,
 			connect_data->host, connect_data->port);
 
+	connect_data->auth_sent = PROXY_AUTH_UNKNOWN;
+	connect_data->auth_rounds = 0;
+
 	if (oul_proxy_info_get_username(connect_data->gpi) != NULL)
 	{
-		char *t1, *t2, *ntlm_type1;
+		char *t2 = NULL, *ntlm_type1 = NULL, *digest = NULL;
 		char hostname[256];
 
-		ret = gethostname(hostname, sizeof(hostname));
-		hostname[sizeof(hostname) - 1] = '\0';
-		if (ret < 0 || hostname[0] == '\0') {
-			oul_debug_warning("proxy", "gethostname() failed -- is your hostname set?");
-			strcpy(hostname, "localhost");
-		}
+		/* Answer the way the proxy was satisfied the last time */
+		auth = proxy_auth_lookup(connect_data->gpi, FALSE);
+
+		if (auth != NULL && auth->http_method == PROXY_AUTH_DIGEST)
+			digest = http_auth_digest(connect_data, auth);
+
+		if (digest != NULL) {
+			g_string_append_printf(request,
+				"Proxy-Authorization: Digest %s\r\n", digest);
+			connect_data->auth_sent = PROXY_AUTH_DIGEST;
+		} else {
+			if (auth == NULL || auth->http_method != PROXY_AUTH_NTLM) {
+				t2 = http_auth_basic(connect_data->gpi);
+				g_string_append_printf(request,
+					"Proxy-Authorization: Basic %s\r\n", t2);
+				connect_data->auth_sent = PROXY_AUTH_BASIC;
+			}
 
-		t1 = g_strdup_printf("%s:%s",
-			oul_proxy_info_get_username(connect_data->gpi),
-			oul_proxy_info_get_password(connect_data->gpi) ?
-				oul_proxy_info_get_password(connect_data->gpi) : "");
-		t2 = oul_base64_encode((const guchar *)t1, strlen(t1));
-		g_free(t1);
+			/* NTLM authenticates the connection, it can't be answered ahead */
+			if (auth == NULL || auth->http_method != PROXY_AUTH_BASIC) {
+				http_auth_hostname(hostname, sizeof(hostname));
+				ntlm_type1 = oul_ntlm_gen_type1(hostname, "");
+				g_string_append_printf(request,
+					"Proxy-Authorization: NTLM %s\r\n", ntlm_type1);
+				if (t2 == NULL)
+					connect_data->auth_sent = PROXY_AUTH_NTLM;
+			}
+		}
 
-		ntlm_type1 = oul_ntlm_gen_type1(hostname, "");
+		g_string_append(request, "Proxy-Connection: Keep-Alive\r\n");
 
-		g_string_append_printf(request,
-			"Proxy-Authorization: Basic %s\r\n"
-			"Proxy-Authorization: NTLM %s\r\n"
-			"Proxy-Connection: Keep-Alive\r\n",
-			t2, ntlm_type1);
+		g_free(digest);
 		g_free(ntlm_type1);
 		g_free(t2);
 	}
@@ -932,44 +1216,6 @@ http_canwrite(gpointer data, gint source, OulInputCondition cond) {
 
 }
 
-static void
-proxy_connect_http(OulProxyConnectData *connect_data, struct sockaddr *addr, socklen_t addrlen)
-{
-	int flags;
-
-	oul_debug_info("proxy",
-			   "Connecting to %s:%d via %s:%d using HTTP\n",
-			   connect_data->host, connect_data->port,
-			   (oul_proxy_info_get_host(connect_data->gpi) ? oul_proxy_info_get_host(connect_data->gpi) : "(null)"),
-			   oul_proxy_info_get_port(connect_data->gpi));
-
-	connect_data->fd = socket(addr->sa_family, SOCK_STREAM, 0);
-	if (connect_data->fd < 0)
-	{
-		oul_proxy_connect_data_disconnect_formatted(connect_data,
-				_("Unable to create socket:\n%s"), g_strerror(errno));
-		return;
-	}
-
-	flags = fcntl(connect_data->fd, F_GETFL);
-	fcntl(connect_data->fd, F_SETFL, flags | O_NONBLOCK);
-	fcntl(connect_data->fd, F_SETFD, FD_CLOEXEC);
-
-	if (connect(connect_data->fd, addr, addrlen) != 0) {
-		if (errno == EINPROGRESS || errno == EINTR) {
-			oul_debug_info("proxy", "Connection in progress\n");
-
-			connect_data->inpa = oul_input_add(connect_data->fd,
-					OUL_INPUT_WRITE, http_canwrite, connect_data);
-		} else
-			oul_proxy_connect_data_disconnect(connect_data, g_strerror(errno));
-	} else {
-		oul_debug_info("proxy", "Connected immediately.\n");
-
-		http_canwrite(connect_data, connect_data->fd, OUL_INPUT_WRITE);
-	}
-}
-
 static void
 s4_canread(gpointer data, gint source, OulInputCondition cond)
 {
@@ -1065,48 +1311,86 @@ s4_canwrite(gpointer data, gint source, OulInputCondition cond)
 	proxy_do_write(connect_data, connect_data->fd, cond);
 }
 
+/* the CONNECT request, by host name */
 static void
-proxy_connect_socks4(OulProxyConnectData *connect_data, struct sockaddr *addr, socklen_t addrlen)
+s5_append_connect(GByteArray *request, OulProxyConnectData *connect_data)
 {
-	int flags;
+	guchar header[5], port[2];
+	int hlen = strlen(connect_data->host);
 
-	oul_debug_info("proxy",
-			   "Connecting to %s:%d via %s:%d using SOCKS4\n",
-			   connect_data->host, connect_data->port,
-			   oul_proxy_info_get_host(connect_data->gpi),
-			   oul_proxy_info_get_port(connect_data->gpi));
+	header[0] = 0x05;
+	header[1] = 0x01;		/* CONNECT */
+	header[2] = 0x00;		/* reserved */
+	header[3] = 0x03;		/* address type -- host name */
+	header[4] = hlen;
+	port[0] = connect_data->port >> 8;
+	port[1] = connect_data->port & 0xff;
+
+	g_byte_array_append(request, header, sizeof(header));
+	g_byte_array_append(request, (const guchar *)connect_data->host, hlen);
+	g_byte_array_append(request, port, sizeof(port));
+}
 
-	connect_data->fd = socket(addr->sa_family, SOCK_STREAM, 0);
-	if (connect_data->fd < 0)
-	{
-		oul_proxy_connect_data_disconnect_formatted(connect_data,
-				_("Unable to create socket:\n%s"), g_strerror(errno));
-		return;
-	}
+/* the username/password request [RFC 1929] */
+static void
+s5_append_userpass(GByteArray *request, OulProxyInfo *gpi)
+{
+	const char *u, *p;
+	guchar len;
 
-	flags = fcntl(connect_data->fd, F_GETFL);
-	fcntl(connect_data->fd, F_SETFL, flags | O_NONBLOCK);
-	fcntl(connect_data->fd, F_SETFD, FD_CLOEXEC);
+	u = oul_proxy_info_get_username(gpi);
+	p = oul_proxy_info_get_password(gpi);
 
-	if (connect(connect_data->fd, addr, addrlen) != 0)
-	{
-		if ((errno == EINPROGRESS) || (errno == EINTR))
-		{
-			oul_debug_info("proxy", "Connection in progress.\n");
-			connect_data->inpa = oul_input_add(connect_data->fd,
-					OUL_INPUT_WRITE, s4_canwrite, connect_data);
-		}
-		else
-		{
-			oul_proxy_connect_data_disconnect(connect_data, g_strerror(errno));
-		}
-	}
-	else
-	{
-		oul_debug_info("proxy", "Connected immediately.\n");
+	len = 0x01;	/* version 1 */
+	g_byte_array_append(request, &len, 1);
 
-		s4_canwrite(connect_data, connect_data->fd, OUL_INPUT_WRITE);
-	}
+	len = (u == NULL) ? 0 : strlen(u);
+	g_byte_array_append(request, &len, 1);
+	if (u != NULL)
+		g_byte_array_append(request, (const guchar *)u, len);
+
+	len = (p == NULL) ? 0 : strlen(p);
+	g_byte_array_append(request, &len, 1);
+	if (p != NULL)
+		g_byte_array_append(request, (const guchar *)p, len);
+}
+
+static void
+s5_write_request(OulProxyConnectData *connect_data, GByteArray *request,
+		OulInputFunction read_cb)
+{
+	connect_data->write_buf_len = request->len;
+	connect_data->write_buffer = g_byte_array_free(request, FALSE);
+	connect_data->written_len = 0;
+
+	connect_data->read_cb = read_cb;
+
+	connect_data->inpa = oul_input_add(connect_data->fd, OUL_INPUT_WRITE,
+		proxy_do_write, connect_data);
+	proxy_do_write(connect_data, connect_data->fd, OUL_INPUT_WRITE);
+}
+
+/*
+ * The proxy did not pick the method the requests were pipelined for,
+ * so it took them for garbage.  Forget it and negotiate from scratch on
+ * a new connection.
+ */
+static void
+s5_renegotiate(OulProxyConnectData *connect_data)
+{
+	oul_debug_info("socks5 proxy", "Proxy changed its authentication, renegotiating\n");
+
+	proxy_auth_forget(connect_data->gpi);
+	connect_data->s5_pipelined = FALSE;
+
+	oul_proxy_connect_data_disconnect(connect_data, NULL);
+	connect_hosts_free(connect_data);
+
+	connect_data->query_data = oul_dnsquery_a(oul_proxy_info_get_host(connect_data->gpi),
+			oul_proxy_info_get_port(connect_data->gpi),
+			connection_host_resolved, connect_data);
+	if (connect_data->query_data == NULL)
+		oul_proxy_connect_data_disconnect(connect_data, _("Could not resolve host name"));
 }
 
 static gboolean
@@ -1131,6 +1415,7 @@ s5_canread_again(gpointer data, gint source, OulInputCondition cond)
 {
 	guchar *dest, *buf;
 	OulProxyConnectData *connect_data = data;
+	OulProxyAuth *auth;
 	int len;
 
 	if (connect_data->read_buffer == NULL) {
@@ -1214,6 +1499,9 @@ s5_canread_again(gpointer data, gint source, OulInputCondition cond)
 	if(!s5_ensure_buffer_length(connect_data, (buf - connect_data->read_buffer) + 2))
 		return;
 
+	if ((auth = proxy_auth_lookup(connect_data->gpi, TRUE)) != NULL)
+		auth->socks5_method = connect_data->s5_method;
+
 	oul_proxy_connect_data_connected(connect_data);
 }
 
@@ -1221,24 +1509,10 @@ static void
 s5_sendconnect(gpointer data, int source)
 {
 	OulProxyConnectData *connect_data = data;
-	int hlen = strlen(connect_data->host);
-	connect_data->write_buf_len = 5 + hlen + 2;
-	connect_data->write_buffer = g_malloc(connect_data->write_buf_len);
-	connect_data->written_len = 0;
-
-	connect_data->write_buffer[0] = 0x05;
-	connect_data->write_buffer[1] = 0x01;		/* CONNECT */
-	connect_data->write_buffer[2] = 0x00;		/* reserved */
-	connect_data->write_buffer[3] = 0x03;		/* address type -- host name */
-	connect_data->write_buffer[4] = hlen;
-	memcpy(connect_data->write_buffer + 5, connect_data->host, hlen);
-	connect_data->write_buffer[5 + hlen] = connect_data->port >> 8;
-	connect_data->write_buffer[5 + hlen + 1] = connect_data->port & 0xff;
+	GByteArray *request = g_byte_array_new();
 
-	connect_data->read_cb = s5_canread_again;
-
-	connect_data->inpa = oul_input_add(connect_data->fd, OUL_INPUT_WRITE, proxy_do_write, connect_data);
-	proxy_do_write(connect_data, connect_data->fd, OUL_INPUT_WRITE);
+	s5_append_connect(request, connect_data);
+	s5_write_request(connect_data, request, s5_canread_again);
 }
 
 static void
@@ -1285,6 +1559,7 @@ s5_readauth(gpointer data, gint source, OulInputCondition cond)
 	connect_data->inpa = 0;
 
 	if ((connect_data->read_buffer[0] != 0x01) || (connect_data->read_buffer[1] != 0x00)) {
+		proxy_auth_forget(connect_data->gpi);
 		oul_proxy_connect_data_disconnect(connect_data,
 				_("Received invalid data on connection with server."));
 		return;
@@ -1293,6 +1568,13 @@ s5_readauth(gpointer data, gint source, OulInputCondition cond)
 	g_free(connect_data->read_buffer);
 	connect_data->read_buffer = NULL;
 
+	/* The CONNECT request went along with the credentials */
+	if (connect_data->s5_pipelined) {
+		connect_data->inpa = oul_input_add(connect_data->fd, OUL_INPUT_READ,
+			s5_canread_again, connect_data);
+		return;
+	}
+
 	s5_sendconnect(connect_data, connect_data->fd);
 }
 
@@ -1438,6 +1720,7 @@ s5_readchap(gpointer data, gint source, OulInputCondition cond)
 					oul_debug_warning("proxy",
 						"socks5 CHAP authentication "
 						"failed.  Disconnecting...");
+					proxy_auth_forget(connect_data->gpi);
 					oul_proxy_connect_data_disconnect(connect_data,
 							_("Authentication failed"));
 				}
@@ -1504,6 +1787,7 @@ static void
 s5_canread(gpointer data, gint source, OulInputCondition cond)
 {
 	OulProxyConnectData *connect_data = data;
+	OulProxyAuth *auth;
 	int len;
 
 	if (connect_data->read_buffer == NULL) {
@@ -1543,43 +1827,40 @@ s5_canread(gpointer data, gint source, OulInputCondition cond)
 	oul_input_remove(connect_data->inpa);
 	connect_data->inpa = 0;
 
+	if (connect_data->s5_pipelined && connect_data->read_buffer[0] == 0x05) {
+		auth = proxy_auth_lookup(connect_data->gpi, FALSE);
+		if (auth == NULL || connect_data->read_buffer[1] != auth->socks5_method) {
+			s5_renegotiate(connect_data);
+			return;
+		}
+
+		/* What the method asks for was sent with the greeting */
+		g_free(connect_data->read_buffer);
+		connect_data->read_buffer = NULL;
+
+		connect_data->inpa = oul_input_add(connect_data->fd, OUL_INPUT_READ,
+			connect_data->s5_method == 0x02 ? s5_readauth : s5_canread_again,
+			connect_data);
+		return;
+	}
+
 	if ((connect_data->read_buffer[0] != 0x05) || (connect_data->read_buffer[1] == 0xff)) {
 		oul_proxy_connect_data_disconnect(connect_data,
 				_("Received invalid data on connection with server."));
 		return;
 	}
 
-	if (connect_data->read_buffer[1] == 0x02) {
-		gsize i, j;
-		const char *u, *p;
-
-		u = oul_proxy_info_get_username(connect_data->gpi);
-		p = oul_proxy_info_get_password(connect_data->gpi);
+	connect_data->s5_method = connect_data->read_buffer[1];
 
-		i = (u == NULL) ? 0 : strlen(u);
-		j = (p == NULL) ? 0 : strlen(p);
-
-		connect_data->write_buf_len = 1 + 1 + i + 1 + j;
-		connect_data->write_buffer = g_malloc(connect_data->write_buf_len);
-		connect_data->written_len = 0;
+	if (connect_data->read_buffer[1] == 0x02) {
+		GByteArray *request = g_byte_array_new();
 
-		connect_data->write_buffer[0] = 0x01;	/* version 1 */
-		connect_data->write_buffer[1] = i;
-		if (u != NULL)
-			memcpy(connect_data->write_buffer + 2, u, i);
-		connect_data->write_buffer[2 + i] = j;
-		if (p != NULL)
-			memcpy(connect_data->write_buffer + 2 + i + 1, p, j);
+		s5_append_userpass(request, connect_data->gpi);
 
 		g_free(connect_data->read_buffer);
 		connect_data->read_buffer = NULL;
 
-		connect_data->read_cb = s5_readauth;
-
-		connect_data->inpa = oul_input_add(connect_data->fd, OUL_INPUT_WRITE,
-			proxy_do_write, connect_data);
-
-		proxy_do_write(connect_data, connect_data->fd, OUL_INPUT_WRITE);
+		s5_write_request(connect_data, request, s5_readauth);
 
 		return;
 	} else if (connect_data->read_buffer[1] == 0x03) {
@@ -1625,6 +1906,8 @@ s5_canwrite(gpointer data, gint source, OulInputCondition cond)
 	unsigned char buf[5];
 	int i;
 	OulProxyConnectData *connect_data = data;
+	OulProxyAuth *auth;
+	GByteArray *request;
 	int error = ETIMEDOUT;
 	int ret;
 
@@ -1645,6 +1928,36 @@ s5_canwrite(gpointer data, gint source, OulInputCondition cond)
 		return;
 	}
 
+	request = g_byte_array_new();
+	auth = proxy_auth_lookup(connect_data->gpi, FALSE);
+
+	connect_data->s5_pipelined = FALSE;
+	connect_data->s5_method = -1;
+
+	/*
+	 * The proxy took no authentication or a password the last time, so
+	 * offer just that and send the rest along: it is answered in one
+	 * round trip instead of up to three.  CHAP needs the challenge first.
+	 */
+	if (auth != NULL && (auth->socks5_method == 0x00 ||
+			(auth->socks5_method == 0x02 &&
+			 oul_proxy_info_get_username(connect_data->gpi) != NULL))) {
+		buf[0] = 0x05;
+		buf[1] = 0x01;
+		buf[2] = auth->socks5_method;
+		g_byte_array_append(request, buf, 3);
+
+		if (auth->socks5_method == 0x02)
+			s5_append_userpass(request, connect_data->gpi);
+		s5_append_connect(request, connect_data);
+
+		connect_data->s5_pipelined = TRUE;
+		connect_data->s5_method = auth->socks5_method;
+
+		s5_write_request(connect_data, request, s5_canread);
+		return;
+	}
+
 	i = 0;
 	buf[0] = 0x05;		/* SOCKS version 5 */
 
@@ -1661,116 +1974,303 @@ s5_canwrite(gpointer data, gint source, OulInputCondition cond)
 		i = 3;
 	}
 
-	connect_data->write_buf_len = i;
-	connect_data->write_buffer = g_malloc(connect_data->write_buf_len);
-	memcpy(connect_data->write_buffer, buf, i);
+	g_byte_array_append(request, buf, i);
 
-	connect_data->read_cb = s5_canread;
+	s5_write_request(connect_data, request, s5_canread);
+}
 
-	connect_data->inpa = oul_input_add(connect_data->fd, OUL_INPUT_WRITE, proxy_do_write, connect_data);
-	proxy_do_write(connect_data, connect_data->fd, OUL_INPUT_WRITE);
+#ifndef INET6_ADDRSTRLEN
+#define INET6_ADDRSTRLEN 46
+#endif
+
+/*
+ * The addresses are tried in the spirit of RFC 8305: a new attempt
+ * starts every PROXY_CONNECT_ATTEMPT_DELAY milliseconds, or as soon as
+ * one fails, and the first socket which connects wins.  A dead address
+ * no longer costs a whole connect timeout.
+ */
+#define PROXY_CONNECT_ATTEMPT_DELAY 250
+
+typedef struct
+{
+	OulProxyConnectData *connect_data;
+	int fd;
+	guint inpa;
+	char ipaddr[INET6_ADDRSTRLEN];
+} OulProxyConnectAttempt;
+
+static void connect_attempt_next(OulProxyConnectData *connect_data);
+
+static void
+connect_attempt_free(OulProxyConnectAttempt *attempt)
+{
+	if (attempt->inpa > 0)
+		oul_input_remove(attempt->inpa);
+
+	if (attempt->fd >= 0)
+		close(attempt->fd);
+
+	g_free(attempt);
 }
 
 static void
-proxy_connect_socks5(OulProxyConnectData *connect_data, struct sockaddr *addr, socklen_t addrlen)
+connect_attempts_clear(OulProxyConnectData *connect_data)
+{
+	if (connect_data->attempt_timer > 0)
+	{
+		oul_timeout_remove(connect_data->attempt_timer);
+		connect_data->attempt_timer = 0;
+	}
+
+	while (connect_data->attempts != NULL)
+	{
+		connect_attempt_free(connect_data->attempts->data);
+		connect_data->attempts = g_slist_delete_link(connect_data->attempts,
+				connect_data->attempts);
+	}
+}
+
+static gboolean
+connect_attempt_timeout_cb(gpointer data)
 {
-	int flags;
+	OulProxyConnectData *connect_data = data;
 
-	oul_debug_info("proxy",
-			   "Connecting to %s:%d via %s:%d using SOCKS5\n",
-			   connect_data->host, connect_data->port,
-			   oul_proxy_info_get_host(connect_data->gpi),
-			   oul_proxy_info_get_port(connect_data->gpi));
+	connect_data->attempt_timer = 0;
+	connect_attempt_next(connect_data);
 
-	connect_data->fd = socket(addr->sa_family, SOCK_STREAM, 0);
-	if (connect_data->fd < 0)
+	return FALSE;
+}
+
+static void
+connect_attempt_ready_cb(gpointer data, gint source, OulInputCondition cond)
+{
+	OulProxyConnectAttempt *attempt = data;
+	OulProxyConnectData *connect_data = attempt->connect_data;
+	int error = 0;
+	int ret;
+
+	ret = oul_input_get_error(attempt->fd, &error);
+
+	if (ret == 0 && error == EINPROGRESS)
+		return;
+
+	connect_data->attempts = g_slist_remove(connect_data->attempts, attempt);
+
+	if (ret != 0 || error != 0)
 	{
-		oul_proxy_connect_data_disconnect_formatted(connect_data,
-				_("Unable to create socket:\n%s"), g_strerror(errno));
+		if (ret != 0)
+			error = errno;
+		oul_debug_info("proxy", "Error connecting to %s (%s).\n",
+				attempt->ipaddr, g_strerror(error));
+
+		connect_data->attempt_error = error;
+		connect_attempt_free(attempt);
+
+		/* Don't wait for the delay, the next address goes right now */
+		connect_attempt_next(connect_data);
 		return;
 	}
 
-	flags = fcntl(connect_data->fd, F_GETFL);
-	fcntl(connect_data->fd, F_SETFL, flags | O_NONBLOCK);
-	fcntl(connect_data->fd, F_SETFD, FD_CLOEXEC);
+	/* We have a winner, the slower attempts are dropped */
+	oul_input_remove(attempt->inpa);
+	connect_data->fd = attempt->fd;
+	g_free(attempt);
+
+	connect_attempts_clear(connect_data);
+
+	connect_data->connected_cb(connect_data, connect_data->fd, OUL_INPUT_WRITE);
+}
+
+/**
+ * This function starts a connection attempt to the next IP address in
+ * the list returned to us by oul_dnsquery_a().  It is called after the
+ * hostname is resolved, each time the attempt delay passes, and each
+ * time an attempt fails.  Once there is nothing left to try and every
+ * attempt failed, the connection fails with the last error.
+ */
+static void
+connect_attempt_next(OulProxyConnectData *connect_data)
+{
+	OulProxyConnectAttempt *attempt;
+	struct sockaddr *addr;
+	size_t addrlen;
+	int fd, flags;
 
-	if (connect(connect_data->fd, addr, addrlen) != 0)
+	while (connect_data->hosts != NULL)
 	{
-		if ((errno == EINPROGRESS) || (errno == EINTR))
+		addrlen = GPOINTER_TO_INT(connect_data->hosts->data);
+		connect_data->hosts = g_slist_remove(connect_data->hosts, connect_data->hosts->data);
+		addr = connect_data->hosts->data;
+		connect_data->hosts = g_slist_remove(connect_data->hosts, connect_data->hosts->data);
+
+		attempt = g_new0(OulProxyConnectAttempt, 1);
+		attempt->connect_data = connect_data;
+#ifdef HAVE_INET_NTOP
+		if (addr->sa_family == AF_INET6)
+			inet_ntop(AF_INET6, &((struct sockaddr_in6 *)addr)->sin6_addr,
+					attempt->ipaddr, sizeof(attempt->ipaddr));
+		else
+			inet_ntop(addr->sa_family, &((struct sockaddr_in *)addr)->sin_addr,
+					attempt->ipaddr, sizeof(attempt->ipaddr));
+#else
+		g_strlcpy(attempt->ipaddr, inet_ntoa(((struct sockaddr_in *)addr)->sin_addr),
+				sizeof(attempt->ipaddr));
+#endif
+		oul_debug_info("proxy", "Attempting connection to %s\n", attempt->ipaddr);
+
+		fd = socket(addr->sa_family, SOCK_STREAM, 0);
+		if (fd < 0)
 		{
-			oul_debug_info("socks5 proxy", "Connection in progress\n");
-			connect_data->inpa = oul_input_add(connect_data->fd,
-					OUL_INPUT_WRITE, s5_canwrite, connect_data);
+			connect_data->attempt_error = errno;
+			oul_debug_info("proxy", "Unable to create socket: %s\n", g_strerror(errno));
+			g_free(attempt);
+			g_free(addr);
+			continue;
 		}
-		else
+
+		flags = fcntl(fd, F_GETFL);
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+		if (connect(fd, addr, addrlen) != 0 && errno != EINPROGRESS && errno != EINTR)
 		{
-			oul_proxy_connect_data_disconnect(connect_data, g_strerror(errno));
+			connect_data->attempt_error = errno;
+			oul_debug_info("proxy", "Error connecting to %s (%s).\n",
+					attempt->ipaddr, g_strerror(errno));
+			close(fd);
+			g_free(attempt);
+			g_free(addr);
+			continue;
 		}
-	}
-	else
-	{
-		oul_debug_info("proxy", "Connected immediately.\n");
 
-		s5_canwrite(connect_data, connect_data->fd, OUL_INPUT_WRITE);
+		g_free(addr);
+
+		/*
+		 * The socket becomes writable once it is connected, even if
+		 * it connected immediately, so the callback never runs before
+		 * we return.
+		 */
+		attempt->fd = fd;
+		attempt->inpa = oul_input_add(fd, OUL_INPUT_WRITE,
+				connect_attempt_ready_cb, attempt);
+		connect_data->attempts = g_slist_append(connect_data->attempts, attempt);
+
+		if (connect_data->attempt_timer > 0)
+		{
+			oul_timeout_remove(connect_data->attempt_timer);
+			connect_data->attempt_timer = 0;
+		}
+
+		if (connect_data->hosts != NULL)
+			connect_data->attempt_timer = oul_timeout_add(PROXY_CONNECT_ATTEMPT_DELAY,
+					connect_attempt_timeout_cb, connect_data);
+
+		return;
 	}
+
+	/* Nothing left to start, it failed if nothing is in progress either */
+	if (connect_data->attempts == NULL)
+		oul_proxy_connect_data_disconnect(connect_data,
+				g_strerror(connect_data->attempt_error ? connect_data->attempt_error : ECONNREFUSED));
 }
 
 /**
- * This function attempts to connect to the next IP address in the list
- * of IP addresses returned to us by oul_dnsquery_a() and attemps
- * to connect to each one.  This is called after the hostname is
- * resolved, and each time a connection attempt fails (assuming there
- * is another IP address to try).
+ * Alternate the address families of the resolved hosts, keeping the
+ * resolver's order within each family, so a broken IPv6 or IPv4 route
+ * only delays the connection by a single attempt.
  */
-#ifndef INET6_ADDRSTRLEN
-#define INET6_ADDRSTRLEN 46
-#endif
-
-static void try_connect(OulProxyConnectData *connect_data)
+static GSList *
+connect_hosts_interleave(GSList *hosts)
 {
-	size_t addrlen;
+	GSList *lists[2] = { NULL, NULL };
+	GSList *ret = NULL;
 	struct sockaddr *addr;
-	char ipaddr[INET6_ADDRSTRLEN];
+	int family = AF_UNSPEC;
+	int i, j;
 
-	addrlen = GPOINTER_TO_INT(connect_data->hosts->data);
-	connect_data->hosts = g_slist_remove(connect_data->hosts, connect_data->hosts->data);
-	addr = connect_data->hosts->data;
-	connect_data->hosts = g_slist_remove(connect_data->hosts, connect_data->hosts->data);
-#ifdef HAVE_INET_NTOP
-	inet_ntop(addr->sa_family, &((struct sockaddr_in *)addr)->sin_addr,
-			ipaddr, sizeof(ipaddr));
-#else
-	memcpy(ipaddr,inet_ntoa(((struct sockaddr_in *)addr)->sin_addr),
-			sizeof(ipaddr));
-#endif
-	oul_debug_info("proxy", "Attempting connection to %s\n", ipaddr);
+	for (i = 0; hosts != NULL; i = 0)
+	{
+		addr = hosts->next->data;
+		if (family == AF_UNSPEC)
+			family = addr->sa_family;
+		if (addr->sa_family != family)
+			i = 1;
+
+		/* Moves the length and the address */
+		for (j = 0; j < 2; j++)
+		{
+			lists[i] = g_slist_prepend(lists[i], hosts->data);
+			hosts = g_slist_delete_link(hosts, hosts);
+		}
+	}
 
+	lists[0] = g_slist_reverse(lists[0]);
+	lists[1] = g_slist_reverse(lists[1]);
+
+	while (lists[0] != NULL || lists[1] != NULL)
+	{
+		for (i = 0; i < 2; i++)
+		{
+			for (j = 0; j < 2 && lists[i] != NULL; j++)
+			{
+				ret = g_slist_prepend(ret, lists[i]->data);
+				lists[i] = g_slist_delete_link(lists[i], lists[i]);
+			}
+		}
+	}
+
+	return g_slist_reverse(ret);
+}
+
+/**
+ * This function races the connections over all the IP addresses, then
+ * goes on with the protocol of the proxy on the socket which won.  It
+ * is called after the hostname is resolved, and again if the protocol
+ * failed on the winner and there are other IP addresses to try.
+ */
+static void try_connect(OulProxyConnectData *connect_data)
+{
 	switch (oul_proxy_info_get_type(connect_data->gpi)) {
 		case OUL_PROXY_NONE:
-			proxy_connect_none(connect_data, addr, addrlen);
+			oul_debug_info("proxy", "Connecting to %s:%d with no proxy\n",
+					connect_data->host, connect_data->port);
+			connect_data->connected_cb = socket_ready_cb;
 			break;
 
 		case OUL_PROXY_HTTP:
-			proxy_connect_http(connect_data, addr, addrlen);
+		case OUL_PROXY_USE_ENVVAR:
+			oul_debug_info("proxy",
+					   "Connecting to %s:%d via %s:%d using HTTP\n",
+					   connect_data->host, connect_data->port,
+					   (oul_proxy_info_get_host(connect_data->gpi) ? oul_proxy_info_get_host(connect_data->gpi) : "(null)"),
+					   oul_proxy_info_get_port(connect_data->gpi));
+			connect_data->connected_cb = http_canwrite;
 			break;
 
 		case OUL_PROXY_SOCKS4:
-			proxy_connect_socks4(connect_data, addr, addrlen);
+			oul_debug_info("proxy",
+					   "Connecting to %s:%d via %s:%d using SOCKS4\n",
+					   connect_data->host, connect_data->port,
+					   oul_proxy_info_get_host(connect_data->gpi),
+					   oul_proxy_info_get_port(connect_data->gpi));
+			connect_data->connected_cb = s4_canwrite;
 			break;
 
 		case OUL_PROXY_SOCKS5:
-			proxy_connect_socks5(connect_data, addr, addrlen);
-			break;
-
-		case OUL_PROXY_USE_ENVVAR:
-			proxy_connect_http(connect_data, addr, addrlen);
+			oul_debug_info("proxy",
+					   "Connecting to %s:%d via %s:%d using SOCKS5\n",
+					   connect_data->host, connect_data->port,
+					   oul_proxy_info_get_host(connect_data->gpi),
+					   oul_proxy_info_get_port(connect_data->gpi));
+			connect_data->connected_cb = s5_canwrite;
 			break;
 
 		default:
-			break;
+			return;
 	}
 
-	g_free(addr);
+	connect_data->attempt_error = 0;
+	connect_attempt_next(connect_data);
 }
 
 static void
@@ -1794,7 +2294,7 @@ connection_host_resolved(GSList *hosts, gpointer data,
 		return;
 	}
 
-	connect_data->hosts = hosts;
+	connect_data->hosts = connect_hosts_interleave(hosts);
 
 	try_connect(connect_data);
 }
@@ -2000,6 +2500,10 @@ proxy_pref_cb(const char *name, OulPrefType type,
 {
 	OulProxyInfo *info = oul_global_proxy_get_info();
 
+	/* The credentials may have changed, the proxies will tell again */
+	if (proxy_auth_cache != NULL)
+		g_hash_table_remove_all(proxy_auth_cache);
+
 	if (!strcmp(name, "/oul/proxy/type")) {
 		int proxytype;
 		const char *type = value;
@@ -2044,6 +2548,9 @@ oul_proxy_init(void)
 	/* Initialize a default proxy info struct. */
 	global_proxy_info = oul_proxy_info_new();
 
+	proxy_auth_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, (GDestroyNotify)proxy_auth_free);
+
 	/* Proxy */
 	oul_prefs_add_none("/oul/network");
 	oul_prefs_add_none("/oul/network/proxy");
@@ -2078,5 +2585,10 @@ oul_proxy_uninit(void)
 		oul_proxy_connect_data_disconnect(handles->data, NULL);
 		oul_proxy_connect_data_destroy(handles->data);
 	}
+
+	if (proxy_auth_cache != NULL) {
+		g_hash_table_destroy(proxy_auth_cache);
+		proxy_auth_cache = NULL;
+	}
 }
 
@@ -164,6 +164,14 @@ const char *oul_proxy_info_get_password(const OulProxyInfo *info);
  */
 OulProxyInfo *oul_global_proxy_get_info(void);
 
+/**
+ * Returns the proxy information used by the connections, after the
+ * environment and the desktop settings were applied.
+ *
+ * @return The proxy information.
+ */
+OulProxyInfo *oul_proxy_get_setup(void);
+
 /*@}*/
 
 /**************************************************************************/
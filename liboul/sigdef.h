@@ -1,4 +1,51 @@
-#ifndef _OUL_SIGDEF_H
-#define _OUL_SIGDEF_H
+/*
+ * The signatures of the signal marshallers.
+ *
+ * This file is included with OUL_SIGDEF_0() to OUL_SIGDEF_5() defined,
+ * and each line turns into what the includer needs: signals.h declares
+ * oul_marshal_<RET>__<ARGS>() and signals.c defines it, along with the
+ * argument types the emitters pack.  It has no include guard for that
+ * reason.
+ *
+ * The return type is VOID, INT, BOOLEAN or POINTER, the argument types
+ * INT, UINT, BOOLEAN, INT64 or POINTER.  A new signature only needs a
+ * line here.
+ */
 
-#endif
+OUL_SIGDEF_0(VOID)
+OUL_SIGDEF_1(VOID, INT)
+OUL_SIGDEF_2(VOID, INT, INT)
+OUL_SIGDEF_1(VOID, POINTER)
+OUL_SIGDEF_2(VOID, POINTER, UINT)
+OUL_SIGDEF_3(VOID, POINTER, INT, INT)
+OUL_SIGDEF_3(VOID, POINTER, INT, POINTER)
+OUL_SIGDEF_2(VOID, POINTER, POINTER)
+OUL_SIGDEF_3(VOID, POINTER, POINTER, UINT)
+OUL_SIGDEF_4(VOID, POINTER, POINTER, UINT, UINT)
+OUL_SIGDEF_3(VOID, POINTER, POINTER, POINTER)
+OUL_SIGDEF_4(VOID, POINTER, POINTER, POINTER, POINTER)
+OUL_SIGDEF_5(VOID, POINTER, POINTER, POINTER, POINTER, POINTER)
+OUL_SIGDEF_4(VOID, POINTER, POINTER, POINTER, UINT)
+OUL_SIGDEF_5(VOID, POINTER, POINTER, POINTER, POINTER, UINT)
+OUL_SIGDEF_5(VOID, POINTER, POINTER, POINTER, UINT, UINT)
+
+OUL_SIGDEF_1(INT, INT)
+OUL_SIGDEF_2(INT, INT, INT)
+OUL_SIGDEF_2(INT, POINTER, POINTER)
+OUL_SIGDEF_5(INT, POINTER, POINTER, POINTER, POINTER, POINTER)
+
+OUL_SIGDEF_1(BOOLEAN, POINTER)
+OUL_SIGDEF_2(BOOLEAN, POINTER, POINTER)
+OUL_SIGDEF_3(BOOLEAN, POINTER, POINTER, POINTER)
+OUL_SIGDEF_3(BOOLEAN, POINTER, POINTER, UINT)
+OUL_SIGDEF_4(BOOLEAN, POINTER, POINTER, POINTER, UINT)
+OUL_SIGDEF_4(BOOLEAN, POINTER, POINTER, POINTER, POINTER)
+OUL_SIGDEF_5(BOOLEAN, POINTER, POINTER, POINTER, POINTER, POINTER)
+OUL_SIGDEF_5(BOOLEAN, POINTER, POINTER, POINTER, POINTER, UINT)
+OUL_SIGDEF_2(BOOLEAN, INT, POINTER)
+
+OUL_SIGDEF_2(POINTER, POINTER, INT)
+OUL_SIGDEF_2(POINTER, POINTER, INT64)
+OUL_SIGDEF_3(POINTER, POINTER, INT, BOOLEAN)
+OUL_SIGDEF_3(POINTER, POINTER, INT64, BOOLEAN)
+OUL_SIGDEF_2(POINTER, POINTER, POINTER)
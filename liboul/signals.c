@@ -1,7 +1,11 @@
 #include "internal.h"
 
 #include "debug.h"
+#include "eventloop.h"
+#include "plugin.h"
+#include "prefs.h"
 #include "signals.h"
+#include "util.h"
 #include "value.h"
 
 
@@ -12,13 +16,48 @@ typedef struct
 	GHashTable *signals;
 	size_t signal_count;
 
-	gulong next_signal_id;
-
 } OulInstanceData;
 
 typedef struct
 {
 	gulong id;
+	OulCallback cb;
+	void *handle;
+	void *data;
+	gboolean use_vargs;
+	int priority;
+	gboolean disconnected;
+
+} OulSignalHandlerData;
+
+/* the most arguments of a marshaller in sigdef.h */
+#define OUL_SIGDEF_MAX_ARGS	5
+
+typedef struct
+{
+	OulSignalMarshalFunc marshal;
+	int num_args;
+	OulType arg_types[OUL_SIGDEF_MAX_ARGS];
+
+} OulSignalMarshaller;
+
+/*
+ * How the emitters pack the arguments of a signal.  It is not changed
+ * once the signal is registered, and lives until oul_signals_uninit(),
+ * so that the async emitters can read it from other threads.
+ */
+typedef struct
+{
+	int num_args;
+	OulType *types;
+	guint32 strings;	/* the arguments registered as strings */
+
+} OulSignalArgs;
+
+typedef struct
+{
+	gulong id;
+	char *name;
 
 	OulSignalMarshalFunc marshal;
 
@@ -26,38 +65,114 @@ typedef struct
 	OulValue **values;
 	OulValue *ret_value;
 
-	GList *handlers;
+	const OulSignalArgs *args;
+
+	/*
+	 * NULL terminated, in the order the handlers are called.  It is
+	 * replaced as a whole when a handler is connected or disconnected,
+	 * so an emission goes on with the array it started with.
+	 */
+	OulSignalHandlerData **handlers;
 	size_t handler_count;
 
 	gulong next_handler_id;
+
+	struct _OulSignalProfile *profile;
+
+	guint emitting;			/* emissions in progress */
+	GSList *retired;		/* arrays and handlers they may still use */
+	gboolean unregistered;	/* freed once the last emission is done */
 } OulSignalData;
 
+static GHashTable *instance_table = NULL;
+
+/* the registered signals by ID, which are never reused */
+static GPtrArray *signal_table = NULL;
+
+static const OulSignalMarshaller *signal_find_marshaller(OulSignalMarshalFunc marshal);
+
+/*
+ * The OulSignalArgs by signal ID, for the async emitters.  The table is
+ * replaced when it grows, and the old ones are kept until
+ * oul_signals_uninit() since another thread may still read them.
+ */
 typedef struct
 {
-	gulong id;
-	OulCallback cb;
-	void *handle;
-	void *data;
-	gboolean use_vargs;
-	int priority;
+	gulong size;
+	OulSignalArgs *args[1];
 
-} OulSignalHandlerData;
+} OulSignalArgsTable;
 
-static GHashTable *instance_table = NULL;
+static OulSignalArgsTable *signal_args_table = NULL;
+static GSList *signal_args_retired = NULL;
 
-static void
-destroy_instance_data(OulInstanceData *instance_data)
+/*
+ * Signals emitted with oul_signal_emit_async().  The emitting threads
+ * push onto the list, and the main loop takes it all at once, so
+ * neither side locks.  Only the push onto an empty list writes to the
+ * pipe, which wakes the main loop up once for a whole batch.
+ */
+typedef struct _OulSignalEvent OulSignalEvent;
+
+struct _OulSignalEvent
 {
-	g_hash_table_destroy(instance_data->signals);
+	OulSignalEvent *next;
 
-	g_free(instance_data);
-}
+	gulong signal_id;
+	const OulSignalArgs *args;
+	OulValue *values;
+};
+
+static OulSignalEvent *async_events = NULL;
+static int async_pipe[2] = { -1, -1 };
+static guint async_pipe_inpa = 0;
+
+/*
+ * The profiler, off unless /oul/signals/profile is set.  The statistics
+ * are kept by signal name and by handle, so they outlive the signals
+ * and handlers they are about, until oul_signals_profile_reset().
+ */
+#define PROFILE_BUCKETS 24	/* the last one up to 2^23 us, and above */
+
+typedef struct _OulSignalProfile
+{
+	gulong emissions;
+	guint64 usec_total;		/* in the handlers */
+	gulong usec_max;
+
+} OulSignalProfile;
+
+typedef struct
+{
+	void *handle;
+
+	gulong calls;
+	guint64 usec_total;
+	gulong usec_max;
+	gulong histogram[PROFILE_BUCKETS];	/* calls under 1, 2, 4... us */
+
+} OulHandlerProfile;
+
+static gboolean profile_enabled = FALSE;
+static gulong profile_budget = 0;	/* us, 0 for no warnings */
+static GHashTable *profile_signals = NULL;
+static GHashTable *profile_handlers = NULL;
 
 static void
-destroy_signal_data(OulSignalData *signal_data)
+free_signal_data(OulSignalData *signal_data)
 {
-	g_list_foreach(signal_data->handlers, (GFunc)g_free, NULL);
-	g_list_free(signal_data->handlers);
+	OulSignalHandlerData **handlers;
+
+	if (signal_data->handlers != NULL)
+	{
+		for (handlers = signal_data->handlers; *handlers != NULL; handlers++)
+			g_free(*handlers);
+
+		g_free(signal_data->handlers);
+	}
+
+	g_slist_foreach(signal_data->retired, (GFunc)g_free, NULL);
+	g_slist_free(signal_data->retired);
 
 	if (signal_data->values != NULL)
 	{
@@ -71,9 +186,232 @@ destroy_signal_data(OulSignalData *signal_data)
 
 	if (signal_data->ret_value != NULL)
 		oul_value_destroy(signal_data->ret_value);
+
+	g_free(signal_data->name);
 	g_free(signal_data);
 }
 
+static void
+destroy_instance_data(OulInstanceData *instance_data)
+{
+	g_hash_table_destroy(instance_data->signals);
+
+	g_free(instance_data);
+}
+
+static void
+destroy_signal_data(OulSignalData *signal_data)
+{
+	if (signal_table != NULL && signal_data->id < signal_table->len)
+		g_ptr_array_index(signal_table, signal_data->id) = NULL;
+
+	/* A handler unregistered the signal it is called for */
+	if (signal_data->emitting > 0)
+	{
+		signal_data->unregistered = TRUE;
+		return;
+	}
+
+	free_signal_data(signal_data);
+}
+
+/* frees what the emissions in progress may use, once there are none */
+static void
+signal_retire(OulSignalData *signal_data, gpointer data)
+{
+	if (signal_data->emitting > 0)
+		signal_data->retired = g_slist_prepend(signal_data->retired, data);
+	else
+		g_free(data);
+}
+
+static void
+signal_emit_begin(OulSignalData *signal_data)
+{
+	signal_data->emitting++;
+}
+
+static void
+signal_emit_end(OulSignalData *signal_data)
+{
+	if (--signal_data->emitting > 0)
+		return;
+
+	if (signal_data->unregistered)
+	{
+		free_signal_data(signal_data);
+		return;
+	}
+
+	g_slist_foreach(signal_data->retired, (GFunc)g_free, NULL);
+	g_slist_free(signal_data->retired);
+	signal_data->retired = NULL;
+}
+
+static OulSignalData *
+signal_lookup_data(void *instance, const char *signal)
+{
+	OulInstanceData *instance_data;
+
+	instance_data =
+		(OulInstanceData *)g_hash_table_lookup(instance_table, instance);
+
+	if (instance_data == NULL)
+		return NULL;
+
+	return (OulSignalData *)g_hash_table_lookup(instance_data->signals, signal);
+}
+
+static OulSignalData *
+signal_data_by_id(gulong signal_id)
+{
+	if (signal_table == NULL || signal_id == 0 || signal_id >= signal_table->len)
+		return NULL;
+
+	return g_ptr_array_index(signal_table, signal_id);
+}
+
+/* how an argument of a registered type is passed through a va_list */
+static OulType
+signal_arg_type(OulType type)
+{
+	switch (type)
+	{
+		case OUL_TYPE_CHAR:
+		case OUL_TYPE_UCHAR:
+		case OUL_TYPE_SHORT:
+		case OUL_TYPE_USHORT:
+		case OUL_TYPE_INT:
+		case OUL_TYPE_ENUM:
+			return OUL_TYPE_INT;
+
+		case OUL_TYPE_UINT:
+		case OUL_TYPE_BOOLEAN:
+		case OUL_TYPE_LONG:
+		case OUL_TYPE_ULONG:
+		case OUL_TYPE_INT64:
+		case OUL_TYPE_UINT64:
+			return type;
+
+		default:
+			return OUL_TYPE_POINTER;
+	}
+}
+
+#ifdef DEBUG
+static gboolean
+signal_arg_types_match(OulType a, OulType b)
+{
+	if (a == b)
+		return TRUE;
+
+	/* the same in a va_list and in the value */
+	return (a == OUL_TYPE_INT || a == OUL_TYPE_UINT || a == OUL_TYPE_BOOLEAN) &&
+		   (b == OUL_TYPE_INT || b == OUL_TYPE_UINT || b == OUL_TYPE_BOOLEAN);
+}
+#endif
+
+/* makes the arguments of a new signal visible to every thread */
+static void
+signal_args_publish(gulong signal_id, OulSignalArgs *args)
+{
+	OulSignalArgsTable *table = signal_args_table;
+	gulong size;
+
+	if (table != NULL && signal_id < table->size)
+	{
+		g_atomic_pointer_set((volatile gpointer *)&table->args[signal_id], args);
+		return;
+	}
+
+	for (size = (table != NULL) ? table->size : 64; size <= signal_id; size *= 2)
+		;
+
+	table = g_malloc0(sizeof(OulSignalArgsTable) + (size - 1) * sizeof(OulSignalArgs *));
+	table->size = size;
+
+	if (signal_args_table != NULL)
+	{
+		memcpy(table->args, signal_args_table->args,
+			   signal_args_table->size * sizeof(OulSignalArgs *));
+		signal_args_retired = g_slist_prepend(signal_args_retired, signal_args_table);
+	}
+
+	table->args[signal_id] = args;
+
+	g_atomic_pointer_set((volatile gpointer *)&signal_args_table, table);
+}
+
+static const OulSignalArgs *
+signal_args_lookup(gulong signal_id)
+{
+	OulSignalArgsTable *table = g_atomic_pointer_get((volatile gpointer *)&signal_args_table);
+
+	if (table == NULL || signal_id == 0 || signal_id >= table->size)
+		return NULL;
+
+	return g_atomic_pointer_get((volatile gpointer *)&table->args[signal_id]);
+}
+
+/*
+ * Sets the argument types the emitters pack.  They come from the
+ * marshaller when it is one of sigdef.h, which is what it reads whatever
+ * was registered, or else from the registered values.
+ */
+static void
+signal_set_args(OulSignalData *signal_data)
+{
+	const OulSignalMarshaller *marshaller;
+	OulSignalArgs *args;
+	int i;
+
+	marshaller = signal_find_marshaller(signal_data->marshal);
+
+	args = g_new0(OulSignalArgs, 1);
+	args->num_args = (marshaller != NULL) ?
+		marshaller->num_args : signal_data->num_values;
+
+	if (args->num_args > 0)
+		args->types = g_new(OulType, args->num_args);
+
+	for (i = 0; i < args->num_args; i++)
+	{
+		if (marshaller != NULL)
+			args->types[i] = marshaller->arg_types[i];
+		else
+			args->types[i] =
+				signal_arg_type(oul_value_get_type(signal_data->values[i]));
+
+		if (i < 32 && i < signal_data->num_values &&
+			oul_value_get_type(signal_data->values[i]) == OUL_TYPE_STRING)
+		{
+			args->strings |= 1U << i;
+		}
+	}
+
+	signal_data->args = args;
+	signal_args_publish(signal_data->id, args);
+
+#ifdef DEBUG
+	if (args->num_args != signal_data->num_values)
+	{
+		oul_debug_warning("signals", "%s is registered with %d values, "
+				"but its marshaller takes %d\n", signal_data->name,
+				signal_data->num_values, args->num_args);
+		return;
+	}
+
+	for (i = 0; i < args->num_args; i++)
+	{
+		OulType type = signal_arg_type(oul_value_get_type(signal_data->values[i]));
+
+		if (!signal_arg_types_match(type, args->types[i]))
+			oul_debug_warning("signals", "Value %d of %s does not match "
+					"its marshaller\n", i + 1, signal_data->name);
+	}
+#endif
+}
+
 gulong
 oul_signal_register(void *instance, const char *signal,
 					 OulSignalMarshalFunc marshal,
@@ -95,17 +433,17 @@ oul_signal_register(void *instance, const char *signal,
 		instance_data = g_new0(OulInstanceData, 1);
 
 		instance_data->instance = instance;
-		instance_data->next_signal_id = 1;
 
 		instance_data->signals =
-			g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
 								  (GDestroyNotify)destroy_signal_data);
 
 		g_hash_table_insert(instance_table, instance, instance_data);
 	}
 
 	signal_data = g_new0(OulSignalData, 1);
-	signal_data->id              = instance_data->next_signal_id;
+	signal_data->id              = signal_table->len;
+	signal_data->name            = g_strdup(signal);
 	signal_data->marshal         = marshal;
 	signal_data->next_handler_id = 1;
 	signal_data->ret_value       = ret_value;
@@ -125,11 +463,15 @@ oul_signal_register(void *instance, const char *signal,
 		va_end(args);
 	}
 
-	g_hash_table_insert(instance_data->signals,
-						g_strdup(signal), signal_data);
+	signal_set_args(signal_data);
 
-	instance_data->next_signal_id++;
-	instance_data->signal_count++;
+	if (g_hash_table_lookup(instance_data->signals, signal) == NULL)
+		instance_data->signal_count++;
+
+	/* The key belongs to the signal data, so it is replaced along with it */
+	g_hash_table_replace(instance_data->signals, signal_data->name, signal_data);
+
+	g_ptr_array_add(signal_table, signal_data);
 
 	return signal_data->id;
 }
@@ -174,6 +516,19 @@ oul_signals_unregister_by_instance(void *instance)
 	g_return_if_fail(found);
 }
 
+gulong
+oul_signal_lookup(void *instance, const char *signal)
+{
+	OulSignalData *signal_data;
+
+	g_return_val_if_fail(instance != NULL, 0);
+	g_return_val_if_fail(signal   != NULL, 0);
+
+	signal_data = signal_lookup_data(instance, signal);
+
+	return (signal_data != NULL) ? signal_data->id : 0;
+}
+
 void
 oul_signal_get_values(void *instance, const char *signal,
 					   OulValue **ret_value,
@@ -206,12 +561,85 @@ oul_signal_get_values(void *instance, const char *signal,
 		*ret_value = signal_data->ret_value;
 }
 
-static gint handler_priority(void * a, void * b) {
-	OulSignalHandlerData *ah = (OulSignalHandlerData*)a;
-	OulSignalHandlerData *bh = (OulSignalHandlerData*)b;
-	if (ah->priority > bh->priority) return 1;
-	if (ah->priority < bh->priority) return -1;
-	return 0;
+/*
+ * Adds a handler after the ones of the same or a lower priority, so
+ * handlers of equal priority are called in the order they connected.
+ */
+static void
+signal_handlers_insert(OulSignalData *signal_data,
+					   OulSignalHandlerData *handler_data)
+{
+	OulSignalHandlerData **handlers;
+	size_t i, j;
+
+	handlers = g_new(OulSignalHandlerData *, signal_data->handler_count + 2);
+
+	for (i = 0, j = 0; i < signal_data->handler_count; i++)
+	{
+		if (j == i && signal_data->handlers[i]->priority > handler_data->priority)
+			handlers[j++] = handler_data;
+
+		handlers[j++] = signal_data->handlers[i];
+	}
+
+	if (j == i)
+		handlers[j++] = handler_data;
+
+	handlers[j] = NULL;
+
+	if (signal_data->handlers != NULL)
+		signal_retire(signal_data, signal_data->handlers);
+
+	signal_data->handlers = handlers;
+	signal_data->handler_count++;
+}
+
+/*
+ * Removes the handlers of the handle, only the first one calling func
+ * unless func is NULL.  Returns how many were removed.
+ */
+static size_t
+signal_handlers_remove(OulSignalData *signal_data, void *handle,
+					   OulCallback func)
+{
+	OulSignalHandlerData **handlers, *handler_data;
+	size_t i, j, removed = 0;
+
+	if (signal_data->handler_count == 0)
+		return 0;
+
+	handlers = g_new(OulSignalHandlerData *, signal_data->handler_count + 1);
+
+	for (i = 0, j = 0; i < signal_data->handler_count; i++)
+	{
+		handler_data = signal_data->handlers[i];
+
+		if (handler_data->handle == handle &&
+			(func == NULL || (handler_data->cb == func && removed == 0)))
+		{
+			/* An emission in progress skips it from now on */
+			handler_data->disconnected = TRUE;
+			signal_retire(signal_data, handler_data);
+			removed++;
+		}
+		else
+			handlers[j++] = handler_data;
+	}
+
+	if (removed == 0)
+	{
+		g_free(handlers);
+		return 0;
+	}
+
+	handlers[j] = NULL;
+
+	signal_retire(signal_data, signal_data->handlers);
+
+	signal_data->handlers = handlers;
+	signal_data->handler_count = j;
+
+	return removed;
 }
 
 static gulong
@@ -259,8 +687,7 @@ signal_connect_common(void *instance, const char *signal, void *handle,
 	handler_data->use_vargs = use_vargs;
 	handler_data->priority = priority;
 
-	signal_data->handlers = g_list_insert_sorted(signal_data->handlers, handler_data, (GCompareFunc)handler_priority);
-	signal_data->handler_count++;
+	signal_handlers_insert(signal_data, handler_data);
 	signal_data->next_handler_id++;
 
 	return handler_data->id;
@@ -300,9 +727,6 @@ oul_signal_disconnect(void *instance, const char *signal,
 {
 	OulInstanceData *instance_data;
 	OulSignalData *signal_data;
-	OulSignalHandlerData *handler_data;
-	GList *l;
-	gboolean found = FALSE;
 
 	g_return_if_fail(instance != NULL);
 	g_return_if_fail(signal   != NULL);
@@ -326,143 +750,334 @@ oul_signal_disconnect(void *instance, const char *signal,
 		return;
 	}
 
-	/* Find the handler data. */
-	for (l = signal_data->handlers; l != NULL; l = l->next)
-	{
-		handler_data = (OulSignalHandlerData *)l->data;
+	/* See note somewhere about this actually helping developers.. */
+	g_return_if_fail(signal_handlers_remove(signal_data, handle, func) > 0);
+}
 
-		if (handler_data->handle == handle && handler_data->cb == func)
-		{
-			g_free(handler_data);
+void
+oul_signals_disconnect_by_handle(void *handle)
+{
+	OulSignalData *signal_data;
+	guint i;
 
-			signal_data->handlers = g_list_remove(signal_data->handlers,
-												  handler_data);
-			signal_data->handler_count--;
+	g_return_if_fail(handle != NULL);
 
-			found = TRUE;
+	for (i = 1; i < signal_table->len; i++)
+	{
+		signal_data = g_ptr_array_index(signal_table, i);
 
-			break;
-		}
+		if (signal_data != NULL)
+			signal_handlers_remove(signal_data, handle, NULL);
 	}
-
-	/* See note somewhere about this actually helping developers.. */
-	g_return_if_fail(found);
 }
 
-/*
- * TODO: Make this all more efficient by storing a list of handlers, keyed
- *       to a handle.
- */
 static void
-disconnect_handle_from_signals(const char *signal,
-							   OulSignalData *signal_data, void *handle)
+signal_profile_emit(OulSignalData *signal_data)
 {
-	GList *l, *l_next;
-	OulSignalHandlerData *handler_data;
-
-	for (l = signal_data->handlers; l != NULL; l = l_next)
+	if (signal_data->profile == NULL)
 	{
-		handler_data = (OulSignalHandlerData *)l->data;
-		l_next = l->next;
+		signal_data->profile = g_hash_table_lookup(profile_signals, signal_data->name);
 
-		if (handler_data->handle == handle)
+		if (signal_data->profile == NULL)
 		{
-			g_free(handler_data);
-
-			signal_data->handler_count--;
-			signal_data->handlers = g_list_remove(signal_data->handlers,
-												  handler_data);
+			signal_data->profile = g_new0(OulSignalProfile, 1);
+			g_hash_table_insert(profile_signals, g_strdup(signal_data->name),
+								signal_data->profile);
 		}
 	}
+
+	signal_data->profile->emissions++;
 }
 
 static void
-disconnect_handle_from_instance(void *instance,
-								OulInstanceData *instance_data,
-								void *handle)
+signal_profile_handler(OulSignalData *signal_data,
+					   OulSignalHandlerData *handler_data, const GTimeVal *start)
 {
-	g_hash_table_foreach(instance_data->signals,
-						 (GHFunc)disconnect_handle_from_signals, handle);
-}
+	OulHandlerProfile *profile;
+	GTimeVal now;
+	gulong usec;
+	int bucket;
 
-void
-oul_signals_disconnect_by_handle(void *handle)
-{
-	g_return_if_fail(handle != NULL);
+	g_get_current_time(&now);
 
-	g_hash_table_foreach(instance_table,
-						 (GHFunc)disconnect_handle_from_instance, handle);
-}
+	/* the clock may have been set back */
+	if (now.tv_sec < start->tv_sec ||
+		(now.tv_sec == start->tv_sec && now.tv_usec < start->tv_usec))
+		usec = 0;
+	else
+		usec = (now.tv_sec - start->tv_sec) * G_USEC_PER_SEC +
+			   (now.tv_usec - start->tv_usec);
 
-void
-oul_signal_emit(void *instance, const char *signal, ...)
-{
-	va_list args;
+	profile = g_hash_table_lookup(profile_handlers, handler_data->handle);
 
-	g_return_if_fail(instance != NULL);
-	g_return_if_fail(signal   != NULL);
+	if (profile == NULL)
+	{
+		profile = g_new0(OulHandlerProfile, 1);
+		profile->handle = handler_data->handle;
+		g_hash_table_insert(profile_handlers, handler_data->handle, profile);
+	}
 
-	va_start(args, signal);
-	oul_signal_emit_vargs(instance, signal, args);
-	va_end(args);
+	for (bucket = 0; bucket < PROFILE_BUCKETS - 1 && (usec >> bucket) != 0; bucket++)
+		;
+
+	profile->calls++;
+	profile->usec_total += usec;
+	profile->usec_max = MAX(profile->usec_max, usec);
+	profile->histogram[bucket]++;
+
+	/* emitted before profiling was switched on */
+	if (signal_data->profile != NULL)
+	{
+		signal_data->profile->usec_total += usec;
+		signal_data->profile->usec_max = MAX(signal_data->profile->usec_max, usec);
+	}
+
+	if (profile_budget != 0 && usec > profile_budget)
+		oul_debug_warning("signals", "A handler of %s took %lu ms, more than "
+				"the %lu ms budget\n", signal_data->name, usec / 1000,
+				profile_budget / 1000);
 }
 
-void
-oul_signal_emit_vargs(void *instance, const char *signal, va_list args)
+/* reads the arguments of the given types out of vargs */
+static void
+signal_pack_types(int num_args, const OulType *types, OulValue *args,
+				  va_list vargs)
 {
-	OulInstanceData *instance_data;
-	OulSignalData *signal_data;
-	OulSignalHandlerData *handler_data;
-	GList *l, *l_next;
-	va_list tmp;
+	int i;
 
-	g_return_if_fail(instance != NULL);
-	g_return_if_fail(signal   != NULL);
+	for (i = 0; i < num_args; i++)
+	{
+		args[i].type = types[i];
 
-	instance_data =
-		(OulInstanceData *)g_hash_table_lookup(instance_table, instance);
+		switch (args[i].type)
+		{
+			case OUL_TYPE_INT:
+				args[i].data.int_data = va_arg(vargs, gint);
+				break;
 
-	g_return_if_fail(instance_data != NULL);
+			case OUL_TYPE_UINT:
+				args[i].data.uint_data = va_arg(vargs, guint);
+				break;
 
-	signal_data =
-		(OulSignalData *)g_hash_table_lookup(instance_data->signals, signal);
+			case OUL_TYPE_BOOLEAN:
+				args[i].data.boolean_data = va_arg(vargs, gboolean);
+				break;
 
-	if (signal_data == NULL)
+			case OUL_TYPE_LONG:
+				args[i].data.long_data = va_arg(vargs, glong);
+				break;
+
+			case OUL_TYPE_ULONG:
+				args[i].data.ulong_data = va_arg(vargs, gulong);
+				break;
+
+			case OUL_TYPE_INT64:
+				args[i].data.int64_data = va_arg(vargs, gint64);
+				break;
+
+			case OUL_TYPE_UINT64:
+				args[i].data.uint64_data = va_arg(vargs, guint64);
+				break;
+
+			default:
+				args[i].data.pointer_data = va_arg(vargs, void *);
+				break;
+		}
+	}
+}
+
+/* packs the arguments once, for all the handlers */
+static void
+signal_pack_args(const OulSignalArgs *signal_args, OulValue *args, va_list vargs)
+{
+	signal_pack_types(signal_args->num_args, signal_args->types, args, vargs);
+}
+
+static gboolean
+signal_check_args(OulSignalData *signal_data, const OulValue *args,
+				  int num_args)
+{
+	if (num_args != signal_data->args->num_args)
 	{
-		oul_debug(OUL_DEBUG_ERROR, "signals",
-				   "Signal data for %s not found!\n", signal);
-		return;
+		oul_debug_error("signals", "%s takes %d arguments, not %d\n",
+				signal_data->name, signal_data->args->num_args, num_args);
+		return FALSE;
+	}
+
+#ifdef DEBUG
+	{
+		int i;
+
+		for (i = 0; i < num_args; i++)
+		{
+			if (!signal_arg_types_match(signal_arg_type(args[i].type),
+										signal_data->args->types[i]))
+			{
+				oul_debug_error("signals", "Argument %d of %s has the wrong "
+						"type\n", i + 1, signal_data->name);
+				return FALSE;
+			}
+		}
 	}
+#endif
+
+	return TRUE;
+}
 
-	for (l = signal_data->handlers; l != NULL; l = l_next)
+/*
+ * Calls the handlers until one returns non-NULL if return_1 is set.
+ * vargs is the va_list for the handlers which want one, or NULL.
+ */
+static void *
+signal_call_handlers(OulSignalData *signal_data, const OulValue *args,
+					 va_list *vargs, gboolean return_1)
+{
+	OulSignalHandlerData **handlers, *handler_data;
+	void *ret_val = NULL;
+	gboolean profiling;
+	GTimeVal start;
+	va_list tmp;
+
+	if (G_UNLIKELY(profile_enabled))
+		signal_profile_emit(signal_data);
+
+	for (handlers = signal_data->handlers;
+		 handlers != NULL && *handlers != NULL; handlers++)
 	{
-		l_next = l->next;
+		handler_data = *handlers;
 
-		handler_data = (OulSignalHandlerData *)l->data;
+		/* Disconnected by a handler called before it */
+		if (handler_data->disconnected)
+			continue;
 
-		/* This is necessary because a va_list may only be
-		 * evaluated once */
-		G_VA_COPY(tmp, args);
+		/* the same for both ends, should a handler switch it */
+		if (G_UNLIKELY(profiling = profile_enabled))
+			g_get_current_time(&start);
 
-		if (handler_data->use_vargs)
+		if (!handler_data->use_vargs)
 		{
-			((void (*)(va_list, void *))handler_data->cb)(tmp,
-														  handler_data->data);
+			signal_data->marshal(handler_data->cb, args, handler_data->data,
+								 return_1 ? &ret_val : NULL);
+		}
+		else if (vargs != NULL)
+		{
+			/* This is necessary because a va_list may only be
+			 * evaluated once */
+			G_VA_COPY(tmp, *vargs);
+
+			if (return_1)
+				ret_val = ((void *(*)(va_list, void *))handler_data->cb)(
+					tmp, handler_data->data);
+			else
+				((void (*)(va_list, void *))handler_data->cb)(tmp,
+															  handler_data->data);
+
+			va_end(tmp);
 		}
 		else
 		{
-			signal_data->marshal(handler_data->cb, tmp,
-								 handler_data->data, NULL);
+			oul_debug_warning("signals", "Handler %lu of %s takes a va_list, "
+					"skipped\n", handler_data->id, signal_data->name);
 		}
 
-		va_end(tmp);
+		if (G_UNLIKELY(profiling))
+			signal_profile_handler(signal_data, handler_data, &start);
+
+		if (ret_val != NULL)
+			break;
 	}
 
+	return ret_val;
+}
+
+static void
+signal_emit(OulSignalData *signal_data, va_list args)
+{
+	OulValue *values;
+	va_list vargs;
+
+	values = g_newa(OulValue, signal_data->args->num_args + 1);
+
+	G_VA_COPY(vargs, args);
+	signal_pack_args(signal_data->args, values, vargs);
+	va_end(vargs);
+
+	signal_emit_begin(signal_data);
+
+	G_VA_COPY(vargs, args);
+	signal_call_handlers(signal_data, values, &vargs, FALSE);
+	va_end(vargs);
+
 #ifdef HAVE_DBUS
-	oul_dbus_signal_emit_Oul(signal, signal_data->num_values, 
+	oul_dbus_signal_emit_Oul(signal_data->name, signal_data->num_values, 
 				   signal_data->values, args);
 #endif	/* HAVE_DBUS */
 
+	signal_emit_end(signal_data);
+}
+
+static void *
+signal_emit_return_1(OulSignalData *signal_data, va_list args)
+{
+	OulValue *values;
+	void *ret_val;
+	va_list vargs;
+
+#ifdef HAVE_DBUS
+	G_VA_COPY(vargs, args);
+	oul_dbus_signal_emit_Oul(signal_data->name, signal_data->num_values, 
+				   signal_data->values, vargs);
+	va_end(vargs);
+#endif	/* HAVE_DBUS */
+
+	values = g_newa(OulValue, signal_data->args->num_args + 1);
+
+	G_VA_COPY(vargs, args);
+	signal_pack_args(signal_data->args, values, vargs);
+	va_end(vargs);
+
+	signal_emit_begin(signal_data);
+
+	G_VA_COPY(vargs, args);
+	ret_val = signal_call_handlers(signal_data, values, &vargs, TRUE);
+	va_end(vargs);
+
+	signal_emit_end(signal_data);
+
+	return ret_val;
+}
+
+void
+oul_signal_emit(void *instance, const char *signal, ...)
+{
+	va_list args;
+
+	g_return_if_fail(instance != NULL);
+	g_return_if_fail(signal   != NULL);
+
+	va_start(args, signal);
+	oul_signal_emit_vargs(instance, signal, args);
+	va_end(args);
+}
+
+void
+oul_signal_emit_vargs(void *instance, const char *signal, va_list args)
+{
+	OulSignalData *signal_data;
+
+	g_return_if_fail(instance != NULL);
+	g_return_if_fail(signal   != NULL);
+
+	g_return_if_fail(g_hash_table_lookup(instance_table, instance) != NULL);
+
+	if ((signal_data = signal_lookup_data(instance, signal)) == NULL)
+	{
+		oul_debug(OUL_DEBUG_ERROR, "signals",
+				   "Signal data for %s not found!\n", signal);
+		return;
+	}
+
+	signal_emit(signal_data, args);
 }
 
 void *
@@ -485,553 +1100,606 @@ void *
 oul_signal_emit_vargs_return_1(void *instance, const char *signal,
 								va_list args)
 {
-	OulInstanceData *instance_data;
 	OulSignalData *signal_data;
-	OulSignalHandlerData *handler_data;
-	GList *l, *l_next;
-	va_list tmp;
 
 	g_return_val_if_fail(instance != NULL, NULL);
 	g_return_val_if_fail(signal   != NULL, NULL);
 
-	instance_data =
-		(OulInstanceData *)g_hash_table_lookup(instance_table, instance);
-
-	g_return_val_if_fail(instance_data != NULL, NULL);
+	g_return_val_if_fail(g_hash_table_lookup(instance_table, instance) != NULL, NULL);
 
-	signal_data =
-		(OulSignalData *)g_hash_table_lookup(instance_data->signals, signal);
-
-	if (signal_data == NULL)
+	if ((signal_data = signal_lookup_data(instance, signal)) == NULL)
 	{
 		oul_debug(OUL_DEBUG_ERROR, "signals",
 				   "Signal data for %s not found!\n", signal);
 		return 0;
 	}
 
-#ifdef HAVE_DBUS
-	G_VA_COPY(tmp, args);
-	oul_dbus_signal_emit_Oul(signal, signal_data->num_values, 
-				   signal_data->values, tmp);
-	va_end(tmp);
-#endif	/* HAVE_DBUS */
-
-	for (l = signal_data->handlers; l != NULL; l = l_next)
-	{
-		void *ret_val = NULL;
-
-		l_next = l->next;
-
-		handler_data = (OulSignalHandlerData *)l->data;
-
-		G_VA_COPY(tmp, args);
-		if (handler_data->use_vargs)
-		{
-			ret_val = ((void *(*)(va_list, void *))handler_data->cb)(
-				tmp, handler_data->data);
-		}
-		else
-		{
-			signal_data->marshal(handler_data->cb, tmp,
-								 handler_data->data, &ret_val);
-		}
-		va_end(tmp);
-
-		if (ret_val != NULL)
-			return ret_val;
-	}
-
-	return NULL;
+	return signal_emit_return_1(signal_data, args);
 }
 
 void
-oul_signals_init()
+oul_signal_emit_by_id(gulong signal_id, ...)
 {
-	g_return_if_fail(instance_table == NULL);
+	va_list args;
 
-	instance_table =
-		g_hash_table_new_full(g_direct_hash, g_direct_equal,
-							  NULL, (GDestroyNotify)destroy_instance_data);
+	va_start(args, signal_id);
+	oul_signal_emit_by_id_vargs(signal_id, args);
+	va_end(args);
 }
 
 void
-oul_signals_uninit()
+oul_signal_emit_by_id_vargs(gulong signal_id, va_list args)
 {
-	g_return_if_fail(instance_table != NULL);
+	OulSignalData *signal_data = signal_data_by_id(signal_id);
 
-	g_hash_table_destroy(instance_table);
-	instance_table = NULL;
-}
+	g_return_if_fail(signal_data != NULL);
 
-/**************************************************************************
- * Marshallers
- **************************************************************************/
-void
-oul_marshal_VOID(OulCallback cb, va_list args, void *data,
-				  void **return_val)
-{
-	((void (*)(void *))cb)(data);
+	signal_emit(signal_data, args);
 }
 
-void
-oul_marshal_VOID__INT(OulCallback cb, va_list args, void *data,
-					   void **return_val)
+void *
+oul_signal_emit_by_id_return_1(gulong signal_id, ...)
 {
-	gint arg1 = va_arg(args, gint);
+	void *ret_val;
+	va_list args;
+
+	va_start(args, signal_id);
+	ret_val = oul_signal_emit_by_id_vargs_return_1(signal_id, args);
+	va_end(args);
 
-	((void (*)(gint, void *))cb)(arg1, data);
+	return ret_val;
 }
 
-void
-oul_marshal_VOID__INT_INT(OulCallback cb, va_list args, void *data,
-						   void **return_val)
+void *
+oul_signal_emit_by_id_vargs_return_1(gulong signal_id, va_list args)
 {
-	gint arg1 = va_arg(args, gint);
-	gint arg2 = va_arg(args, gint);
+	OulSignalData *signal_data = signal_data_by_id(signal_id);
 
-	((void (*)(gint, gint, void *))cb)(arg1, arg2, data);
+	g_return_val_if_fail(signal_data != NULL, NULL);
+
+	return signal_emit_return_1(signal_data, args);
 }
 
 void
-oul_marshal_VOID__POINTER(OulCallback cb, va_list args, void *data,
-						   void **return_val)
+oul_signal_emit_values(gulong signal_id, const OulValue *values, int num_values)
 {
-	void *arg1 = va_arg(args, void *);
+	OulSignalData *signal_data = signal_data_by_id(signal_id);
 
-	((void (*)(void *, void *))cb)(arg1, data);
-}
+	g_return_if_fail(signal_data != NULL);
 
-void
-oul_marshal_VOID__POINTER_UINT(OulCallback cb, va_list args,
-										void *data, void **return_val)
-{
-	void *arg1 = va_arg(args, void *);
-	guint arg2 = va_arg(args, guint);
+	if (!signal_check_args(signal_data, values, num_values))
+		return;
 
-	((void (*)(void *, guint, void *))cb)(arg1, arg2, data);
+	signal_emit_begin(signal_data);
+	signal_call_handlers(signal_data, values, NULL, FALSE);
+	signal_emit_end(signal_data);
 }
 
-void oul_marshal_VOID__POINTER_INT_INT(OulCallback cb, va_list args,
-                                        void *data, void **return_val)
+void *
+oul_signal_emit_values_return_1(gulong signal_id, const OulValue *values,
+								 int num_values)
 {
-	void *arg1 = va_arg(args, void *);
-	gint arg2 = va_arg(args, gint);
-	gint arg3 = va_arg(args, gint);
+	OulSignalData *signal_data = signal_data_by_id(signal_id);
+	void *ret_val;
 
-	((void (*)(void *, gint, gint, void *))cb)(arg1, arg2, arg3, data);
-}
+	g_return_val_if_fail(signal_data != NULL, NULL);
 
-void oul_marshal_VOID__POINTER_INT_POINTER(OulCallback cb, va_list args,
-                                              void *data, void **return_val)
-{
-	void *arg1 = va_arg(args, void *);
-	gint arg2 = va_arg(args, gint);
-	void *arg3 = va_arg(args, void *);
+	if (!signal_check_args(signal_data, values, num_values))
+		return NULL;
+
+	signal_emit_begin(signal_data);
+	ret_val = signal_call_handlers(signal_data, values, NULL, TRUE);
+	signal_emit_end(signal_data);
 
-	((void (*)(void *, gint, void *, void *))cb)(arg1, arg2, arg3, data);
+	return ret_val;
 }
 
-void
-oul_marshal_VOID__POINTER_POINTER(OulCallback cb, va_list args,
-								   void *data, void **return_val)
+static void
+signal_event_free(OulSignalEvent *event)
 {
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
+	int i;
 
-	((void (*)(void *, void *, void *))cb)(arg1, arg2, data);
+	for (i = 0; i < event->args->num_args && i < 32; i++)
+	{
+		if (event->args->strings & (1U << i))
+			g_free(event->values[i].data.string_data);
+	}
+
+	g_free(event);
 }
 
-void
-oul_marshal_VOID__POINTER_POINTER_UINT(OulCallback cb, va_list args,
-										void *data, void **return_val)
+OulValue *
+oul_signal_marshaller_pack(OulSignalMarshalFunc marshal, int num_values,
+						   OulValue **values, int *num_args, va_list args)
 {
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
-	guint arg3 = va_arg(args, guint);
+	const OulSignalMarshaller *marshaller;
+	OulValue *packed;
+	OulType *types;
+	int i, n;
 
-	((void (*)(void *, void *, guint, void *))cb)(arg1, arg2, arg3, data);
-}
+	g_return_val_if_fail(marshal != NULL, NULL);
 
-void
-oul_marshal_VOID__POINTER_POINTER_UINT_UINT(OulCallback cb, va_list args,
-										     void *data, void **return_val)
-{
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
-	guint arg3 = va_arg(args, guint);
-	guint arg4 = va_arg(args, guint);
+	/* the same types as the emitters of a signal registered with them */
+	marshaller = signal_find_marshaller(marshal);
+	n = (marshaller != NULL) ? marshaller->num_args : num_values;
 
-	((void (*)(void *, void *, guint, guint, void *))cb)(arg1, arg2, arg3, arg4, data);
-}
+	types = g_newa(OulType, n + 1);
+	for (i = 0; i < n; i++)
+	{
+		if (marshaller != NULL)
+			types[i] = marshaller->arg_types[i];
+		else
+			types[i] = signal_arg_type(oul_value_get_type(values[i]));
+	}
 
-void
-oul_marshal_VOID__POINTER_POINTER_POINTER(OulCallback cb, va_list args,
-										   void *data, void **return_val)
-{
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
-	void *arg3 = va_arg(args, void *);
+	packed = g_new(OulValue, n + 1);
+	signal_pack_types(n, types, packed, args);
 
-	((void (*)(void *, void *, void *, void *))cb)(arg1, arg2, arg3, data);
+	if (num_args != NULL)
+		*num_args = n;
+
+	return packed;
 }
 
 void
-oul_marshal_VOID__POINTER_POINTER_POINTER_POINTER(OulCallback cb,
-												   va_list args,
-												   void *data,
-												   void **return_val)
+oul_signal_emit_async(gulong signal_id, ...)
 {
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
-	void *arg3 = va_arg(args, void *);
-	void *arg4 = va_arg(args, void *);
+	const OulSignalArgs *signal_args;
+	OulSignalEvent *event, *head;
+	va_list args;
+	int i;
 
-	((void (*)(void *, void *, void *, void *, void *))cb)(arg1, arg2, arg3, arg4, data);
-}
+	signal_args = signal_args_lookup(signal_id);
 
-void
-oul_marshal_VOID__POINTER_POINTER_POINTER_POINTER_POINTER(OulCallback cb,
-														   va_list args,
-														   void *data,
-														   void **return_val)
-{
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
-	void *arg3 = va_arg(args, void *);
-	void *arg4 = va_arg(args, void *);
-	void *arg5 = va_arg(args, void *);
-
-	((void (*)(void *, void *, void *, void *, void *, void *))cb)(arg1, arg2, arg3, arg4, arg5, data);
-}
+	g_return_if_fail(signal_args != NULL);
+	g_return_if_fail(async_pipe[1] >= 0);
 
-void
-oul_marshal_VOID__POINTER_POINTER_POINTER_UINT(OulCallback cb,
-												   va_list args,
-												   void *data,
-												   void **return_val)
-{
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
-	void *arg3 = va_arg(args, void *);
-	guint arg4 = va_arg(args, guint);
+	event = g_malloc(sizeof(OulSignalEvent) +
+					 signal_args->num_args * sizeof(OulValue));
+	event->signal_id = signal_id;
+	event->args      = signal_args;
+	event->values    = (OulValue *)(event + 1);
 
-	((void (*)(void *, void *, void *, guint, void *))cb)(arg1, arg2, arg3, arg4, data);
-}
+	va_start(args, signal_id);
+	signal_pack_args(signal_args, event->values, args);
+	va_end(args);
 
-void
-oul_marshal_VOID__POINTER_POINTER_POINTER_POINTER_UINT(OulCallback cb,
-													    va_list args,
-													    void *data,
-													    void **return_val)
-{
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
-	void *arg3 = va_arg(args, void *);
-	void *arg4 = va_arg(args, void *);
-	guint arg5 = va_arg(args, guint);
-
-	((void (*)(void *, void *, void *, void *, guint, void *))cb)(arg1, arg2, arg3, arg4, arg5, data);
-}
+	/* the caller may free its strings as soon as this returns */
+	for (i = 0; i < signal_args->num_args && i < 32; i++)
+	{
+		if (signal_args->strings & (1U << i))
+			event->values[i].data.string_data =
+				g_strdup(event->values[i].data.string_data);
+	}
 
-void
-oul_marshal_VOID__POINTER_POINTER_POINTER_UINT_UINT(OulCallback cb,
-													 va_list args,
-													 void *data,
-													 void **return_val)
-{
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
-	void *arg3 = va_arg(args, void *);
-	guint arg4 = va_arg(args, guint);
-	guint arg5 = va_arg(args, guint);
-
-	((void (*)(void *, void *, void *, guint, guint, void *))cb)(
-			arg1, arg2, arg3, arg4, arg5, data);
+	do
+	{
+		head = g_atomic_pointer_get((volatile gpointer *)&async_events);
+		event->next = head;
+	}
+	while (!g_atomic_pointer_compare_and_exchange((volatile gpointer *)&async_events,
+												  head, event));
+
+	if (head == NULL && write(async_pipe[1], "", 1) < 0 && errno != EAGAIN)
+		oul_debug_error("signals", "Unable to wake up the main loop: %s\n",
+				g_strerror(errno));
 }
 
-void
-oul_marshal_INT__INT(OulCallback cb, va_list args, void *data,
-					  void **return_val)
+/* takes the signals emitted so far, in the order they were */
+static OulSignalEvent *
+signal_events_take(void)
 {
-	gint ret_val;
-	gint arg1 = va_arg(args, gint);
+	OulSignalEvent *events, *event, *next;
 
-	ret_val = ((gint (*)(gint, void *))cb)(arg1, data);
+	do
+	{
+		events = g_atomic_pointer_get((volatile gpointer *)&async_events);
+	}
+	while (events != NULL &&
+		   !g_atomic_pointer_compare_and_exchange((volatile gpointer *)&async_events,
+												  events, NULL));
 
-	if (return_val != NULL)
-		*return_val = GINT_TO_POINTER(ret_val);
+	for (event = NULL; events != NULL; events = next)
+	{
+		next = events->next;
+		events->next = event;
+		event = events;
+	}
+
+	return event;
 }
 
-void
-oul_marshal_INT__INT_INT(OulCallback cb, va_list args, void *data,
-						  void **return_val)
+static void
+signal_events_cb(gpointer data, gint source, OulInputCondition cond)
 {
-	gint ret_val;
-	gint arg1 = va_arg(args, gint);
-	gint arg2 = va_arg(args, gint);
+	OulSignalEvent *event, *next;
+	OulSignalData *signal_data;
+	char buf[64];
 
-	ret_val = ((gint (*)(gint, gint, void *))cb)(arg1, arg2, data);
+	while (read(source, buf, sizeof(buf)) > 0)
+		;
 
-	if (return_val != NULL)
-		*return_val = GINT_TO_POINTER(ret_val);
+	for (event = signal_events_take(); event != NULL; event = next)
+	{
+		next = event->next;
+
+		/* unregistered since */
+		if ((signal_data = signal_data_by_id(event->signal_id)) != NULL)
+		{
+			signal_emit_begin(signal_data);
+			signal_call_handlers(signal_data, event->values, NULL, FALSE);
+			signal_emit_end(signal_data);
+		}
+
+		signal_event_free(event);
+	}
 }
 
-void
-oul_marshal_INT__POINTER_POINTER(OulCallback cb, va_list args, void *data,
-                                      void **return_val)
+static void *
+signal_profile_get_handle(void)
 {
-	gint ret_val;
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
+	static int handle;
 
-	ret_val = ((gint (*)(void *, void *, void *))cb)(arg1, arg2, data);
+	return &handle;
+}
 
-	if (return_val != NULL)
-		*return_val = GINT_TO_POINTER(ret_val);
+static void
+signal_profile_pref_cb(const char *name, OulPrefType type,
+					   gconstpointer val, gpointer data)
+{
+	if (g_str_equal(name, "/oul/signals/profile"))
+		profile_enabled = GPOINTER_TO_INT(val);
+	else
+		profile_budget = MAX(GPOINTER_TO_INT(val), 0) * 1000;
 }
 
 void
-oul_marshal_INT__POINTER_POINTER_POINTER_POINTER_POINTER(
-		OulCallback cb, va_list args, void *data, void **return_val)
+oul_signals_profile_init(void)
 {
-	gint ret_val;
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
-	void *arg3 = va_arg(args, void *);
-	void *arg4 = va_arg(args, void *);
-	void *arg5 = va_arg(args, void *);
+	void *handle = signal_profile_get_handle();
 
-	ret_val =
-		((gint (*)(void *, void *, void *, void *, void *, void *))cb)(
-			arg1, arg2, arg3, arg4, arg5, data);
+	oul_prefs_add_none("/oul/signals");
+	oul_prefs_add_bool("/oul/signals/profile", FALSE);
+	oul_prefs_add_int("/oul/signals/handler_budget", 100);
 
-	if (return_val != NULL)
-		*return_val = GINT_TO_POINTER(ret_val);
+	oul_prefs_connect_callback(handle, "/oul/signals/profile", signal_profile_pref_cb, NULL);
+	oul_prefs_connect_callback(handle, "/oul/signals/handler_budget", signal_profile_pref_cb, NULL);
+
+	oul_prefs_trigger_callback("/oul/signals/profile");
+	oul_prefs_trigger_callback("/oul/signals/handler_budget");
 }
 
-void
-oul_marshal_BOOLEAN__POINTER(OulCallback cb, va_list args, void *data,
-							  void **return_val)
+static void
+signal_profile_reset_signal(gpointer key, gpointer value, gpointer data)
 {
-	gboolean ret_val;
-	void *arg1 = va_arg(args, void *);
-
-	ret_val = ((gboolean (*)(void *, void *))cb)(arg1, data);
-
-	if (return_val != NULL)
-		*return_val = GINT_TO_POINTER(ret_val);
+	memset(value, 0, sizeof(OulSignalProfile));
 }
 
 void
-oul_marshal_BOOLEAN__POINTER_POINTER(OulCallback cb, va_list args,
-									  void *data, void **return_val)
+oul_signals_profile_reset(void)
 {
-	gboolean ret_val;
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
-
-	ret_val = ((gboolean (*)(void *, void *, void *))cb)(arg1, arg2, data);
-
-	if (return_val != NULL)
-		*return_val = GINT_TO_POINTER(ret_val);
+	/* the signals point to their entries, which are kept */
+	g_hash_table_foreach(profile_signals, signal_profile_reset_signal, NULL);
+	g_hash_table_remove_all(profile_handlers);
 }
 
-void
-oul_marshal_BOOLEAN__POINTER_POINTER_POINTER(OulCallback cb, va_list args,
-											  void *data, void **return_val)
+static gint
+signal_profile_compare_handlers(gconstpointer a, gconstpointer b)
 {
-	gboolean ret_val;
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
-	void *arg3 = va_arg(args, void *);
+	const OulHandlerProfile *pa = a, *pb = b;
 
-	ret_val = ((gboolean (*)(void *, void *, void *, void *))cb)(arg1, arg2,
-																 arg3, data);
+	if (pa->usec_total != pb->usec_total)
+		return (pa->usec_total < pb->usec_total) ? 1 : -1;
 
-	if (return_val != NULL)
-		*return_val = GINT_TO_POINTER(ret_val);
+	return 0;
 }
 
-void
-oul_marshal_BOOLEAN__POINTER_POINTER_UINT(OulCallback cb,
-												   va_list args,
-												   void *data,
-												   void **return_val)
+static void
+signal_profile_append_signal(gpointer key, gpointer value, gpointer data)
 {
-	gboolean ret_val;
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
-	guint arg3 = va_arg(args, guint);
+	OulSignalProfile *profile = value;
 
-	ret_val = ((gboolean (*)(void *, void *, guint, void *))cb)(
-			arg1, arg2, arg3, data);
+	if (profile->emissions == 0)
+		return;
 
-	if (return_val != NULL)
-		*return_val = GINT_TO_POINTER(ret_val);
+	g_string_append_printf(data, "\t%s: %lu emissions, %" G_GUINT64_FORMAT
+			" us in the handlers, %lu us at most\n", (const char *)key,
+			profile->emissions, profile->usec_total, profile->usec_max);
 }
 
-void
-oul_marshal_BOOLEAN__POINTER_POINTER_POINTER_UINT(OulCallback cb,
-												   va_list args,
-												   void *data,
-												   void **return_val)
+static void
+signal_profile_append_handler(GString *report, OulHandlerProfile *profile)
 {
-	gboolean ret_val;
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
-	void *arg3 = va_arg(args, void *);
-	guint arg4 = va_arg(args, guint);
+	const char *name = NULL;
+	GList *l;
+	int i;
 
-	ret_val = ((gboolean (*)(void *, void *, void *, guint, void *))cb)(
-			arg1, arg2, arg3, arg4, data);
+	for (l = oul_plugins_get_loaded(); l != NULL; l = l->next)
+	{
+		if (l->data == profile->handle)
+			name = oul_plugin_get_id(l->data);
+	}
 
-	if (return_val != NULL)
-		*return_val = GINT_TO_POINTER(ret_val);
-}
+	if (name != NULL)
+		g_string_append_printf(report, "\t%s", name);
+	else
+		g_string_append_printf(report, "\t%p", profile->handle);
 
-void
-oul_marshal_BOOLEAN__POINTER_POINTER_POINTER_POINTER(OulCallback cb,
-													  va_list args,
-													  void *data,
-													  void **return_val)
-{
-	gboolean ret_val;
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
-	void *arg3 = va_arg(args, void *);
-	void *arg4 = va_arg(args, void *);
+	g_string_append_printf(report, ": %lu calls, %" G_GUINT64_FORMAT
+			" us, %lu us at most\n", profile->calls, profile->usec_total,
+			profile->usec_max);
 
-	ret_val = ((gboolean (*)(void *, void *, void *, void *, void *))cb)(
-			arg1, arg2, arg3, arg4, data);
+	for (i = 0; i < PROFILE_BUCKETS; i++)
+	{
+		if (profile->histogram[i] == 0)
+			continue;
 
-	if (return_val != NULL)
-		*return_val = GINT_TO_POINTER(ret_val);
+		if (i < PROFILE_BUCKETS - 1)
+			g_string_append_printf(report, "\t\tunder %lu us: %lu\n",
+					1UL << i, profile->histogram[i]);
+		else
+			g_string_append_printf(report, "\t\tabove: %lu\n",
+					profile->histogram[i]);
+	}
 }
 
 void
-oul_marshal_BOOLEAN__POINTER_POINTER_POINTER_POINTER_POINTER(
-		OulCallback cb, va_list args, void *data, void **return_val)
+oul_signals_profile_dump(const char *filename)
 {
-	gboolean ret_val;
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
-	void *arg3 = va_arg(args, void *);
-	void *arg4 = va_arg(args, void *);
-	void *arg5 = va_arg(args, void *);
+	GString *report;
+	GList *handlers, *l;
 
-	ret_val =
-		((gboolean (*)(void *, void *, void *, void *, void *, void *))cb)(
-			arg1, arg2, arg3, arg4, arg5, data);
+	g_return_if_fail(profile_signals != NULL);
 
-	if (return_val != NULL)
-		*return_val = GINT_TO_POINTER(ret_val);
-}
+	report = g_string_new("Signal emissions:\n");
+	g_hash_table_foreach(profile_signals, signal_profile_append_signal, report);
 
-void
-oul_marshal_BOOLEAN__POINTER_POINTER_POINTER_POINTER_UINT(
-		OulCallback cb, va_list args, void *data, void **return_val)
-{
-	gboolean ret_val;
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
-	void *arg3 = va_arg(args, void *);
-	void *arg4 = va_arg(args, void *);
-	guint arg5 = va_arg(args, guint);
+	g_string_append(report, "Signal handlers, by the time they took:\n");
 
-	ret_val =
-		((gboolean (*)(void *, void *, void *, void *, guint, void *))cb)(
-			arg1, arg2, arg3, arg4, arg5, data);
+	handlers = g_list_sort(g_hash_table_get_values(profile_handlers),
+						   signal_profile_compare_handlers);
 
-	if (return_val != NULL)
-		*return_val = GINT_TO_POINTER(ret_val);
-}
+	for (l = handlers; l != NULL; l = l->next)
+		signal_profile_append_handler(report, l->data);
 
-void
-oul_marshal_BOOLEAN__INT_POINTER(OulCallback cb, va_list args, void *data,
-                                  void **return_val)
-{
-	gboolean ret_val;
-	gint arg1 = va_arg(args, gint);
-	void *arg2 = va_arg(args, void *);
+	g_list_free(handlers);
 
-	ret_val = ((gboolean (*)(gint, void *, void *))cb)(arg1, arg2, data);
+	if (filename == NULL)
+		oul_debug_info("signals", "%s", report->str);
+	else if (!oul_util_write_data_to_file(filename, report->str, report->len))
+		oul_debug_error("signals", "Unable to write the profile to %s\n", filename);
 
-	if (return_val != NULL)
-		*return_val = GINT_TO_POINTER(ret_val);
+	g_string_free(report, TRUE);
 }
 
 void
-oul_marshal_POINTER__POINTER_INT(
-                                    OulCallback cb, va_list args, void *data,
-                                    void **return_val)
+oul_signals_init()
 {
-	gpointer ret_val;
-	void *arg1 = va_arg(args, void *);
-	gint arg2 = va_arg(args, gint);
+	g_return_if_fail(instance_table == NULL);
 
-	ret_val = ((gpointer(*)(void *, gint, void *))cb)(arg1, arg2, data);
+	instance_table =
+		g_hash_table_new_full(g_direct_hash, g_direct_equal,
+							  NULL, (GDestroyNotify)destroy_instance_data);
 
-	if (return_val != NULL)
-		*return_val = ret_val;
-}
+	/* 0 is no signal */
+	signal_table = g_ptr_array_new();
+	g_ptr_array_add(signal_table, NULL);
 
-void
-oul_marshal_POINTER__POINTER_INT64(
-                                    OulCallback cb, va_list args, void *data,
-                                    void **return_val)
-{
-	gpointer ret_val;
-	void *arg1 = va_arg(args, void *);
-	gint64 arg2 = va_arg(args, gint64);
+	profile_signals = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	profile_handlers = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
 
-	ret_val = ((gpointer(*)(void *, gint64, void *))cb)(arg1, arg2, data);
+	/* without an event loop, nothing would deliver the async emissions */
+	if (oul_eventloop_get_ui_ops() == NULL)
+		return;
 
-	if (return_val != NULL)
-		*return_val = ret_val;
+	if (pipe(async_pipe) < 0)
+	{
+		oul_debug_error("signals", "Unable to create a pipe: %s\n", g_strerror(errno));
+		async_pipe[0] = async_pipe[1] = -1;
+		return;
+	}
+
+	fcntl(async_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(async_pipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(async_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(async_pipe[1], F_SETFD, FD_CLOEXEC);
+
+	async_pipe_inpa = oul_input_add(async_pipe[0], OUL_INPUT_READ, signal_events_cb, NULL);
 }
 
 void
-oul_marshal_POINTER__POINTER_INT_BOOLEAN(
-                                    OulCallback cb, va_list args, void *data,
-                                    void **return_val)
+oul_signals_uninit()
 {
-	gpointer ret_val;
-	void *arg1 = va_arg(args, void *);
-	gint arg2 = va_arg(args, gint);
-	gboolean arg3 = va_arg(args, gboolean);
+	OulSignalEvent *event, *next;
 
-	ret_val = ((gpointer(*)(void *, gint, gboolean, void *))cb)(arg1, arg2, arg3, data);
+	g_return_if_fail(instance_table != NULL);
 
-	if (return_val != NULL)
-		*return_val = ret_val;
+	g_hash_table_destroy(instance_table);
+	instance_table = NULL;
+
+	g_ptr_array_free(signal_table, TRUE);
+	signal_table = NULL;
+
+	oul_prefs_disconnect_by_handle(signal_profile_get_handle());
+	profile_enabled = FALSE;
+
+	g_hash_table_destroy(profile_signals);
+	profile_signals = NULL;
+	g_hash_table_destroy(profile_handlers);
+	profile_handlers = NULL;
+
+	if (async_pipe_inpa != 0)
+	{
+		oul_input_remove(async_pipe_inpa);
+		async_pipe_inpa = 0;
+	}
+
+	/* the signals emitted but not delivered yet are dropped */
+	for (event = signal_events_take(); event != NULL; event = next)
+	{
+		next = event->next;
+		signal_event_free(event);
+	}
+
+	if (async_pipe[0] >= 0)
+	{
+		close(async_pipe[0]);
+		close(async_pipe[1]);
+		async_pipe[0] = async_pipe[1] = -1;
+	}
+
+	if (signal_args_table != NULL)
+	{
+		gulong i;
+
+		for (i = 0; i < signal_args_table->size; i++)
+		{
+			if (signal_args_table->args[i] != NULL)
+			{
+				g_free(signal_args_table->args[i]->types);
+				g_free(signal_args_table->args[i]);
+			}
+		}
+
+		g_free(signal_args_table);
+		signal_args_table = NULL;
+	}
+
+	g_slist_foreach(signal_args_retired, (GFunc)g_free, NULL);
+	g_slist_free(signal_args_retired);
+	signal_args_retired = NULL;
 }
 
-void
-oul_marshal_POINTER__POINTER_INT64_BOOLEAN(
-                                    OulCallback cb, va_list args, void *data,
-                                    void **return_val)
-{
-	gpointer ret_val;
-	void *arg1 = va_arg(args, void *);
-	gint64 arg2 = va_arg(args, gint64);
-	gboolean arg3 = va_arg(args, gboolean);
+/**************************************************************************
+ * Marshallers
+ **************************************************************************/
+/*
+ * The marshallers are generated from the list in sigdef.h.  Each one
+ * casts the callback to its signature and calls it with the arguments
+ * the emitter packed.
+ */
+#define OUL_SIGDEF_CTYPE_INT		gint
+#define OUL_SIGDEF_CTYPE_UINT		guint
+#define OUL_SIGDEF_CTYPE_BOOLEAN	gboolean
+#define OUL_SIGDEF_CTYPE_INT64		gint64
+#define OUL_SIGDEF_CTYPE_POINTER	void *
+
+#define OUL_SIGDEF_FIELD_INT		int_data
+#define OUL_SIGDEF_FIELD_UINT		uint_data
+#define OUL_SIGDEF_FIELD_BOOLEAN	boolean_data
+#define OUL_SIGDEF_FIELD_INT64		int64_data
+#define OUL_SIGDEF_FIELD_POINTER	pointer_data
+
+#define OUL_SIGDEF_ARG(t, i)	args[i].data.OUL_SIGDEF_FIELD_##t
+
+#define OUL_SIGDEF_CALL_VOID(types, call) \
+	((void (*)types)cb)call;
+
+#define OUL_SIGDEF_CALL_INT(types, call) \
+	gint ret_val = ((gint (*)types)cb)call; \
+	\
+	if (return_val != NULL) \
+		*return_val = GINT_TO_POINTER(ret_val);
 
-	ret_val = ((gpointer(*)(void *, gint64, gboolean, void *))cb)(arg1, arg2, arg3, data);
+#define OUL_SIGDEF_CALL_BOOLEAN(types, call) \
+	gboolean ret_val = ((gboolean (*)types)cb)call; \
+	\
+	if (return_val != NULL) \
+		*return_val = GINT_TO_POINTER(ret_val);
 
-	if (return_val != NULL)
+#define OUL_SIGDEF_CALL_POINTER(types, call) \
+	gpointer ret_val = ((gpointer (*)types)cb)call; \
+	\
+	if (return_val != NULL) \
 		*return_val = ret_val;
-}
 
-void
-oul_marshal_POINTER__POINTER_POINTER(OulCallback cb, va_list args, void *data,
-                                      void **return_val)
+#define OUL_SIGDEF_DEFINE(name, r, types, call) \
+	void \
+	name(OulCallback cb, const OulValue *args, void *data, void **return_val) \
+	{ \
+		OUL_SIGDEF_CALL_##r(types, call) \
+	}
+
+#define OUL_SIGDEF_0(r) \
+	OUL_SIGDEF_DEFINE(oul_marshal_##r, r, (void *), (data))
+
+#define OUL_SIGDEF_1(r, a1) \
+	OUL_SIGDEF_DEFINE(oul_marshal_##r##__##a1, r, \
+		(OUL_SIGDEF_CTYPE_##a1, void *), \
+		(OUL_SIGDEF_ARG(a1, 0), data))
+
+#define OUL_SIGDEF_2(r, a1, a2) \
+	OUL_SIGDEF_DEFINE(oul_marshal_##r##__##a1##_##a2, r, \
+		(OUL_SIGDEF_CTYPE_##a1, OUL_SIGDEF_CTYPE_##a2, void *), \
+		(OUL_SIGDEF_ARG(a1, 0), OUL_SIGDEF_ARG(a2, 1), data))
+
+#define OUL_SIGDEF_3(r, a1, a2, a3) \
+	OUL_SIGDEF_DEFINE(oul_marshal_##r##__##a1##_##a2##_##a3, r, \
+		(OUL_SIGDEF_CTYPE_##a1, OUL_SIGDEF_CTYPE_##a2, \
+		 OUL_SIGDEF_CTYPE_##a3, void *), \
+		(OUL_SIGDEF_ARG(a1, 0), OUL_SIGDEF_ARG(a2, 1), \
+		 OUL_SIGDEF_ARG(a3, 2), data))
+
+#define OUL_SIGDEF_4(r, a1, a2, a3, a4) \
+	OUL_SIGDEF_DEFINE(oul_marshal_##r##__##a1##_##a2##_##a3##_##a4, r, \
+		(OUL_SIGDEF_CTYPE_##a1, OUL_SIGDEF_CTYPE_##a2, \
+		 OUL_SIGDEF_CTYPE_##a3, OUL_SIGDEF_CTYPE_##a4, void *), \
+		(OUL_SIGDEF_ARG(a1, 0), OUL_SIGDEF_ARG(a2, 1), \
+		 OUL_SIGDEF_ARG(a3, 2), OUL_SIGDEF_ARG(a4, 3), data))
+
+#define OUL_SIGDEF_5(r, a1, a2, a3, a4, a5) \
+	OUL_SIGDEF_DEFINE(oul_marshal_##r##__##a1##_##a2##_##a3##_##a4##_##a5, r, \
+		(OUL_SIGDEF_CTYPE_##a1, OUL_SIGDEF_CTYPE_##a2, \
+		 OUL_SIGDEF_CTYPE_##a3, OUL_SIGDEF_CTYPE_##a4, \
+		 OUL_SIGDEF_CTYPE_##a5, void *), \
+		(OUL_SIGDEF_ARG(a1, 0), OUL_SIGDEF_ARG(a2, 1), \
+		 OUL_SIGDEF_ARG(a3, 2), OUL_SIGDEF_ARG(a4, 3), \
+		 OUL_SIGDEF_ARG(a5, 4), data))
+
+#include "sigdef.h"
+
+#undef OUL_SIGDEF_0
+#undef OUL_SIGDEF_1
+#undef OUL_SIGDEF_2
+#undef OUL_SIGDEF_3
+#undef OUL_SIGDEF_4
+#undef OUL_SIGDEF_5
+
+/* and the argument types they take, for the emitters to pack */
+#define OUL_SIGDEF_0(r) \
+	{ oul_marshal_##r, 0, { OUL_TYPE_UNKNOWN } },
+#define OUL_SIGDEF_1(r, a1) \
+	{ oul_marshal_##r##__##a1, 1, \
+	  { OUL_TYPE_##a1 } },
+#define OUL_SIGDEF_2(r, a1, a2) \
+	{ oul_marshal_##r##__##a1##_##a2, 2, \
+	  { OUL_TYPE_##a1, OUL_TYPE_##a2 } },
+#define OUL_SIGDEF_3(r, a1, a2, a3) \
+	{ oul_marshal_##r##__##a1##_##a2##_##a3, 3, \
+	  { OUL_TYPE_##a1, OUL_TYPE_##a2, OUL_TYPE_##a3 } },
+#define OUL_SIGDEF_4(r, a1, a2, a3, a4) \
+	{ oul_marshal_##r##__##a1##_##a2##_##a3##_##a4, 4, \
+	  { OUL_TYPE_##a1, OUL_TYPE_##a2, OUL_TYPE_##a3, OUL_TYPE_##a4 } },
+#define OUL_SIGDEF_5(r, a1, a2, a3, a4, a5) \
+	{ oul_marshal_##r##__##a1##_##a2##_##a3##_##a4##_##a5, 5, \
+	  { OUL_TYPE_##a1, OUL_TYPE_##a2, OUL_TYPE_##a3, OUL_TYPE_##a4, \
+	    OUL_TYPE_##a5 } },
+
+static const OulSignalMarshaller marshallers[] =
+{
+#include "sigdef.h"
+};
+
+static const OulSignalMarshaller *
+signal_find_marshaller(OulSignalMarshalFunc marshal)
 {
-	gpointer ret_val;
-	void *arg1 = va_arg(args, void *);
-	void *arg2 = va_arg(args, void *);
+	guint i;
 
-	ret_val = ((gpointer (*)(void *, void *, void *))cb)(arg1, arg2, data);
+	for (i = 0; i < G_N_ELEMENTS(marshallers); i++)
+	{
+		if (marshallers[i].marshal == marshal)
+			return &marshallers[i];
+	}
 
-	if (return_val != NULL)
-		*return_val = ret_val;
+	return NULL;
 }
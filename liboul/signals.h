@@ -7,7 +7,7 @@
 #define OUL_CALLBACK(func) ((OulCallback)func)
 
 typedef void (*OulCallback)(void);
-typedef void (*OulSignalMarshalFunc)(OulCallback cb, va_list args,
+typedef void (*OulSignalMarshalFunc)(OulCallback cb, const OulValue *args,
 									  void *data, void **return_val);
 
 #ifdef __cplusplus
@@ -49,8 +49,8 @@ extern "C" {
  * @param num_values The number of values to be passed to the callbacks.
  * @param ...        The values to pass to the callbacks.
  *
- * @return The signal ID local to that instance, or 0 if the signal
- *         couldn't be registered.
+ * @return The signal ID, unique among all the registered signals, or 0
+ *         if the signal couldn't be registered.
  *
  * @see OulValue
  */
@@ -73,6 +73,19 @@ void oul_signal_unregister(void *instance, const char *signal);
  */
 void oul_signals_unregister_by_instance(void *instance);
 
+/**
+ * Looks up the ID of a signal, for the oul_signal_emit_by_id() functions.
+ *
+ * The ID stays valid until the signal is unregistered, so a frequent
+ * emitter can look it up once instead of on every emission.
+ *
+ * @param instance The instance the signal is registered to.
+ * @param signal   The signal name.
+ *
+ * @return The signal ID, or 0 if the signal isn't registered.
+ */
+gulong oul_signal_lookup(void *instance, const char *signal);
+
 /**
  * Returns a list of value types used for a signal.
  *
@@ -249,6 +262,141 @@ void *oul_signal_emit_return_1(void *instance, const char *signal, ...);
 void *oul_signal_emit_vargs_return_1(void *instance, const char *signal,
 									  va_list args);
 
+/**
+ * Emits a signal by its ID.
+ *
+ * @param signal_id The ID from oul_signal_register() or oul_signal_lookup().
+ *
+ * @see oul_signal_emit()
+ */
+void oul_signal_emit_by_id(gulong signal_id, ...);
+
+/**
+ * Emits a signal by its ID.
+ *
+ * @param signal_id The ID from oul_signal_register() or oul_signal_lookup().
+ * @param args      The arguments list.
+ *
+ * @see oul_signal_emit_vargs()
+ */
+void oul_signal_emit_by_id_vargs(gulong signal_id, va_list args);
+
+/**
+ * Emits a signal by its ID and returns the first non-NULL return value.
+ *
+ * @param signal_id The ID from oul_signal_register() or oul_signal_lookup().
+ *
+ * @return The first non-NULL return value
+ *
+ * @see oul_signal_emit_return_1()
+ */
+void *oul_signal_emit_by_id_return_1(gulong signal_id, ...);
+
+/**
+ * Emits a signal by its ID and returns the first non-NULL return value.
+ *
+ * @param signal_id The ID from oul_signal_register() or oul_signal_lookup().
+ * @param args      The arguments list.
+ *
+ * @return The first non-NULL return value
+ *
+ * @see oul_signal_emit_vargs_return_1()
+ */
+void *oul_signal_emit_by_id_vargs_return_1(gulong signal_id, va_list args);
+
+/**
+ * Emits a signal with its arguments already packed, without going
+ * through a va_list.
+ *
+ * values holds one OulValue for each argument of the signal's
+ * marshaller, with the data in the field of the marshaller's type:
+ * int_data, uint_data, boolean_data, int64_data, or pointer_data for
+ * pointers.  Builds with DEBUG defined also check the type of each value.
+ *
+ * Handlers connected with the _vargs functions need a va_list, and are
+ * skipped.
+ *
+ * @param signal_id  The ID from oul_signal_register() or oul_signal_lookup().
+ * @param values     The arguments.
+ * @param num_values The number of arguments.
+ */
+void oul_signal_emit_values(gulong signal_id, const OulValue *values,
+							int num_values);
+
+/**
+ * Emits a signal with its arguments already packed and returns the
+ * first non-NULL return value.
+ *
+ * @param signal_id  The ID from oul_signal_register() or oul_signal_lookup().
+ * @param values     The arguments.
+ * @param num_values The number of arguments.
+ *
+ * @return The first non-NULL return value
+ *
+ * @see oul_signal_emit_values()
+ */
+void *oul_signal_emit_values_return_1(gulong signal_id, const OulValue *values,
+									   int num_values);
+
+/**
+ * Packs arguments for a marshaller, as the emitters do for a signal
+ * registered with it.
+ *
+ * The types come from the marshaller when it is one of sigdef.h, or
+ * else from the registered values.
+ *
+ * @param marshal    The marshal function.
+ * @param num_values The number of registered values.
+ * @param values     The registered values.
+ * @param num_args   Set to the number of arguments packed, if not NULL.
+ * @param args       The arguments.
+ *
+ * @return The packed arguments, to be freed with g_free().
+ */
+OulValue *oul_signal_marshaller_pack(OulSignalMarshalFunc marshal,
+									 int num_values, OulValue **values,
+									 int *num_args, va_list args);
+
+/**
+ * Emits a signal from any thread.
+ *
+ * The arguments are copied, strings included, and the handlers are
+ * called later from the main loop, in the order of the emissions.  Other
+ * pointers must stay valid until then.  Look the ID up on the main
+ * thread beforehand: the other signal functions are not thread-safe.
+ *
+ * Handlers connected with the _vargs functions are skipped, as with
+ * oul_signal_emit_values(), and a signal unregistered in the meantime
+ * is dropped.  The event loop UI ops must be set before
+ * oul_signals_init() for this to work.
+ *
+ * @param signal_id The ID from oul_signal_register() or oul_signal_lookup().
+ */
+void oul_signal_emit_async(gulong signal_id, ...);
+
+/**
+ * Registers the profiler prefs, once the prefs subsystem is up.
+ *
+ * With /oul/signals/profile set, the emissions of each signal are
+ * counted, and the time each handler takes is added up by handle, in a
+ * log2 histogram.  A handler taking more than
+ * /oul/signals/handler_budget milliseconds is logged, 0 for never.
+ */
+void oul_signals_profile_init(void);
+
+/**
+ * Clears the statistics of the profiler.
+ */
+void oul_signals_profile_reset(void);
+
+/**
+ * Writes out the statistics of the profiler.
+ *
+ * @param filename The file to write, in the user directory, or NULL for
+ *                 the debug log.
+ */
+void oul_signals_profile_dump(const char *filename);
+
 /**
  * Initializes the signals subsystem.
  */
@@ -266,78 +414,36 @@ void oul_signals_uninit(void);
 /**************************************************************************/
 /*@{*/
 
-void oul_marshal_VOID(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_VOID__INT(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_VOID__INT_INT(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_VOID__POINTER(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_VOID__POINTER_UINT(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_VOID__POINTER_INT_INT(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_VOID__POINTER_INT_POINTER(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_VOID__POINTER_POINTER(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_VOID__POINTER_POINTER_UINT(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_VOID__POINTER_POINTER_UINT_UINT(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_VOID__POINTER_POINTER_POINTER(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_VOID__POINTER_POINTER_POINTER_POINTER(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_VOID__POINTER_POINTER_POINTER_POINTER_POINTER(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_VOID__POINTER_POINTER_POINTER_UINT(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_VOID__POINTER_POINTER_POINTER_POINTER_UINT(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_VOID__POINTER_POINTER_POINTER_UINT_UINT(
-		OulCallback cb, va_list args, void *data, void **return_val);
-
-void oul_marshal_INT__INT(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_INT__INT_INT(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_INT__POINTER_POINTER(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_INT__POINTER_POINTER_POINTER_POINTER_POINTER(
-		OulCallback cb, va_list args, void *data, void **return_val);
-
-void oul_marshal_BOOLEAN__POINTER(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_BOOLEAN__POINTER_POINTER(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_BOOLEAN__POINTER_POINTER_POINTER(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_BOOLEAN__POINTER_POINTER_UINT(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_BOOLEAN__POINTER_POINTER_POINTER_UINT(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_BOOLEAN__POINTER_POINTER_POINTER_POINTER(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_BOOLEAN__POINTER_POINTER_POINTER_POINTER_POINTER(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_BOOLEAN__POINTER_POINTER_POINTER_POINTER_UINT(
-		OulCallback cb, va_list args, void *data, void **return_val);
-
-void oul_marshal_BOOLEAN__INT_POINTER(
-		OulCallback cb, va_list args, void *data, void **return_val);
-
-void oul_marshal_POINTER__POINTER_INT(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_POINTER__POINTER_INT64(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_POINTER__POINTER_INT_BOOLEAN(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_POINTER__POINTER_INT64_BOOLEAN(
-		OulCallback cb, va_list args, void *data, void **return_val);
-void oul_marshal_POINTER__POINTER_POINTER(
-		OulCallback cb, va_list args, void *data, void **return_val);
+/*
+ * The marshallers take the arguments packed by the emitters, and are
+ * declared from the list in sigdef.h.
+ */
+#define OUL_SIGDEF_DECLARE(name) \
+	void name(OulCallback cb, const OulValue *args, void *data, void **return_val);
+
+#define OUL_SIGDEF_0(r) \
+	OUL_SIGDEF_DECLARE(oul_marshal_##r)
+#define OUL_SIGDEF_1(r, a1) \
+	OUL_SIGDEF_DECLARE(oul_marshal_##r##__##a1)
+#define OUL_SIGDEF_2(r, a1, a2) \
+	OUL_SIGDEF_DECLARE(oul_marshal_##r##__##a1##_##a2)
+#define OUL_SIGDEF_3(r, a1, a2, a3) \
+	OUL_SIGDEF_DECLARE(oul_marshal_##r##__##a1##_##a2##_##a3)
+#define OUL_SIGDEF_4(r, a1, a2, a3, a4) \
+	OUL_SIGDEF_DECLARE(oul_marshal_##r##__##a1##_##a2##_##a3##_##a4)
+#define OUL_SIGDEF_5(r, a1, a2, a3, a4, a5) \
+	OUL_SIGDEF_DECLARE(oul_marshal_##r##__##a1##_##a2##_##a3##_##a4##_##a5)
+
+#include "sigdef.h"
+
+#undef OUL_SIGDEF_0
+#undef OUL_SIGDEF_1
+#undef OUL_SIGDEF_2
+#undef OUL_SIGDEF_3
+#undef OUL_SIGDEF_4
+#undef OUL_SIGDEF_5
+#undef OUL_SIGDEF_DECLARE
+
 /*@}*/
 
 #ifdef __cplusplus
@@ -268,7 +268,21 @@ static void hbn_listen_cb(int fd, gpointer data) {
 	static struct stun_header hdr_data;
 	int ret;
 
-	if(fd < 0) {
+	/* the socket is IPv4, the server may have IPv6 addresses first */
+	while(hosts && ((struct sockaddr *)hosts->next->data)->sa_family != AF_INET) {
+		hosts = g_slist_remove(hosts, hosts->data);
+		g_free(hosts->data);
+		hosts = g_slist_remove(hosts, hosts->data);
+	}
+
+	if(fd < 0 || !hosts) {
+		if(fd >= 0)
+			close(fd);
+		while(hosts) {
+			hosts = g_slist_remove(hosts, hosts->data);
+			g_free(hosts->data);
+			hosts = g_slist_remove(hosts, hosts->data);
+		}
 		nattype.status = OUL_STUN_STATUS_UNKNOWN;
 		nattype.lookup_time = time(NULL);
 		do_callbacks();
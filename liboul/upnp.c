@@ -430,8 +430,9 @@ oul_upnp_parse_description(const gchar* descriptionURL, UPnPDiscoveryData *dd)
 	oul_timeout_remove(dd->tima);
 	dd->tima = 0;
 
-	oul_http_fetch_url_request_len(descriptionURL, TRUE, NULL, TRUE, httpRequest,
-			TRUE, MAX_UPNP_DOWNLOAD, upnp_parse_description_cb, dd);
+	oul_http_fetch_url_request_priority(descriptionURL, TRUE, NULL, TRUE, httpRequest,
+			TRUE, MAX_UPNP_DOWNLOAD, OUL_HTTP_PRIORITY_BACKGROUND,
+			upnp_parse_description_cb, dd);
 
 	g_free(httpRequest);
 
@@ -695,8 +696,9 @@ oul_upnp_generate_action_message_and_send(const gchar* actionName,
 	g_free(pathOfControl);
 	g_free(soapMessage);
 
-	gfud = oul_http_fetch_url_request_len(control_info.control_url, FALSE, NULL, TRUE,
-				totalSendMessage,  TRUE, MAX_UPNP_DOWNLOAD, cb, cb_data);
+	gfud = oul_http_fetch_url_request_priority(control_info.control_url, FALSE, NULL, TRUE,
+				totalSendMessage,  TRUE, MAX_UPNP_DOWNLOAD, OUL_HTTP_PRIORITY_BACKGROUND,
+				cb, cb_data);
 
 	g_free(totalSendMessage);
 	g_free(addressOfControl);
@@ -3,274 +3,764 @@
 
 #include "internal.h"
 #include "qmon.h"
+#include "qmonhttp.h"
 #include "qmonoptions.h"
+#include "qmonreport.h"
 #include "notify.h"
 
-static guint http_check_timer = 0;
-
-static size_t
-monitor_httpheader_cb(void *ptr, size_t size, size_t nmemb, void *data)
+/* one round trip to qmon, shared by all the monitors with the same selection */
+typedef struct _QmonPoll
 {
-	g_return_if_fail(data != NULL);
-	
-	QmonMonitor *monitor = (QmonMonitor *)data;
+	QmonMonitorSet			*set;
+	gchar					*selection;
 
-	size_t real_size = size * nmemb;
+	QmonHttpRequest			*request;		/* persistent http request used by every round */
+	QmonReportParser		*parser;		/* extracts SRs from the round in progress */
 
-	if(monitor->httpheader == NULL){
-		monitor->httpheader = g_string_new("");
-	}
+	guint					hash;			/* hash of the page received so far */
+	gchar					*etag;			/* validators of the last page, for conditional requests */
+	gchar					*last_modified;
 
-	monitor->httpheader = g_string_append_len(monitor->httpheader, ptr, real_size);
+	GList					*monitors;		/* monitors waiting for the result */
+	gboolean				retried;		/* the session was renewed once for this round */
+}QmonPoll;
 
-	return real_size;
-}
+typedef enum
+{
+	QMON_POLL_FAILED,
+	QMON_POLL_UNCHANGED,
+	QMON_POLL_CHANGED
+}QmonPollResult;
 
-static size_t
-monitor_httpbody_cb(void *ptr, size_t size, size_t nmemb, void *data)
+static void set_schedule(QmonMonitorSet *set);
+static void poll_login_cb(QmonSession *session, gboolean success, gpointer data);
+
+static time_t
+monitor_interval(QmonMonitor *monitor)
 {
-	g_return_if_fail(data != NULL);
-	
-	QmonMonitor *monitor = (QmonMonitor *)data;
+	return MAX(monitor->options->interval, 1) * 60;
+}
 
-	size_t real_size = size * nmemb;
+static time_t
+monitor_jitter(time_t delay)
+{
+	gint32 jitter = delay * QMON_SCHED_JITTER / 100;
 
-	if(monitor->httpbody == NULL)
-		monitor->httpbody = g_string_new("");
-	
-	monitor->httpbody = g_string_append_len(monitor->httpbody, ptr, real_size);
+	if(jitter <= 0)
+		return delay;
 
-	return real_size;
+	return delay + g_random_int_range(-jitter, jitter + 1);
 }
 
+/*
+ * Poll faster while the SRs are churning, back off exponentially while
+ * nothing changed or the server fails, never beyond the configured limits.
+ */
 static void
-monitor_http_cleanup(QmonMonitor *monitor)
+monitor_adapt(QmonMonitor *monitor, QmonPollResult result)
 {
-	monitor->httpdone = FALSE;
-	
-	if(monitor->httpheader){
-		g_string_free(monitor->httpheader, TRUE);
-		monitor->httpheader = NULL;
+	time_t base = monitor_interval(monitor);
+
+	switch(result){
+		case QMON_POLL_FAILED:
+			monitor->errors = MIN(monitor->errors + 1, QMON_SCHED_MAX_ERRORS);
+			monitor->delay 	= MIN(base << monitor->errors, MAX(base, QMON_SCHED_MAX_DELAY));
+			break;
+		case QMON_POLL_CHANGED:
+			monitor->errors = 0;
+			monitor->delay 	= MAX(base / 2, QMON_SCHED_MIN_DELAY);
+			break;
+		case QMON_POLL_UNCHANGED:
+		default:
+			monitor->errors = 0;
+			if(monitor->delay < base)
+				monitor->delay = base;
+			else
+				monitor->delay = MIN(monitor->delay * 2, base * QMON_SCHED_BACKOFF_MAX);
+			break;
 	}
 
-	if(monitor->httpbody){
-		g_string_free(monitor->httpbody, TRUE);
-		monitor->httpbody = NULL;
-	}
+	monitor->due = time(NULL) + monitor_jitter(monitor->delay);
 }
 
-static void *
-monitor_query(gpointer data)
+static void
+poll_body_cb(const gchar *data, gsize len, gpointer user_data)
 {
-	CURL *curl_handle = NULL;
-	CURLcode curl_ret;
-	gchar error_msg[CURL_ERROR_SIZE];
-	gchar *cookie = NULL;
+	QmonPoll *poll = (QmonPoll *)user_data;
+	gsize i;
 
-	g_return_if_fail(data != NULL);
-	
-	QmonMonitor *monitor = (QmonMonitor *)data;
+	/* the hash tells an unchanged page apart without a validator from the server */
+	for(i = 0; i < len; i++)
+		poll->hash = (poll->hash << 5) + poll->hash + (guchar)data[i];
 
-	curl_handle = curl_easy_init();
+	/* SR rows are extracted while the page is still arriving */
+	if(poll->parser)
+		qmon_report_parser_feed(poll->parser, data, len);
+}
 
-#if 1
-	curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 1L);
-#endif
+/* the server answers an expired session with the login page */
+static gboolean
+poll_session_expired(QmonHttpRequest *request, QmonReportParser *parser)
+{
+	if(request->status == 401 || request->status == 403)
+		return TRUE;
 
-	curl_easy_setopt(curl_handle, CURLOPT_NOPROGRESS, 1L);
-	curl_easy_setopt(curl_handle, CURLOPT_ERRORBUFFER, &error_msg);
-	curl_easy_setopt(curl_handle, CURLOPT_URL, QMON_URL);
-	curl_easy_setopt(curl_handle, CURLOPT_POST, 1L);
+	if(request->status == 304 || request->status >= 400)
+		return FALSE;
 
-	cookie = g_strdup_printf(QMON_COOKIE, monitor->session->aw_user, monitor->session->tier2unpw);
+	return request->status >= 300 || !qmon_report_parser_found_table(parser);
+}
 
-	curl_easy_setopt(curl_handle, CURLOPT_COOKIE, cookie);
-	
-	gchar *post_content = g_strdup_printf(QMON_POLL_CONTENT, monitor->options->selection);
+static void
+poll_done_cb(QmonHttpRequest *request, gboolean success, gpointer data)
+{
+	QmonPoll *poll = (QmonPoll *)data;
+	QmonReportParser *parser = poll->parser;
+	GList *monitors = poll->monitors;
+	GList *srlist = NULL, *tmp = NULL;
+	QmonMonitor *monitor = NULL;
+	QmonPollResult result = QMON_POLL_FAILED;
+	gboolean parse = FALSE, parsed = FALSE;
+
+	poll->parser 	= NULL;
+	poll->monitors 	= NULL;
+
+	if(parser == NULL){
+		g_list_free(monitors);
+		return;
+	}
+
+	/* renew the session once, and retry the same round */
+	if(success && poll_session_expired(request, parser)){
+		if(!poll->retried){
+			oul_debug_info("qmon", "session expired, login again for %s.\n", poll->selection);
 
-	curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, post_content);
+			qmon_report_parser_destroy(parser);
 
-	curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, monitor_httpheader_cb);
-	curl_easy_setopt(curl_handle, CURLOPT_WRITEHEADER, monitor);
+			poll->monitors 	= monitors;
+			poll->retried 	= TRUE;
 
-	curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, monitor_httpbody_cb);
-	curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, monitor);
+			qmon_session_expire(poll->set->session);
+			qmon_session_login(poll->set->session, poll_login_cb, poll);
+			return;
+		}
+
+		oul_debug_error("qmon", "session of %s is still refused after login.\n", poll->selection);
+		success = FALSE;
+	}
 
-	curl_ret = curl_easy_perform(curl_handle);
-	if(curl_ret != CURLE_OK){
-		oul_debug_info("qmon", "qmon http perform failed: %s.\n", error_msg);
+	poll->retried = FALSE;
+
+	if(!success || request->status >= 400){
+		oul_debug_error("qmon", "poll of %s failed, http status %ld.\n",
+						poll->selection, request->status);
+	}else if(request->status == 304){
+		result = QMON_POLL_UNCHANGED;
 	}else{
-		oul_debug_info("qmon", "qmon http perform ok.\n");
-		monitor->httpdone = TRUE;
+		result = QMON_POLL_UNCHANGED;
+
+		g_free(poll->etag);
+		poll->etag = qmon_http_request_get_header(request, "ETag");
+
+		g_free(poll->last_modified);
+		poll->last_modified = qmon_http_request_get_header(request, "Last-Modified");
+
+		/* the SR list is only built if some monitor did not see this page */
+		for(tmp = monitors; tmp; tmp = g_list_next(tmp)){
+			monitor = (QmonMonitor *)tmp->data;
+
+			if(!monitor->page_seen || monitor->page_hash != poll->hash)
+				parse = TRUE;
+		}
+
+		if(parse){
+			/* an empty queue still has the table, with the header row only */
+			if(qmon_report_parser_found_table(parser)){
+				srlist = qmon_report_parser_finish(parser);
+				parser = NULL;
+				parsed = TRUE;
+			}else{
+				oul_debug_error("qmon", "Can not get valid sr list.\n");
+				result = QMON_POLL_FAILED;
+			}
+		}else{
+			oul_debug_info("qmon", "page of %s is unchanged.\n", poll->selection);
+		}
 	}
 
-	curl_easy_cleanup(curl_handle);
-	g_free(cookie);
-	g_free(post_content);
+	if(parser)
+		qmon_report_parser_destroy(parser);
+
+	/* the same page serves every monitor of the selection */
+	for(tmp = monitors; tmp; tmp = g_list_next(tmp)){
+		monitor = (QmonMonitor *)tmp->data;
+
+		if(parsed && (!monitor->page_seen || monitor->page_hash != poll->hash)){
+			monitor->page_hash = poll->hash;
+			monitor->page_seen = TRUE;
+
+			monitor_adapt(monitor, qmon_report(monitor, srlist) ?
+							QMON_POLL_CHANGED : QMON_POLL_UNCHANGED);
+		}else{
+			monitor_adapt(monitor, result);
+		}
+	}
+
+	qmon_srlist_free(srlist);
+	g_list_free(monitors);
 
+	set_schedule(poll->set);
 }
 
-gboolean
-monitor_http_check(QmonMonitor *monitor)
+static QmonPoll *
+poll_new(QmonMonitorSet *set, const gchar *selection)
 {
-	if(monitor->httpdone){
-		/* remove http check timer first */
-		oul_timeout_remove(http_check_timer);
-		http_check_timer = 0;
-		
-		qmon_report(monitor);
-		monitor_http_cleanup(monitor);
-		
-		return FALSE;
+	QmonPoll *poll = NULL;
+
+	poll = g_new0(QmonPoll, 1);
+
+	poll->set 		= set;
+	poll->selection = g_strdup(selection);
+
+	/* the request and its connection are kept for the later rounds */
+	poll->request = qmon_http_request_new(QMON_URL, poll_done_cb, poll);
+	if(poll->request == NULL){
+		g_free(poll->selection);
+		g_free(poll);
+		return NULL;
 	}
 
-	return TRUE;
+	qmon_http_request_set_write_func(poll->request, poll_body_cb, poll);
+
+	return poll;
 }
 
-/*******************************************************
- ******public interface*************************************
- ********************************************************/
+static void
+poll_destroy(QmonPoll *poll)
+{
+	qmon_session_cancel(poll->set->session, poll);
 
+	if(poll->request){
+		qmon_http_request_destroy(poll->request);
+		poll->request = NULL;
+	}
 
-gboolean
-qmon_monitor_poll(gpointer data)
+	if(poll->parser){
+		qmon_report_parser_destroy(poll->parser);
+		poll->parser = NULL;
+	}
+
+	g_list_free(poll->monitors);
+	poll->monitors = NULL;
+
+	g_free(poll->etag);
+	g_free(poll->last_modified);
+
+	g_free(poll->selection);
+	g_free(poll);
+}
+
+/* a monitor that did not see the page needs it, not a 304 */
+static gboolean
+poll_page_wanted(QmonPoll *poll)
 {
-	GThread *thread;
-	GError *error;
+	GList *tmp = NULL;
 
-	oul_debug_info("qmon", "qmon poll ...\n");
+	for(tmp = poll->monitors; tmp; tmp = g_list_next(tmp)){
+		if(!((QmonMonitor *)tmp->data)->page_seen)
+			return TRUE;
+	}
 
-	QmonMonitor *monitor = (QmonMonitor *)data;
-	
-	/* give a chance to use the new modified options */
-	qmon_options_refresh(monitor->options);
-	if(!qmon_options_validate(monitor->options)){
-		oul_debug_error("qmon", "invalid options, please check it.\n");
+	return FALSE;
+}
+
+static gboolean
+poll_start(QmonPoll *poll)
+{
+	gchar *post_content = NULL, *header = NULL;
+	gboolean ret = FALSE, wanted = FALSE;
+
+	poll->parser = qmon_report_parser_new();
+	if(poll->parser == NULL)
 		return FALSE;
+
+	poll->hash = 5381;
+
+	/* the session may have been renewed since the last round */
+	qmon_http_request_set_cookie(poll->request, poll->set->session->cookie);
+
+	/* let the server answer 304 if the page did not change */
+	qmon_http_request_clear_headers(poll->request);
+	wanted = poll_page_wanted(poll);
+	if(poll->etag && !wanted){
+		header = g_strdup_printf("If-None-Match: %s", poll->etag);
+		qmon_http_request_add_header(poll->request, header);
+		g_free(header);
 	}
 
-	thread = g_thread_create(monitor_query, monitor, FALSE, &error);
-	if(thread == NULL){
-		oul_debug_error("qmon", "Error create http thread: %s\n", error);
-		
-		if(error)
-			g_error_free(error);
+	if(poll->last_modified && !wanted){
+		header = g_strdup_printf("If-Modified-Since: %s", poll->last_modified);
+		qmon_http_request_add_header(poll->request, header);
+		g_free(header);
+	}
 
-		return TRUE;
+	post_content = g_strdup_printf(QMON_POLL_CONTENT, poll->selection);
+	ret = qmon_http_request_post(poll->request, post_content);
+	g_free(post_content);
+
+	if(!ret){
+		qmon_report_parser_destroy(poll->parser);
+		poll->parser = NULL;
 	}
 
-	/* startup the http check process */
-	if(http_check_timer == 0){
-		oul_debug_info("qmon", "startup the http check timer.\n");
-		http_check_timer = oul_timeout_add_seconds(2, monitor_http_check, monitor);
+	return ret;
+}
+
+static void
+poll_login_cb(QmonSession *session, gboolean success, gpointer data)
+{
+	QmonPoll *poll = (QmonPoll *)data;
+	GList *tmp = NULL;
+
+	if(success && poll_start(poll))
+		return;
+
+	oul_debug_error("qmon", "Error retry qmon poll of %s.\n", poll->selection);
+
+	for(tmp = poll->monitors; tmp; tmp = g_list_next(tmp))
+		monitor_adapt((QmonMonitor *)tmp->data, QMON_POLL_FAILED);
+
+	g_list_free(poll->monitors);
+	poll->monitors 	= NULL;
+	poll->retried 	= FALSE;
+
+	set_schedule(poll->set);
+}
+
+static void
+poll_forget_monitor(gpointer key, gpointer value, gpointer data)
+{
+	QmonPoll *poll = (QmonPoll *)value;
+
+	poll->monitors = g_list_remove(poll->monitors, data);
+}
+
+static QmonMonitor *
+set_find_monitor(QmonMonitorSet *set, const gchar *profile)
+{
+	GList *tmp = NULL;
+	QmonMonitor *monitor = NULL;
+
+	for(tmp = set->monitors; tmp; tmp = g_list_next(tmp)){
+		monitor = (QmonMonitor *)tmp->data;
+
+		if(profile == NULL && monitor->options->profile == NULL)
+			return monitor;
+
+		if(profile && monitor->options->profile
+			&& !strcmp(profile, monitor->options->profile))
+			return monitor;
 	}
 
-	return TRUE;
+	return NULL;
 }
 
-gboolean
-qmon_monitor_start(QmonMonitor *monitor)
+/* the login may have been changed in the prefs */
+static void
+set_refresh_login(QmonMonitorSet *set)
 {
-	g_return_val_if_fail(monitor != NULL, FALSE);
+	gchar *username = NULL, *password = NULL;
 
-	oul_debug_info("qmon", "monitor starting...\n");
+	username = g_strdup(oul_prefs_get_string(PLUGIN_QMON_USERNAME));
+	if(username)
+		username = g_strstrip(username);
+
+	password = g_strdup(oul_prefs_get_string(PLUGIN_QMON_PASSWORD));
+	if(password)
+		password = g_strstrip(password);
+
+	qmon_session_set_login(set->session, username, password);
 
-	if(monitor->status == QMON_STATUS_STARTED){
-		oul_debug_info("qmon", "monitor already started...\n");	
+	g_free(username);
+	g_free(password);
+}
+
+static void set_login_cb(QmonSession *session, gboolean success, gpointer data);
+
+/*
+ * Polls all the monitors which are due, or every monitor if forced.
+ * Monitors sharing a selection are answered by a single request.
+ */
+static void
+set_dispatch(QmonMonitorSet *set, gboolean force)
+{
+	QmonMonitor *monitor = NULL;
+	QmonPoll *poll = NULL;
+	GList *tmp = NULL, *round = NULL;
+	time_t now = time(NULL);
+
+	set_refresh_login(set);
+
+	/* the polls wait for the login, it never blocks the main loop */
+	if(!qmon_session_is_valid(set->session)){
+		set->force = set->force || force;
+		qmon_session_login(set->session, set_login_cb, set);
 		return;
 	}
 
-	monitor->timer = oul_timeout_add_seconds(monitor->options->interval * 60, 
-									qmon_monitor_poll, monitor);
+	for(tmp = set->monitors; tmp; tmp = g_list_next(tmp)){
+		monitor = (QmonMonitor *)tmp->data;
 
-	monitor->status = QMON_STATUS_STARTED;
-	
-	return TRUE;
+		if(!force && monitor->due > now + QMON_SCHED_SLACK)
+			continue;
+
+		/* give a chance to use the new modified options, a new filter reports the page again */
+		if(qmon_options_refresh(monitor->options))
+			monitor->page_seen = FALSE;
+
+		/* until the result arrives and adapts it */
+		monitor->due = now + MAX(monitor->delay, monitor_interval(monitor));
+
+		if(!qmon_options_validate(monitor->options)){
+			oul_debug_error("qmon", "invalid options of profile %s, please check it.\n",
+							monitor->options->profile ? monitor->options->profile : "default");
+			continue;
+		}
+
+		poll = g_hash_table_lookup(set->polls, monitor->options->selection);
+		if(poll == NULL){
+			poll = poll_new(set, monitor->options->selection);
+			if(poll == NULL)
+				continue;
+
+			g_hash_table_insert(set->polls, poll->selection, poll);
+		}
+
+		if(poll->request->busy){
+			oul_debug_info("qmon", "last poll of %s is still in progress, skip this one.\n",
+							poll->selection);
+			continue;
+		}
+
+		if(poll->monitors == NULL)
+			round = g_list_prepend(round, poll);
+
+		if(!g_list_find(poll->monitors, monitor))
+			poll->monitors = g_list_append(poll->monitors, monitor);
+	}
+
+	for(tmp = round; tmp; tmp = g_list_next(tmp)){
+		poll = (QmonPoll *)tmp->data;
+
+		if(!poll_start(poll)){
+			oul_debug_error("qmon", "Error start qmon poll of %s.\n", poll->selection);
+
+			g_list_free(poll->monitors);
+			poll->monitors = NULL;
+		}
+	}
+
+	g_list_free(round);
 }
 
-void
-qmon_monitor_stop(QmonMonitor *monitor)
+static gboolean set_timer_cb(gpointer data);
+
+static void
+set_login_cb(QmonSession *session, gboolean success, gpointer data)
 {
-	g_return_if_fail(monitor != NULL);
+	QmonMonitorSet *set = (QmonMonitorSet *)data;
+	QmonMonitor *monitor = NULL;
+	GList *tmp = NULL;
+	gboolean force = set->force;
+	time_t now = time(NULL);
 
-	oul_debug_info("qmon", "monitor stop...\n");
+	set->force = FALSE;
 
-	if(monitor->status == QMON_STATUS_STOPED){
-		oul_debug_info("qmon", "monitor already stoped...\n");	
-		return;
+	if(success){
+		set_dispatch(set, force);
+	}else{
+		oul_debug_error("qmon", "qmon login failed.\n");
+
+		/* back off the due monitors, or the timer keeps logging in */
+		for(tmp = set->monitors; tmp; tmp = g_list_next(tmp)){
+			monitor = (QmonMonitor *)tmp->data;
+
+			if(force || monitor->due <= now + QMON_SCHED_SLACK)
+				monitor_adapt(monitor, QMON_POLL_FAILED);
+		}
 	}
 
-	/* if we stop monitor, we need remove the timer handler */
-	if(monitor->timer > 0){
-		oul_timeout_remove(monitor->timer);
-		monitor->timer = 0;
+	set_schedule(set);
+}
+
+/* arm the single timer for the monitor which is due first */
+static void
+set_schedule(QmonMonitorSet *set)
+{
+	QmonMonitor *monitor = NULL;
+	GList *tmp = NULL;
+	time_t now, due = 0;
+
+	if(set->timer > 0){
+		oul_timeout_remove(set->timer);
+		set->timer = 0;
+	}
+
+	if(set->status != QMON_STATUS_STARTED || set->monitors == NULL)
+		return;
+
+	/* the due monitors wait for the login, whose callbacks schedule again */
+	if(qmon_session_is_busy(set->session))
+		return;
+
+	for(tmp = set->monitors; tmp; tmp = g_list_next(tmp)){
+		monitor = (QmonMonitor *)tmp->data;
+
+		if(due == 0 || monitor->due < due)
+			due = monitor->due;
 	}
 
-	monitor->status = QMON_STATUS_STOPED;
+	now = time(NULL);
+
+	set->timer = oul_timeout_add_seconds(due > now ? due - now : 0, set_timer_cb, set);
 }
 
+static gboolean
+set_timer_cb(gpointer data)
+{
+	QmonMonitorSet *set = (QmonMonitorSet *)data;
+
+	oul_debug_info("qmon", "qmon poll ...\n");
+
+	set->timer = 0;
+
+	set_dispatch(set, FALSE);
+	set_schedule(set);
+
+	return FALSE;
+}
+
+/*******************************************************
+ ******public interface*************************************
+ ********************************************************/
 QmonMonitor *
-qmon_monitor_new(OulPlugin *plugin)
+qmon_monitor_new(OulPlugin *plugin, const gchar *profile)
 {
 	oul_debug_info("qmon", "qmon monitor new ...\n");
 
 	QmonMonitor *monitor = NULL;
 
 	monitor = g_new0(QmonMonitor, 1);
-		
-	monitor->plugin = plugin;
 
-	monitor->status = QMON_STATUS_STOPED;
+	monitor->plugin = plugin;
 
-	monitor->httpdone = FALSE;
-	monitor->httpheader = NULL;
-	monitor->httpbody = NULL;
+	qmon_prefs_profile_init(profile);
 
-	monitor->options = qmon_options_new();
+	monitor->options = qmon_options_new_for_profile(profile);
 	if(!monitor->options){
 		g_free(monitor);
-	
+
 		return NULL;
 	}
 
-	if(!qmon_options_validate(monitor->options)){
+	monitor->delay 	= monitor_interval(monitor);
+	monitor->due 	= time(NULL) + monitor_jitter(monitor->delay);
+
+	monitor->state = qmon_report_state_new();
+
+	return monitor;
+}
+
+void
+qmon_monitor_destroy(QmonMonitor *monitor)
+{
+	monitor->plugin = NULL;
+
+	qmon_report_state_destroy(monitor->state);
+	monitor->state = NULL;
+
+	qmon_options_destroy(monitor->options);
+
+	g_free(monitor);
+	monitor = NULL;
+}
+
+QmonMonitorSet *
+qmon_monitor_set_new(OulPlugin *plugin)
+{
+	QmonMonitorSet *set = NULL;
+	QmonOptions *options = NULL;
+
+	/* the login only needs the options shared by all the profiles */
+	options = qmon_options_new();
+	if(!options)
+		return NULL;
+
+	if(!qmon_options_validate(options)){
 		oul_debug_error("qmon", "Options was invalid.\n");
+		qmon_options_destroy(options);
 
 		return NULL;
 	}
 
-	/* if cannot get valid qmonsession, then failed */
-	monitor->session = qmon_session_new(monitor->options);
-	if(!monitor->session){
-		qmon_options_destroy(monitor->options);
-		monitor->options = NULL;
-		
-		g_free(monitor);
+	set = g_new0(QmonMonitorSet, 1);
+
+	set->plugin = plugin;
+	set->status = QMON_STATUS_STOPED;
+
+	/* the cached cookies are used, or the first poll logs in */
+	set->session = qmon_session_new(options);
+	qmon_options_destroy(options);
+
+	if(!set->session){
+		g_free(set);
 
 		return NULL;
 	}
 
-	return monitor;
+	set->polls = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)poll_destroy);
+
+	qmon_monitor_set_reload(set);
 
+	return set;
 }
 
 void
-qmon_monitor_destroy(QmonMonitor *monitor)
+qmon_monitor_set_destroy(QmonMonitorSet *set)
 {
-	monitor->plugin = NULL;
-	
-	if(monitor->timer > 0){
-		oul_timeout_remove(monitor->timer);
-		monitor->timer = 0;
+	g_return_if_fail(set != NULL);
+
+	if(set->timer > 0){
+		oul_timeout_remove(set->timer);
+		set->timer = 0;
 	}
-	
-	qmon_session_destroy(monitor->session);
-	qmon_options_destroy(monitor->options);
-	
-	monitor_http_cleanup(monitor);
 
-	g_free(monitor);
-	monitor = NULL;
+	g_hash_table_destroy(set->polls);
+	set->polls = NULL;
+
+	qmon_session_cancel(set->session, set);
+
+	g_list_foreach(set->monitors, (GFunc)qmon_monitor_destroy, NULL);
+	g_list_free(set->monitors);
+	set->monitors = NULL;
+
+	qmon_session_destroy(set->session);
+
+	g_free(set);
+	set = NULL;
 }
 
+/* sync the monitors with the profiles in the prefs, the kept ones keep their state */
+void
+qmon_monitor_set_reload(QmonMonitorSet *set)
+{
+	GList *profiles = NULL, *tmp = NULL, *monitors = NULL;
+	QmonMonitor *monitor = NULL;
+	gchar *profile = NULL;
+
+	g_return_if_fail(set != NULL);
+
+	profiles = oul_prefs_get_string_list(PLUGIN_QMON_PROFILES);
+	profiles = g_list_prepend(profiles, NULL);
+
+	for(tmp = profiles; tmp; tmp = g_list_next(tmp)){
+		profile = (gchar *)tmp->data;
+
+		if(profile && *profile == '\0')
+			continue;
+
+		monitor = set_find_monitor(set, profile);
+		if(monitor)
+			set->monitors = g_list_remove(set->monitors, monitor);
+		else
+			monitor = qmon_monitor_new(set->plugin, profile);
+
+		if(monitor && !g_list_find(monitors, monitor))
+			monitors = g_list_append(monitors, monitor);
+	}
+
+	/* the profiles left were removed from the prefs */
+	for(tmp = set->monitors; tmp; tmp = g_list_next(tmp)){
+		monitor = (QmonMonitor *)tmp->data;
+
+		g_hash_table_foreach(set->polls, poll_forget_monitor, monitor);
+		qmon_monitor_destroy(monitor);
+	}
+
+	g_list_free(set->monitors);
+	set->monitors = monitors;
+
+	g_list_foreach(profiles, (GFunc)g_free, NULL);
+	g_list_free(profiles);
+
+	set_schedule(set);
+}
+
+gboolean
+qmon_monitor_set_start(QmonMonitorSet *set)
+{
+	QmonMonitor *monitor = NULL;
+	GList *tmp = NULL;
+	time_t now;
+
+	g_return_val_if_fail(set != NULL, FALSE);
+
+	oul_debug_info("qmon", "monitor starting...\n");
 
+	if(set->status == QMON_STATUS_STARTED){
+		oul_debug_info("qmon", "monitor already started...\n");
+		return TRUE;
+	}
+
+	set->status = QMON_STATUS_STARTED;
+
+	/* the first polls are one interval away, as they always were */
+	now = time(NULL);
+	for(tmp = set->monitors; tmp; tmp = g_list_next(tmp)){
+		monitor = (QmonMonitor *)tmp->data;
+
+		monitor->delay 	= monitor_interval(monitor);
+		monitor->errors = 0;
+		monitor->due 	= now + monitor_jitter(monitor->delay);
+	}
+
+	qmon_monitor_set_reload(set);
+
+	return TRUE;
+}
+
+void
+qmon_monitor_set_stop(QmonMonitorSet *set)
+{
+	g_return_if_fail(set != NULL);
+
+	oul_debug_info("qmon", "monitor stop...\n");
+
+	if(set->status == QMON_STATUS_STOPED){
+		oul_debug_info("qmon", "monitor already stoped...\n");
+		return;
+	}
+
+	set->status = QMON_STATUS_STOPED;
+
+	/* if we stop monitor, we need remove the timer handler */
+	set_schedule(set);
+}
+
+/* poll every monitor right now */
+void
+qmon_monitor_set_poll(QmonMonitorSet *set)
+{
+	GList *tmp = NULL;
+
+	g_return_if_fail(set != NULL);
+
+	qmon_monitor_set_reload(set);
+
+	/* a manual check always reports, even if the page did not change */
+	for(tmp = set->monitors; tmp; tmp = g_list_next(tmp))
+		((QmonMonitor *)tmp->data)->page_seen = FALSE;
+
+	set_dispatch(set, TRUE);
+	set_schedule(set);
+}
@@ -3,38 +3,78 @@
 
 #include "qmonsession.h"
 #include "qmonoptions.h"
+#include "qmonhttp.h"
 
 #define	QMON_URL						"http://qmon.oraclecorp.com/qmon3/qmon.pl"
-#define QMON_COOKIE						"AW_user=%s; Tier2unpw=%s;"
 
 #define	QMON_POLL_CONTENT				"tab=srs&label=status&" \
 										"stat_type=B&sel_type=T&.cgifields=stat_type&" \
 										"sel_action=Pick&selection=%s"
+/* due polls within this many seconds are coalesced into one round */
+#define	QMON_SCHED_SLACK				30
+
+/* limits of the adaptive poll delay, in seconds */
+#define	QMON_SCHED_MIN_DELAY			60
+#define	QMON_SCHED_MAX_DELAY			(4 * 60 * 60)
+
+/* an idle queue is polled at most this many intervals apart */
+#define	QMON_SCHED_BACKOFF_MAX			4
+
+/* failed polls double the delay up to this many times */
+#define	QMON_SCHED_MAX_ERRORS			6
+
+/* percent of the delay randomized, so that desktops do not poll in step */
+#define	QMON_SCHED_JITTER				10
+
 typedef enum
 {
 	QMON_STATUS_STARTED,			/* states connected to qmon website */
 	QMON_STATUS_STOPED				/* indicates one qmon poll was done */
 } QmonMonitorStatus;
 
+/* one watched queue, described by a profile of options */
 typedef struct _QmonMonitor
 {
 	OulPlugin				*plugin;
-	QmonSession				*session;
 	QmonOptions				*options;
 	
-	guint					timer;			/* timer which will invoked periodically */
+	time_t					due;			/* when the next poll of this monitor is due */
+	time_t					delay;			/* adaptive delay between polls */
+	guint					errors;			/* polls failed in a row */
 
-	QmonMonitorStatus		status;			/* current status in QmonMonitor */
+	guint					page_hash;		/* hash of the last page reported */
+	gboolean				page_seen;		/* page_hash is valid */
 
-	gboolean				httpdone;		/* a flag state that http was done */
-	GString 				*httpheader;	/* validated and parsed http header */
-	GString					*httpbody;		/* validated and parsed http body */
+	struct _QmonReportState		*state;			/* SRs reported by previous polls */
 	
 }QmonMonitor;
 
-QmonMonitor *	qmon_monitor_new(OulPlugin *plugin);
+/* all the monitors, driven by one timer and one login */
+typedef struct _QmonMonitorSet
+{
+	OulPlugin				*plugin;
+	QmonSession				*session;		/* shared by every profile */
+
+	GList					*monitors;
+	GHashTable				*polls;			/* selection -> QmonPoll, keeps the requests between rounds */
+
+	guint					timer;			/* armed for the earliest due monitor */
+	gboolean				force;			/* a manual check is waiting for the login */
+
+	QmonMonitorStatus		status;			/* current status of the scheduler */
+
+}QmonMonitorSet;
+
+QmonMonitor *	qmon_monitor_new(OulPlugin *plugin, const gchar *profile);
 void			qmon_monitor_destroy(QmonMonitor *monitor);
 
+QmonMonitorSet *	qmon_monitor_set_new(OulPlugin *plugin);
+void				qmon_monitor_set_destroy(QmonMonitorSet *set);
+void				qmon_monitor_set_reload(QmonMonitorSet *set);
+gboolean			qmon_monitor_set_start(QmonMonitorSet *set);
+void				qmon_monitor_set_stop(QmonMonitorSet *set);
+void				qmon_monitor_set_poll(QmonMonitorSet *set);
+
 
 
 #endif
@@ -0,0 +1,675 @@
+/*
+ * qmonbench - replays qmon pages through the report pipeline, offline.
+ *
+ *   qmonbench [-n iterations] [--http] [page.html ...]
+ *   qmonbench --generate rows > page.html
+ *
+ * Without pages, synthetic small, typical and 10k rows pages are used.
+ * Each stage is reported with its wall time and allocations per
+ * iteration, the peak RSS is printed at the end. --http also serves
+ * every page from a local stand-in server, and runs the whole poll
+ * path: qmon_http, the streaming parser and qmon_report().
+ */
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+
+#include <libxml/xmlmemory.h>
+
+#include "internal.h"
+#include "eventloop.h"
+#include "notify.h"
+#include "signals.h"
+#include "qmon.h"
+#include "qmonhttp.h"
+#include "qmonreport.h"
+
+#define	BENCH_ITERATIONS		20
+
+/* the analyst and every n-th SR are watched by the filters */
+#define	BENCH_ANALYST			"ANALYST7"
+#define	BENCH_SRLIST_STEP		10
+
+typedef struct _BenchPage
+{
+	gchar		*name;
+	GString		*html;
+}BenchPage;
+
+typedef struct _BenchStage
+{
+	const gchar	*name;
+	GTimer		*timer;
+	gulong		allocs;
+}BenchStage;
+
+typedef struct _BenchHttp
+{
+	GMainLoop			*loop;
+	QmonReportParser	*parser;
+	gboolean			success;
+}BenchHttp;
+
+static gulong bench_allocs = 0;
+
+/*******************************************************
+ ******allocation counting*************************************
+ ********************************************************/
+#if !GLIB_CHECK_VERSION(2,46,0)
+static gpointer
+bench_malloc(gsize n_bytes)
+{
+	bench_allocs++;
+	return malloc(n_bytes);
+}
+
+static gpointer
+bench_realloc(gpointer mem, gsize n_bytes)
+{
+	bench_allocs++;
+	return realloc(mem, n_bytes);
+}
+
+static GMemVTable bench_vtable = {
+	bench_malloc,
+	bench_realloc,
+	free,
+	NULL,
+	NULL,
+	NULL
+};
+#endif
+
+static void *
+bench_xml_malloc(size_t size)
+{
+	bench_allocs++;
+	return malloc(size);
+}
+
+static void *
+bench_xml_realloc(void *mem, size_t size)
+{
+	bench_allocs++;
+	return realloc(mem, size);
+}
+
+static char *
+bench_xml_strdup(const char *str)
+{
+	bench_allocs++;
+	return strdup(str);
+}
+
+/*******************************************************
+ ******pages*************************************
+ ********************************************************/
+static GString *
+bench_page_generate(gint rows)
+{
+	static const gchar *status[] = { "WIP", "CUS", "SLP", "RVW" };
+	GString *html = NULL;
+	gint row, column;
+
+	html = g_string_sized_new(rows * 512 + 1024);
+
+	g_string_append(html, "<html><head><title>Qmon</title></head><body>\n"
+						"<table><tr><td>menu</td><td>queue</td></tr></table>\n"
+						"<TABLE BORDER=0 CELLSPACING=1 CELLPADDING=2 BGCOLOR="
+						QMON_HTMLTABLE_BGCOLOR ">\n<tr>");
+
+	for(column = 0; column < QMON_HTMLTABLE_COLUMN_NUM; column++)
+		g_string_append_printf(html, "<td><b>column %d</b></td>", column);
+	g_string_append(html, "</tr>\n");
+
+	for(row = 0; row < rows; row++){
+		g_string_append(html, "<tr>");
+
+		for(column = 0; column < QMON_HTMLTABLE_COLUMN_NUM; column++){
+			switch(column){
+				case INDEX_SR_NUMBER:
+					g_string_append_printf(html, "<td><a href=\"sr?%d\">3-%07d</a></td>", row, row);
+					break;
+				case INDEX_SR_SERVERITY:
+					g_string_append_printf(html, "<td>%d</td>", row % 4 + 1);
+					break;
+				case INDEX_SR_STATUS:
+					g_string_append_printf(html, "<td>%s</td>", status[row % 4]);
+					break;
+				case INDEX_SR_ANALYST:
+					g_string_append_printf(html, "<td>ANALYST%d</td>", row % 25);
+					break;
+				case INDEX_SR_SUBJECT:
+					g_string_append_printf(html, "<td>Subject of SR %d &amp; its product</td>", row);
+					break;
+				default:
+					g_string_append(html, "<td><font size=1>-</font></td>");
+					break;
+			}
+		}
+
+		g_string_append(html, "</tr>\n");
+	}
+
+	g_string_append(html, "</TABLE>\n<p>generated by qmonbench</p></body></html>\n");
+
+	return html;
+}
+
+static BenchPage *
+bench_page_new(const gchar *name, GString *html)
+{
+	BenchPage *page = g_new0(BenchPage, 1);
+
+	page->name = g_strdup(name);
+	page->html = html;
+
+	return page;
+}
+
+static BenchPage *
+bench_page_load(const gchar *filename)
+{
+	GError *error = NULL;
+	gchar *contents = NULL;
+	gsize length = 0;
+	BenchPage *page = NULL;
+
+	if(!g_file_get_contents(filename, &contents, &length, &error)){
+		g_printerr("qmonbench: %s\n", error->message);
+		g_error_free(error);
+		return NULL;
+	}
+
+	page = bench_page_new(filename, g_string_new_len(contents, length));
+	g_free(contents);
+
+	return page;
+}
+
+static void
+bench_page_free(BenchPage *page)
+{
+	g_free(page->name);
+	g_string_free(page->html, TRUE);
+	g_free(page);
+}
+
+/*******************************************************
+ ******stages*************************************
+ ********************************************************/
+static void
+bench_stage_begin(BenchStage *stage, const gchar *name)
+{
+	stage->name 	= name;
+	stage->allocs 	= bench_allocs;
+	g_timer_start(stage->timer);
+}
+
+static void
+bench_stage_end(BenchStage *stage, const BenchPage *page, gint rows, gint iterations)
+{
+	g_timer_stop(stage->timer);
+
+	g_print("%-24s %7d  %-16s %10.3f %10lu\n", page->name, rows, stage->name,
+			g_timer_elapsed(stage->timer, NULL) * 1000 / iterations,
+			(bench_allocs - stage->allocs) / iterations);
+}
+
+static GList *
+bench_parse(const GString *html)
+{
+	QmonReportParser *parser = NULL;
+	gsize offset, len;
+
+	parser = qmon_report_parser_new();
+
+	/* as the http engine hands the body over */
+	for(offset = 0; offset < html->len; offset += len){
+		len = MIN(QMON_HTTP_FEED_SIZE, html->len - offset);
+		qmon_report_parser_feed(parser, html->str + offset, len);
+	}
+
+	return qmon_report_parser_finish(parser);
+}
+
+static QmonMonitor *
+bench_monitor_new(QmonTarget target, GList *srlist)
+{
+	QmonMonitor *monitor = NULL;
+	QmonOptions *options = NULL;
+	GList *tmp = NULL;
+	gint i = 0;
+
+	options = g_new0(QmonOptions, 1);
+	options->target = target;
+	options->srset 	= g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	if(target == QMON_TARGET_ANALYST)
+		options->params.analyst = g_strdup(BENCH_ANALYST);
+
+	for(tmp = srlist; tmp; tmp = g_list_next(tmp), i++){
+		if(i % BENCH_SRLIST_STEP == 0)
+			g_hash_table_replace(options->srset,
+						g_ascii_strdown(((SR *)tmp->data)->number, -1), GINT_TO_POINTER(TRUE));
+	}
+
+	monitor = g_new0(QmonMonitor, 1);
+	monitor->plugin 	= g_new0(OulPlugin, 1);
+	monitor->options 	= options;
+	monitor->state 		= qmon_report_state_new();
+
+	return monitor;
+}
+
+static void
+bench_monitor_free(QmonMonitor *monitor)
+{
+	g_free(monitor->plugin->extra);
+	g_free(monitor->plugin);
+
+	g_hash_table_destroy(monitor->options->srset);
+	if(monitor->options->target == QMON_TARGET_ANALYST)
+		g_free(monitor->options->params.analyst);
+	g_free(monitor->options);
+
+	qmon_report_state_destroy(monitor->state);
+	g_free(monitor);
+}
+
+/* every iteration reports to a fresh monitor, so every SR is new */
+static void
+bench_report(GList *srlist, QmonTarget target)
+{
+	QmonMonitor *monitor = bench_monitor_new(target, srlist);
+
+	qmon_report(monitor, srlist);
+	bench_monitor_free(monitor);
+}
+
+/*******************************************************
+ ******http stand-in*************************************
+ ********************************************************/
+static gboolean
+bench_server_request(gint fd, GString *request)
+{
+	gchar buf[4096], *end = NULL, *p = NULL;
+	gssize n;
+	gsize need;
+
+	g_string_truncate(request, 0);
+
+	for(;;){
+		if((end = strstr(request->str, "\r\n\r\n")) != NULL){
+			need = end - request->str + 4;
+
+			p = g_strstr_len(request->str, end - request->str, "Content-Length:");
+			if(p)
+				need += strtoul(p + strlen("Content-Length:"), NULL, 10);
+
+			if(request->len >= need)
+				return TRUE;
+		}
+
+		n = read(fd, buf, sizeof(buf));
+		if(n <= 0)
+			return FALSE;
+
+		g_string_append_len(request, buf, n);
+	}
+}
+
+/* answers every request on the connection with the page, until it is closed */
+static void
+bench_server_serve(gint fd, const GString *html)
+{
+	GString *request = g_string_new("");
+	gchar *header = NULL;
+	gsize sent;
+	gssize n;
+
+	header = g_strdup_printf("HTTP/1.1 200 OK\r\n"
+							"Content-Type: text/html\r\n"
+							"Content-Length: %lu\r\n\r\n", (gulong)html->len);
+
+	while(bench_server_request(fd, request)){
+		if(write(fd, header, strlen(header)) < 0)
+			break;
+
+		for(sent = 0; sent < html->len; sent += n){
+			n = write(fd, html->str + sent, html->len - sent);
+			if(n <= 0)
+				break;
+		}
+	}
+
+	g_free(header);
+	g_string_free(request, TRUE);
+	close(fd);
+}
+
+static pid_t
+bench_server_start(const GString *html, gint *port)
+{
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	gint listen_fd, fd;
+	pid_t pid;
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(listen_fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family 		= AF_INET;
+	addr.sin_addr.s_addr 	= htonl(INADDR_LOOPBACK);
+	addr.sin_port 			= 0;
+
+	if(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+		|| listen(listen_fd, 8) < 0
+		|| getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) < 0){
+		close(listen_fd);
+		return -1;
+	}
+
+	*port = ntohs(addr.sin_port);
+
+	pid = fork();
+	if(pid != 0){
+		close(listen_fd);
+		return pid;
+	}
+
+	while((fd = accept(listen_fd, NULL, NULL)) >= 0)
+		bench_server_serve(fd, html);
+
+	_exit(0);
+}
+
+static guint
+bench_input_add(gint fd, OulInputCondition condition, OulInputFunction function, gpointer data);
+
+static OulEventLoopUiOps bench_eventloop_ops =
+{
+	g_timeout_add,
+	g_source_remove,
+	bench_input_add,
+	g_source_remove,
+	NULL,
+#if GLIB_CHECK_VERSION(2,14,0)
+	g_timeout_add_seconds,
+#else
+	NULL,
+#endif
+	NULL,
+	NULL,
+	NULL
+};
+
+typedef struct _BenchIOClosure
+{
+	OulInputFunction	function;
+	gpointer			data;
+}BenchIOClosure;
+
+static gboolean
+bench_io_invoke(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	BenchIOClosure *closure = data;
+	OulInputCondition cond = 0;
+
+	if(condition & (G_IO_IN | G_IO_HUP | G_IO_ERR))
+		cond |= OUL_INPUT_READ;
+	if(condition & (G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL))
+		cond |= OUL_INPUT_WRITE;
+
+	closure->function(closure->data, g_io_channel_unix_get_fd(source), cond);
+
+	return TRUE;
+}
+
+static guint
+bench_input_add(gint fd, OulInputCondition condition, OulInputFunction function, gpointer data)
+{
+	BenchIOClosure *closure = g_new0(BenchIOClosure, 1);
+	GIOChannel *channel = NULL;
+	GIOCondition cond = 0;
+	guint ret;
+
+	closure->function 	= function;
+	closure->data 		= data;
+
+	if(condition & OUL_INPUT_READ)
+		cond |= G_IO_IN | G_IO_HUP | G_IO_ERR;
+	if(condition & OUL_INPUT_WRITE)
+		cond |= G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
+
+	channel = g_io_channel_unix_new(fd);
+	ret = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, cond, bench_io_invoke, closure, g_free);
+	g_io_channel_unref(channel);
+
+	return ret;
+}
+
+static void
+bench_http_body_cb(const gchar *data, gsize len, gpointer user_data)
+{
+	BenchHttp *http = (BenchHttp *)user_data;
+
+	qmon_report_parser_feed(http->parser, data, len);
+}
+
+static void
+bench_http_done_cb(QmonHttpRequest *request, gboolean success, gpointer data)
+{
+	BenchHttp *http = (BenchHttp *)data;
+
+	http->success = success && request->status == 200;
+	g_main_loop_quit(http->loop);
+}
+
+/* the whole poll path, against the stand-in serving the page */
+static void
+bench_http(const BenchPage *page, BenchStage *stage, gint iterations)
+{
+	QmonHttpRequest *request = NULL;
+	BenchHttp http;
+	GList *srlist = NULL;
+	gchar *url = NULL;
+	gint port = 0, i, rows = 0;
+	pid_t pid;
+
+	pid = bench_server_start(page->html, &port);
+	if(pid < 0){
+		g_printerr("qmonbench: can not start the http stand-in.\n");
+		return;
+	}
+
+	url = g_strdup_printf("http://127.0.0.1:%d/qmon3/qmon.pl", port);
+
+	memset(&http, 0, sizeof(http));
+	http.loop = g_main_loop_new(NULL, FALSE);
+
+	request = qmon_http_request_new(url, bench_http_done_cb, &http);
+	qmon_http_request_set_write_func(request, bench_http_body_cb, &http);
+
+	bench_stage_begin(stage, "http poll");
+	for(i = 0; i < iterations; i++){
+		http.parser = qmon_report_parser_new();
+
+		if(!qmon_http_request_post(request, "tab=srs&selection=bench")){
+			qmon_report_parser_destroy(http.parser);
+			break;
+		}
+
+		g_main_loop_run(http.loop);
+
+		srlist = qmon_report_parser_finish(http.parser);
+		http.parser = NULL;
+
+		if(!http.success || srlist == NULL){
+			g_printerr("qmonbench: http poll of %s failed.\n", page->name);
+			qmon_srlist_free(srlist);
+			break;
+		}
+
+		rows = g_list_length(srlist);
+		bench_report(srlist, QMON_TARGET_CTC);
+		qmon_srlist_free(srlist);
+	}
+	bench_stage_end(stage, page, rows, MAX(i, 1));
+
+	qmon_http_request_destroy(request);
+	g_main_loop_unref(http.loop);
+	g_free(url);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+/*******************************************************
+ ******main*************************************
+ ********************************************************/
+static void
+bench_run(const BenchPage *page, gint iterations, gboolean http)
+{
+	BenchStage stage;
+	GList *srlist = NULL, *filtered = NULL;
+	GString *details = NULL;
+	QmonMonitor *monitor = NULL;
+	gint i, rows;
+
+	stage.timer = g_timer_new();
+
+	bench_stage_begin(&stage, "parse");
+	for(i = 0; i < iterations; i++){
+		qmon_srlist_free(srlist);
+		srlist = bench_parse(page->html);
+	}
+	rows = g_list_length(srlist);
+	bench_stage_end(&stage, page, rows, iterations);
+
+	if(srlist == NULL){
+		g_printerr("qmonbench: no SR table in %s.\n", page->name);
+		g_timer_destroy(stage.timer);
+		return;
+	}
+
+	monitor = bench_monitor_new(QMON_TARGET_SRLIST, srlist);
+	bench_stage_begin(&stage, "filter srlist");
+	for(i = 0; i < iterations; i++){
+		filtered = sr_filter_by_srlist(srlist, monitor->options->srset);
+		g_list_free(filtered);
+	}
+	bench_stage_end(&stage, page, rows, iterations);
+	bench_monitor_free(monitor);
+
+	bench_stage_begin(&stage, "filter analyst");
+	for(i = 0; i < iterations; i++){
+		filtered = sr_filter_by_analyst(srlist, BENCH_ANALYST);
+		g_list_free(filtered);
+	}
+	bench_stage_end(&stage, page, rows, iterations);
+
+	bench_stage_begin(&stage, "srdetails");
+	for(i = 0; i < iterations; i++){
+		details = srlist_to_srdetails(srlist);
+		g_string_free(details, TRUE);
+	}
+	bench_stage_end(&stage, page, rows, iterations);
+
+	bench_stage_begin(&stage, "report");
+	for(i = 0; i < iterations; i++)
+		bench_report(srlist, QMON_TARGET_CTC);
+	bench_stage_end(&stage, page, rows, iterations);
+
+	qmon_srlist_free(srlist);
+
+	if(http)
+		bench_http(page, &stage, iterations);
+
+	g_timer_destroy(stage.timer);
+}
+
+static void
+bench_usage(void)
+{
+	g_printerr("usage: qmonbench [-n iterations] [--http] [page.html ...]\n"
+			   "       qmonbench --generate rows > page.html\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	GList *pages = NULL, *tmp = NULL;
+	BenchPage *page = NULL;
+	struct rusage usage;
+	gint iterations = BENCH_ITERATIONS, i;
+	gboolean http = FALSE;
+	GString *html = NULL;
+
+	/* must come before anything allocates, newer glib only counts libxml2 */
+#if !GLIB_CHECK_VERSION(2,46,0)
+	g_mem_set_vtable(&bench_vtable);
+#endif
+	xmlMemSetup(free, bench_xml_malloc, bench_xml_realloc, bench_xml_strdup);
+
+	for(i = 1; i < argc; i++){
+		if(!strcmp(argv[i], "-n") && i + 1 < argc){
+			iterations = atoi(argv[++i]);
+			iterations = MAX(iterations, 1);
+		}else if(!strcmp(argv[i], "--http")){
+			http = TRUE;
+		}else if(!strcmp(argv[i], "--generate") && i + 1 < argc){
+			html = bench_page_generate(atoi(argv[++i]));
+			fwrite(html->str, 1, html->len, stdout);
+			g_string_free(html, TRUE);
+			return 0;
+		}else if(argv[i][0] == '-'){
+			bench_usage();
+			return 1;
+		}else if((page = bench_page_load(argv[i])) != NULL){
+			pages = g_list_append(pages, page);
+		}else{
+			return 1;
+		}
+	}
+
+	if(pages == NULL){
+		pages = g_list_append(pages, bench_page_new("small", bench_page_generate(20)));
+		pages = g_list_append(pages, bench_page_new("typical", bench_page_generate(500)));
+		pages = g_list_append(pages, bench_page_new("synthetic-10k", bench_page_generate(10000)));
+	}
+
+	/* qmon_report() notifies through the signals, nobody listens here */
+	oul_signals_init();
+	oul_notify_init();
+
+	if(http){
+		oul_eventloop_set_ui_ops(&bench_eventloop_ops);
+		if(!qmon_http_init())
+			return 1;
+	}
+
+	g_print("%-24s %7s  %-16s %10s %10s\n", "page", "rows", "stage", "ms/iter", "allocs/iter");
+
+	for(tmp = pages; tmp; tmp = g_list_next(tmp))
+		bench_run((BenchPage *)tmp->data, iterations, http);
+
+	if(http)
+		qmon_http_uninit();
+
+	g_list_foreach(pages, (GFunc)bench_page_free, NULL);
+	g_list_free(pages);
+
+	oul_notify_uninit();
+	oul_signals_uninit();
+
+	getrusage(RUSAGE_SELF, &usage);
+	g_print("peak rss: %ld KB\n", usage.ru_maxrss);
+
+	return 0;
+}
@@ -0,0 +1,529 @@
+
+#include <curl/curl.h>
+#include <curl/multi.h>
+
+#include "internal.h"
+#include "eventloop.h"
+#include "qmonhttp.h"
+
+typedef struct _QmonHttpSocket
+{
+	curl_socket_t	fd;
+	guint			input;		/* oul input handler watching the fd */
+	int				what;		/* CURL_POLL_* which is being watched */
+}QmonHttpSocket;
+
+static CURLM *multi_handle 	= NULL;
+static guint multi_timer 	= 0;
+static int running_handles 	= 0;
+
+static GList *http_requests = NULL;
+static GList *http_sockets 	= NULL;
+
+/* finished requests waiting to be delivered by http_done_dispatch_cb() */
+static GQueue *http_done_queue = NULL;
+static guint http_done_timer = 0;
+
+/* grow the body once from Content-Length, instead of doubling while it arrives */
+static void
+http_body_presize(QmonHttpRequest *request, const gchar *line, size_t len)
+{
+	static const gchar name[] = "Content-Length:";
+	gchar value[32];
+	gulong size;
+
+	if(request->write_func || len <= sizeof(name) - 1 || len - (sizeof(name) - 1) >= sizeof(value))
+		return;
+
+	if(g_ascii_strncasecmp(line, name, sizeof(name) - 1))
+		return;
+
+	memcpy(value, line + sizeof(name) - 1, len - (sizeof(name) - 1));
+	value[len - (sizeof(name) - 1)] = '\0';
+
+	size = strtoul(value, NULL, 10);
+	if(size == 0 || size > QMON_HTTP_PRESIZE_MAX || size <= request->body->allocated_len)
+		return;
+
+	g_string_set_size(request->body, size);
+	g_string_truncate(request->body, 0);
+}
+
+static size_t
+http_header_cb(void *ptr, size_t size, size_t nmemb, void *data)
+{
+	QmonHttpRequest *request = (QmonHttpRequest *)data;
+	size_t real_size = size * nmemb;
+
+	g_string_append_len(request->header, ptr, real_size);
+	http_body_presize(request, ptr, real_size);
+
+	return real_size;
+}
+
+/* hand the batched part of a streamed body to the write func */
+static void
+http_body_flush(QmonHttpRequest *request)
+{
+	if(request->write_func == NULL || request->body->len == 0)
+		return;
+
+	request->write_func(request->body->str, request->body->len, request->write_data);
+	g_string_truncate(request->body, 0);
+}
+
+static size_t
+http_body_cb(void *ptr, size_t size, size_t nmemb, void *data)
+{
+	QmonHttpRequest *request = (QmonHttpRequest *)data;
+	size_t real_size = size * nmemb;
+
+	if(request->write_func == NULL){
+		g_string_append_len(request->body, ptr, real_size);
+		return real_size;
+	}
+
+	/* big writes go straight through, small ones are batched in the reused body */
+	if(request->body->len == 0 && real_size >= QMON_HTTP_FEED_SIZE){
+		request->write_func(ptr, real_size, request->write_data);
+		return real_size;
+	}
+
+	g_string_append_len(request->body, ptr, real_size);
+	if(request->body->len >= QMON_HTTP_FEED_SIZE)
+		http_body_flush(request);
+
+	return real_size;
+}
+
+/* deliver all the finished requests in one batch from the main loop */
+static gboolean
+http_done_dispatch_cb(gpointer data)
+{
+	QmonHttpRequest *request = NULL;
+
+	http_done_timer = 0;
+
+	while((request = g_queue_pop_head(http_done_queue)) != NULL){
+		request->busy = FALSE;
+
+		/* the tail of a streamed body is still in the batch */
+		if(request->result == CURLE_OK)
+			http_body_flush(request);
+
+		if(request->callback)
+			request->callback(request, request->result == CURLE_OK, request->user_data);
+	}
+
+	return FALSE;
+}
+
+static void
+http_check_multi_info(void)
+{
+	CURLMsg *msg = NULL;
+	CURL *curl = NULL;
+	CURLcode result;
+	QmonHttpRequest *request = NULL;
+	int msgs_left = 0;
+
+	while((msg = curl_multi_info_read(multi_handle, &msgs_left)) != NULL){
+		if(msg->msg != CURLMSG_DONE)
+			continue;
+
+		/* msg is invalid after the easy handle was removed */
+		curl 	= msg->easy_handle;
+		result 	= msg->data.result;
+
+		request = NULL;
+		curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&request);
+		curl_multi_remove_handle(multi_handle, curl);
+
+		if(request == NULL)
+			continue;
+
+		request->result = result;
+		request->status = 0;
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &request->status);
+
+		if(result != CURLE_OK){
+			oul_debug_info("qmonhttp", "qmon http perform failed: %s.\n", request->error_msg);
+		}else{
+			oul_debug_info("qmonhttp", "qmon http perform ok.\n");
+		}
+
+		/* never call back from inside curl, queue it for the main loop */
+		g_queue_push_tail(http_done_queue, request);
+	}
+
+	if(!g_queue_is_empty(http_done_queue) && http_done_timer == 0)
+		http_done_timer = oul_timeout_add(0, http_done_dispatch_cb, NULL);
+}
+
+static gboolean
+http_multi_timeout_cb(gpointer data)
+{
+	multi_timer = 0;
+
+	curl_multi_socket_action(multi_handle, CURL_SOCKET_TIMEOUT, 0, &running_handles);
+	http_check_multi_info();
+
+	return FALSE;
+}
+
+/* curl asks us to (re)arm the single timer of the multi handle */
+static int
+http_multi_timer_cb(CURLM *multi, long timeout_ms, void *data)
+{
+	if(multi_timer > 0){
+		oul_timeout_remove(multi_timer);
+		multi_timer = 0;
+	}
+
+	/* -1 means there is no timeout to wait for */
+	if(timeout_ms >= 0)
+		multi_timer = oul_timeout_add(timeout_ms, http_multi_timeout_cb, NULL);
+
+	return 0;
+}
+
+static void
+http_socket_event_cb(gpointer data, gint fd, OulInputCondition cond)
+{
+	int action = 0;
+
+	if(cond & OUL_INPUT_READ)
+		action |= CURL_CSELECT_IN;
+	if(cond & OUL_INPUT_WRITE)
+		action |= CURL_CSELECT_OUT;
+
+	curl_multi_socket_action(multi_handle, fd, action, &running_handles);
+	http_check_multi_info();
+
+	if(running_handles <= 0 && multi_timer > 0){
+		oul_timeout_remove(multi_timer);
+		multi_timer = 0;
+	}
+}
+
+static void
+http_socket_free(QmonHttpSocket *sock)
+{
+	if(sock->input > 0){
+		oul_input_remove(sock->input);
+		sock->input = 0;
+	}
+
+	http_sockets = g_list_remove(http_sockets, sock);
+	g_free(sock);
+}
+
+/* curl tells us which sockets it is interested in */
+static int
+http_multi_socket_cb(CURL *curl, curl_socket_t fd, int what, void *data, void *socketp)
+{
+	QmonHttpSocket *sock = (QmonHttpSocket *)socketp;
+	OulInputCondition cond = 0;
+
+	if(what == CURL_POLL_REMOVE){
+		if(sock)
+			http_socket_free(sock);
+
+		return 0;
+	}
+
+	if(sock == NULL){
+		sock = g_new0(QmonHttpSocket, 1);
+		sock->fd = fd;
+
+		http_sockets = g_list_prepend(http_sockets, sock);
+		curl_multi_assign(multi_handle, fd, sock);
+	}
+
+	if(sock->input > 0){
+		if(sock->what == what)
+			return 0;
+
+		oul_input_remove(sock->input);
+		sock->input = 0;
+	}
+
+	if(what & CURL_POLL_IN)
+		cond |= OUL_INPUT_READ;
+	if(what & CURL_POLL_OUT)
+		cond |= OUL_INPUT_WRITE;
+
+	sock->what 	= what;
+	sock->input = oul_input_add(fd, cond, http_socket_event_cb, NULL);
+
+	return 0;
+}
+
+/*******************************************************
+ ******public interface*************************************
+ ********************************************************/
+gboolean
+qmon_http_init(void)
+{
+	if(multi_handle != NULL)
+		return TRUE;
+
+	if(curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK){
+		oul_debug_error("qmonhttp", "curl global init failed.\n");
+		return FALSE;
+	}
+
+	multi_handle = curl_multi_init();
+	if(multi_handle == NULL){
+		oul_debug_error("qmonhttp", "curl multi init failed.\n");
+		curl_global_cleanup();
+		return FALSE;
+	}
+
+	curl_multi_setopt(multi_handle, CURLMOPT_SOCKETFUNCTION, http_multi_socket_cb);
+	curl_multi_setopt(multi_handle, CURLMOPT_TIMERFUNCTION, http_multi_timer_cb);
+
+	http_done_queue = g_queue_new();
+
+	return TRUE;
+}
+
+void
+qmon_http_uninit(void)
+{
+	if(multi_handle == NULL)
+		return;
+
+	while(http_requests)
+		qmon_http_request_destroy((QmonHttpRequest *)http_requests->data);
+
+	curl_multi_cleanup(multi_handle);
+	multi_handle = NULL;
+
+	while(http_sockets)
+		http_socket_free((QmonHttpSocket *)http_sockets->data);
+
+	if(multi_timer > 0){
+		oul_timeout_remove(multi_timer);
+		multi_timer = 0;
+	}
+
+	if(http_done_timer > 0){
+		oul_timeout_remove(http_done_timer);
+		http_done_timer = 0;
+	}
+
+	g_queue_free(http_done_queue);
+	http_done_queue = NULL;
+
+	running_handles = 0;
+
+	curl_global_cleanup();
+}
+
+QmonHttpRequest *
+qmon_http_request_new(const gchar *url, QmonHttpCallback callback, gpointer user_data)
+{
+	QmonHttpRequest *request = NULL;
+
+	g_return_val_if_fail(url != NULL, NULL);
+
+	request = g_new0(QmonHttpRequest, 1);
+
+	request->curl = curl_easy_init();
+	if(request->curl == NULL){
+		oul_debug_error("qmonhttp", "curl easy init failed.\n");
+		g_free(request);
+		return NULL;
+	}
+
+	request->callback 	= callback;
+	request->user_data 	= user_data;
+	request->busy 		= FALSE;
+
+	request->header 	= g_string_new("");
+	request->body 		= g_string_new("");
+
+	/* the curl traces only go with the debug output */
+	if(oul_debug_is_enabled())
+		curl_easy_setopt(request->curl, CURLOPT_VERBOSE, 1L);
+
+	curl_easy_setopt(request->curl, CURLOPT_PRIVATE, request);
+	curl_easy_setopt(request->curl, CURLOPT_NOPROGRESS, 1L);
+	curl_easy_setopt(request->curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(request->curl, CURLOPT_ERRORBUFFER, request->error_msg);
+	curl_easy_setopt(request->curl, CURLOPT_URL, url);
+	curl_easy_setopt(request->curl, CURLOPT_POST, 1L);
+	curl_easy_setopt(request->curl, CURLOPT_CONNECTTIMEOUT, (long)QMON_HTTP_CONNECT_TIMEOUT);
+	curl_easy_setopt(request->curl, CURLOPT_TIMEOUT, (long)QMON_HTTP_TIMEOUT);
+
+	curl_easy_setopt(request->curl, CURLOPT_HEADERFUNCTION, http_header_cb);
+	curl_easy_setopt(request->curl, CURLOPT_WRITEHEADER, request);
+	curl_easy_setopt(request->curl, CURLOPT_WRITEFUNCTION, http_body_cb);
+	curl_easy_setopt(request->curl, CURLOPT_WRITEDATA, request);
+
+#if LIBCURL_VERSION_NUM >= 0x071900
+	curl_easy_setopt(request->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+#endif
+
+	http_requests = g_list_prepend(http_requests, request);
+
+	return request;
+}
+
+void
+qmon_http_request_set_cookie(QmonHttpRequest *request, const gchar *cookie)
+{
+	g_return_if_fail(request != NULL);
+
+	curl_easy_setopt(request->curl, CURLOPT_COOKIE, cookie);
+}
+
+void
+qmon_http_request_set_write_func(QmonHttpRequest *request, QmonHttpWriteFunc func, gpointer user_data)
+{
+	g_return_if_fail(request != NULL);
+
+	request->write_func = func;
+	request->write_data = user_data;
+
+	/* the batch is allocated once, and kept for every later transfer */
+	if(func && request->body->allocated_len < QMON_HTTP_FEED_SIZE * 2){
+		g_string_set_size(request->body, QMON_HTTP_FEED_SIZE * 2);
+		g_string_truncate(request->body, 0);
+	}
+}
+
+void
+qmon_http_request_add_header(QmonHttpRequest *request, const gchar *header)
+{
+	g_return_if_fail(request != NULL);
+	g_return_if_fail(header != NULL);
+
+	request->headers = curl_slist_append(request->headers, header);
+	curl_easy_setopt(request->curl, CURLOPT_HTTPHEADER, request->headers);
+}
+
+void
+qmon_http_request_clear_headers(QmonHttpRequest *request)
+{
+	g_return_if_fail(request != NULL);
+
+	curl_easy_setopt(request->curl, CURLOPT_HTTPHEADER, NULL);
+
+	if(request->headers){
+		curl_slist_free_all(request->headers);
+		request->headers = NULL;
+	}
+}
+
+gchar *
+qmon_http_request_get_header(QmonHttpRequest *request, const gchar *name)
+{
+	gchar *line = NULL, *end = NULL, *value = NULL;
+	gsize name_len;
+
+	g_return_val_if_fail(request != NULL, NULL);
+	g_return_val_if_fail(name != NULL, NULL);
+
+	name_len = strlen(name);
+
+	/* the last one wins, the headers of a redirect or 100-continue come first */
+	for(line = request->header->str; line && *line; line = end){
+		end = strchr(line, '\n');
+		if(end)
+			end++;
+
+		if(g_ascii_strncasecmp(line, name, name_len) || line[name_len] != ':')
+			continue;
+
+		g_free(value);
+		value = g_strstrip(g_strndup(line + name_len + 1,
+						(end ? end : line + strlen(line)) - line - name_len - 1));
+	}
+
+	return value;
+}
+
+gboolean
+qmon_http_request_post(QmonHttpRequest *request, const gchar *post_content)
+{
+	CURLMcode code;
+
+	g_return_val_if_fail(request != NULL, FALSE);
+	g_return_val_if_fail(multi_handle != NULL, FALSE);
+
+	if(request->busy){
+		oul_debug_info("qmonhttp", "previous transfer is still in progress.\n");
+		return FALSE;
+	}
+
+	g_free(request->post_content);
+	request->post_content = g_strdup(post_content);
+	request->error_msg[0] = '\0';
+	request->result = CURLE_OK;
+	request->status = 0;
+
+	/* the buffers are reused, so the memory is kept between polls */
+	g_string_truncate(request->header, 0);
+	g_string_truncate(request->body, 0);
+
+	curl_easy_setopt(request->curl, CURLOPT_POSTFIELDS, request->post_content);
+
+	/* the multi handle kicks off the transfer from its timer */
+	code = curl_multi_add_handle(multi_handle, request->curl);
+	if(code != CURLM_OK){
+		oul_debug_error("qmonhttp", "add transfer failed: %s\n", curl_multi_strerror(code));
+		return FALSE;
+	}
+
+	request->busy = TRUE;
+
+	return TRUE;
+}
+
+void
+qmon_http_request_cancel(QmonHttpRequest *request)
+{
+	GList *link = NULL;
+
+	g_return_if_fail(request != NULL);
+
+	if(!request->busy)
+		return;
+
+	/* either still transferring or waiting to be delivered */
+	link = g_queue_find(http_done_queue, request);
+	if(link)
+		g_queue_delete_link(http_done_queue, link);
+	else
+		curl_multi_remove_handle(multi_handle, request->curl);
+
+	request->busy = FALSE;
+}
+
+void
+qmon_http_request_destroy(QmonHttpRequest *request)
+{
+	g_return_if_fail(request != NULL);
+
+	qmon_http_request_cancel(request);
+
+	http_requests = g_list_remove(http_requests, request);
+
+	curl_easy_cleanup(request->curl);
+	request->curl = NULL;
+
+	if(request->headers){
+		curl_slist_free_all(request->headers);
+		request->headers = NULL;
+	}
+
+	g_free(request->post_content);
+	request->post_content = NULL;
+
+	g_string_free(request->header, TRUE);
+	g_string_free(request->body, TRUE);
+
+	g_free(request);
+}
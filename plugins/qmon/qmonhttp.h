@@ -0,0 +1,81 @@
+#ifndef __PLUGIN_QMON_HTTP_H
+#define __PLUGIN_QMON_HTTP_H
+
+#include <glib.h>
+#include <curl/curl.h>
+
+/* streamed bodies are handed to the write func in blocks of at least this size */
+#define	QMON_HTTP_FEED_SIZE			(32 * 1024)
+
+/* a body is preallocated from Content-Length up to this size */
+#define	QMON_HTTP_PRESIZE_MAX		(16 * 1024 * 1024)
+
+/* a hung server fails the login or poll after these many seconds */
+#define	QMON_HTTP_CONNECT_TIMEOUT	30
+#define	QMON_HTTP_TIMEOUT			120
+
+typedef struct _QmonHttpRequest QmonHttpRequest;
+
+/**
+ * Invoked from the main loop once the transfer was finished, the
+ * received header and body are only valid until the next post.
+ *
+ * @param request	The finished request.
+ * @param success	TRUE if curl completed the transfer without error.
+ * @param data		User data passed to qmon_http_request_new().
+ */
+typedef void (*QmonHttpCallback)(QmonHttpRequest *request, gboolean success, gpointer data);
+
+/* Receives the http body block by block, instead of accumulating it */
+typedef void (*QmonHttpWriteFunc)(const gchar *data, gsize len, gpointer user_data);
+
+struct _QmonHttpRequest
+{
+	CURL				*curl;			/* easy handle, reused for every transfer */
+	gchar				error_msg[CURL_ERROR_SIZE];
+	gchar				*post_content;	/* curl does not copy it, keep it until transfer finishes */
+
+	GString				*header;		/* received http header */
+	GString				*body;			/* received http body, or the batch of a streamed one */
+
+	QmonHttpWriteFunc	write_func;
+	gpointer			write_data;
+
+	struct curl_slist	*headers;		/* extra request headers, sent with every post */
+
+	gboolean			busy;			/* TRUE until the completion was delivered */
+	CURLcode			result;			/* result of the finished transfer */
+	long				status;			/* http response code of the finished transfer */
+
+	QmonHttpCallback	callback;
+	gpointer			user_data;
+};
+
+/**
+ * Initializes the shared curl multi handle, and hooks it into the
+ * oul eventloop. All transfers started by qmon_http_request_post()
+ * are driven by it, so connections are reused between polls.
+ */
+gboolean			qmon_http_init(void);
+void				qmon_http_uninit(void);
+
+QmonHttpRequest *	qmon_http_request_new(const gchar *url, QmonHttpCallback callback, gpointer user_data);
+void				qmon_http_request_destroy(QmonHttpRequest *request);
+void				qmon_http_request_set_cookie(QmonHttpRequest *request, const gchar *cookie);
+void				qmon_http_request_set_write_func(QmonHttpRequest *request, QmonHttpWriteFunc func, gpointer user_data);
+void				qmon_http_request_add_header(QmonHttpRequest *request, const gchar *header);
+void				qmon_http_request_clear_headers(QmonHttpRequest *request);
+
+/* returns a copy of the value of a received header, or NULL */
+gchar *				qmon_http_request_get_header(QmonHttpRequest *request, const gchar *name);
+
+/**
+ * Starts a POST transfer on the request, returns immediately.
+ * It fails if the previous transfer of this request is still running,
+ * or its completion was not delivered yet.
+ */
+gboolean			qmon_http_request_post(QmonHttpRequest *request, const gchar *post_content);
+void				qmon_http_request_cancel(QmonHttpRequest *request);
+
+
+#endif
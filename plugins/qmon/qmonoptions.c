@@ -1,87 +1,216 @@
 #include "internal.h"
 #include "qmonoptions.h"
 
+/* compile the watch list into a set, so filtering is one lookup per SR */
+static GHashTable *
+qmon_options_srset_new(GList *srlist)
+{
+	GHashTable *srset = NULL;
+	GList *tmp = NULL;
+	gchar *key = NULL;
+
+	srset = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	for(tmp = srlist; tmp; tmp = g_list_next(tmp)){
+		if(tmp->data == NULL)
+			continue;
+
+		key = g_ascii_strdown(g_strstrip((gchar *)tmp->data), -1);
+		if(strlen(key) == 0){
+			g_free(key);
+			continue;
+		}
+
+		g_hash_table_replace(srset, key, GINT_TO_POINTER(TRUE));
+	}
+
+	return srset;
+}
+
+/* free the values loaded by qmon_options_get(), they are copies of the prefs */
+static void
+qmon_options_clear(QmonOptions *options)
+{
+	g_free(options->username);
+	options->username = NULL;
+
+	g_free(options->password);
+	options->password = NULL;
+
+	g_free(options->selection);
+	options->selection = NULL;
+
+	switch(options->target){
+		case QMON_TARGET_SRLIST:
+			g_list_foreach(options->params.srlist, (GFunc)g_free, NULL);
+			g_list_free(options->params.srlist);
+			options->params.srlist = NULL;
+			break;
+		case QMON_TARGET_ANALYST:
+			g_free(options->params.analyst);
+			options->params.analyst = NULL;
+			break;
+		case QMON_TARGET_CTC:
+		default:
+			break;
+	}
+
+	if(options->srset){
+		g_hash_table_destroy(options->srset);
+		options->srset = NULL;
+	}
+}
+
 static void
 qmon_options_get(QmonOptions *options)
 {
+	gchar *path = NULL;
+
 	g_return_if_fail(options != NULL);
 
-	options->username = oul_prefs_get_string(PLUGIN_QMON_USERNAME);
+	/* the login is shared by all the profiles */
+	options->username = g_strdup(oul_prefs_get_string(PLUGIN_QMON_USERNAME));
 	if(options->username)
 		options->username = g_strstrip(options->username);
 
-	options->password = oul_prefs_get_string(PLUGIN_QMON_PASSWORD);
+	options->password = g_strdup(oul_prefs_get_string(PLUGIN_QMON_PASSWORD));
 		if(options->password)
 			options->password = g_strstrip(options->password);
 	
-	options->target = oul_prefs_get_int(PLUGIN_QMON_TARGET);
+	path = qmon_prefs_profile_path(options->profile, PLUGIN_QMON_KEY_TARGET);
+	options->target = oul_prefs_get_int(path);
+	g_free(path);
+
 	switch(options->target){
 		case QMON_TARGET_SRLIST:
-			options->params.srlist = oul_prefs_get_string_list(PLUGIN_QMON_SRLIST);
+			path = qmon_prefs_profile_path(options->profile, PLUGIN_QMON_KEY_SRLIST);
+			options->params.srlist = oul_prefs_get_string_list(path);
+			options->srset = qmon_options_srset_new(options->params.srlist);
+			g_free(path);
 			break;
 		case QMON_TARGET_ANALYST:
-			options->params.analyst = oul_prefs_get_string(PLUGIN_QMON_ANALYST);
+			path = qmon_prefs_profile_path(options->profile, PLUGIN_QMON_KEY_ANALYST);
+			options->params.analyst = g_strdup(oul_prefs_get_string(path));
 			if(options->params.analyst)
 				options->params.analyst = g_strstrip(options->params.analyst);
-			
+			g_free(path);
 			break;
 		case QMON_TARGET_CTC:
 		default:
 			break;
 	}
 
-	options->interval  = oul_prefs_get_int(PLUGIN_QMON_INTERVAL);
+	path = qmon_prefs_profile_path(options->profile, PLUGIN_QMON_KEY_INTERVAL);
+	options->interval  = oul_prefs_get_int(path);
+	g_free(path);
 	
-	options->selection = oul_prefs_get_string(PLUGIN_QMON_SELECTION);
+	path = qmon_prefs_profile_path(options->profile, PLUGIN_QMON_KEY_SELECTION);
+	options->selection = g_strdup(oul_prefs_get_string(path));
 	if(options->selection)
 		options->selection = g_strstrip(options->selection);
-
-	
+	g_free(path);
 }
 
 QmonOptions *
 qmon_options_new()
+{
+	return qmon_options_new_for_profile(NULL);
+}
+
+QmonOptions *
+qmon_options_new_for_profile(const gchar *profile)
 {
 	QmonOptions *options = NULL;
 	
 	options = g_new0(QmonOptions, 1);
 
+	if(profile && *profile != '\0')
+		options->profile = g_strdup(profile);
+
 	qmon_options_get(options);
 
 	return options;		
 }
 
-void
-qmon_options_refresh(QmonOptions *options)
+static gboolean
+qmon_options_str_equal(const gchar *str1, const gchar *str2)
 {
-	qmon_options_get(options);
+	if(str1 == NULL || str2 == NULL)
+		return str1 == str2;
+
+	return !strcmp(str1, str2);
 }
 
-void
-qmon_options_destroy(QmonOptions *options)
+static gboolean
+qmon_options_srset_missing(gpointer key, gpointer value, gpointer data)
 {
-	g_return_if_fail(options != NULL);
+	return g_hash_table_lookup((GHashTable *)data, key) == NULL;
+}
 
-	if(options->selection){
-		g_free(options->selection);	
-		options->selection = NULL;
-	}
+static gboolean
+qmon_options_srset_equal(GHashTable *srset1, GHashTable *srset2)
+{
+	if(srset1 == NULL || srset2 == NULL)
+		return srset1 == srset2;
 
-	switch(options->target){
+	if(g_hash_table_size(srset1) != g_hash_table_size(srset2))
+		return FALSE;
+
+	return g_hash_table_find(srset1, qmon_options_srset_missing, srset2) == NULL;
+}
+
+/* TRUE if both options pick the same SRs out of the same page */
+static gboolean
+qmon_options_filter_equal(QmonOptions *options1, QmonOptions *options2)
+{
+	if(options1->target != options2->target
+		|| !qmon_options_str_equal(options1->selection, options2->selection))
+		return FALSE;
+
+	switch(options1->target){
 		case QMON_TARGET_SRLIST:
-			g_list_foreach(options->params.srlist, (GFunc)g_free, NULL);
-			g_list_free(options->params.srlist);
-			options->params.srlist = NULL;
-			break;
+			return qmon_options_srset_equal(options1->srset, options2->srset);
 		case QMON_TARGET_ANALYST:
-			g_free(options->params.analyst);
-			options->params.analyst = NULL;
-			break;
+			return qmon_options_str_equal(options1->params.analyst, options2->params.analyst);
 		case QMON_TARGET_CTC:
 		default:
-			break;
+			return TRUE;
 	}
+}
+
+gboolean
+qmon_options_refresh(QmonOptions *options)
+{
+	QmonOptions old;
+	gboolean changed = FALSE;
+
+	g_return_val_if_fail(options != NULL, FALSE);
+
+	/* load the prefs into fresh values, and keep the old ones to compare */
+	old = *options;
+
+	options->username 		= NULL;
+	options->password 		= NULL;
+	options->selection 		= NULL;
+	options->params.srlist 	= NULL;
+	options->srset 			= NULL;
+
+	qmon_options_get(options);
+
+	changed = !qmon_options_filter_equal(&old, options);
+	qmon_options_clear(&old);
+
+	return changed;
+}
+
+void
+qmon_options_destroy(QmonOptions *options)
+{
+	g_return_if_fail(options != NULL);
+
+	qmon_options_clear(options);
 
+	g_free(options->profile);
 	g_free(options);
 	options = NULL;
 }
@@ -6,6 +6,8 @@
 
 typedef struct _QmonOptions
 {
+	gchar			*profile;	/* NULL for the default profile */
+
 	gchar			*username;
 	gchar			*password;
 	
@@ -20,13 +22,16 @@ typedef struct _QmonOptions
 		gchar *analyst;
 	}params;
 	
+	GHashTable		*srset;		/* lower cased SR numbers of srlist, for lookup */
+	
 }QmonOptions;
 
 QmonOptions *	qmon_options_new();
+QmonOptions *	qmon_options_new_for_profile(const gchar *profile);
 void			qmon_options_destroy(QmonOptions *options);
 gboolean		qmon_options_validate(QmonOptions *options);
-QmonOptions *	qmon_options_new();
-void			qmon_options_refresh(QmonOptions *options);
+/* reloads the prefs, returns TRUE if the SRs picked out of the page changed */
+gboolean		qmon_options_refresh(QmonOptions *options);
 
 
 #endif
@@ -24,22 +24,24 @@
 
 #include "beasy.h"
 #include "qmon.h"
+#include "qmonhttp.h"
 #include "qmonplugin.h"
 #include "qmonpref.h"
 #include "gtkplugin.h"
 
 static OulPlugin 	*plugin_qmon = NULL;
-static QmonMonitor 	*monitor = NULL;
+static QmonMonitorSet 	*monitors = NULL;
 
 static void
 plugin_qmon_start(OulPluginAction *action)
 {
 	oul_debug_info("qmonplugin", "qmon start.\n");
 
-	if(monitor == NULL)
-		monitor = qmon_monitor_new(plugin_qmon);
+	if(monitors == NULL)
+		monitors = qmon_monitor_set_new(plugin_qmon);
 
-	qmon_monitor_start(monitor);
+	if(monitors)
+		qmon_monitor_set_start(monitors);
 }
 
 static void
@@ -47,7 +49,8 @@ plugin_qmon_stop(OulPluginAction *action)
 {
 	oul_debug_info("qmonplugin", "qmon stop.\n");
 	
-	qmon_monitor_stop(monitor);
+	if(monitors)
+		qmon_monitor_set_stop(monitors);
 }
 
 static void
@@ -55,10 +58,11 @@ plugin_qmon_check(OulPluginAction *action)
 {
 	oul_debug_info("qmonplugin", "qmon check.\n");
 
-	if(monitor == NULL)
-		monitor = qmon_monitor_new(plugin_qmon);
+	if(monitors == NULL)
+		monitors = qmon_monitor_set_new(plugin_qmon);
 
-	qmon_monitor_poll(monitor);
+	if(monitors)
+		qmon_monitor_set_poll(monitors);
 }
 
 static GList *
@@ -87,14 +91,22 @@ plugin_load(OulPlugin *plugin)
 	/* we need a handle for all the notify calls */
 	plugin_qmon = plugin;
 
+	/* all the qmon polls share the same http engine */
+	if(!qmon_http_init())
+		return FALSE;
+
 	return TRUE;
 }
 
 static gboolean
 plugin_unload(OulPlugin *plugin)
 {
-	if(monitor)
-		qmon_monitor_destroy(monitor);
+	if(monitors){
+		qmon_monitor_set_destroy(monitors);
+		monitors = NULL;
+	}
+
+	qmon_http_uninit();
 
 	return TRUE;
 }
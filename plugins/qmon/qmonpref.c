@@ -372,6 +372,52 @@ qmon_prefs_init()
 	oul_prefs_add_string(PLUGIN_QMON_ANALYST, "");
 	oul_prefs_add_string_list(PLUGIN_QMON_SRLIST, NULL);
 
+	oul_prefs_add_string_list(PLUGIN_QMON_PROFILES, NULL);
+	oul_prefs_add_none(PLUGIN_QMON_PROFILE);
+}
+
+/* returns the full pref name of key in the profile, NULL means the default one */
+gchar *
+qmon_prefs_profile_path(const gchar *profile, const gchar *key)
+{
+	if(profile == NULL || *profile == '\0')
+		return g_strdup_printf("%s/%s", PLUGIN_QMON_ROOT, key);
+
+	return g_strdup_printf("%s/%s/%s", PLUGIN_QMON_PROFILE, profile, key);
+}
+
+/* registers the prefs of a profile, the values loaded from disk are kept */
+void
+qmon_prefs_profile_init(const gchar *profile)
+{
+	gchar *path = NULL;
+
+	if(profile == NULL || *profile == '\0')
+		return;
+
+	path = g_strdup_printf("%s/%s", PLUGIN_QMON_PROFILE, profile);
+	oul_prefs_add_none(path);
+	g_free(path);
+
+	path = qmon_prefs_profile_path(profile, PLUGIN_QMON_KEY_SELECTION);
+	oul_prefs_add_string(path, "");
+	g_free(path);
+
+	path = qmon_prefs_profile_path(profile, PLUGIN_QMON_KEY_INTERVAL);
+	oul_prefs_add_int(path, 5);
+	g_free(path);
+
+	path = qmon_prefs_profile_path(profile, PLUGIN_QMON_KEY_TARGET);
+	oul_prefs_add_int(path, QMON_TARGET_CTC);
+	g_free(path);
+
+	path = qmon_prefs_profile_path(profile, PLUGIN_QMON_KEY_ANALYST);
+	oul_prefs_add_string(path, "");
+	g_free(path);
+
+	path = qmon_prefs_profile_path(profile, PLUGIN_QMON_KEY_SRLIST);
+	oul_prefs_add_string_list(path, NULL);
+	g_free(path);
 }
 
 
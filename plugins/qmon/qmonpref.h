@@ -27,8 +27,21 @@ typedef enum
 /* SR list monitor parameters */
 #define	PLUGIN_QMON_SRLIST		PLUGIN_QMON_ROOT "/srlist"
 
+/* names of the extra queue profiles, the default profile is the root itself */
+#define	PLUGIN_QMON_PROFILES	PLUGIN_QMON_ROOT "/profiles"
+#define	PLUGIN_QMON_PROFILE		PLUGIN_QMON_ROOT "/profile"
+
+/* keys each profile has, see qmon_prefs_profile_path() */
+#define	PLUGIN_QMON_KEY_SELECTION	"selection"
+#define	PLUGIN_QMON_KEY_INTERVAL	"interval"
+#define	PLUGIN_QMON_KEY_TARGET		"target"
+#define	PLUGIN_QMON_KEY_ANALYST		"analyst"
+#define	PLUGIN_QMON_KEY_SRLIST		"srlist"
+
 GtkWidget *	qmon_prefs_frame_get(OulPlugin *plugin);
 void		qmon_prefs_init();
+void		qmon_prefs_profile_init(const gchar *profile);
+gchar *		qmon_prefs_profile_path(const gchar *profile, const gchar *key);
 
 
 #endif
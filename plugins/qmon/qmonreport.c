@@ -5,146 +5,159 @@
 #include "qmonreport.h"
 #include "qmonxml.h"
 
-static GString *
-report_htmltable_get(GString *httpbody)
+static void sr_free(gpointer data, gpointer user_data);
+
+/* only the columns we report are kept from the SR table */
+static gboolean
+parser_column_wanted(gint column)
 {
-	gchar *table_begin = NULL, *table_end = NULL;
-	GString *htmltable = NULL;
-
-	g_return_if_fail(httpbody != NULL);
-
-	/* get the SR HTML table */
-	if((table_begin = strstr(httpbody->str, QMON_HTMLTABLE_BEGIN)) != NULL){
-		if((table_end = strstr(table_begin, QMON_HTMLTABLE_END)) != NULL){
-			if(table_end > table_begin){
-				htmltable = g_string_new("<HTML><BODY>");
-				htmltable = g_string_append_len(htmltable, table_begin, table_end - table_begin);
-			}
-		}
+	switch(column){
+		case INDEX_SR_NUMBER:
+		case INDEX_SR_SERVERITY:
+		case INDEX_SR_STATUS:
+		case INDEX_SR_ANALYST:
+		case INDEX_SR_SUBJECT:
+			return TRUE;
+		default:
+			return FALSE;
 	}
+}
 
-	if(!htmltable || htmltable->len <= 0){
-		oul_debug_error("qmonreport", "can not get the SR table from the html body\n");
-
-		return htmltable;
-	}
+static gboolean
+parser_is_sr_table(const xmlChar **attrs)
+{
+	gint i;
 
-	
-	/* for some reason, we need to revise the HTML to make XPATH parse ok */
-	oul_strreplace(htmltable->str,"&", "&amp;");
-	htmltable->len = strlen(htmltable->str);
+	if(attrs == NULL)
+		return FALSE;
 
-	htmltable = g_string_append(htmltable, "</TABLE></BODY></HTML>");
+	for(i = 0; attrs[i] != NULL; i += 2){
+		if(!xmlStrcasecmp(attrs[i], BAD_CAST "bgcolor") && attrs[i + 1] != NULL
+			&& !xmlStrcasecmp(attrs[i + 1], BAD_CAST QMON_HTMLTABLE_BGCOLOR))
+			return TRUE;
+	}
 
-	return htmltable;
+	return FALSE;
 }
 
-/* Get the SR list via xpath parsing */
-static GList *
-report_htmltable_parse(GString *htmltable)
+static void
+parser_start_element(void *ctx, const xmlChar *name, const xmlChar **attrs)
 {
-	gint sr_count 	= 0;
-	GList *sr_list 	= NULL;
-	
-	LIBXML_TEST_VERSION
-	
-	htmlDocPtr doc = xml_parse_html_from_memory(htmltable->str, htmltable->len);
-	if (doc == NULL ) {
-		oul_debug_error("qmonplugin", "html parse error.\n");
+	QmonReportParser *parser = (QmonReportParser *)ctx;
 
-		xmlCleanupParser();
-		
-		return NULL;
+	if(parser->done)
+		return;
+
+	if(!xmlStrcasecmp(name, BAD_CAST "table")){
+		/* nested tables inside the SR table are only counted */
+		if(parser->table_depth > 0)
+			parser->table_depth++;
+		else if(parser_is_sr_table(attrs))
+			parser->table_depth = 1;
+
+		return;
 	}
-	
-	xmlXPathObjectPtr xpathobj = xml_xpath_evaluate(doc, QMON_HTMLTABLE_XPATH_EXPR);
-	if(!xpathobj){
-		oul_debug_info("qmonreport", "can not evaluate the xpath.\n");
-		
-		xmlFreeDoc(doc);
-		xmlCleanupParser();
-		
-		return NULL;
+
+	if(parser->table_depth != 1)
+		return;
+
+	if(!xmlStrcasecmp(name, BAD_CAST "tr")){
+		parser->row++;
+		parser->column = -1;
+
+		/* the first row is the table header */
+		if(parser->row > 1 && parser->sr == NULL)
+			parser->sr = g_new0(SR, 1);
+	}else if(!xmlStrcasecmp(name, BAD_CAST "td")){
+		parser->column++;
+		parser->in_cell = TRUE;
+		g_string_truncate(parser->cell, 0);
 	}
+}
 
-	xmlNodeSetPtr nodeset = xpathobj->nodesetval;
-	if(xmlXPathNodeSetIsEmpty(nodeset)){
-    	oul_debug_info("qmonreport", "xml nodeset is empty.\n");
-	
-    	xmlXPathFreeObject(xpathobj);
-		xmlFreeDoc(doc);
-		xmlCleanupParser();
-		
-    	return NULL;
-  	}
+static void
+parser_end_element(void *ctx, const xmlChar *name)
+{
+	QmonReportParser *parser = (QmonReportParser *)ctx;
+	SR *sr = parser->sr;
+	gchar *text = NULL;
 
-	/* if SR list exist */
-	sr_count = nodeset->nodeNr/QMON_HTMLTABLE_COLUMN_NUM;
-	if(sr_count == 0){
-		oul_debug_info("qmonplugin", "no valid SRs can be found.\n");
+	if(parser->done || parser->table_depth == 0)
+		return;
 
-		xmlXPathFreeObject(xpathobj);
-		xmlFreeDoc(doc);
-		xmlCleanupParser();
+	if(!xmlStrcasecmp(name, BAD_CAST "table")){
+		parser->table_depth--;
 
-		return NULL;
+		/* the rest of the page is not interesting */
+		if(parser->table_depth == 0){
+			parser->done = TRUE;
+			xmlStopParser(parser->ctxt);
+		}
+
+		return;
 	}
 
-	/* parse the table and fill to the SR list */
-	int i, j;
-	xmlNodePtr cur_node = NULL;
-	xmlChar	*tmp = NULL;
-	for(i = 0; i < sr_count; i++){
-		SR *sr = g_new0(SR, 1);
-		
-		for(j = 0; j < QMON_HTMLTABLE_COLUMN_NUM; j++){
+	if(parser->table_depth != 1)
+		return;
 
-			cur_node = nodeset->nodeTab[i * QMON_HTMLTABLE_COLUMN_NUM + j];
-			if(!cur_node){
-				oul_debug_info("qmonplugin", "invalid html elements.\n");
+	if(!xmlStrcasecmp(name, BAD_CAST "td")){
+		if(!parser->in_cell || sr == NULL)
+			return;
 
-				g_free(sr);
-				sr = NULL;
-				
+		parser->in_cell = FALSE;
+		if(!parser_column_wanted(parser->column))
+			return;
+
+		text = g_strstrip(g_strdup(parser->cell->str));
+		switch(parser->column){
+			case INDEX_SR_NUMBER:
+				sr->number = text;
+				break;
+			case INDEX_SR_SERVERITY:
+				sr->severity = text;
+				break;
+			case INDEX_SR_STATUS:
+				sr->status = text;
+				break;
+			case INDEX_SR_ANALYST:
+				sr->analyst = text;
+				break;
+			case INDEX_SR_SUBJECT:
+				sr->subject = text;
+				break;
+			default:
+				g_free(text);
 				break;
-			}
-
-            /* iteration <td> element to the last text element */
-            while(cur_node->xmlChildrenNode){
-                cur_node = cur_node->xmlChildrenNode;
-            }
-
-			tmp = xmlNodeListGetString(doc, cur_node, 1);
-			switch(j){
-				case INDEX_SR_NUMBER:
-					sr->number = g_strdup(tmp);
-					break;
-				case INDEX_SR_SERVERITY:
-					sr->severity = g_strdup(tmp);
-					break;
-				case INDEX_SR_STATUS:
-					sr->status = g_strdup(tmp);
-					break;
-				case INDEX_SR_ANALYST:
-					sr->analyst = g_strdup(tmp);
-					break;
-				case INDEX_SR_SUBJECT:
-					sr->subject = g_strdup(tmp);
-					break;
-				default:
-					break;
-			}
 		}
+	}else if(!xmlStrcasecmp(name, BAD_CAST "tr")){
+		if(sr == NULL)
+			return;
 
-		sr_list = g_list_append(sr_list, sr);
+		parser->sr = NULL;
+		
+		if(parser->column < INDEX_SR_SUBJECT || sr->number == NULL){
+			oul_debug_info("qmonreport", "invalid html elements.\n");
+			sr_free(sr, NULL);
+			return;
+		}
+
+		parser->srlist = g_list_prepend(parser->srlist, sr);
+		parser->sr_count++;
 	}
+}
+
+static void
+parser_characters(void *ctx, const xmlChar *ch, int len)
+{
+	QmonReportParser *parser = (QmonReportParser *)ctx;
+
+	if(parser->done || !parser->in_cell || parser->table_depth == 0)
+		return;
 
-	g_free(tmp);
-	xmlXPathFreeObject(xpathobj);
-	xmlFreeDoc(doc);
-	xmlCleanupParser();
+	if(!parser_column_wanted(parser->column))
+		return;
 
-	return sr_list;
+	g_string_append_len(parser->cell, (const gchar *)ch, len);
 }
 
 static void
@@ -158,56 +171,65 @@ sr_free(gpointer data, gpointer user_data)
 	if(sr->status) { g_free(sr->status); sr->status = NULL; }
 	if(sr->analyst){ g_free(sr->analyst); sr->analyst = NULL; }
 	if(sr->subject){ g_free(sr->subject); sr->subject = NULL; }
+
+	g_free(sr);
 }
 
-GList *
-sr_filter_by_srlist(GList *plist, GList *srlist)
+/* look up the SR number case-insensitively, without allocation for usual sizes */
+static gboolean
+sr_filter_match(GHashTable *srset, const gchar *number)
 {
-	SR *sr, *new_sr = NULL;
-	GList *p1 = NULL, *p2 = NULL, *ret_list = NULL;
-	gchar *sr_number; 
+	gchar key[64];
+	gchar *long_key = NULL;
+	gboolean ret = FALSE;
+	gsize i;
 
-	g_return_val_if_fail(plist != NULL, NULL);
-	g_return_val_if_fail(srlist != NULL, NULL);
+	for(i = 0; number[i] != '\0' && i < sizeof(key) - 1; i++)
+		key[i] = g_ascii_tolower(number[i]);
 
-	if(g_list_length(srlist) == 0){
-		oul_debug_info("qmonreport", "srlist is empty.\n");
-		return g_list_copy(plist);
+	if(number[i] != '\0'){
+		long_key = g_ascii_strdown(number, -1);
+		ret = g_hash_table_lookup(srset, long_key) != NULL;
+		g_free(long_key);
+
+		return ret;
 	}
 
-	p1 = plist;
-	for(; p1; p1 = g_list_next(p1)){
-			sr = (SR *)p1->data;
+	key[i] = '\0';
+
+	return g_hash_table_lookup(srset, key) != NULL;
+}
 
-			p2 = srlist;
-			for(; p2; p2=g_list_next(p2)){
-				sr_number = (gchar *)p2->data;
+/* the returned list borrows the SRs from plist, free it with g_list_free() */
+GList *
+sr_filter_by_srlist(GList *plist, GHashTable *srset)
+{
+	SR *sr = NULL;
+	GList *tmp = NULL, *ret_list = NULL;
 
-				if(!strcasecmp(sr->number, sr_number)){
-					
-					oul_debug_info("qmonreport", "matched %s, %s\n", sr->number ,sr_number);
+	g_return_val_if_fail(plist != NULL, NULL);
+	g_return_val_if_fail(srset != NULL, NULL);
 
-					new_sr = g_new0(SR, 1);
+	if(g_hash_table_size(srset) == 0){
+		oul_debug_info("qmonreport", "srlist is empty.\n");
+		return g_list_copy(plist);
+	}
 
-					new_sr->analyst 	= g_strdup(sr->analyst);
-					new_sr->number  	= g_strdup(sr->number);
-					new_sr->severity 	= g_strdup(sr->severity);
-					new_sr->status 		= g_strdup(sr->status);
-					new_sr->subject 	= g_strdup(sr->subject);
+	for(tmp = plist; tmp; tmp = g_list_next(tmp)){
+		sr = (SR *)tmp->data;
 
-					ret_list = g_list_append(ret_list, new_sr);
-				}
-			}
-			
+		if(sr->number && sr_filter_match(srset, sr->number))
+			ret_list = g_list_prepend(ret_list, sr);
 	}
 
-	return ret_list;
+	return g_list_reverse(ret_list);
 }
 
+/* the returned list borrows the SRs from plist, free it with g_list_free() */
 GList *
 sr_filter_by_analyst(GList *plist, gchar *analyst)
 {
-	SR *sr, *new_sr = NULL;
+	SR *sr = NULL;
 	GList *tmp = NULL, *sr_list = NULL;
 
 	g_return_val_if_fail(plist != NULL, NULL);
@@ -218,29 +240,18 @@ sr_filter_by_analyst(GList *plist, gchar *analyst)
 		return NULL;
 	}
 
-	tmp = plist;
-	for(; tmp; tmp = g_list_next(tmp)){
-			sr = (SR *)tmp->data;
-
-			if(!strcasecmp(analyst, sr->analyst)){
-				oul_debug_info("qmonplugin", "matched %s, %s\n", sr->number ,sr->analyst);
-				
-				new_sr = g_new0(SR, 1);
-
-				new_sr->analyst 	= g_strdup(sr->analyst);
-				new_sr->number  	= g_strdup(sr->number);
-				new_sr->severity 	= g_strdup(sr->severity);
-				new_sr->status 		= g_strdup(sr->status);
-				new_sr->subject 	= g_strdup(sr->subject);
+	for(tmp = plist; tmp; tmp = g_list_next(tmp)){
+		sr = (SR *)tmp->data;
 
-				sr_list = g_list_append(sr_list, new_sr);
-			}
+		if(sr->analyst && !g_ascii_strcasecmp(analyst, sr->analyst))
+			sr_list = g_list_prepend(sr_list, sr);
 	}
 
-	return sr_list;
+	return g_list_reverse(sr_list);
 }
 
-static GString *
+/* builds the beasymsg xml of the SRs, which is shown by the notification */
+GString *
 srlist_to_srdetails(GList *plist)
 {
 	xmlDocPtr doc;
@@ -290,22 +301,22 @@ srlist_to_srdetails(GList *plist)
 		row_node = xmlNewNode(NULL, "row");
 		xmlAddChild(content_node, row_node);
 
-		tmp_node = xmlNewChild(row_node, NULL, "cell", sr->number);
+		tmp_node = xmlNewTextChild(row_node, NULL, "cell", sr->number);
 		xmlNewProp(tmp_node, "col", beasy_msg_header[0].idx);
 		gchar *url = g_strdup_printf(QMON_SR_URL, sr->number);
 		xmlNewProp(tmp_node, "url", url);
 		g_free(url);
 	
-		tmp_node = xmlNewChild(row_node, NULL, "cell", sr->severity);
+		tmp_node = xmlNewTextChild(row_node, NULL, "cell", sr->severity);
 		xmlNewProp(tmp_node, "col", beasy_msg_header[1].idx);
 
-		tmp_node = xmlNewChild(row_node, NULL, "cell", sr->status);
+		tmp_node = xmlNewTextChild(row_node, NULL, "cell", sr->status);
 		xmlNewProp(tmp_node, "col", beasy_msg_header[2].idx);
 
-		tmp_node = xmlNewChild(row_node, NULL, "cell", sr->analyst);
+		tmp_node = xmlNewTextChild(row_node, NULL, "cell", sr->analyst);
 		xmlNewProp(tmp_node, "col", beasy_msg_header[3].idx);
 
-		tmp_node = xmlNewChild(row_node, NULL, "cell", sr->subject);
+		tmp_node = xmlNewTextChild(row_node, NULL, "cell", sr->subject);
 		xmlNewProp(tmp_node, "col", beasy_msg_header[4].idx);
 		
 	}
@@ -328,121 +339,322 @@ srlist_to_srdetails(GList *plist)
 	return ret;
 }
 	
-static void
+/* hash of the reported columns, the SR number is the key of state table */
+static guint
+sr_hash(SR *sr)
+{
+	const gchar *fields[] = { sr->severity, sr->status, sr->analyst, sr->subject };
+	const gchar *p = NULL;
+	guint hash = 5381;
+	gint i;
+
+	for(i = 0; i < G_N_ELEMENTS(fields); i++){
+		for(p = fields[i]; p && *p; p++)
+			hash = (hash << 5) + hash + *p;
+
+		/* separator, so that moving text between columns is a change */
+		hash = (hash << 5) + hash + 0x1f;
+	}
+
+	return hash;
+}
+
+static gboolean
+state_is_stale(gpointer key, gpointer value, gpointer data)
+{
+	QmonSRState *srstate = (QmonSRState *)value;
+	QmonReportState *state = (QmonReportState *)data;
+
+	return srstate->generation != state->generation;
+}
+
+/* 
+ * Update the state table with current SR list, return the new and changed
+ * SRs, which are borrowed from plist. The removed SRs are only counted.
+ */
+static GList *
+report_diff(QmonReportState *state, GList *plist, guint *added, guint *changed, guint *removed)
+{
+	GList *tmp = NULL, *delta = NULL;
+	QmonSRState *srstate = NULL;
+	SR *sr = NULL;
+	guint hash;
+
+	*added = *changed = *removed = 0;
+	state->generation++;
+
+	for(tmp = plist; tmp; tmp = g_list_next(tmp)){
+		sr = (SR *)tmp->data;
+		hash = sr_hash(sr);
+
+		srstate = g_hash_table_lookup(state->table, sr->number);
+		if(srstate == NULL){
+			srstate = g_new0(QmonSRState, 1);
+			g_hash_table_insert(state->table, g_strdup(sr->number), srstate);
+
+			delta = g_list_prepend(delta, sr);
+			(*added)++;
+		}else if(srstate->generation == state->generation){
+			/* the same SR listed twice in one page */
+			continue;
+		}else if(srstate->hash != hash){
+			delta = g_list_prepend(delta, sr);
+			(*changed)++;
+		}
+
+		srstate->hash 		= hash;
+		srstate->generation = state->generation;
+	}
+
+	*removed = g_hash_table_foreach_remove(state->table, state_is_stale, state);
+
+	return g_list_reverse(delta);
+}
+
+/* returns TRUE if any SR was added, changed or removed */
+static gboolean
 report_common(QmonMonitor *monitor, GList *plist, const gchar *title)
 {
 	GString *sr_details = NULL;
+	GList *delta = NULL;
+	guint added, changed, removed;
 
-	sr_details = srlist_to_srdetails(plist);
-	if(!sr_details){
-		oul_debug_info("qmonreport", "Cannot get SR details.\n");
-		return;
+	/* the state is only meaningful for the SRs of one target */
+	if(monitor->state->target != monitor->options->target){
+		g_hash_table_remove_all(monitor->state->table);
+		monitor->state->target = monitor->options->target;
 	}
 
-	oul_debug_info("qmonreport", "srdetails:%s\n", sr_details->str);
+	delta = report_diff(monitor->state, plist, &added, &changed, &removed);
+	if(delta == NULL && removed == 0){
+		oul_debug_info("qmonreport", "No SR was changed since last poll.\n");
+		return FALSE;
+	}
+
+	oul_debug_info("qmonreport", "SRs added:%d, changed:%d, removed:%d\n", added, changed, removed);
+
+	/* only the changed SRs are put into the details */
+	if(delta){
+		sr_details = srlist_to_srdetails(delta);
+		g_list_free(delta);
+
+		if(!sr_details){
+			oul_debug_info("qmonreport", "Cannot get SR details.\n");
+			return TRUE;
+		}
+
+		oul_debug_info("qmonreport", "srdetails:%s\n", sr_details->str);
+
+		g_free(monitor->plugin->extra);
+		monitor->plugin->extra = g_string_free(sr_details, FALSE);
+	}else{
+		/* only removals, the details of the last poll do not apply */
+		g_free(monitor->plugin->extra);
+		monitor->plugin->extra = NULL;
+	}
 	
 	/* send the signal to GUI notifcation sub system */
-	gpointer handle = oul_notify_get_handle();
+	static gulong notify_info_id = 0;
+
+	if (notify_info_id == 0)
+		notify_info_id = oul_signal_lookup(oul_notify_get_handle(), "notify-info");
 
-	gchar *content = g_strdup_printf("There are %d SRs were updated!", g_list_length(plist));
-	oul_signal_emit(handle, "notify-info", "Qmon Monitor", title, content);
+	gchar *content = g_strdup_printf("There are %d new, %d updated and %d removed SRs!", 
+									added, changed, removed);
+	oul_signal_emit_by_id(notify_info_id, "Qmon Monitor", title, content);
 	g_free(content);
-	
-	monitor->plugin->extra = g_strdup(sr_details->str);
-	
-	g_string_free(sr_details, TRUE);
+
+	return TRUE;
 }
 
-static void
+static gboolean
 report_for_ctc(QmonMonitor *monitor, GList *plist)
 {
 	GString *sr_details = NULL;
 
 	oul_debug_info("qmonreport", "report for ctc.\n");
 
-	report_common(monitor, plist, "CTC Notification Details");
+	return report_common(monitor, plist, "CTC Notification Details");
 }
 
-static void
+static gboolean
 report_for_analyst(QmonMonitor *monitor, GList *plist)
 {
 	GList *mylist = NULL;
-
-	g_return_if_fail(plist != NULL);
+	gboolean ret = FALSE;
 
 	oul_debug_info("qmonreport", "report for analyst.\n");
 
-	mylist = sr_filter_by_analyst(plist, monitor->options->params.analyst);
-	if(!mylist){
+	/* still report an empty list, the SRs may have been removed */
+	if(plist)
+		mylist = sr_filter_by_analyst(plist, monitor->options->params.analyst);
+	if(!mylist)
 		oul_debug_info("qmonplugin", "Can not found the updated SR for analyst.\n");
-		return;
-	}
 
-	report_common(monitor, mylist, "Analyst Notification Details");
+	ret = report_common(monitor, mylist, "Analyst Notification Details");
 
-	g_list_foreach(mylist, (GFunc)sr_free, NULL);
 	g_list_free(mylist);
-	
+
+	return ret;
 }
 
-static void
+static gboolean
 report_for_srlist(QmonMonitor *monitor, GList *plist)
 {
 	GList *mylist = NULL;
-
-	g_return_if_fail(plist != NULL);
+	gboolean ret = FALSE;
 
 	oul_debug_info("qmonreport", "report for srlist.\n");
 
-	mylist = sr_filter_by_srlist(plist, monitor->options->params.srlist);
-	if(!mylist){
+	/* still report an empty list, the SRs may have been removed */
+	if(plist)
+		mylist = sr_filter_by_srlist(plist, monitor->options->srset);
+	if(!mylist)
 		oul_debug_info("qmonreport", "Can not found the updated SR for srlist.\n");
-		return;
-	}
 
-	report_common(monitor, mylist, "SRList Notification Details");
+	ret = report_common(monitor, mylist, "SRList Notification Details");
 
-	g_list_foreach(mylist, (GFunc)sr_free, NULL);
 	g_list_free(mylist);
+
+	return ret;
+}
+
+/*******************************************************
+ ******public interface*************************************
+ ********************************************************/
+QmonReportParser *
+qmon_report_parser_new(void)
+{
+	QmonReportParser *parser = NULL;
+	htmlSAXHandler sax;
+
+	LIBXML_TEST_VERSION
+
+	memset(&sax, 0, sizeof(sax));
+	sax.startElement 	= parser_start_element;
+	sax.endElement 		= parser_end_element;
+	sax.characters 		= parser_characters;
+	sax.cdataBlock 		= parser_characters;
+
+	parser = g_new0(QmonReportParser, 1);
+	parser->column 	= -1;
+	parser->cell 	= g_string_new("");
+
+	/* no tree is built, rows are picked up from the SAX events */
+	parser->ctxt = htmlCreatePushParserCtxt(&sax, parser, NULL, 0, NULL, XML_CHAR_ENCODING_UTF8);
+	if(parser->ctxt == NULL){
+		oul_debug_error("qmonreport", "can not create html parser.\n");
+		g_string_free(parser->cell, TRUE);
+		g_free(parser);
+		return NULL;
+	}
+
+	htmlCtxtUseOptions(parser->ctxt, HTML_PARSE_NOERROR | HTML_PARSE_NOWARNING | HTML_PARSE_NONET);
+
+	return parser;
 }
 
 void
-qmon_report(QmonMonitor *monitor)
+qmon_report_parser_feed(QmonReportParser *parser, const gchar *data, gsize len)
+{
+	g_return_if_fail(parser != NULL);
+
+	if(parser->done || len == 0)
+		return;
+
+	htmlParseChunk(parser->ctxt, data, len, 0);
+}
+
+GList *
+qmon_report_parser_finish(QmonReportParser *parser)
 {
 	GList *srlist = NULL;
-	g_return_if_fail(monitor != NULL);
-	
-	GString *htmltable = report_htmltable_get(monitor->httpbody);
-	if(!htmltable){
-		oul_debug_error("qmonreport", "Can not get valid htmltable.\n");
-		return;	
-	}
 
-	srlist = report_htmltable_parse(htmltable);
-	g_string_free(htmltable, TRUE);
-	if(srlist == NULL){
-		oul_debug_error("qmonreport", "Can not get valid sr list.\n");
-		g_string_free(htmltable, TRUE);
-		return;	
-	}
+	g_return_val_if_fail(parser != NULL, NULL);
+
+	if(!parser->done)
+		htmlParseChunk(parser->ctxt, NULL, 0, 1);
+
+	if(parser->table_depth == 0 && !parser->done)
+		oul_debug_error("qmonreport", "can not get the SR table from the html body\n");
+
+	srlist = g_list_reverse(parser->srlist);
+	parser->srlist = NULL;
+
+	qmon_report_parser_destroy(parser);
+
+	return srlist;
+}
+
+/* a page without the SR table is usually the login page */
+gboolean
+qmon_report_parser_found_table(QmonReportParser *parser)
+{
+	g_return_val_if_fail(parser != NULL, FALSE);
+
+	return parser->table_depth > 0 || parser->done;
+}
+
+void
+qmon_report_parser_destroy(QmonReportParser *parser)
+{
+	g_return_if_fail(parser != NULL);
+
+	if(parser->ctxt)
+		htmlFreeParserCtxt(parser->ctxt);
+
+	if(parser->sr)
+		sr_free(parser->sr, NULL);
+
+	qmon_srlist_free(parser->srlist);
+	g_string_free(parser->cell, TRUE);
+
+	g_free(parser);
+}
+
+QmonReportState *
+qmon_report_state_new(void)
+{
+	QmonReportState *state = NULL;
+
+	state = g_new0(QmonReportState, 1);
+	state->table 		= g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	state->generation 	= 0;
+	state->target 		= QMON_TARGET_NUM;
+
+	return state;
+}
+
+void
+qmon_report_state_destroy(QmonReportState *state)
+{
+	g_return_if_fail(state != NULL);
+
+	g_hash_table_destroy(state->table);
+	g_free(state);
+}
+
+void
+qmon_srlist_free(GList *srlist)
+{
+	g_list_foreach(srlist, (GFunc)sr_free, NULL);
+	g_list_free(srlist);
+}
+
+gboolean
+qmon_report(QmonMonitor *monitor, GList *srlist)
+{
+	g_return_val_if_fail(monitor != NULL, FALSE);
 
 	oul_debug_info("qmonreport", "total sr list:%d\n", g_list_length(srlist));
 	switch(monitor->options->target){
 		case QMON_TARGET_ANALYST:
-			report_for_analyst(monitor, srlist);
-			break;
+			return report_for_analyst(monitor, srlist);
 		case QMON_TARGET_SRLIST:
-			report_for_srlist(monitor, srlist);
-			break;
+			return report_for_srlist(monitor, srlist);
 		case QMON_TARGET_CTC:
 		default:
-			report_for_ctc(monitor, srlist);
-			break;
+			return report_for_ctc(monitor, srlist);
 	}
-
-	g_list_foreach(srlist, (GFunc)sr_free, NULL);
-	g_list_free(srlist);
-
-	return;
 }
 
@@ -2,13 +2,13 @@
 #define __PLUGIN_QMON_REPORT_H
 
 #include <glib.h>
+#include <libxml/HTMLparser.h>
 #include "qmon.h"
 
-#define QMON_HTMLTABLE_XPATH_EXPR		"/html/body/table/tr[position()>1]/td"
 #define	QMON_HTMLTABLE_COLUMN_NUM		18
 
-#define	QMON_HTMLTABLE_BEGIN			"<TABLE BORDER=0 CELLSPACING=1 CELLPADDING=2 BGCOLOR=#CDCE9C>"
-#define	QMON_HTMLTABLE_END				"</TABLE>"
+/* the SR table is <TABLE BORDER=0 CELLSPACING=1 CELLPADDING=2 BGCOLOR=#CDCE9C> */
+#define	QMON_HTMLTABLE_BGCOLOR			"#CDCE9C"
 
 #define	QMON_SR_URL						"http://qmon.oraclecorp.com:7777/qmon3/quickpicks.pl?t=t&q=%s"
 
@@ -32,7 +32,53 @@ typedef struct _SR{
 	gchar	*subject;
 }SR;
 
-void	qmon_report(QmonMonitor *monitor);
+/* streaming extractor of the SR table, fed with the http body as it arrives */
+typedef struct _QmonReportParser{
+	htmlParserCtxtPtr	ctxt;
+
+	gint		table_depth;	/* > 0 inside the SR table, counts nested tables */
+	gint		row;			/* rows seen in the SR table, the first is header */
+	gint		column;			/* index of current <td> in the row */
+	gboolean	in_cell;
+	gboolean	done;			/* the SR table was closed, ignore the rest */
+
+	GString		*cell;			/* text of current cell, only for used columns */
+	SR			*sr;			/* the row being built */
+	GList		*srlist;		/* finished rows, in reverse order */
+	gint		sr_count;
+}QmonReportParser;
+
+QmonReportParser *	qmon_report_parser_new(void);
+void				qmon_report_parser_feed(QmonReportParser *parser, const gchar *data, gsize len);
+GList *				qmon_report_parser_finish(QmonReportParser *parser);
+gboolean			qmon_report_parser_found_table(QmonReportParser *parser);
+void				qmon_report_parser_destroy(QmonReportParser *parser);
+
+/* what was reported of one SR in the last poll */
+typedef struct _QmonSRState{
+	guint		hash;			/* hash of severity, status, analyst and subject */
+	guint		generation;		/* the last poll which listed the SR */
+}QmonSRState;
+
+/* SRs reported by a monitor, so that only the changes are notified */
+typedef struct _QmonReportState{
+	GHashTable	*table;			/* SR number -> QmonSRState */
+	guint		generation;
+	QmonTarget	target;			/* the state is reset if the target changed */
+}QmonReportState;
+
+QmonReportState *	qmon_report_state_new(void);
+void				qmon_report_state_destroy(QmonReportState *state);
+
+/* filters return lists borrowing the SRs of plist */
+GList *	sr_filter_by_srlist(GList *plist, GHashTable *srset);
+GList *	sr_filter_by_analyst(GList *plist, gchar *analyst);
+
+GString *	srlist_to_srdetails(GList *plist);
+
+void	qmon_srlist_free(GList *srlist);
+/* returns TRUE if the monitor saw any SR change, an empty srlist reports the removals */
+gboolean	qmon_report(QmonMonitor *monitor, GList *srlist);
 
 
 #endif
@@ -3,165 +3,380 @@
 
 
 #include "internal.h"
+#include "util.h"
+#include "xmlnode.h"
+#include "qmon.h"
 #include "qmonpref.h"
 #include "qmonsession.h"
 
-GString *session_httpheader = NULL;
+typedef struct _QmonSessionWaiter
+{
+	QmonSessionCallback	callback;
+	gpointer			data;
+}QmonSessionWaiter;
 
-static size_t
-session_httpbody_cb(void *ptr, size_t size, size_t nmemb, void *data)
+/* returns the value of the cookie named by prefix, and where its attributes start */
+static gchar *
+session_cookie_get(const gchar *header, const gchar *prefix, const gchar **attrs)
 {
-	size_t real_size = size * nmemb;
+	const gchar *p1 = NULL, *p2 = NULL;
+
+	if((p1 = strstr(header, prefix)) == NULL)
+		return NULL;
+
+	p1 += strlen(prefix);
+	if((p2 = strstr(p1, ";")) == NULL || p2 <= p1)
+		return NULL;
+
+	if(attrs)
+		*attrs = p2;
 
-	return real_size;
+	return g_strndup(p1, p2 - p1);
 }
 
-static size_t
-session_httpheader_cb(void *ptr, size_t size, size_t nmemb, void *data)
+/* the expiry of the cookie, or the default lifetime if it has none */
+static time_t
+session_cookie_expires(const gchar *attrs)
 {
-	size_t real_size = size * nmemb;
+	const gchar *end = NULL, *p = NULL;
+	gchar *date = NULL;
+	time_t now = time(NULL), expires = -1;
+
+	end = strchr(attrs, '\n');
+	if(end == NULL)
+		end = attrs + strlen(attrs);
+
+	p = g_strstr_len(attrs, end - attrs, QMON_EXPIRES_PREFIX);
+	if(p){
+		p += strlen(QMON_EXPIRES_PREFIX);
 
-	if(session_httpheader == NULL)
-		session_httpheader = g_string_new("");
-	
-	session_httpheader = g_string_append_len(session_httpheader, ptr, real_size);
+		date = g_strndup(p, end - p);
+		if(strchr(date, ';'))
+			*strchr(date, ';') = '\0';
 
-	return real_size;
+		expires = curl_getdate(g_strstrip(date), NULL);
+		g_free(date);
+	}
+
+	if(expires <= now)
+		return now + QMON_SESSION_LIFETIME;
+
+	return MIN(expires, now + QMON_SESSION_LIFETIME);
 }
 
 static gboolean
-session_httpheader_parse(QmonSession *session)
+session_httpheader_parse(QmonSession *session, const gchar *header)
 {
-	gchar *p1 = NULL, *p2 = NULL;
+	const gchar *attrs = NULL;
 
 	oul_debug_info("qmonsession", "qmon session header parsing...\n");
 
-	if(session_httpheader == NULL){
-		oul_debug_error("qmonsession", "qmon http header is not exist.\n");
-		return FALSE;
-	}
-		
-	if((p1 = strstr(session_httpheader->str, QMON_TIER2UNPW_PREFIX)) != NULL){
-		p1 += strlen(QMON_TIER2UNPW_PREFIX);
-		if((p2 = strstr(p1, ";")) != NULL){
-			if(p2 > p1){
-				session->tier2unpw = g_strndup(p1, p2-p1);
-			}
-		}
-	}
-
+	session->tier2unpw = session_cookie_get(header, QMON_TIER2UNPW_PREFIX, &attrs);
 	if(session->tier2unpw == NULL){
 		oul_debug_error("qmonsession", "Can not find tier2unpw.\n");
-		g_string_free(session_httpheader, TRUE);
 		return FALSE;
 	}
 
-	p1 = p2 = NULL;
-	if((p1 = strstr(session_httpheader->str, QMON_AWUSER_PREFIX)) != NULL){
-		p1 += strlen(QMON_AWUSER_PREFIX);
-		if((p2 = strstr(p1, ";")) != NULL){
-			if(p2 > p1){
-				session->aw_user = g_strndup(p1, p2-p1);
-			}
-		}
-	}
+	session->expires = session_cookie_expires(attrs);
 
-	if(session->aw_user== NULL){
+	session->aw_user = session_cookie_get(header, QMON_AWUSER_PREFIX, NULL);
+	if(session->aw_user == NULL){
 		oul_debug_error("qmonsession", "Can not find aw_user.\n");
-		g_string_free(session_httpheader, TRUE);
 		return FALSE;
 	}
 
+	session->cookie = g_strdup_printf(QMON_COOKIE, session->aw_user, session->tier2unpw);
+
 	return TRUE;
 }
 
-static gboolean
-qmon_login(QmonSession *session, QmonOptions *options)
+static void
+session_clear(QmonSession *session)
 {
-	CURL *curl_handle = NULL;
-	CURLcode curl_ret;
-	gchar error_msg[CURL_ERROR_SIZE];
-	gboolean ret = FALSE;
-	gchar *post_content = NULL;
+	g_free(session->aw_user);
+	session->aw_user = NULL;
 
-	curl_handle = curl_easy_init();
+	g_free(session->tier2unpw);
+	session->tier2unpw = NULL;
 
-#if 1
-	curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 1L);
-#endif
+	g_free(session->cookie);
+	session->cookie = NULL;
 
-	curl_easy_setopt(curl_handle, CURLOPT_NOPROGRESS, 1L);
-	curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 0L);
-	curl_easy_setopt(curl_handle, CURLOPT_ERRORBUFFER, &error_msg);
-	curl_easy_setopt(curl_handle, CURLOPT_URL, "http://qmon.oraclecorp.com/qmon3/qmon.pl");
-	curl_easy_setopt(curl_handle, CURLOPT_POST, 1L);
+	session->expires = 0;
+}
 
-	post_content = g_strdup_printf(QMON_LOGIN_REQUEST, options->username, options->password);
+static void
+session_cache_save(QmonSession *session)
+{
+	xmlnode *node = NULL, *child = NULL;
+	gchar *data = NULL, *expires = NULL;
+	mode_t old_mask;
+
+	node = xmlnode_new("qmon_session");
+	xmlnode_set_attrib(node, "version", "1.0");
+
+	child = xmlnode_new_child(node, "session");
+	xmlnode_set_attrib(child, "username", session->username);
+
+	expires = g_strdup_printf("%ld", (long)session->expires);
+	xmlnode_set_attrib(child, "expires", expires);
+	g_free(expires);
 
-	curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, post_content);
-	curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, session_httpheader_cb);
-	curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, session_httpbody_cb);
+	xmlnode_insert_data(xmlnode_new_child(child, "aw_user"), session->aw_user, -1);
+	xmlnode_insert_data(xmlnode_new_child(child, "tier2unpw"), session->tier2unpw, -1);
 
-	/*As curl will not copy the postcontent, preserved until the transfer finishes*/
-	curl_ret = curl_easy_perform(curl_handle);
-	if(curl_ret != CURLE_OK){
-		oul_debug_info("qmonsession", "qmon session http failed: [%d]%s\n", curl_ret, error_msg);
-		ret = FALSE;
+	data = xmlnode_to_formatted_str(node, NULL);
+
+	/* the cookies are as good as the password, nobody else may read them even while written */
+	old_mask = umask(S_IRWXG | S_IRWXO);
+	oul_util_write_data_to_file(QMON_SESSION_FILE, data, -1);
+	umask(old_mask);
+
+	g_free(data);
+	xmlnode_free(node);
+}
+
+static void
+session_cache_load(QmonSession *session)
+{
+	xmlnode *node = NULL, *child = NULL;
+	const gchar *username = NULL, *expires = NULL;
+
+	node = oul_util_read_xml_from_file(QMON_SESSION_FILE, "qmon session");
+	if(node == NULL)
+		return;
+
+	child = xmlnode_get_child(node, "session");
+	if(child == NULL){
+		xmlnode_free(node);
+		return;
+	}
+
+	/* the cookies of another user are useless */
+	username = xmlnode_get_attrib(child, "username");
+	expires = xmlnode_get_attrib(child, "expires");
+	if(username == NULL || expires == NULL || g_ascii_strcasecmp(username, session->username)){
+		xmlnode_free(node);
+		return;
+	}
+
+	session->expires = strtol(expires, NULL, 10);
+	if(xmlnode_get_child(child, "aw_user"))
+		session->aw_user = xmlnode_get_data(xmlnode_get_child(child, "aw_user"));
+	if(xmlnode_get_child(child, "tier2unpw"))
+		session->tier2unpw = xmlnode_get_data(xmlnode_get_child(child, "tier2unpw"));
+
+	if(session->aw_user && session->tier2unpw && session->expires > time(NULL)){
+		oul_debug_info("qmonsession", "use cached qmon session.\n");
+		session->cookie = g_strdup_printf(QMON_COOKIE, session->aw_user, session->tier2unpw);
+	}else{
+		session_clear(session);
+	}
+
+	xmlnode_free(node);
+}
+
+static void
+session_cache_remove(void)
+{
+	gchar *filename = NULL;
+
+	filename = g_build_filename(oul_user_dir(), QMON_SESSION_FILE, NULL);
+	g_unlink(filename);
+	g_free(filename);
+}
+
+static void
+session_login_cb(QmonHttpRequest *request, gboolean success, gpointer data)
+{
+	QmonSession *session = (QmonSession *)data;
+	QmonSessionWaiter *waiter = NULL;
+	GList *waiters = NULL, *tmp = NULL;
+
+	if(!success){
+		oul_debug_error("qmonsession", "qmon session http failed: %s\n",
+						request ? request->error_msg : "no request");
 	}else{
 		oul_debug_info("qmonsession", "qmon session http ok.\n");
-		ret = TRUE;
+
+		session_clear(session);
+		success = session_httpheader_parse(session, request->header->str);
+		if(success)
+			session_cache_save(session);
+		else
+			session_clear(session);
 	}
 
-	curl_easy_cleanup(curl_handle);
-	g_free(post_content);
+	/* the callbacks may log in again */
+	waiters = session->waiters;
+	session->waiters = NULL;
 
-	return ret;
+	for(tmp = waiters; tmp; tmp = g_list_next(tmp)){
+		waiter = (QmonSessionWaiter *)tmp->data;
+
+		waiter->callback(session, success, waiter->data);
+		g_free(waiter);
+	}
+
+	g_list_free(waiters);
 }
 
+/*******************************************************
+ ******public interface*************************************
+ ********************************************************/
 QmonSession *
 qmon_session_new(QmonOptions *options)
 {
-	
 	QmonSession *session = NULL;
 
+	g_return_val_if_fail(options != NULL, NULL);
+
 	session = g_new0(QmonSession, 1);
 
-	session->aw_user 	= NULL;
-	session->tier2unpw 	= NULL;
+	session->username = g_strdup(options->username);
+	session->password = g_strdup(options->password);
 
-	/* clear session_httpheader before we login */
-	if(session_httpheader){
-		g_string_free(session_httpheader, TRUE);
-		session_httpheader = NULL;
-	}
-		
-	if(!qmon_login(session, options)){
-		g_free(session);
-		return NULL;
-	}
+	session_cache_load(session);
 
-	if(!session_httpheader_parse(session)){
-		g_free(session);
-		return NULL;
-	}
-		
 	return session;
 }
 
 void
 qmon_session_destroy(QmonSession *session)
 {
-	if(session->aw_user){
-		g_free(session->aw_user);
-		session->aw_user = NULL;
-	}
+	g_return_if_fail(session != NULL);
 
-	if(session->tier2unpw){
-		g_free(session->tier2unpw);
-		session->tier2unpw = NULL;
+	if(session->request){
+		qmon_http_request_destroy(session->request);
+		session->request = NULL;
 	}
 
+	g_list_foreach(session->waiters, (GFunc)g_free, NULL);
+	g_list_free(session->waiters);
+	session->waiters = NULL;
+
+	session_clear(session);
+
+	g_free(session->username);
+	g_free(session->password);
+
 	g_free(session);
 	session = NULL;
 }
 
+void
+qmon_session_set_login(QmonSession *session, const gchar *username, const gchar *password)
+{
+	g_return_if_fail(session != NULL);
+
+	if(username && password && session->username && session->password
+		&& !strcmp(username, session->username) && !strcmp(password, session->password))
+		return;
+
+	g_free(session->username);
+	session->username = g_strdup(username);
+
+	g_free(session->password);
+	session->password = g_strdup(password);
+
+	qmon_session_expire(session);
+}
+
+gboolean
+qmon_session_is_valid(QmonSession *session)
+{
+	g_return_val_if_fail(session != NULL, FALSE);
+
+	return session->cookie != NULL && session->expires > time(NULL);
+}
+
+gboolean
+qmon_session_is_busy(QmonSession *session)
+{
+	g_return_val_if_fail(session != NULL, FALSE);
+
+	return session->request != NULL && session->request->busy;
+}
+
+void
+qmon_session_login(QmonSession *session, QmonSessionCallback callback, gpointer data)
+{
+	QmonSessionWaiter *waiter = NULL;
+	gchar *post_content = NULL;
+	GList *tmp = NULL;
+	gboolean ret = FALSE;
+
+	g_return_if_fail(session != NULL);
+	g_return_if_fail(callback != NULL);
+
+	if(qmon_session_is_valid(session)){
+		callback(session, TRUE, data);
+		return;
+	}
+
+	for(tmp = session->waiters; tmp; tmp = g_list_next(tmp)){
+		waiter = (QmonSessionWaiter *)tmp->data;
+
+		if(waiter->callback == callback && waiter->data == data)
+			break;
+	}
+
+	if(tmp == NULL){
+		waiter = g_new0(QmonSessionWaiter, 1);
+		waiter->callback 	= callback;
+		waiter->data 		= data;
+
+		session->waiters = g_list_append(session->waiters, waiter);
+	}
+
+	/* share the login in progress */
+	if(qmon_session_is_busy(session))
+		return;
+
+	if(session->request == NULL){
+		session->request = qmon_http_request_new(QMON_URL, session_login_cb, session);
+		if(session->request == NULL){
+			session_login_cb(NULL, FALSE, session);
+			return;
+		}
+	}
+
+	oul_debug_info("qmonsession", "qmon session login...\n");
+
+	post_content = g_strdup_printf(QMON_LOGIN_REQUEST, session->username, session->password);
+	ret = qmon_http_request_post(session->request, post_content);
+	g_free(post_content);
+
+	if(!ret)
+		session_login_cb(session->request, FALSE, session);
+}
+
+void
+qmon_session_cancel(QmonSession *session, gpointer data)
+{
+	QmonSessionWaiter *waiter = NULL;
+	GList *tmp = NULL, *next = NULL;
+
+	g_return_if_fail(session != NULL);
+
+	for(tmp = session->waiters; tmp; tmp = next){
+		next = g_list_next(tmp);
+		waiter = (QmonSessionWaiter *)tmp->data;
+
+		if(waiter->data == data){
+			session->waiters = g_list_delete_link(session->waiters, tmp);
+			g_free(waiter);
+		}
+	}
+}
+
+void
+qmon_session_expire(QmonSession *session)
+{
+	g_return_if_fail(session != NULL);
+
+	oul_debug_info("qmonsession", "qmon session expired.\n");
+
+	session_clear(session);
+	session_cache_remove();
+}
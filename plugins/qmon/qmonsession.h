@@ -3,20 +3,71 @@
 
 #include <glib.h>
 #include "qmonoptions.h"
+#include "qmonhttp.h"
 
 #define	QMON_TIER2UNPW_PREFIX       "Tier2unpw="
 #define QMON_AWUSER_PREFIX			"AW_user="
+#define QMON_EXPIRES_PREFIX			"expires="
+
+#define QMON_COOKIE					"AW_user=%s; Tier2unpw=%s;"
 
 #define QMON_LOGIN_REQUEST			"++++++++LOGIN++++++++=LOGIN&un=%s&pw=%s"
 
-typedef struct _QmonSession
+/* the cookies are cached in this file of the user dir */
+#define	QMON_SESSION_FILE			"qmon_session.xml"
+
+/* lifetime of a session whose cookies carry no expiry, in seconds */
+#define	QMON_SESSION_LIFETIME		(8 * 60 * 60)
+
+typedef struct _QmonSession QmonSession;
+
+/**
+ * Invoked once the login was finished.
+ *
+ * @param session	The session which logged in.
+ * @param success	TRUE if the session has valid cookies now.
+ * @param data		User data passed to qmon_session_login().
+ */
+typedef void (*QmonSessionCallback)(QmonSession *session, gboolean success, gpointer data);
+
+struct _QmonSession
 {
+	gchar *username;
+	gchar *password;
+
 	gchar *aw_user;
 	gchar *tier2unpw;
-}QmonSession;
 
+	gchar *cookie;			/* built once after login, reused by every poll */
+	time_t expires;			/* the cookies are not used after it */
+
+	QmonHttpRequest *request;	/* login request, kept for the later logins */
+	GList *waiters;				/* callbacks waiting for the login in progress */
+};
+
+/* never blocks, the cached cookies are used if they did not expire */
 QmonSession *	qmon_session_new(QmonOptions *options);
+void			qmon_session_destroy(QmonSession *session);
 
+/* the cached cookies are dropped if the login changed */
+void			qmon_session_set_login(QmonSession *session, const gchar *username, const gchar *password);
+gboolean		qmon_session_is_valid(QmonSession *session);
 
-#endif
+/* TRUE while a login is in progress */
+gboolean		qmon_session_is_busy(QmonSession *session);
+
+/**
+ * Logs in asynchronously, the callback is invoked from the main loop
+ * when it is done. A valid session calls back right away. Callers
+ * asking while a login is in progress share it.
+ */
+void			qmon_session_login(QmonSession *session, QmonSessionCallback callback, gpointer data);
+
+/* forget the callbacks registered with data */
+void			qmon_session_cancel(QmonSession *session, gpointer data);
 
+/* the server refused the cookies, drop them and the cache */
+void			qmon_session_expire(QmonSession *session);
+
+
+#endif